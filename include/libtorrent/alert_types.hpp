@@ -0,0 +1,76 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_ALERT_TYPES_HPP_INCLUDED
+#define TORRENT_ALERT_TYPES_HPP_INCLUDED
+
+#include <string>
+
+#include <boost/shared_array.hpp>
+
+#include "libtorrent/alert.hpp"
+#include "libtorrent/peer_id.hpp"
+
+namespace libtorrent
+{
+
+	// is posted when a piece that has a deadline (see
+	// torrent_handle::set_piece_deadline()) has been downloaded
+	// and passed the hash check. The buffer holds the data of
+	// the piece, it's size bytes long
+	struct piece_finished_alert: alert
+	{
+		piece_finished_alert(
+			const sha1_hash& info_hash_
+			, int piece_
+			, boost::shared_array<char> buffer_
+			, int size_
+			, const std::string& msg)
+			: alert(alert::warning, msg)
+			, info_hash(info_hash_)
+			, piece(piece_)
+			, buffer(buffer_)
+			, size(size_)
+		{}
+
+		virtual std::auto_ptr<alert> clone() const
+		{ return std::auto_ptr<alert>(new piece_finished_alert(*this)); }
+
+		sha1_hash info_hash;
+		int piece;
+		boost::shared_array<char> buffer;
+		int size;
+	};
+
+}
+
+#endif // TORRENT_ALERT_TYPES_HPP_INCLUDED
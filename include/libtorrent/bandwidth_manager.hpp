@@ -0,0 +1,161 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BANDWIDTH_MANAGER_HPP_INCLUDED
+#define TORRENT_BANDWIDTH_MANAGER_HPP_INCLUDED
+
+#include <deque>
+#include <cassert>
+
+#include <boost/noncopyable.hpp>
+
+#include "libtorrent/timer_wheel.hpp"
+
+namespace libtorrent
+{
+
+	class peer_connection;
+
+	// a token bucket. It's filled with limit bytes
+	// per second, and the bytes are taken out of it by
+	// the bandwidth_manager when it hands out quota to
+	// peers. It's filled lazily, when it's used, so
+	// channels that aren't in use don't cost anything.
+	class bandwidth_channel
+	{
+	public:
+
+		enum
+		{
+			// the bucket never holds more than this many
+			// milliseconds worth of quota. This is what
+			// limits the size of the bursts
+			max_burst_ms = 200
+		};
+
+		bandwidth_channel();
+
+		// sets the limit in bytes per second,
+		// -1 means unlimited
+		void throttle(int limit);
+		int throttle() const { return m_limit; }
+
+		bool is_limited() const { return m_limit != -1; }
+
+		// fills the bucket with the quota for the time
+		// that has passed since it was last filled
+		void update_quota(timer_wheel::time_type now);
+
+		int quota_left() const { return m_quota_left; }
+		void use_quota(int amount);
+
+		// used by the bandwidth manager while handing
+		// out quota. The number of waiting peers that
+		// take quota from this channel
+		int tmp;
+
+	private:
+
+		int m_limit;
+		int m_quota_left;
+		timer_wheel::time_type m_last_update;
+	};
+
+	struct bw_request
+	{
+		enum { max_channels = 4 };
+
+		bw_request(peer_connection* p, int max)
+			: peer(p), max_amount(max), num_channels(0) {}
+
+		void add_channel(bandwidth_channel* c)
+		{
+			assert(num_channels < max_channels);
+			channel[num_channels++] = c;
+		}
+
+		peer_connection* peer;
+		// the most quota the peer will use
+		int max_amount;
+		// the quota is taken from all these channels,
+		// the amount handed out is limited by the one
+		// with the least quota left
+		bandwidth_channel* channel[max_channels];
+		int num_channels;
+	};
+
+	// keeps the peers that are waiting for quota in one
+	// direction (upload or download). Every refill_interval
+	// milliseconds, the quota that has accumulated in their
+	// channels is distributed among them. Only the peers
+	// that are waiting are touched, and the timer is only
+	// running as long as there's anyone waiting.
+	class bandwidth_manager: public timer_callback, boost::noncopyable
+	{
+	public:
+
+		enum { refill_interval = 100 };
+
+		// channel is the direction passed on to
+		// peer_connection::assign_bandwidth()
+		bandwidth_manager(timer_wheel& timers, int channel);
+
+		// is called by a peer that has run out of quota. If
+		// there's quota available, and no other peer is waiting
+		// for it, it's handed out right away and returned.
+		// Otherwise 0 is returned and the peer is queued. It
+		// will then be given quota through assign_bandwidth()
+		// as it becomes available.
+		int request_bandwidth(const bw_request& r);
+
+		// removes any request from the given peer. Must be
+		// called before the peer is destructed
+		void cancel(peer_connection* p);
+
+		bool is_queued(const peer_connection* p) const;
+
+		int queue_size() const { return m_queue.size(); }
+
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		timer_wheel& m_timers;
+		timer_entry m_timer;
+		int m_channel;
+
+		std::deque<bw_request> m_queue;
+	};
+
+}
+
+#endif // TORRENT_BANDWIDTH_MANAGER_HPP_INCLUDED
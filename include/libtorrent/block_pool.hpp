@@ -0,0 +1,199 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BLOCK_POOL_HPP_INCLUDED
+#define TORRENT_BLOCK_POOL_HPP_INCLUDED
+
+#include <vector>
+#include <set>
+#include <cassert>
+
+#include <boost/shared_array.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/detail/atomic_count.hpp>
+
+namespace libtorrent
+{
+
+	struct block_pool_status
+	{
+		// the number of bytes currently allocated by
+		// the pool, both handed out and kept for reuse
+		int allocated;
+		// the number of bytes currently handed out
+		int in_use;
+		// the largest number of bytes the pool has
+		// had allocated at any one time
+		int peak_allocated;
+		// the largest number of bytes that has been
+		// handed out at any one time
+		int peak_in_use;
+		// the memory limit, 0 means unlimited
+		int limit;
+	};
+
+	// a pool of buffers that blocks received from peers
+	// are read into, and that pieces are read into when
+	// they are hashed or moved around by the storage.
+	// Buffers are handed out in size classes that are
+	// powers of two times the block size, as reference
+	// counted arrays. Once the last reference to a buffer
+	// goes away, it's returned to the pool (instead of the
+	// heap) and reused. This keeps the heap from being
+	// fragmented by the constant allocation and deallocation
+	// of large buffers.
+	// Each thread keeps a small cache of blocks of its own,
+	// so that the common case doesn't need to lock the pool.
+	// The pool must outlive all buffers allocated from it, but
+	// not the threads that have used it.
+	class block_pool: boost::noncopyable
+	{
+	public:
+
+		enum
+		{
+			default_block_size = 16 * 1024,
+			// the number of size classes. With the default
+			// block size the largest class is 4 MB. Larger
+			// buffers are allocated directly from the heap
+			num_size_classes = 9,
+			// the max number of blocks each thread keeps
+			// in its own cache
+			thread_cache_size = 32
+		};
+
+		block_pool(int block_size = default_block_size);
+		~block_pool();
+
+		// returns a buffer of block_size() bytes
+		boost::shared_array<char> allocate();
+
+		// returns a buffer of at least size bytes
+		boost::shared_array<char> allocate(int size);
+
+		int block_size() const { return m_block_size; }
+
+		// sets the max number of bytes the pool should
+		// hand out. 0 means unlimited. The limit is not
+		// enforced by allocate(), since the storage needs its
+		// buffers to make progress. Instead, the network side
+		// is expected to back off when exceeded() returns
+		// true. While the limit is exceeded, buffers that are
+		// returned to the pool are freed instead of kept.
+		void set_limit(int bytes);
+
+		// returns true if the memory handed out by
+		// the pool has reached its limit
+		bool exceeded() const;
+
+		block_pool_status status() const;
+
+	private:
+
+		struct thread_cache
+		{
+			thread_cache(block_pool* p): pool(p) {}
+			~thread_cache();
+			// 0 once the pool has been destructed. The caches
+			// of the threads that outlive the pool are only
+			// deleted when those threads exit
+			block_pool* pool;
+			std::vector<char*> blocks;
+		};
+		friend struct thread_cache;
+
+		struct deleter
+		{
+			deleter(block_pool* p, int s): pool(p), size(s) {}
+			void operator()(char* buf) const { pool->release(buf, size); }
+			block_pool* pool;
+			int size;
+		};
+		friend struct deleter;
+
+		void release(char* buf, int size);
+
+		// returns the size class for buffers of the given
+		// size, or -1 if it's too large to be pooled
+		int size_class(int size) const;
+
+		// these must be called with m_mutex locked
+		char* heap_allocate(int size);
+		void heap_free(char* buf, int size);
+		int in_use() const;
+
+		// moves the blocks in the calling thread's cache to
+		// the free lists. Must be called with m_mutex locked
+		void flush_thread_cache();
+
+		thread_cache* get_thread_cache();
+
+		const int m_block_size;
+
+		mutable boost::mutex m_mutex;
+
+		// buffers that have been returned to the pool,
+		// one list per size class
+		std::vector<char*> m_free[num_size_classes];
+
+		// the number of bytes allocated from the heap
+		int m_allocated;
+		// the number of bytes in the free lists
+		int m_free_bytes;
+		int m_peak_allocated;
+		int m_peak_in_use;
+		int m_limit;
+
+		// the number of blocks in the thread caches. They're
+		// not in use, but they're not in the free lists
+		// either. It's updated without locking m_mutex
+		boost::detail::atomic_count m_cached_blocks;
+
+		// the caches of all threads that have used the pool.
+		// The destructor frees their blocks and detaches them
+		std::set<thread_cache*> m_caches;
+
+#if defined(TORRENT_USE_HUGE_PAGES)
+		// the buffers that are backed by huge pages,
+		// and have to be unmapped instead of deleted
+		std::set<char*> m_huge_pages;
+#endif
+
+		// declared last, to be destructed first
+		boost::thread_specific_ptr<thread_cache> m_thread_cache;
+	};
+
+}
+
+#endif // TORRENT_BLOCK_POOL_HPP_INCLUDED
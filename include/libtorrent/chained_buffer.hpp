@@ -0,0 +1,116 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_CHAINED_BUFFER_HPP_INCLUDED
+#define TORRENT_CHAINED_BUFFER_HPP_INCLUDED
+
+#include <deque>
+#include <vector>
+#include <cassert>
+
+#include <boost/shared_array.hpp>
+
+#include "libtorrent/socket.hpp"
+
+namespace libtorrent
+{
+
+	// this is a send buffer made up of a chain of
+	// reference counted chunks. Data is appended at the
+	// end and consumed from the front, without ever moving
+	// the bytes that are still waiting to be sent.
+	// Small appends are coalesced into the last chunk, which
+	// means that a number of protocol messages generated in
+	// the same loop iteration will end up in the same chunk
+	// and be flushed with a single send.
+	class chained_buffer
+	{
+	public:
+
+		// the smallest chunk that is allocated. Protocol
+		// messages are copied into chunks of (at least)
+		// this size.
+		enum { min_chunk_size = 1024 };
+
+		chained_buffer(): m_bytes(0) {}
+
+		// appends a copy of the given bytes at the end
+		// of the buffer
+		void append(const char* buf, int size);
+
+		// makes room for size bytes at the end of the
+		// buffer and returns a pointer to them. The caller
+		// is expected to fill them in before the buffer is
+		// sent.
+		char* allocate_appendix(int size);
+
+		// removes the first size bytes from the buffer
+		void pop_front(int size);
+
+		// fills in vec with the buffers at the front of the
+		// chain, covering at most max_bytes bytes. This is
+		// used for gather writes.
+		void build_iovec(std::vector<socket::buffer>& vec, int max_bytes) const;
+
+		int size() const { return m_bytes; }
+		bool empty() const { return m_bytes == 0; }
+
+		void clear();
+
+	private:
+
+		struct chunk
+		{
+			boost::shared_array<char> buf;
+			// the total number of bytes in buf
+			int capacity;
+			// the offset to the first byte that hasn't
+			// been consumed yet
+			int start;
+			// the number of bytes after start that
+			// are in use
+			int used;
+		};
+
+		// returns a new chunk with at least size bytes
+		// of space in it
+		chunk& add_chunk(int size);
+
+		std::deque<chunk> m_chunks;
+
+		// the number of bytes in all chunks
+		int m_bytes;
+	};
+
+}
+
+#endif // TORRENT_CHAINED_BUFFER_HPP_INCLUDED
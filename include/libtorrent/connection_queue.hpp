@@ -0,0 +1,140 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_CONNECTION_QUEUE_HPP_INCLUDED
+#define TORRENT_CONNECTION_QUEUE_HPP_INCLUDED
+
+#include <deque>
+
+#include <boost/noncopyable.hpp>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/timer_wheel.hpp"
+
+namespace libtorrent
+{
+
+	class torrent;
+
+	namespace detail
+	{
+		struct session_impl;
+	}
+
+	// the peers we want to connect to are queued here, and
+	// connected to as the limits allow. The number of half-open
+	// connections, the rate of connection attempts and the total
+	// number of connections are limited.
+	// The connection attempts are always made from the timer
+	// callback, never from within enqueue() or done_connecting(),
+	// since those may be called while the session is modifying
+	// its connection list.
+	class connection_queue: public timer_callback, boost::noncopyable
+	{
+	public:
+
+		connection_queue(detail::session_impl& ses);
+
+		// peers with priority are connected to before
+		// the ones already in the queue
+		void enqueue(torrent* t, const address& a, const peer_id& id
+			, bool priority = false);
+
+		// removes all the queued peers for the given torrent.
+		// Must be called before the torrent is destructed.
+		void remove(torrent* t);
+
+		// is called by outgoing connections when they start
+		// connecting, and once they have connected or failed to
+		void connecting() { ++m_half_open; }
+		void done_connecting();
+
+		// makes sure the timer fires as soon as possible,
+		// unless it's already scheduled. It's called when a
+		// connection is closed, since that may have made room
+		// for the queued peers
+		void wake_up();
+
+		// -1 means unlimited, for all of these
+		void set_max_half_open(int limit);
+		void set_max_connections(int limit);
+		void set_connect_rate(int attempts_per_second);
+
+		void set_connect_timeout(int seconds);
+		int connect_timeout() const { return m_connect_timeout; }
+
+		int max_connections() const { return m_max_connections; }
+		int num_half_open() const { return m_half_open; }
+		int size() const { return m_queue.size(); }
+
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		// returns true if we're below the half-open
+		// and the connection limits
+		bool can_connect() const;
+
+		struct entry
+		{
+			entry(torrent* t_, const address& a, const peer_id& i)
+				: t(t_), addr(a), id(i) {}
+			torrent* t;
+			address addr;
+			peer_id id;
+		};
+
+		std::deque<entry> m_queue;
+
+		detail::session_impl& m_ses;
+
+		// when the connect rate is limited, this timer is
+		// scheduled for when the next attempt may be made
+		timer_entry m_timer;
+
+		// the number of outgoing connections that
+		// haven't connected yet
+		int m_half_open;
+
+		int m_max_half_open;
+		int m_max_connections;
+		int m_connect_rate;
+
+		// in seconds
+		int m_connect_timeout;
+	};
+
+}
+
+#endif // TORRENT_CONNECTION_QUEUE_HPP_INCLUDED
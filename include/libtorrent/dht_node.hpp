@@ -0,0 +1,234 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_DHT_NODE_HPP_INCLUDED
+#define TORRENT_DHT_NODE_HPP_INCLUDED
+
+#include <map>
+#include <list>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/entry.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/dht_routing_table.hpp"
+
+namespace libtorrent
+{
+
+	// a node in the mainline (Kademlia) DHT. It answers the queries
+	// of other nodes, stores the peers that are announced to it, and
+	// looks up the peers of our torrents. The socket is monitored by
+	// the selector, which hands it to incoming() when it's readable.
+	// Like the local service discovery, the socket is only opened
+	// and closed from the timer callback.
+	class dht_node: public timer_callback, boost::noncopyable
+	{
+	public:
+
+		// is called with the peers found for a torrent. It may
+		// be called several times for every lookup
+		typedef boost::function2<void, const sha1_hash&
+			, const std::vector<address>&> peers_callback;
+
+		enum
+		{
+			// a lookup ends when the closest nodes of this many
+			// have responded, and the torrent is announced to them
+			lookup_size = 8,
+			// the number of queries in flight per lookup
+			lookup_parallelism = 3,
+			max_lookup_nodes = 100,
+			// in milliseconds
+			query_timeout = 3000,
+			tick_interval = 500,
+			refresh_interval = 15 * 60 * 1000,
+			// the tokens are made from a secret that's replaced
+			// this often. The ones made from the previous
+			// secret are accepted too
+			token_interval = 5 * 60 * 1000,
+			// the peers announced to us are forgotten after this
+			// long, unless they announce again
+			peer_timeout = 30 * 60 * 1000,
+			max_peers_per_torrent = 100,
+			max_torrents = 2000,
+			// the number of peers sent in one get_peers response
+			max_peers_reply = 50
+		};
+
+		dht_node(timer_wheel& timers, selector& sel, const peers_callback& cb);
+		~dht_node();
+
+		// the socket is bound to the given udp port
+		void start(unsigned short port);
+		void stop();
+
+		// closes the socket right away. Must only be
+		// called from the network thread
+		void abort();
+
+		// the tokens we hand out are accepted for one to two
+		// intervals. It's token_interval unless it's changed
+		void set_token_interval(int milliseconds) { m_token_interval = milliseconds; }
+
+		bool is_running() const { return m_socket.get() != 0; }
+		unsigned short port() const { return m_port; }
+
+		// the node is pinged, and put in the routing table if
+		// it responds. This is how the DHT is bootstrapped
+		void add_node(const address& a);
+
+		// looks up the peers of the torrent. Unless listen_port
+		// is 0, we're announced to the nodes closest to it
+		void get_peers(const sha1_hash& info_hash, int listen_port);
+
+		// if the socket is ours, everything is received
+		// from it and true is returned
+		bool incoming(const boost::shared_ptr<socket>& s);
+
+		int num_sockets() const { return m_socket ? 1 : 0; }
+		int num_nodes() const { return m_table.size(); }
+		int num_lookups() const { return m_lookups.size(); }
+		const node_id& id() const { return m_table.id(); }
+
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		struct lookup_node
+		{
+			enum state_t { fresh, queried, responded, failed };
+			node_id id;
+			address addr;
+			state_t state;
+			// the token it gave us, to announce with
+			std::string token;
+		};
+
+		struct lookup
+		{
+			node_id target;
+			// otherwise it's a find_node
+			bool get_peers;
+			int listen_port;
+			// sorted by distance to the target
+			std::vector<lookup_node> nodes;
+			int in_flight;
+		};
+
+		struct transaction
+		{
+			address addr;
+			// all zeros if we don't know it yet
+			node_id id;
+			// the lookup the query belongs to, if any
+			boost::shared_ptr<lookup> l;
+			timer_wheel::time_type sent;
+		};
+
+		struct stored_peer
+		{
+			address addr;
+			timer_wheel::time_type added;
+		};
+
+		void open_socket();
+		void close_socket();
+
+		void on_message(const char* buf, int size, const address& from);
+		void on_query(const address& from, const entry& tid
+			, const std::string& query, const entry& args);
+		void on_response(const address& from, const std::string& tid
+			, const entry* args);
+
+		void send_query(const address& to, const node_id& id
+			, const char* query, entry& args
+			, const boost::shared_ptr<lookup>& l);
+		void send_message(const address& to, const entry& msg);
+
+		void start_lookup(const node_id& target, bool get_peers, int listen_port);
+		void add_lookup_node(lookup& l, const node_id& id, const address& a);
+		void lookup_response(const boost::shared_ptr<lookup>& l
+			, const address& from, const entry& r);
+		void lookup_failed(const boost::shared_ptr<lookup>& l, const address& from);
+		void continue_lookup(const boost::shared_ptr<lookup>& l);
+		void finish_lookup(const boost::shared_ptr<lookup>& l);
+
+		std::string make_token(const address& a, boost::uint32_t secret) const;
+		bool verify_token(const address& a, const std::string& token) const;
+		void announce_peer(const sha1_hash& info_hash, const address& a);
+		void expire_peers();
+
+		timer_wheel& m_timers;
+		selector& m_selector;
+		peers_callback m_callback;
+
+		boost::shared_ptr<socket> m_socket;
+		unsigned short m_port;
+		bool m_enabled;
+
+		dht_routing_table m_table;
+
+		// the nodes to ping once the socket is open
+		std::deque<address> m_pending_nodes;
+		// we look ourself up once we know
+		// the first nodes
+		bool m_bootstrapped;
+
+		std::map<unsigned short, transaction> m_transactions;
+		unsigned short m_next_transaction;
+
+		std::list<boost::shared_ptr<lookup> > m_lookups;
+
+		// the peers announced to us, by info-hash
+		std::map<sha1_hash, std::vector<stored_peer> > m_storage;
+
+		boost::uint32_t m_secret[2];
+		timer_wheel::time_type m_secret_changed;
+		int m_token_interval;
+		timer_wheel::time_type m_last_expire;
+
+		timer_entry m_timer;
+	};
+
+}
+
+#endif // TORRENT_DHT_NODE_HPP_INCLUDED
@@ -0,0 +1,128 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_DHT_ROUTING_TABLE_HPP_INCLUDED
+#define TORRENT_DHT_ROUTING_TABLE_HPP_INCLUDED
+
+#include <vector>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/timer_wheel.hpp"
+
+namespace libtorrent
+{
+
+	typedef big_number node_id;
+
+	// the number of leading bits the two ids have in common,
+	// 160 if they're equal
+	int common_prefix(const node_id& a, const node_id& b);
+
+	// returns true if a is closer to target than b is
+	bool closer_to(const node_id& target, const node_id& a, const node_id& b);
+
+	// a random id that shares exactly prefix bits with id
+	node_id random_id_at(const node_id& id, int prefix);
+
+	struct dht_node_entry
+	{
+		node_id id;
+		address addr;
+		// the number of queries in a row it
+		// hasn't responded to
+		int fail_count;
+		timer_wheel::time_type last_seen;
+	};
+
+	// the nodes we know about, in one bucket for every length of
+	// the prefix they share with our id. Every bucket holds up to
+	// bucket_size nodes, the ones that have been alive the longest
+	// are kept. Nodes that don't fit are remembered as replacements
+	// for the nodes that stop responding.
+	class dht_routing_table
+	{
+	public:
+
+		enum
+		{
+			bucket_size = 8,
+			// a node that has failed to respond this many
+			// times in a row is replaced
+			max_fail_count = 2,
+			num_buckets = 160
+		};
+
+		dht_routing_table(const node_id& id);
+
+		// the node has responded to us, or sent a query
+		void node_seen(const node_id& id, const address& a
+			, timer_wheel::time_type now);
+
+		// a query to the node timed out
+		void node_failed(const node_id& id, const address& a);
+
+		// fills in the count nodes closest to target,
+		// closest first
+		void find_closest(const node_id& target, int count
+			, std::vector<dht_node_entry>& nodes) const;
+
+		// returns true if there's a bucket that hasn't seen any
+		// activity for interval milliseconds, and fills in an id
+		// in its range to look up. The bucket counts as active
+		// from now on
+		bool need_refresh(timer_wheel::time_type now, int interval
+			, node_id& target);
+
+		int size() const;
+		const node_id& id() const { return m_id; }
+
+	private:
+
+		struct bucket
+		{
+			bucket(): last_active(0) {}
+			std::vector<dht_node_entry> live;
+			std::vector<dht_node_entry> replacements;
+			timer_wheel::time_type last_active;
+		};
+
+		int bucket_index(const node_id& id) const;
+
+		node_id m_id;
+		std::vector<bucket> m_buckets;
+	};
+
+}
+
+#endif // TORRENT_DHT_ROUTING_TABLE_HPP_INCLUDED
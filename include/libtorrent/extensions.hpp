@@ -0,0 +1,85 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_EXTENSIONS_HPP_INCLUDED
+#define TORRENT_EXTENSIONS_HPP_INCLUDED
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+
+#include "libtorrent/entry.hpp"
+
+namespace libtorrent
+{
+
+	class torrent;
+	class peer_connection;
+
+	// an extension to the peer protocol, using the extension
+	// protocol (message id 20). Every connection to a peer that
+	// supports the extension protocol gets one instance of
+	// each registered extension. The message ids are
+	// negotiated in the extension handshake, by name.
+	class peer_extension
+	{
+	public:
+
+		virtual ~peer_extension() {}
+
+		// the name of the extension's message, as it
+		// appears in the "m" dictionary of the handshake
+		virtual const char* message_name() const = 0;
+
+		// may add keys to the handshake we send
+		virtual void add_handshake(entry& h) {}
+
+		// is called with the peer's extension handshake
+		virtual void on_handshake(const entry& h) {}
+
+		// is called with the payload of each message of
+		// this extension the peer sends. Throws
+		// protocol_error if the message is invalid
+		virtual void on_message(const char* body, int size) = 0;
+
+		// is called once every second
+		virtual void tick() {}
+	};
+
+	// creates the extension's state for a connection. The
+	// factories are registered with the session
+	typedef boost::function2<boost::shared_ptr<peer_extension>
+		, torrent&, peer_connection&> extension_factory;
+
+}
+
+#endif // TORRENT_EXTENSIONS_HPP_INCLUDED
@@ -0,0 +1,141 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_LSD_HPP_INCLUDED
+#define TORRENT_LSD_HPP_INCLUDED
+
+#include <deque>
+#include <set>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/timer_wheel.hpp"
+
+namespace libtorrent
+{
+
+	// local service discovery. The info-hashes of our torrents and
+	// our listen port are multicast on the local network, and the
+	// peers that announce torrents we have are connected to before
+	// the peers we get from the trackers.
+	// The socket is only opened and closed from the timer callback,
+	// since the selector may not be touched while the session is
+	// waiting on it.
+	class lsd: public timer_callback, boost::noncopyable
+	{
+	public:
+
+		// is called with every peer that announces one of
+		// the info-hashes. The torrent may have been removed
+		typedef boost::function2<void, const sha1_hash&
+			, const address&> peer_callback;
+
+		enum
+		{
+			lsd_port = 6771,
+			// every torrent is announced this often, in seconds
+			announce_interval = 5 * 60,
+			max_announces_per_second = 5,
+			// the rest of the messages received within the
+			// same second are ignored
+			max_incoming_per_second = 50
+		};
+
+		lsd(timer_wheel& timers, selector& sel, const peer_callback& cb);
+
+		void start();
+		void stop();
+
+		// the port the peers are told to connect to
+		void set_listen_port(unsigned short port) { m_listen_port = port; }
+
+		// closes the socket right away. Must only be
+		// called from the network thread
+		void abort();
+
+		// the torrent is announced as soon as the rate
+		// limit allows it, and then once every announce_interval
+		// until it's removed
+		void announce(const sha1_hash& info_hash);
+		void remove(const sha1_hash& info_hash);
+
+		// if the socket is our multicast socket, all datagrams
+		// are received from it, and true is returned
+		bool incoming(const boost::shared_ptr<socket>& s);
+
+		int num_sockets() const { return m_socket ? 1 : 0; }
+
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		void open_socket();
+		void close_socket();
+		void send_announce(const sha1_hash& info_hash);
+		void on_announce(const char* buf, int size, const address& from);
+
+		timer_wheel& m_timers;
+		selector& m_selector;
+		peer_callback m_callback;
+		unsigned short m_listen_port;
+
+		boost::shared_ptr<socket> m_socket;
+		address m_group;
+
+		// our announces are looped back to us, they are
+		// recognized by this cookie
+		std::string m_cookie;
+
+		// the torrents that are announced every interval
+		std::set<sha1_hash> m_torrents;
+
+		// the torrents that are waiting to be announced
+		std::deque<sha1_hash> m_queue;
+
+		// is scheduled once per second while we're running
+		timer_entry m_timer;
+		timer_wheel::time_type m_next_announce;
+
+		// the number of messages received this second
+		int m_received;
+		bool m_enabled;
+	};
+
+}
+
+#endif // TORRENT_LSD_HPP_INCLUDED
@@ -0,0 +1,129 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_PEER_CLASS_HPP_INCLUDED
+#define TORRENT_PEER_CLASS_HPP_INCLUDED
+
+#include <map>
+#include <string>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/bandwidth_manager.hpp"
+
+namespace libtorrent
+{
+
+	// the peer classes every session has. All peers are in
+	// the default class, except the ones on the local network
+	enum
+	{
+		default_peer_class = 0,
+		local_peer_class = 1
+	};
+
+	struct peer_class_settings
+	{
+		peer_class_settings()
+			: upload_limit(-1)
+			, download_limit(-1)
+			, connection_limit(-1)
+			, ignore_global_limit(false)
+		{}
+
+		// in bytes per second, -1 means unlimited
+		int upload_limit;
+		int download_limit;
+
+		// the max number of connections to peers in this
+		// class, -1 means unlimited
+		int connection_limit;
+
+		// if this is true, the peers in this class are not
+		// limited by the session wide rate limits
+		bool ignore_global_limit;
+	};
+
+	// a group of peers, determined by their IP, that
+	// share rate limits and a connection limit
+	struct peer_class
+	{
+		peer_class(const std::string& n);
+
+		void apply(const peer_class_settings& s);
+
+		bool is_full() const
+		{ return connection_limit != -1 && connections >= connection_limit; }
+
+		std::string name;
+
+		// indexed by peer_connection::upload_channel
+		// and download_channel
+		bandwidth_channel bandwidth_limit[2];
+
+		int connection_limit;
+		bool ignore_global_limit;
+
+		// the number of connections to peers in this class
+		int connections;
+	};
+
+	// maps IP ranges to peer classes. Only the first address
+	// of every range is stored, each range extends up to the
+	// start of the next one. That keeps the map small and
+	// a lookup is a single binary search.
+	class peer_class_map
+	{
+	public:
+
+		// all addresses start out in the default class
+		peer_class_map();
+
+		// puts all addresses in the range [first, last]
+		// in the given class. Ports are ignored
+		void add_range(const address& first, const address& last, int peer_class);
+
+		int class_for(const address& a) const;
+
+	private:
+
+		int class_for(unsigned int ip) const;
+
+		// the first ip, in host byte order, of each range
+		// and the class of that range. There's always an
+		// entry for 0.
+		std::map<unsigned int, int> m_ranges;
+	};
+
+}
+
+#endif // TORRENT_PEER_CLASS_HPP_INCLUDED
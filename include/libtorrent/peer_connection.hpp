@@ -37,6 +37,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <algorithm>
 #include <vector>
 #include <deque>
+#include <map>
+#include <string>
 
 #include <boost/smart_ptr.hpp>
 #include <boost/noncopyable.hpp>
@@ -49,6 +51,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/storage.hpp"
 #include "libtorrent/piece_picker.hpp"
 #include "libtorrent/stat.hpp"
+#include "libtorrent/chained_buffer.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/bandwidth_manager.hpp"
+#include "libtorrent/extensions.hpp"
 #include "libtorrent/debug.hpp"
 
 // TODO: each time a block is 'taken over'
@@ -109,10 +115,12 @@ namespace libtorrent
 		int full_block_bytes;
 	};
 
-	class peer_connection: public boost::noncopyable
+	class peer_connection: public timer_callback, public boost::noncopyable
 	{
 	public:
 
+		typedef entry::integer_type size_type;
+
 		// this is the constructor where the we are teh active part. The peer_conenction
 		// should handshake and verify that the other end has the correct id
 		peer_connection(
@@ -147,22 +155,35 @@ namespace libtorrent
 		// tells if this connection has data it want to send
 		bool has_data() const throw();
 
-		bool has_timed_out()
-		{
-			boost::posix_time::time_duration d;
-			d = boost::posix_time::second_clock::local_time() - m_last_receive;
-			return d.seconds() > m_timeout;
-		}
+		bool has_timed_out() const;
 
 		// will send a keep-alive message to the peer
 		void keep_alive();
 
+		// the connection's timer has expired. Sends a keep-alive
+		// if it's time for one, or asks the session to close
+		// the connection if it has timed out
+		virtual void on_timer(timer_entry& t);
+
 		const peer_id& id() const throw() { return m_peer_id; }
 		bool has_piece(int i) const throw() { return m_have_piece[i]; }
 
 		const std::deque<piece_block>& download_queue() const throw()
 		{ return m_download_queue; }
 
+		// the number of blocks we try to keep requested from this
+		// peer. It follows the bandwidth-delay product of the
+		// connection and is updated every second
+		int desired_queue_size() const { return m_desired_queue_size; }
+
+		// the round trip time of requests to this peer, in
+		// milliseconds. It's 0 until it has been measured
+		int request_rtt() const;
+
+		// true if the peer hasn't sent us any piece data in a
+		// while, even though we have requested blocks from it
+		bool is_snubbed() const { return m_snubbed; }
+
 		void choke();
 		void unchoke();
 		void interested();
@@ -170,6 +191,12 @@ namespace libtorrent
 		void request_block(piece_block block);
 		void cancel_block(piece_block block);
 
+		// false while we're running out of buffers to receive
+		// blocks into, or while the peer is out of download
+		// quota and still has requests outstanding. New
+		// requests would only queue up then
+		bool can_request_blocks() const;
+
 		// returns the block currently being
 		// downloaded. And the progress of that
 		// block. If the peer isn't downloading
@@ -183,6 +210,34 @@ namespace libtorrent
 		bool is_peer_interested() const throw() { return m_peer_interested; }
 		bool has_peer_choked() const throw() { return m_peer_choked; }
 
+		// true if the other end has set the fast extension
+		// bit in its handshake
+		bool supports_fast() const { return m_supports_fast; }
+
+		// the pieces the peer lets us request while it has
+		// choked us
+		const std::vector<int>& allowed_fast() const { return m_allowed_fast; }
+
+		// the pieces the peer has suggested we download
+		// from it, the most recent last
+		const std::vector<int>& suggested_pieces() const { return m_suggested_pieces; }
+
+		// true if the peer has told us, in its extension
+		// handshake, that it understands the given extension
+		// message
+		bool supports_extension(const char* name) const
+		{ return m_extension_ids.find(name) != m_extension_ids.end(); }
+
+		// sends an extension message. The peer must
+		// support the extension
+		void send_extended(const char* name, const std::string& payload);
+
+		// the address other peers may connect to this peer
+		// on. For incoming connections it's only known if the
+		// peer has told us its listen port. Returns false if
+		// it isn't known
+		bool remote_listen_address(address& a) const;
+
 		// returns the torrent this connection is a part of
 		// may be zero if the connection is an incoming connection
 		// and it hasn't received enough information to determine
@@ -199,13 +254,45 @@ namespace libtorrent
 		const peer_id& get_peer_id() const { return m_peer_id; }
 		const std::vector<bool>& get_bitfield() const { return m_have_piece; }
 
-		// sets the number of bytes this peer
-		// is allowed to send until it should
-		// stop sending. When it stops sending
-		// it will simply wait for another call
-		// to second_tick() where it will get
-		// more send quota.
-		void set_send_quota(int num_bytes);
+		// the direction passed to assign_bandwidth()
+		enum
+		{
+			upload_channel = 0,
+			download_channel,
+			num_channels
+		};
+
+		// is called by the bandwidth manager when this
+		// peer has been given more quota
+		void assign_bandwidth(int channel, int amount);
+
+		// is called when the upload limit of the session,
+		// the torrent or this peer has changed. If none of
+		// them is limited, the send quota becomes unlimited.
+		void update_send_quota();
+
+		// the same as update_send_quota(), but for the
+		// download direction
+		void update_recv_quota();
+
+		// limits the rate of this particular peer, in
+		// bytes per second. -1 means unlimited
+		void set_upload_limit(int limit);
+		void set_download_limit(int limit);
+		int upload_limit() const { return m_upload_limit; }
+		int download_limit() const
+		{ return m_bandwidth_limit[download_channel].throttle(); }
+
+		// returns true while this peer has run out of
+		// download quota and we have stopped reading from
+		// its socket. No more blocks should be requested
+		// from it until it gets more quota.
+		bool is_download_throttled() const
+		{ return m_waiting_for_download_quota; }
+
+		// the peer class this peer was put in when the
+		// connection was made, based on its address
+		int peer_class() const { return m_peer_class; }
 
 		// returns the send quota this peer has
 		// left until will stop sending.
@@ -219,8 +306,8 @@ namespace libtorrent
 		void add_free_upload(int free_upload)
 		{ m_free_upload += free_upload; }
 
-		// returns the send quota assigned to this
-		// peer.
+		// returns the send quota this peer was given
+		// during the last second, or -1 if unlimited
 		int send_quota() const { return m_send_quota; }
 
 		void received_valid_data()
@@ -254,13 +341,69 @@ namespace libtorrent
 
 	private:
 
-		bool dispatch_message(int received);
+		// the size of the receive buffer in its normal state.
+		// it only grows beyond this for packets that won't
+		// fit (like large bitfields)
+		enum { receive_buffer_size = 16 * 1024 };
+
+		// the number of blocks requested from a new peer,
+		// until its rate and round trip time are known
+		enum { initial_queue_size = 16 };
+
+		void prepare_receive_buffer();
+		void account_received(std::size_t from, std::size_t to);
+		void start_piece_payload();
+		void parse_received_data();
+		void dispatch_message(const char* packet);
 		void send_buffer_updated();
 
+		// returns true if there is something to send,
+		// regardless of the send quota
+		bool wants_to_send() const;
+
+		// returns true if any of this peer's channels in the
+		// given direction, or its torrent's, its peer class'
+		// or the session's, are limited
+		bool is_limited(int channel) const;
+
+		// adds the channels in the given direction that this
+		// peer's traffic is counted against, from the peer
+		// itself up to the session. The session's channel is
+		// left out if the peer class ignores the global limit
+		void add_channels(bw_request& r, int channel);
+
+		// throttles the upload channel to the lower of
+		// m_upload_limit and m_send_quota_limit
+		void update_upload_throttle();
+
+		// asks the bandwidth managers for more quota.
+		// request_download_bandwidth() returns false, and
+		// stops reading from the socket, if none could be
+		// given right away
+		void request_upload_bandwidth();
+		bool request_download_bandwidth();
+
 		void send_bitfield();
 		void send_have(int index);
 		void send_handshake();
 
+		// fast extension messages
+		void send_reject(const peer_request& r);
+		void send_allowed_fast(int index);
+
+		// tells the peer the udp port of our dht node
+		void send_dht_port();
+
+		// the extension protocol
+		void send_extended_handshake();
+		void on_extended(const char* packet);
+
+		// sends the allowed fast set for this peer. It's
+		// generated from the peer's ip and the info hash,
+		// as described in the fast extension specification.
+		// Only the pieces we have are sent
+		void send_allowed_fast_set();
+
 		// is used during handshake
 		enum state
 		{
@@ -288,36 +431,104 @@ namespace libtorrent
 			msg_bitfield,
 			msg_request,
 			msg_piece,
-			msg_cancel
+			msg_cancel,
+			// the dht
+			msg_port,
+
+			// fast extension
+			msg_suggest_piece = 0x0d,
+			msg_have_all,
+			msg_have_none,
+			msg_reject_request,
+			msg_allowed_fast,
+
+			// extension protocol
+			msg_extended = 20
+		};
+
+		enum
+		{
+			// the bit in the last reserved handshake byte
+			// that says the fast extension is supported
+			fast_extension_bit = 0x04,
+			// the bit in the sixth reserved byte that says
+			// the extension protocol is supported
+			extension_protocol_bit = 0x10,
+			// the bit in the last reserved byte that says the
+			// peer runs a dht node, and sends its port
+			dht_bit = 0x01,
+			// the number of pieces in the allowed fast set
+			// we give each peer
+			allowed_fast_set_size = 10,
+			// the number of suggestions we remember per peer
+			max_suggested_pieces = 16
 		};
 
 		std::size_t m_packet_size;
-		std::size_t m_recv_pos;
+
+		// the bytes in the range [m_recv_start, m_recv_end)
+		// of the receive buffer are received but not yet
+		// parsed. The packet currently being received
+		// starts at m_recv_start.
+		std::size_t m_recv_start;
+		std::size_t m_recv_end;
+		// the number of bytes of the current (partial) packet
+		// that have been counted in the statistics
+		std::size_t m_recv_counted;
 		std::vector<char> m_recv_buffer;
 
+		// the payload of piece messages are received into
+		// buffers from the session's block pool rather than
+		// into the receive buffer. Only the header is kept in
+		// the receive buffer. m_piece_received is the number
+		// of payload bytes received into m_piece_buffer.
+		boost::shared_array<char> m_piece_buffer;
+		std::size_t m_piece_received;
+
 		// this is the buffer where data that is
 		// to be sent is stored until it gets
 		// consumed by send()
-		std::vector<char> m_send_buffer;
+		chained_buffer m_send_buffer;
 
 		// this is a queue of ranges that describes
-		// where in the send buffer actual payload
+		// where in the send stream actual payload
 		// data is located. This is currently
 		// only used to be able to gather statistics
 		// seperately on payload and protocol data.
+		// The offsets are counted from the start of
+		// the connection, so they never have to be
+		// updated as the send buffer is consumed.
 		struct range
 		{
-			range(int s, int l): start(s), length(l) {}
-			int start;
+			range(size_type s, int l): start(s), length(l) {}
+			size_type start;
 			int length;
 		};
-		static bool range_below_zero(const range& r)
-		{ return r.start < 0; }
 		std::deque<range> m_payloads;
 
+		// the total number of bytes that has been
+		// sent (consumed from the send buffer) on
+		// this connection. It is the stream offset
+		// of the first byte in m_send_buffer
+		size_type m_bytes_sent;
+
 		// timeouts
-		boost::posix_time::ptime m_last_receive;
-		boost::posix_time::ptime m_last_sent;
+		timer_wheel::time_type m_last_receive;
+		timer_wheel::time_type m_last_sent;
+
+		// this timer is scheduled for the next time the
+		// connection may time out or need a keep-alive.
+		// When nothing happens on the connection, it
+		// doesn't cost anything until then
+		timer_entry m_timer;
+
+		// schedules m_timer for the next keep-alive
+		// or timeout, whichever comes first
+		void schedule_timer();
+
+		// the timeout in seconds. While we're connecting
+		// it's the session's connect timeout
+		int timeout() const;
 
 		// the selector is used to add and remove this
 		// peer's socket from the writability monitor list.
@@ -344,6 +555,11 @@ namespace libtorrent
 		// and false if we got an incomming connection
 		bool m_active;
 
+		// true while an outgoing connection hasn't been
+		// established yet. It counts as a half-open
+		// connection in the session's connection queue
+		bool m_connecting;
+
 		// this is true as long as this peer's
 		// socket is added to the selector to
 		// monitor writability. Each time we do
@@ -377,6 +593,29 @@ namespace libtorrent
 		// from this peer
 		std::deque<peer_request> m_requests;
 
+		// the fast extension state. m_allowed_fast are the
+		// pieces the peer lets us request while we're choked,
+		// m_accept_fast are the ones we let it request while
+		// it is choked
+		bool m_supports_fast;
+		std::vector<int> m_allowed_fast;
+		std::vector<int> m_accept_fast;
+		std::vector<int> m_suggested_pieces;
+
+		// the extension protocol state. The id of each of our
+		// extensions is its index in m_extensions + 1. The
+		// peer's ids are kept by name
+		bool m_supports_extensions;
+		std::vector<boost::shared_ptr<peer_extension> > m_extensions;
+
+		// the peer runs a dht node
+		bool m_supports_dht;
+		std::map<std::string, int> m_extension_ids;
+
+		// the port the peer listens on, from its extension
+		// handshake. 0 if unknown
+		int m_remote_listen_port;
+
 		// a list of pieces that have become available
 		// and should be announced as available to
 		// the peer
@@ -386,6 +625,55 @@ namespace libtorrent
 		// from this peer
 		std::deque<piece_block> m_download_queue;
 
+		// one request at a time is timed, to measure the
+		// round trip time. This is the block, the time its
+		// request was sent and the number of blocks that were
+		// requested before it and hadn't arrived. The piece
+		// index is -1 when no request is timed.
+		piece_block m_timed_block;
+		timer_wheel::time_type m_timed_request_sent;
+		int m_timed_queue_ahead;
+
+		// the lowest round trip times, in milliseconds, measured
+		// during the current and the previous 30 seconds. 0 if
+		// there was no measurement. m_rtt_age is the number of
+		// seconds the current period has lasted
+		int m_rtt_history[2];
+		int m_rtt_age;
+
+		// see desired_queue_size()
+		int m_desired_queue_size;
+
+		// recalculates m_desired_queue_size from the download
+		// rate and the round trip time
+		void update_desired_queue_size();
+
+		// the last time piece data was received, or a request
+		// was sent while none was outstanding. The requests
+		// expire when the peer hasn't made progress on them
+		// for a while
+		timer_wheel::time_type m_request_progress;
+
+		// the last time the requests expired. The ones sent
+		// after that are timed from here, the peer isn't
+		// snubbed any sooner though
+		timer_wheel::time_type m_requests_expired;
+
+		// the time we wait for the next block before the requests
+		// expire, in milliseconds. It's three times the time a
+		// block takes at the peer's rate plus a round trip. It's
+		// never less than the session's request timeout
+		int m_block_timeout;
+
+		// set when the peer hasn't sent any piece data during the
+		// session's snub timeout, while we had requests outstanding.
+		// A snubbed peer gets one request at a time
+		bool m_snubbed;
+
+		// gives the expired requests back to the piece picker,
+		// and snubs the peer if it has been silent for too long
+		void check_request_timeouts();
+
 		// statistics about upload and download speeds
 		// and total amount of uploads and downloads for
 		// this peer
@@ -400,18 +688,24 @@ namespace libtorrent
 		int m_free_upload;
 
 		// this is used to limit upload bandwidth.
-		// it is reset to the allowed number of
-		// bytes to send frequently. Every time
-		// thie peer send some data,
-		// m_send_quota_left variable will be decreased
-		// so it can limit the number of bytes next
-		// time it sends data. when it reaches zero
-		// the client will stop send data and await
-		// more quota. if it is set to -1, the peer
-		// will ignore the qouta and send at maximum
-		// speed
+		// m_send_quota_left is the number of bytes
+		// this peer may send. Every time this peer
+		// sends some data it is decreased. When it
+		// reaches zero, the peer asks the session's
+		// upload manager for more, and won't send
+		// anything until it gets it. If it is set to
+		// -1, the peer will ignore the quota and send
+		// at maximum speed.
+		// m_send_quota is the quota handed out during
+		// the last second, and m_granted_quota is what
+		// has been handed out so far this second.
 		int m_send_quota;
 		int m_send_quota_left;
+		int m_granted_quota;
+
+		// true while this peer is queued in the
+		// session's upload manager
+		bool m_waiting_for_upload_quota;
 
 		// this is the maximum send quota we should give
 		// this peer given the current download rate
@@ -420,6 +714,28 @@ namespace libtorrent
 		// -1 means no limit
 		int m_send_quota_limit;
 
+		// the upload limit set by the user on this
+		// peer. -1 means unlimited
+		int m_upload_limit;
+
+		// the token buckets for this peer, indexed by
+		// upload_channel and download_channel. The upload
+		// channel is throttled to the lower of m_upload_limit
+		// and m_send_quota_limit
+		bandwidth_channel m_bandwidth_limit[num_channels];
+
+		// the number of bytes we may receive before we have
+		// to ask the session's download manager for more.
+		// -1 means unlimited. While we are waiting for more,
+		// the socket isn't monitored for readability, which
+		// makes the kernel's receive buffer fill up and the
+		// TCP window close.
+		int m_recv_quota_left;
+		bool m_waiting_for_download_quota;
+
+		// index into the session's peer classes
+		int m_peer_class;
+
 		// for every valid piece we receive where this
 		// peer was one of the participants, we increase
 		// this value. For every invalid piece we receive
@@ -434,6 +750,13 @@ namespace libtorrent
 	// the writibility monitor in the selector.
 	inline void peer_connection::send_buffer_updated()
 	{
+		if (m_send_quota_left == 0
+			&& !m_waiting_for_upload_quota
+			&& wants_to_send())
+		{
+			request_upload_bandwidth();
+		}
+
 		if (!has_data())
 		{
 			if (m_added_to_selector)
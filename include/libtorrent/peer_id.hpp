@@ -55,6 +55,15 @@ namespace libtorrent
 			return !std::equal(n.m_number, n.m_number+number_size, m_number);
 		}
 
+		// peers we got from a tracker that doesn't send
+		// peer ids have an id with all bits cleared
+		bool is_all_zeros() const
+		{
+			for (int i = 0; i < number_size; ++i)
+				if (m_number[i] != 0) return false;
+			return true;
+		}
+
 		bool operator<(const big_number& n) const
 		{
 			for(int i = 0; i < number_size; ++i)
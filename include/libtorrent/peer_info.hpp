@@ -46,7 +46,8 @@ namespace libtorrent
 			interesting = 0x1,
 			choked = 0x2,
 			remote_interested = 0x4,
-			remote_choked = 0x8
+			remote_choked = 0x8,
+			snubbed = 0x10
 		};
 		unsigned int flags;
 		address ip;
@@ -59,6 +60,9 @@ namespace libtorrent
 		int upload_limit;
 		int upload_ceiling;
 
+		// the peer class this peer belongs to
+		int peer_class;
+
 		int load_balancing;
 
 		// the currently downloading piece
@@ -68,6 +72,15 @@ namespace libtorrent
 		int downloading_block_index;
 		int downloading_progress;
 		int downloading_total;
+
+		// the number of blocks requested from the peer that
+		// haven't arrived yet, and the number we try to keep
+		// requested
+		int download_queue_length;
+		int desired_queue_length;
+
+		// the round trip time of requests, in milliseconds
+		int rtt;
 	};
 
 }
@@ -68,14 +68,26 @@ namespace libtorrent
 
 		enum { max_blocks_per_piece = 128 };
 
+		// pieces have a priority from 0 to 7. Higher priority
+		// pieces are picked first, and the ones with priority
+		// 0 aren't downloaded at all
+		enum
+		{
+			priority_levels = 8,
+			default_priority = 4
+		};
+
 		struct block_info
 		{
-			block_info(): num_downloads(0) {}
+			block_info(): num_downloads(0), num_requests(0) {}
 			// the peer this block was requested or
 			// downloaded from
 			peer_id peer;
 			// the number of times this block has been downloaded
 			int num_downloads;
+			// the number of peers this block is requested
+			// from. It's more than one only in end-game mode
+			int num_requests;
 		};
 
 		struct downloading_piece
@@ -134,6 +146,14 @@ namespace libtorrent
 			std::vector<piece_block>& interesting_blocks,
 			int num_pieces) const;
 
+		// picks the blocks of the pieces in the range [first, last)
+		// in index order, the same way as pick_pieces() does. Is
+		// used for sequential download
+		void pick_in_order(const std::vector<bool>& pieces
+			, int first, int last
+			, std::vector<piece_block>& interesting_blocks
+			, int num_blocks) const;
+
 		// returns true if any client is currently downloading this
 		// piece-block, or if it's queued for downloading by some client
 		// or if it already has been successfully downlloaded
@@ -141,7 +161,19 @@ namespace libtorrent
 
 		bool is_finished(piece_block block) const;
 
-		// marks this piece-block as queued for downloading
+		// returns the number of peers the block is
+		// requested from
+		int num_requests(piece_block block) const;
+
+		// true when every block we don't have, that some peer
+		// has, is requested. Then blocks may be requested from
+		// more than one peer (end-game mode)
+		bool is_end_game() const;
+
+		// marks this piece-block as queued for downloading. In
+		// end-game mode a block may be marked more than once,
+		// it's downloading until it's finished or every request
+		// has been aborted
 		void mark_as_downloading(piece_block block, const peer_id& peer);
 		void mark_as_finished(piece_block block, const peer_id& peer);
 
@@ -149,8 +181,9 @@ namespace libtorrent
 		// made available for redownloading
 		void restore_piece(int index);
 
-		// clears the given piece's download flag
-		// this means that this piece-block can be picked again
+		// aborts one of the requests of the given block.
+		// When no peer is left that the block is requested
+		// from, it can be picked again
 		void abort_download(piece_block block);
 
 		bool is_piece_finished(int index) const;
@@ -162,6 +195,16 @@ namespace libtorrent
 		// the hash-check yet
 		int unverified_blocks() const;
 
+		// sets the priority of the piece, 0 - 7. The pieces
+		// with the highest priority are picked first, rarest
+		// first among them. Priority 0 means the piece isn't
+		// downloaded. The default is default_priority
+		void set_piece_priority(int index, int priority);
+		int piece_priority(int index) const;
+
+		// sets mask[i] to true for every piece with priority 0
+		void filtered_pieces(std::vector<bool>& mask) const;
+
 		void get_downloaders(std::vector<peer_id>& d, int index);
 		const std::vector<downloading_piece>& get_download_queue() const
 		{ return m_downloads; }
@@ -173,6 +216,11 @@ namespace libtorrent
 
 	private:
 
+		// the buckets of every priority start this far apart
+		// in m_piece_info and m_downloading_piece_info. It's the
+		// number of values peer_count can have
+		enum { bucket_stride = 128 };
+
 		struct piece_pos
 		{
 			piece_pos() {}
@@ -180,6 +228,7 @@ namespace libtorrent
 				: peer_count(peer_count_)
 				, downloading(0)
 				, index(index_)
+				, piece_priority(default_priority)
 			{}
 
 			// selects which vector to look in
@@ -188,6 +237,20 @@ namespace libtorrent
 			unsigned downloading : 1;
 			// index in to the piece_info vector
 			unsigned index : 24;
+			// 0 - 7, see set_piece_priority()
+			unsigned piece_priority : 3;
+
+			// the bucket in the piece_info vectors this piece is
+			// in. The buckets are ordered by priority, the highest
+			// first, and within a priority by the number of peers
+			// that have the piece. Priority 0 comes last
+			int bucket() const
+			{
+				int level = piece_priority == 0
+					? priority_levels - 1
+					: priority_levels - 1 - piece_priority;
+				return level * bucket_stride + peer_count;
+			}
 
 			bool operator!=(piece_pos p)
 			{ return index != p.index || peer_count != p.peer_count; }
@@ -207,8 +270,10 @@ namespace libtorrent
 			int index;
 		};
 
-		void move(bool downloading, int vec_index, int elem_index);
-		void remove(bool downloading, int vec_index, int elem_index);
+		// the piece at elem_index in the given bucket is moved
+		// to the bucket its piece_pos says it belongs in
+		void move(bool downloading, int bucket, int elem_index);
+		void remove(bool downloading, int bucket, int elem_index);
 
 		int add_interesting_blocks(const std::vector<int>& piece_list,
 				const std::vector<bool>& pieces,
@@ -219,7 +284,10 @@ namespace libtorrent
 		// in the first entry (index 0) is a vector of all pieces
 		// that no peer have, the vector at index 1 contains
 		// all pieces that exactly one peer have, index 2 contains
-		// all pieces exactly two peers have and so on.
+		// all pieces exactly two peers have and so on. That's
+		// for the pieces with the highest priority, the ones with
+		// lower priority follow, bucket_stride entries apart
+		// (see piece_pos::bucket()).
 		std::vector<std::vector<int> > m_piece_info;
 
 		// this vector has the same structure as m_piece_info
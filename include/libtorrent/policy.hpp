@@ -40,6 +40,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/peer.hpp"
 #include "libtorrent/piece_picker.hpp"
+#include "libtorrent/socket.hpp"
 
 namespace libtorrent
 {
@@ -63,9 +64,20 @@ namespace libtorrent
 		bool new_connection(peer_connection& c);
 
 		// this is called once for every peer we get from
-		// the tracker
+		// the tracker. The peer is put in the session's
+		// connection queue, unless we're already connected
+		// to it or it's banned
 		void peer_from_tracker(const address& remote, const peer_id& id);
 
+		// a peer on the local network announced the torrent.
+		// It's connected to before the peers from the tracker
+		void peer_from_lsd(const address& remote);
+
+		// is called by the connection queue when it's time to
+		// connect to a peer. Returns false if no connection
+		// was made
+		bool connect_peer(const address& remote, const peer_id& id);
+
 		// the given connection was just closed
 		void connection_closed(const peer_connection& c);
 
@@ -76,9 +88,27 @@ namespace libtorrent
 		// the peer has got at least one interesting piece
 		void peer_is_interesting(peer_connection& c);
 
+		// the peer has no pieces left that we want
+		void peer_is_uninteresting(peer_connection& c);
+
 		void piece_finished(int index, bool successfully_verified);
 
-		void block_finished(peer_connection& c, piece_block b);
+		// other_requests is true if the block has been requested
+		// from other peers too, in end-game mode. Only then
+		// are their download queues searched for it
+		void block_finished(peer_connection& c, piece_block b
+			, bool other_requests);
+
+		// the peer rejected our request for the block
+		void block_rejected(peer_connection& c, piece_block b);
+
+		// the peer didn't send the blocks in time, and
+		// the requests have been given back to the picker
+		void requests_timed_out(peer_connection& c);
+
+		// the peer will let us request the piece even
+		// while it has choked us
+		void allowed_fast(peer_connection& c, int index);
 
 		// the peer choked us
 		void choked(peer_connection& c);
@@ -118,6 +148,11 @@ namespace libtorrent
 			// will be saved a limited amount of time
 			peer_id id;
 
+			// the address we connected to the peer on. Peers
+			// from trackers that don't send peer ids are
+			// identified by this until we have connected to them
+			address ip;
+
 			// the time when this peer was optimistically unchoked
 			// the last time.
 			boost::posix_time::ptime last_optimistically_unchoked;
@@ -146,6 +181,13 @@ namespace libtorrent
 			peer_connection* connection;
 		};
 
+		// finds the peer with the given id, or with the given
+		// address if the id is all zeros
+		std::vector<peer>::iterator find_peer(const address& remote, const peer_id& id);
+
+		// finds the peer that c is the connection of
+		std::vector<peer>::iterator find_connection(const peer_connection& c);
+
 		bool unchoke_one_peer();
 		peer* find_choke_candidate();
 		peer* find_unchoke_candidate();
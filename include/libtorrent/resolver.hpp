@@ -0,0 +1,187 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_RESOLVER_HPP_INCLUDED
+#define TORRENT_RESOLVER_HPP_INCLUDED
+
+#include <string>
+#include <map>
+#include <set>
+#include <list>
+#include <deque>
+
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/timer_wheel.hpp"
+
+namespace libtorrent
+{
+
+	// resolves hostnames without blocking the network thread.
+	// The lookups are made by a few worker threads, and the
+	// results are cached, failures as well as successes.
+	// The handlers are always called from on_timer() in the
+	// network thread, never from within async_resolve().
+	class resolver: public timer_callback, boost::noncopyable
+	{
+	public:
+
+		// the first argument is 0 on success, otherwise
+		// the error returned by getaddrinfo()
+		typedef boost::function2<void, int, const address&> handler;
+
+		// looks up the hostname and sets the second argument to
+		// its IP, in host byte order. Returns 0 on success,
+		// otherwise an error code. It's called by the worker
+		// threads. The default one calls getaddrinfo()
+		typedef boost::function2<int, const std::string&, unsigned int&> lookup_function;
+
+		enum
+		{
+			num_threads = 2,
+			// how often the results from the worker
+			// threads are checked, in milliseconds
+			poll_interval = 50,
+			// how long results are kept in the cache by
+			// default, see set_cache_ttl(),
+			// in milliseconds
+			cache_ttl = 10 * 60 * 1000,
+			negative_cache_ttl = 60 * 1000,
+			max_cache_size = 1000
+		};
+
+		resolver(timer_wheel& timers);
+		resolver(timer_wheel& timers, const lookup_function& f);
+		~resolver();
+
+		// sets how long successful and failed lookups
+		// are cached, in milliseconds
+		void set_cache_ttl(int ttl, int negative_ttl);
+
+		// resolves the hostname, which may also be a dotted
+		// IP, and calls the handler with the address and the
+		// given port. The owner is only used to cancel the
+		// request.
+		void async_resolve(const std::string& hostname
+			, unsigned short port
+			, const void* owner
+			, const handler& h);
+
+		// none of the handlers passed in by the given
+		// owner will be called after this
+		void cancel(const void* owner);
+
+		// the number of hostnames in the cache. IPs are
+		// never cached
+		int cache_size() const { return int(m_cache.size()); }
+
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		void start_threads();
+		void worker();
+
+		// hands the hostname to the worker threads,
+		// unless it's already being looked up
+		void lookup(const std::string& hostname);
+
+		// removes expired entries from the cache
+		void prune_cache();
+
+		struct request
+		{
+			std::string hostname;
+			unsigned short port;
+			const void* owner;
+			handler h;
+			// the hostname is a dotted IP, which is
+			// delivered without being looked up or cached
+			bool literal;
+			unsigned int ip;
+		};
+
+		struct cache_entry
+		{
+			// in host byte order, 0 if the lookup failed
+			unsigned int ip;
+			int error;
+			timer_wheel::time_type expires;
+		};
+
+		struct result
+		{
+			result(const std::string& h, unsigned int i, int e)
+				: hostname(h), ip(i), error(e) {}
+			std::string hostname;
+			unsigned int ip;
+			int error;
+		};
+
+		// these are only used by the network thread
+
+		timer_wheel& m_timers;
+		timer_entry m_timer;
+		std::map<std::string, cache_entry> m_cache;
+		int m_cache_ttl;
+		int m_negative_cache_ttl;
+
+		// the requests that are waiting for a lookup
+		// or to be delivered
+		std::list<request> m_requests;
+
+		// the hostnames that are being looked up
+		// by the worker threads
+		std::set<std::string> m_in_progress;
+
+		// these are shared with the worker threads
+
+		boost::mutex m_mutex;
+		boost::condition m_cond;
+		std::deque<std::string> m_jobs;
+		std::deque<result> m_results;
+		bool m_abort;
+
+		// is only set by the constructor, before
+		// the worker threads are started
+		lookup_function m_lookup;
+
+		boost::thread_group m_threads;
+	};
+
+}
+
+#endif // TORRENT_RESOLVER_HPP_INCLUDED
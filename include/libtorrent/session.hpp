@@ -58,6 +58,16 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/alert.hpp"
 #include "libtorrent/fingerprint.hpp"
 #include "libtorrent/debug.hpp"
+#include "libtorrent/block_pool.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/bandwidth_manager.hpp"
+#include "libtorrent/peer_class.hpp"
+#include "libtorrent/connection_queue.hpp"
+#include "libtorrent/resolver.hpp"
+#include "libtorrent/tracker_scheduler.hpp"
+#include "libtorrent/lsd.hpp"
+#include "libtorrent/dht_node.hpp"
+#include "libtorrent/extensions.hpp"
 
 
 // TODO: if we're not interested and the peer isn't interested, close the connections
@@ -127,29 +137,140 @@ namespace libtorrent
 
 		// this is the link between the main thread and the
 		// thread started to run the main downloader loop
-		struct session_impl: boost::noncopyable
+		struct session_impl: timer_callback, boost::noncopyable
 		{
 			typedef std::map<boost::shared_ptr<socket>, boost::shared_ptr<peer_connection> > connection_map;
 
-			session_impl(int listen_port, const fingerprint& cl_fprint);
+			session_impl(int listen_port
+				, const fingerprint& cl_fprint
+				, int listen_backlog);
 			void operator()();
 
+			// is called once every second, by m_second_timer
+			virtual void on_timer(timer_entry& t);
+
 			// must be locked to access the data
 			// in this struct
 			boost::mutex m_mutex;
 			torrent* find_torrent(const sha1_hash& info_hash);
 			const peer_id& get_peer_id() const { return m_peer_id; }
 
+			// the buffers that piece payloads are received
+			// into. It's declared before the connections and
+			// torrents, so that it's destructed after them
+			block_pool m_block_pool;
+
+			// all timeouts, keep-alives and periodic events are
+			// scheduled on this wheel. Like the block pool, it has
+			// to outlive the connections and torrents.
+			timer_wheel m_timers;
+
+			// the timer for the once-a-second tasks
+			timer_entry m_second_timer;
+
+			// hostnames of peers and trackers are looked up
+			// here, so that the network thread never blocks
+			// on the DNS. It must outlive the torrents
+			resolver m_resolver;
+
+			// the connections whose timeouts have expired. They
+			// are closed by the main loop after the timers have
+			// been advanced.
+			std::vector<boost::shared_ptr<socket> > m_timed_out;
+
+			// the session wide upload and download limits,
+			// indexed by peer_connection::upload_channel and
+			// download_channel. The limits are in bytes per
+			// second, -1 means unlimited
+			bandwidth_channel m_bandwidth_limit[peer_connection::num_channels];
+
+			// the peers that are waiting for quota are
+			// queued here. They must outlive the connections
+			bandwidth_manager m_upload_manager;
+			bandwidth_manager m_download_manager;
+
+			// the peer classes, indexed by their ids. It's a
+			// deque so that their bandwidth channels don't move
+			// when classes are added. Like the bandwidth managers
+			// they must outlive the connections.
+			std::deque<peer_class> m_classes;
+			peer_class_map m_class_map;
+
+			// updates the send and receive quota of all
+			// connections, after some limit has changed
+			void update_quotas();
+
+			// accepts all the connections waiting on the
+			// listen socket
+			void accept_connections(boost::shared_ptr<socket> listener);
+
+			// the peers we get from the trackers wait here
+			// until we may connect to them. It must outlive
+			// the connections and the torrents
+			connection_queue m_connection_queue;
+
 			tracker_manager m_tracker_manager;
+
+			// announces and scrapes to udp:// trackers. Its
+			// sockets are monitored by m_selector
+			udp_tracker_manager m_udp_tracker_manager;
+
+			// spreads out the announces and scrapes the
+			// torrents' swarm sizes between them. It must
+			// outlive the torrents
+			tracker_scheduler m_tracker_scheduler;
+
+			// multicasts our torrents on the local network,
+			// when it's enabled. Its socket is monitored by
+			// m_selector
+			lsd m_lsd;
+
+			// finds peers without a tracker. Its socket
+			// is monitored by m_selector
+			dht_node m_dht;
+
+			// is called by the local service discovery
+			// with a peer that announced one of our torrents
+			void on_lsd_peer(const sha1_hash& info_hash
+				, const address& peer);
+
+			// is called by the dht with the peers it
+			// has found for a torrent
+			void on_dht_peers(const sha1_hash& info_hash
+				, const std::vector<address>& peers);
+
 			std::map<sha1_hash, boost::shared_ptr<torrent> > m_torrents;
 			connection_map m_connections;
 
+			// the extensions to the peer protocol. Every
+			// connection that supports the extension protocol
+			// gets one instance of each
+			std::vector<extension_factory> m_extensions;
+
 			// the peer id that is generated at the start of each torrent
 			peer_id m_peer_id;
 
 			// the port we are listening on for connections
 			int m_listen_port;
 
+			// the number of incoming connections the kernel
+			// will queue up for us before it starts dropping
+			// them
+			int m_listen_backlog;
+
+			// the bounds of the number of blocks requested from
+			// a peer at a time. Within them, every peer's queue is
+			// sized from its download rate and round trip time
+			int m_min_request_queue;
+			int m_max_request_queue;
+
+			// the shortest time, in seconds, we wait for a block
+			// before the requests to a peer expire, and the time
+			// a peer may go without sending any piece data before
+			// it's snubbed
+			int m_request_timeout;
+			int m_snub_timeout;
+
 			// this is where all active sockets are stored.
 			// the selector can sleep while there's no activity on
 			// them
@@ -163,11 +284,6 @@ namespace libtorrent
 			// should exit
 			volatile bool m_abort;
 
-			// maximum upload rate given in
-			// bytes per second. -1 means
-			// unlimited
-			int m_upload_rate;
-
 			// handles delayed alerts
 			alert_manager m_alerts;
 
@@ -188,8 +304,15 @@ namespace libtorrent
 	{
 	public:
 
-		session(int listen_port, const fingerprint& print);
-		session(int listen_port);
+		// the listen backlog is the number of incoming
+		// connections that may wait to be accepted
+		enum { default_listen_backlog = 128 };
+
+		session(int listen_port
+			, const fingerprint& print
+			, int listen_backlog = default_listen_backlog);
+		session(int listen_port
+			, int listen_backlog = default_listen_backlog);
 
 		~session();
 
@@ -201,6 +324,60 @@ namespace libtorrent
 
 		void set_http_settings(const http_settings& s);
 		void set_upload_rate_limit(int bytes_per_second);
+		void set_download_rate_limit(int bytes_per_second);
+
+		// creates a new peer class and returns its id.
+		// The session has two classes from the start,
+		// default_peer_class and local_peer_class
+		int create_peer_class(const std::string& name);
+		void set_peer_class_settings(int peer_class, const peer_class_settings& s);
+
+		// puts the peers in the address range [first, last]
+		// in the given class. Only connections made after this
+		// call are affected
+		void add_peer_class_range(const address& first
+			, const address& last, int peer_class);
+
+		// limits for outgoing connection attempts, and the
+		// total number of connections. -1 means unlimited
+		void set_max_connections(int limit);
+		void set_max_half_open_connections(int limit);
+		void set_connect_rate(int attempts_per_second);
+		void set_connect_timeout(int seconds);
+
+		// the number of outstanding block requests to a peer is
+		// kept between these bounds. The defaults are 2 and 250
+		void set_request_queue_limits(int min_blocks, int max_blocks);
+
+		// requests to a peer that doesn't send the blocks in
+		// time are given back, to be requested from other peers.
+		// The timeout follows the peer's rate, but is never less
+		// than this. The default is 10 seconds
+		void set_request_timeout(int seconds);
+
+		// a peer that hasn't sent us any data in this many seconds,
+		// while we were waiting for blocks, is snubbed. We only
+		// request one block at a time from it. The default is 30
+		void set_snub_timeout(int seconds);
+
+		// local service discovery, finds peers on the local
+		// network by multicasting the info-hashes of the
+		// torrents. It's off by default
+		void start_lsd();
+		void stop_lsd();
+
+		// the dht node finds peers when the trackers can't. It
+		// listens on the given udp port. The nodes added are used
+		// to join the dht, the peers that support it give us
+		// nodes too. It's off by default
+		void start_dht(int port);
+		void stop_dht();
+		void add_dht_node(const address& node);
+
+		// limits the memory used for block buffers.
+		// 0 means unlimited
+		void set_buffer_pool_limit(int bytes);
+		block_pool_status buffer_pool_status() const;
 
 		std::auto_ptr<alert> pop_alert();
 
@@ -39,9 +39,11 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #if defined(_WIN32)
 	#include <winsock2.h>
+	#include <ws2tcpip.h>
 #else
 	#include <unistd.h>
 	#include <sys/socket.h>
+	#include <sys/uio.h>
 	#include <netinet/in.h>
 	#include <netdb.h>
 	#include <errno.h>
@@ -57,6 +59,8 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <vector>
 #include <exception>
 #include <string>
+#include <cstring>
+#include <algorithm>
 
 namespace libtorrent
 {
@@ -120,7 +124,12 @@ namespace libtorrent
 		const address& sender() const { return m_sender; }
 		address name() const;
 
+		// queue is the backlog of connections that
+		// haven't been accepted yet
 		void listen(unsigned short port, int queue);
+
+		// on a non-blocking socket, this returns an empty
+		// pointer when there are no more connections waiting
 		boost::shared_ptr<libtorrent::socket> accept();
 
 		template<class T> int send(const T& buffer);
@@ -131,6 +140,57 @@ namespace libtorrent
 		int send_to(const address& addr, const char* buffer, int size);
 		int receive(char* buffer, int size);
 
+		// receives one datagram and fills in the address
+		// it was sent from. Returns -1 on failure, just
+		// like receive().
+		int receive_from(char* buffer, int size, address& from);
+
+		// binds the socket to the given port on all
+		// interfaces. With reuse_address, several sockets
+		// (and processes) may bind the same port, which is
+		// what multicast listeners need.
+		void bind(unsigned short port, bool reuse_address);
+
+		// the datagrams sent to the given multicast group
+		// will be received by this socket. The datagrams we
+		// send to a group reach only the local network
+		// (ttl 1) and are looped back to this machine.
+		void join_multicast_group(const address& group);
+
+		// one datagram in a batch. When receiving, size is the
+		// size of buf, and it's set to the number of bytes that
+		// were received
+		struct datagram
+		{
+			char* buf;
+			int size;
+			address addr;
+		};
+
+		// receives up to num datagrams, with a single system call
+		// where the platform supports it. Returns the number of
+		// datagrams received, or -1 if there were none
+		int receive_batch(datagram* d, int num);
+
+		// sends the datagrams in order, with a single system call
+		// where possible. Returns the number of datagrams sent, or
+		// -1 if none could be sent
+		int send_batch(const datagram* d, int num);
+
+		// describes one of the buffers given
+		// to a gather write
+		struct buffer
+		{
+			const char* buf;
+			int size;
+		};
+
+		// sends as much as possible of the given buffers,
+		// in order, with a single call (where the platform
+		// supports gather writes). Returns the number of bytes
+		// sent or -1 on failure, just like send().
+		int send(const std::vector<buffer>& bufs);
+
 		void set_receive_bufsize(int size);
 		void set_send_bufsize(int size);
 
@@ -202,6 +262,162 @@ namespace libtorrent
 		return receive(reinterpret_cast<char*>(&buf), sizeof(T));
 	}
 
+	inline int socket::send(const std::vector<buffer>& bufs)
+	{
+		if (bufs.empty()) return 0;
+#if defined(_WIN32)
+		// no gather writes, send the buffers one by one
+		// until one of them can't be sent completely
+		int ret = 0;
+		for (std::vector<buffer>::const_iterator i = bufs.begin();
+			i != bufs.end();
+			++i)
+		{
+			int sent = send(i->buf, i->size);
+			if (sent < 0) return ret > 0 ? ret : sent;
+			ret += sent;
+			if (sent < i->size) break;
+		}
+		return ret;
+#else
+		// don't pass more buffers than the
+		// platform is guaranteed to accept
+		enum { max_iovec = 64 };
+		iovec vec[max_iovec];
+		int num_bufs = std::min(int(bufs.size()), int(max_iovec));
+		for (int i = 0; i < num_bufs; ++i)
+		{
+			vec[i].iov_base = const_cast<char*>(bufs[i].buf);
+			vec[i].iov_len = bufs[i].size;
+		}
+		msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec;
+		msg.msg_iovlen = num_bufs;
+#if defined(MSG_NOSIGNAL)
+		return ::sendmsg(m_socket, &msg, MSG_NOSIGNAL);
+#else
+		return ::sendmsg(m_socket, &msg, 0);
+#endif
+#endif
+	}
+
+	inline int socket::receive_from(char* buffer, int size, address& from)
+	{
+#if defined(_WIN32)
+		int len = sizeof(from.m_sockaddr);
+#else
+		socklen_t len = sizeof(from.m_sockaddr);
+#endif
+		return ::recvfrom(m_socket, buffer, size, 0
+			, reinterpret_cast<sockaddr*>(&from.m_sockaddr), &len);
+	}
+
+	inline int socket::receive_batch(datagram* d, int num)
+	{
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+		enum { max_batch = 32 };
+		if (num > max_batch) num = max_batch;
+		mmsghdr msgs[max_batch];
+		iovec vec[max_batch];
+		std::memset(msgs, 0, sizeof(mmsghdr) * num);
+		for (int i = 0; i < num; ++i)
+		{
+			vec[i].iov_base = d[i].buf;
+			vec[i].iov_len = d[i].size;
+			msgs[i].msg_hdr.msg_iov = &vec[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &d[i].addr.m_sockaddr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(d[i].addr.m_sockaddr);
+		}
+		int ret = ::recvmmsg(m_socket, msgs, num, 0, 0);
+		for (int i = 0; i < ret; ++i)
+			d[i].size = msgs[i].msg_len;
+		return ret;
+#else
+		int i = 0;
+		for (; i < num; ++i)
+		{
+			int size = receive_from(d[i].buf, d[i].size, d[i].addr);
+			if (size < 0) break;
+			d[i].size = size;
+		}
+		return i > 0 ? i : -1;
+#endif
+	}
+
+	inline int socket::send_batch(const datagram* d, int num)
+	{
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+		enum { max_batch = 32 };
+		if (num > max_batch) num = max_batch;
+		mmsghdr msgs[max_batch];
+		iovec vec[max_batch];
+		std::memset(msgs, 0, sizeof(mmsghdr) * num);
+		for (int i = 0; i < num; ++i)
+		{
+			vec[i].iov_base = d[i].buf;
+			vec[i].iov_len = d[i].size;
+			msgs[i].msg_hdr.msg_iov = &vec[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = const_cast<sockaddr_in*>(&d[i].addr.m_sockaddr);
+			msgs[i].msg_hdr.msg_namelen = sizeof(d[i].addr.m_sockaddr);
+		}
+		return ::sendmmsg(m_socket, msgs, num, 0);
+#else
+		int i = 0;
+		for (; i < num; ++i)
+		{
+			if (send_to(d[i].addr, d[i].buf, d[i].size) < 0) break;
+		}
+		return i > 0 ? i : -1;
+#endif
+	}
+
+	inline void socket::bind(unsigned short port, bool reuse_address)
+	{
+		if (reuse_address)
+		{
+			int one = 1;
+			if (::setsockopt(m_socket, SOL_SOCKET, SO_REUSEADDR
+				, reinterpret_cast<const char*>(&one), sizeof(one)) != 0)
+				throw network_error(last_error());
+#if defined(SO_REUSEPORT)
+			// some BSDs won't let two sockets bind the same
+			// multicast port without this. It's fine if it fails
+			::setsockopt(m_socket, SOL_SOCKET, SO_REUSEPORT
+				, reinterpret_cast<const char*>(&one), sizeof(one));
+#endif
+		}
+
+		sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(port);
+		if (::bind(m_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+			throw network_error(last_error());
+	}
+
+	inline void socket::join_multicast_group(const address& group)
+	{
+		ip_mreq req;
+		std::memset(&req, 0, sizeof(req));
+		req.imr_multiaddr.s_addr = group.ip();
+		req.imr_interface.s_addr = htonl(INADDR_ANY);
+		if (::setsockopt(m_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP
+			, reinterpret_cast<const char*>(&req), sizeof(req)) != 0)
+			throw network_error(last_error());
+
+		// these are the defaults, but make sure
+		unsigned char ttl = 1;
+		::setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_TTL
+			, reinterpret_cast<const char*>(&ttl), sizeof(ttl));
+		unsigned char loop = 1;
+		::setsockopt(m_socket, IPPROTO_IP, IP_MULTICAST_LOOP
+			, reinterpret_cast<const char*>(&loop), sizeof(loop));
+	}
+
 
 	// timeout is given in microseconds
 	// modified is cleared and filled with the sockets that is ready for reading or writing
@@ -223,9 +439,18 @@ namespace libtorrent
 */
 		void remove(boost::shared_ptr<socket> s);
 
+		void remove_readable(boost::shared_ptr<socket> s)
+		{ m_readable.erase(std::find(m_readable.begin(), m_readable.end(), s)); }
+
 		void remove_writable(boost::shared_ptr<socket> s)
 		{ m_writable.erase(std::find(m_writable.begin(), m_writable.end(), s)); }
 
+		bool is_readability_monitored(boost::shared_ptr<socket> s)
+		{
+			return std::find(m_readable.begin(), m_readable.end(), s)
+				!= m_readable.end();
+		}
+
 		bool is_writability_monitored(boost::shared_ptr<socket> s)
 		{
 			return std::find(m_writable.begin(), m_writable.end(), s)
@@ -50,6 +50,7 @@ namespace libtorrent
 		class piece_checker_data;
 	}
 	class session;
+	class block_pool;
 
 	struct file_allocation_failed: std::exception
 	{
@@ -85,7 +86,8 @@ namespace libtorrent
 
 		piece_manager(
 			const torrent_info& info
-		  , const boost::filesystem::path& path);
+		  , const boost::filesystem::path& path
+		  , block_pool& pool);
 
 		void check_pieces(
 			boost::mutex& mutex
@@ -94,6 +96,13 @@ namespace libtorrent
 
 		void allocate_slots(int num_slots);
 
+		// the slots of the pieces set in the filter are not
+		// allocated, so the parts of the files that only those
+		// pieces cover are never written. Unlike the rest of
+		// the piece_manager it isn't locked, it's called with
+		// the session (or the checker) locked
+		void set_piece_filter(const std::vector<bool>& filter);
+
 		size_type read(char* buf, int piece_index, size_type offset, size_type size);
 		void write(const char* buf, int piece_index, size_type offset, size_type size);
 
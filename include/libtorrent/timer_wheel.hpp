@@ -0,0 +1,177 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_TIMER_WHEEL_HPP_INCLUDED
+#define TORRENT_TIMER_WHEEL_HPP_INCLUDED
+
+#include <cassert>
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace libtorrent
+{
+
+	class timer_wheel;
+	class timer_entry;
+
+	// the interface for objects that want to be
+	// notified when a timer expires
+	struct timer_callback
+	{
+		virtual void on_timer(timer_entry& t) = 0;
+		virtual ~timer_callback() {}
+	};
+
+	// a timer that can be scheduled on a timer_wheel.
+	// The timer is owned by the user (typically it's a member
+	// of the object that wants the callback) and is linked
+	// into the wheel while it's scheduled. It's cancelled
+	// automatically when destructed, which means it must
+	// not outlive the wheel it's scheduled on.
+	class timer_entry: boost::noncopyable
+	{
+	friend class timer_wheel;
+	public:
+
+		timer_entry()
+			: m_wheel(0)
+			, m_callback(0)
+			, m_expires(0)
+			, m_next(0)
+			, m_prev(0)
+		{}
+
+		~timer_entry() { cancel(); }
+
+		bool is_scheduled() const { return m_next != 0; }
+
+		// removes the timer from the wheel, if it's scheduled
+		void cancel();
+
+	private:
+
+		void unlink();
+
+		timer_wheel* m_wheel;
+		timer_callback* m_callback;
+
+		// the tick this timer expires at
+		boost::int64_t m_expires;
+
+		// the slot in the wheel is a circular
+		// doubly linked list
+		timer_entry* m_next;
+		timer_entry* m_prev;
+	};
+
+	// a hierarchical timing wheel. It has a number of levels
+	// of slots, where each slot on one level covers all
+	// the slots on the level below it. Scheduling and
+	// cancelling a timer is O(1), and a timer is only
+	// touched when it expires, or when the slot it's in
+	// is cascaded down a level (at most once per level).
+	// That way a large number of mostly idle connections
+	// can all have timers without costing anything until
+	// the timers fire.
+	// The wheel also holds the clock. The time is read
+	// once per loop by update_time() and is then available
+	// through now(), without any system calls.
+	class timer_wheel: boost::noncopyable
+	{
+	friend class timer_entry;
+	public:
+
+		// milliseconds on a monotonic clock
+		typedef boost::int64_t time_type;
+
+		enum
+		{
+			// the resolution of the timers, in milliseconds
+			tick_ms = 10,
+			level_bits = 6,
+			num_slots = 1 << level_bits,
+			num_levels = 4
+		};
+
+		timer_wheel();
+		~timer_wheel();
+
+		// reads the clock, the time is then returned
+		// by now() until the next call to update_time()
+		void update_time();
+		time_type now() const { return m_now; }
+
+		// schedules t to expire in the given number of
+		// milliseconds. If the timer already is scheduled
+		// it's moved to the new expiration time.
+		void schedule(timer_entry& t, timer_callback* c, int milliseconds);
+
+		// calls the callbacks of all timers that have
+		// expired, as of now(). The timers are removed
+		// from the wheel before their callbacks are called,
+		// so the callbacks may reschedule them.
+		void advance();
+
+		// returns the number of milliseconds until the
+		// next timer expires, or -1 if no timer is scheduled
+		int time_to_next() const;
+
+		// the number of scheduled timers
+		int size() const { return m_size; }
+
+	private:
+
+		void link(timer_entry& t);
+
+		// moves all timers in the given slot to
+		// lower levels. Returns the index of the slot
+		int cascade(int level);
+
+		static int slot_index(boost::int64_t tick, int level)
+		{ return int(tick >> (level * level_bits)) & (num_slots - 1); }
+
+		// the heads of the slot lists. These are never
+		// scheduled, they're just list sentinels
+		timer_entry m_slots[num_levels][num_slots];
+
+		// the next tick to process
+		boost::int64_t m_tick;
+
+		time_type m_now;
+
+		int m_size;
+	};
+
+}
+
+#endif // TORRENT_TIMER_WHEEL_HPP_INCLUDED
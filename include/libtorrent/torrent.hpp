@@ -50,7 +50,11 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/policy.hpp"
 #include "libtorrent/storage.hpp"
 #include "libtorrent/url_handler.hpp"
+#include "libtorrent/udp_tracker.hpp"
 #include "libtorrent/stat.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/bandwidth_manager.hpp"
+#include "libtorrent/peer_connection.hpp"
 
 namespace libtorrent
 {
@@ -63,10 +67,24 @@ namespace libtorrent
 		struct session_impl;
 	}
 
+	class block_pool;
+
+	// escapes a string for use in an url
+	std::string escape_string(const char* str, int len);
+
+	// fills in the priorities of the pieces the given file overlaps,
+	// from the priorities of the files. A piece gets the highest
+	// priority of the files it overlaps, empty files don't count.
+	// Returns the index of the first of the pieces, -1 if the
+	// file is empty
+	int file_piece_priorities(const torrent_info& info
+		, const std::vector<int>& file_priority, int file
+		, std::vector<int>& piece_priority);
+
 	// a torrent is a class that holds information
 	// for a specific download. It updates itself against
 	// the tracker
-	class torrent: public request_callback
+	class torrent: public request_callback, public timer_callback
 	{
 	public:
 
@@ -85,14 +103,15 @@ namespace libtorrent
 		// is called every second by session.
 		void second_tick();
 
-		// returns true if it time for this torrent to make another
-		// tracker request
-		bool should_request() const throw()
-		{
-//			boost::posix_time::time_duration d = m_next_request - boost::posix_time::second_clock::local_time();
-//			return d.is_negative();
-			return m_next_request < boost::posix_time::second_clock::local_time();
-		}
+		// is called by the session when the files have
+		// been checked and the torrent has been added to
+		// the session. Starts the tracker announces and the
+		// policy pulses.
+		void start();
+
+		// is called when it's time to announce to the
+		// tracker or to pulse the policy
+		virtual void on_timer(timer_entry& t);
 
 		void print(std::ostream& os) const;
 
@@ -115,6 +134,9 @@ namespace libtorrent
 
 		piece_manager& filesystem() { return m_storage; }
 
+		// the session wide pool of block buffers
+		block_pool& buffer_pool();
+
 // --------------------------------------------
 		// PEER MANAGEMENT
 
@@ -131,10 +153,74 @@ namespace libtorrent
 		// the number of peers that belong to this torrent
 		int num_peers() const { return m_connections.size(); }
 
+		// -1 means unlimited
+		void set_max_connections(int limit);
+
+		// the priorities of the pieces, 0 - 7, see
+		// piece_picker::set_piece_priority()
+		void set_piece_priority(int index, int priority);
+		int piece_priority(int index) const;
+
+		// sets the priority of every piece the file overlaps.
+		// A piece that overlaps several files gets the highest
+		// priority of them
+		void set_file_priority(int index, int priority);
+		int file_priority(int index) const;
+
+		// the piece should be downloaded within deadline
+		// milliseconds from now. It's requested from the fastest
+		// peers, and requested again from other peers when it
+		// looks like it won't arrive in time. Once it has passed
+		// the hash check, a piece_finished_alert is posted with
+		// its data
+		void set_piece_deadline(int index, int deadline);
+		void reset_piece_deadline(int index);
+
+		// in sequential mode, the read_ahead() pieces starting
+		// at sequential_cursor(), the first piece we don't have,
+		// are picked in order before any other piece
+		void set_sequential_download(bool sequential);
+		void set_read_ahead(int pieces);
+		bool is_sequential_download() const { return m_sequential_download; }
+		int read_ahead() const { return m_read_ahead; }
+		int sequential_cursor() const { return m_sequential_cursor; }
+
+		// returns true if this torrent has as many
+		// connections as it's allowed to
+		bool is_full() const
+		{
+			return m_max_connections != -1
+				&& int(m_connections.size()) >= m_max_connections;
+		}
+
+		// puts the peer in the session's connection queue. Peers
+		// with priority are put in front of the queue
+		void queue_connection(const address& a, const peer_id& id
+			, bool priority = false);
+
 		// returns true if this torrent has a connection
 		// to a peer with the given peer_id
 		bool has_peer(const peer_id& id) const;
 
+		// returns the connection to the peer with the
+		// given address, or 0 if there is none
+		peer_connection* connection_for(const address& a) const;
+
+// --------------------------------------------
+		// BANDWIDTH MANAGEMENT
+
+		// limits the total rate of all peers in this torrent,
+		// in bytes per second. -1 means unlimited
+		void set_upload_limit(int limit);
+		void set_download_limit(int limit);
+
+		// indexed by peer_connection::upload_channel and
+		// download_channel
+		bandwidth_channel& bandwidth_limit(int channel)
+		{ return m_bandwidth_limit[channel]; }
+		const bandwidth_channel& bandwidth_limit(int channel) const
+		{ return m_bandwidth_limit[channel]; }
+
 		typedef std::vector<peer_connection*>::iterator peer_iterator;
 		typedef std::vector<peer_connection*>::const_iterator peer_const_iterator;
 
@@ -182,9 +268,41 @@ namespace libtorrent
 		// to the tracker
 		std::string generate_tracker_request(int port);
 
+		// the same request, for udp:// trackers
+		udp_tracker_request generate_udp_tracker_request(int port);
+
+		// sends a request to the current tracker, over http or
+		// udp depending on its url. The response is passed to
+		// c, if it isn't 0
+		void announce(request_callback* c);
+
+		// is called by the resolver when the address of
+		// a peer we got from the tracker has been looked up
+		void on_peer_resolved(int error, const address& a, const peer_id& id);
+
+		// is called by the local service discovery when a peer
+		// on the local network announces this torrent
+		void local_peer_found(const address& a);
+
+		// is called by the dht with the peers it has
+		// found for this torrent
+		void dht_peer_found(const address& a);
+
 		boost::posix_time::ptime next_announce() const
 		{ return m_next_request; }
 
+		// the url of the tracker that answered last
+		const std::string& tracker_url() const
+		{ return m_torrent_file.trackers()[m_last_working_tracker].url; }
+
+		// is called with the number of seeds and downloaders
+		// in the swarm, from announce or scrape responses
+		void set_swarm_size(int complete, int incomplete)
+		{
+			m_num_complete = complete;
+			m_num_incomplete = incomplete;
+		}
+
 // --------------------------------------------
 		// PIECE MANAGEMENT
 
@@ -237,6 +355,9 @@ namespace libtorrent
 		bool is_seed() const
 		{ return m_num_pieces == m_torrent_file.num_pieces(); }
 
+		// the number of pieces we have
+		int num_have() const { return m_num_pieces; }
+
 		boost::filesystem::path save_path() const
 		{ return m_storage.save_path(); }
 
@@ -254,6 +375,10 @@ namespace libtorrent
 
 		void try_next_tracker();
 
+		// sets the time of the next tracker request
+		// and schedules the announce timer for it
+		void set_next_request(int seconds);
+
 		enum event_id
 		{
 			event_started = 0,
@@ -273,7 +398,12 @@ namespace libtorrent
 
 		event_id m_event;
 
-		void parse_response(const entry& e, std::vector<peer>& peer_list);
+		// peers in the dictionary form are put in peer_list,
+		// peers in the compact form (6 bytes per peer) are
+		// put in compact_peers
+		void parse_response(const entry& e
+			, std::vector<peer>& peer_list
+			, std::vector<address>& compact_peers);
 
 		torrent_info m_torrent_file;
 
@@ -291,6 +421,15 @@ namespace libtorrent
 
 		std::vector<peer_connection*> m_connections;
 
+		// the max number of connections in this
+		// torrent. -1 means unlimited
+		int m_max_connections;
+
+		// the upload and download limits of this torrent.
+		// Every peer's quota is taken from these as well
+		// as from its own and the session's channels
+		bandwidth_channel m_bandwidth_limit[peer_connection::num_channels];
+
 		// this is the upload and download statistics for the whole torrent.
 		// it's updated from all its peers once every second.
 		libtorrent::stat m_stat;
@@ -309,10 +448,32 @@ namespace libtorrent
 		int m_last_working_tracker;
 		int m_currently_trying_tracker;
 
-		// this is a counter that is increased every
-		// second, and when it reaches 10, the policy::pulse()
-		// is called and the time scaler is reset to 0.
-		int m_time_scaler;
+		// the number of seeds and downloaders the tracker
+		// knows about, -1 if it hasn't told us
+		int m_num_complete;
+		int m_num_incomplete;
+
+		// expires when it's time to make the next
+		// tracker request
+		timer_entry m_announce_timer;
+
+		// the second the tracker scheduler has booked for our
+		// next announce, or -1. It's given back when the
+		// announce is rescheduled
+		boost::int64_t m_announce_slot;
+
+		// expires every 10 seconds, to call
+		// policy::pulse()
+		timer_entry m_pulse_timer;
+
+		// the torrent is looked up in the dht, and we're
+		// announced to it, when this timer fires
+		timer_entry m_dht_timer;
+
+		// true once start() has been called. Before that
+		// the torrent is checking its files and isn't
+		// part of the session yet
+		bool m_started;
 
 		// this is the priority of this torrent. It is used
 		// to weight the assigned upload bandwidth between peers
@@ -326,6 +487,49 @@ namespace libtorrent
 		// std::accumulate(m_have_pieces.begin(),
 		// m_have_pieces.end(), 0)
 		int m_num_pieces;
+
+		// the priority of every file, as set by
+		// set_file_priority()
+		std::vector<int> m_file_priority;
+
+		// is called when some piece priorities have changed.
+		// Cancels the requests for pieces that are filtered out,
+		// and tells the storage not to allocate them. If pieces
+		// were unfiltered, the peers that have them may have
+		// become interesting
+		void priorities_changed(bool unfiltered);
+
+		struct time_critical_piece
+		{
+			int piece;
+			// the time the piece should be downloaded by
+			timer_wheel::time_type deadline;
+
+			bool operator<(const time_critical_piece& p) const
+			{ return deadline < p.deadline; }
+		};
+
+		// the pieces with deadlines, the earliest deadline first
+		std::vector<time_critical_piece> m_time_critical_pieces;
+
+		// requests the blocks of the pieces with deadlines that
+		// haven't been requested, and requests them again from
+		// other peers if they won't make it in time. Is called
+		// once every second
+		void request_time_critical_pieces();
+
+		// reads the piece from disk and posts a
+		// piece_finished_alert with it
+		void post_piece_finished(int index);
+
+		// see set_sequential_download()
+		bool m_sequential_download;
+		int m_read_ahead;
+		int m_sequential_cursor;
+
+		// moves m_sequential_cursor past the pieces we
+		// have and the ones that are filtered
+		void advance_sequential_cursor();
 	};
 
 }
@@ -75,6 +75,11 @@ namespace libtorrent
 		float progress;
 		boost::posix_time::time_duration next_announce;
 
+		// the number of seeds and downloaders in the swarm,
+		// as reported by the tracker. -1 if it's unknown
+		int num_complete;
+		int num_incomplete;
+
 		// transferred this session!
 		std::size_t total_download;
 		std::size_t total_upload;
@@ -123,6 +128,43 @@ namespace libtorrent
 		// -1 means unlimited unchokes
 		void set_max_uploads(int max_uploads);
 
+		// limits the upload and download rates of this
+		// torrent, in bytes per second. -1 means unlimited
+		void set_upload_limit(int limit);
+		void set_download_limit(int limit);
+
+		// limits the rates of the peer with the given
+		// address. Has no effect if there's no such peer
+		void set_peer_upload_limit(const address& ip, int limit);
+		void set_peer_download_limit(const address& ip, int limit);
+
+		// -1 means unlimited connections
+		void set_max_connections(int max_connections);
+
+		// the priority of a piece is 0 - 7. The pieces with
+		// higher priority are downloaded first, the ones with
+		// priority 0 aren't downloaded at all. The default is 4
+		void set_piece_priority(int index, int priority);
+		int piece_priority(int index) const;
+
+		// sets the priority of every piece of the file. The
+		// files with priority 0 are never allocated or written,
+		// except the parts that share a piece with a file that
+		// is downloaded
+		void set_file_priority(int index, int priority);
+		int file_priority(int index) const;
+
+		// the piece should be downloaded within deadline
+		// milliseconds. When it is, a piece_finished_alert
+		// with its data is posted
+		void set_piece_deadline(int index, int deadline);
+		void reset_piece_deadline(int index);
+
+		// downloads the pieces in order, pieces number of
+		// pieces ahead of the first piece we don't have
+		void set_sequential_download(bool sequential);
+		void set_read_ahead(int pieces);
+
 		const sha1_hash& info_hash() const
 		{ return m_info_hash; }
 
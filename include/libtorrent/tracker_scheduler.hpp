@@ -0,0 +1,164 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_TRACKER_SCHEDULER_HPP_INCLUDED
+#define TORRENT_TRACKER_SCHEDULER_HPP_INCLUDED
+
+#include <map>
+#include <list>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/url_handler.hpp"
+
+namespace libtorrent
+{
+
+	namespace detail
+	{
+		struct session_impl;
+	}
+
+	class tracker_scheduler;
+
+	// a scrape of a number of torrents on the same tracker.
+	// The response is handed out to the torrents that are
+	// still in the session.
+	class scrape_batch: public request_callback, boost::noncopyable
+	{
+	public:
+
+		scrape_batch(detail::session_impl& ses
+			, const std::string& url
+			, const std::vector<sha1_hash>& hashes);
+
+		virtual void tracker_response(const entry& e);
+		virtual void tracker_request_timed_out();
+		virtual void tracker_request_error(const char* str);
+#ifndef NDEBUG
+		virtual void debug_log(const std::string& line);
+#endif
+
+		// sends the request to the udp or the http
+		// tracker manager, depending on the url
+		void send();
+
+		bool done() const { return m_done; }
+
+	private:
+
+		detail::session_impl& m_ses;
+		std::string m_url;
+		std::vector<sha1_hash> m_hashes;
+		bool m_done;
+	};
+
+	// decides when the torrents announce. Announces are spread
+	// out so that no more than max_announces_per_second are
+	// made in any one second, and the intervals get some
+	// jitter so that torrents that were started together
+	// drift apart. Between the announces, the swarm sizes of
+	// the torrents are refreshed by scraping, with many torrents
+	// in each request.
+	class tracker_scheduler: public timer_callback, boost::noncopyable
+	{
+	public:
+
+		enum
+		{
+			max_announces_per_second = 5,
+			// the announce intervals are shortened by up
+			// to this many percent
+			announce_jitter = 10,
+			// seconds between the scrapes of a torrent
+			scrape_interval = 30 * 60,
+			// the maximum number of torrents in one scrape
+			max_scrape_batch = 50,
+			max_scrapes_per_second = 1
+		};
+
+		tracker_scheduler(detail::session_impl& ses);
+		~tracker_scheduler();
+
+		// returns the number of seconds an announce that
+		// should happen in the given number of seconds
+		// should actually be made in. A slot is booked for it,
+		// and slot is set to it. The slot that was booked
+		// before, unless it's -1, is given back first
+		int announce_delay(int seconds, boost::int64_t& slot);
+
+		// gives the booked slot back, if it
+		// hasn't passed. Nothing happens if it's -1
+		void cancel_announce(boost::int64_t slot);
+
+		// starts the periodic scrapes
+		void start();
+
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		// groups the torrents by tracker and queues
+		// the scrape requests
+		void queue_scrapes();
+
+		detail::session_impl& m_ses;
+
+		// the number of announces scheduled in each second,
+		// indexed by the time in seconds. The seconds that
+		// have passed are removed
+		std::map<boost::int64_t, int> m_announces;
+
+		// the scrapes waiting to be sent
+		std::deque<boost::shared_ptr<scrape_batch> > m_scrape_queue;
+
+		// the scrapes that have been sent
+		std::list<boost::shared_ptr<scrape_batch> > m_requests;
+
+		// fires every scrape_interval
+		timer_entry m_scrape_timer;
+
+		// fires every second while there are
+		// queued scrapes
+		timer_entry m_send_timer;
+	};
+
+}
+
+#endif // TORRENT_TRACKER_SCHEDULER_HPP_INCLUDED
@@ -0,0 +1,245 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_UDP_TRACKER_HPP_INCLUDED
+#define TORRENT_UDP_TRACKER_HPP_INCLUDED
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/peer_id.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/url_handler.hpp"
+
+namespace libtorrent
+{
+
+	class resolver;
+
+	struct udp_tracker_request
+	{
+		enum kind_t { announce_request, scrape_request };
+
+		// the events, as numbered by the protocol
+		enum event_t { none = 0, completed, started, stopped };
+
+		udp_tracker_request()
+			: kind(announce_request)
+			, downloaded(0)
+			, uploaded(0)
+			, left(0)
+			, event(none)
+			, listen_port(0)
+		{}
+
+		kind_t kind;
+		// udp://hostname:port
+		std::string url;
+		// the torrent to announce
+		sha1_hash info_hash;
+		// the torrents to scrape, at most
+		// udp_tracker_manager::max_scrape_hashes
+		std::vector<sha1_hash> scrape_hashes;
+		peer_id id;
+		boost::int64_t downloaded;
+		boost::int64_t uploaded;
+		boost::int64_t left;
+		event_t event;
+		unsigned short listen_port;
+	};
+
+	class udp_tracker_manager;
+
+	// one request to a UDP tracker. The tracker's address is
+	// looked up, a connection id is obtained (unless there's
+	// one cached for the tracker) and then the announce or
+	// scrape is sent. Lost packets are resent with an
+	// exponentially growing timeout.
+	class udp_tracker_connection: public timer_callback, boost::noncopyable
+	{
+	public:
+
+		udp_tracker_connection(udp_tracker_manager& man
+			, const udp_tracker_request& req
+			, request_callback* c);
+		~udp_tracker_connection();
+
+		void start();
+
+		// is called when the socket is readable
+		void receive();
+
+		virtual void on_timer(timer_entry& t);
+
+		bool done() const { return m_state == state_done; }
+		const boost::shared_ptr<socket>& get_socket() const { return m_socket; }
+
+		// the callback is cleared if its owner goes
+		// away before the request is done
+		request_callback* callback() const { return m_callback; }
+		void clear_callback() { m_callback = 0; }
+
+	private:
+
+		enum state_t
+		{
+			state_resolving,
+			state_connecting,
+			state_requesting,
+			state_done
+		};
+
+		enum action_t
+		{
+			action_connect = 0,
+			action_announce,
+			action_scrape,
+			action_error
+		};
+
+		void on_resolved(int error, const address& a);
+
+		// sends the connect request, or the announce or
+		// scrape if we have a connection id, and sets
+		// the timeout
+		void send_request();
+
+		void parse_announce_response(const char* buf, int size);
+		void parse_scrape_response(const char* buf, int size);
+
+		// reports the error to the callback and ends the request
+		void fail(const char* msg);
+		void finish();
+
+		udp_tracker_manager& m_man;
+		udp_tracker_request m_request;
+		request_callback* m_callback;
+		boost::shared_ptr<socket> m_socket;
+		address m_tracker;
+
+		state_t m_state;
+		boost::uint32_t m_transaction_id;
+		boost::int64_t m_connection_id;
+
+		// true if m_connection_id was taken from the cache.
+		// If the tracker doesn't accept it, it may have
+		// expired, and we connect again
+		bool m_cached_id;
+
+		// the number of times the current packet has been sent
+		int m_attempts;
+		timer_entry m_timer;
+	};
+
+	// keeps the UDP tracker requests that are in progress and
+	// the connection ids of the trackers we have talked to
+	// recently. The sockets are monitored by the session's
+	// selector, and it hands them to incoming() when they're
+	// readable.
+	class udp_tracker_manager: public timer_callback, boost::noncopyable
+	{
+	friend class udp_tracker_connection;
+	public:
+
+		enum
+		{
+			// how long a connection id may be used,
+			// in milliseconds
+			connection_id_ttl = 60 * 1000,
+			// the first timeout, in milliseconds. It is
+			// doubled with every resend
+			initial_timeout = 15 * 1000,
+			max_attempts = 3,
+			// the number of torrents that fit in one
+			// scrape packet
+			max_scrape_hashes = 74
+		};
+
+		udp_tracker_manager(timer_wheel& timers
+			, selector& sel
+			, resolver& r);
+
+		// if c is 0, the request is only tried once and
+		// its response is ignored
+		void queue_request(const udp_tracker_request& req, request_callback* c = 0);
+
+		// c won't be called anymore
+		void abort_request(request_callback* c);
+		void abort_all_requests();
+
+		// if the socket belongs to one of the requests, it
+		// receives from it and returns true
+		bool incoming(const boost::shared_ptr<socket>& s);
+
+		bool send_finished() const { return m_connections.empty(); }
+		int num_sockets() const { return m_connections.size(); }
+
+		// removes the requests that are done
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		// is called by the connections when they're
+		// done, they're removed from the timer callback
+		void connection_done();
+
+		bool cached_connection_id(const address& a, boost::int64_t& id) const;
+		void cache_connection_id(const address& a, boost::int64_t id);
+		void forget_connection_id(const address& a);
+
+		struct cached_id
+		{
+			boost::int64_t id;
+			timer_wheel::time_type expires;
+		};
+
+		timer_wheel& m_timers;
+		selector& m_selector;
+		resolver& m_resolver;
+
+		timer_entry m_cleanup_timer;
+
+		std::list<boost::shared_ptr<udp_tracker_connection> > m_connections;
+		std::map<address, cached_id> m_connection_ids;
+	};
+
+}
+
+#endif // TORRENT_UDP_TRACKER_HPP_INCLUDED
@@ -0,0 +1,90 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_UT_PEX_HPP_INCLUDED
+#define TORRENT_UT_PEX_HPP_INCLUDED
+
+#include <set>
+
+#include "libtorrent/extensions.hpp"
+#include "libtorrent/socket.hpp"
+
+namespace libtorrent
+{
+
+	// peer exchange. Every minute the peers we're connected
+	// to in the torrent are sent to the other end, as lists of
+	// the peers that have been added and dropped since the
+	// last message. The peers we get are handed to the
+	// policy like the ones from the tracker.
+	class ut_pex_peer: public peer_extension
+	{
+	public:
+
+		enum
+		{
+			// seconds between the messages
+			send_interval = 60,
+			// the maximum number of added peers in
+			// one message, both ways
+			max_peers = 50
+		};
+
+		ut_pex_peer(torrent& t, peer_connection& c);
+
+		virtual const char* message_name() const { return "ut_pex"; }
+		virtual void on_message(const char* body, int size);
+		virtual void tick();
+
+	private:
+
+		torrent& m_torrent;
+		peer_connection& m_connection;
+
+		// the peers the other end knows we're connected
+		// to, i.e. the ones we have sent as added
+		std::set<address> m_sent;
+
+		// seconds until the next message is sent
+		int m_countdown;
+
+		// the number of seconds since the last message
+		// we received, to ignore peers that send too often
+		int m_last_received;
+	};
+
+	boost::shared_ptr<peer_extension> create_ut_pex(torrent& t, peer_connection& c);
+
+}
+
+#endif // TORRENT_UT_PEX_HPP_INCLUDED
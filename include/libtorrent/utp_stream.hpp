@@ -0,0 +1,349 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_UTP_STREAM_HPP_INCLUDED
+#define TORRENT_UTP_STREAM_HPP_INCLUDED
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <utility>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/timer_wheel.hpp"
+
+namespace libtorrent
+{
+
+	class utp_socket_manager;
+
+	// a reliable, ordered byte stream over UDP (uTP). The congestion
+	// control is LEDBAT: the sender measures the one-way delay of the
+	// packets and keeps the queuing delay it causes around
+	// target_delay. It backs off as soon as the buffers of a shared
+	// link start to fill up, so bulk transfers yield to TCP and to
+	// latency sensitive traffic.
+	// All streams share the UDP socket of the utp_socket_manager,
+	// which drives them. send() and receive() work like the socket
+	// functions.
+	class utp_stream: boost::noncopyable
+	{
+	friend class utp_socket_manager;
+	public:
+
+		enum
+		{
+			header_size = 20,
+			packet_size = 1400,
+			payload_size = packet_size - header_size,
+			// the queuing delay we aim for, in microseconds
+			target_delay = 100000,
+			min_window = payload_size,
+			max_window = 1024 * 1024,
+			max_send_buffer = 256 * 1024,
+			max_receive_buffer = 256 * 1024,
+			// in milliseconds
+			initial_timeout = 1000,
+			min_timeout = 500,
+			min_probe_timeout = 100,
+			max_timeout = 60 * 1000,
+			// the number of timeouts in a row before
+			// the connection is given up
+			max_timeouts = 6,
+			// the base delay is the lowest delay seen during
+			// the last delay_history minutes
+			delay_history = 3,
+			// the largest selective ack we send, in bytes. Each
+			// bit is one packet
+			max_sack_size = 32
+		};
+
+		enum state_t
+		{
+			state_syn_sent,
+			state_connected,
+			state_fin_sent,
+			state_closed
+		};
+
+		// returns the number of bytes that were buffered, 0 if
+		// the buffer is full, or -1 if the stream is closed
+		int send(const char* buf, int size);
+
+		// returns the number of bytes received, 0 if the other
+		// end has closed the stream and everything has been
+		// read, or -1 if there's nothing to read
+		int receive(char* buf, int size);
+
+		// the buffered data is sent before the stream is closed
+		void close();
+
+		bool is_readable() const { return !m_receive_buffer.empty() || m_eof; }
+		bool is_writable() const;
+
+		state_t state() const { return m_state; }
+
+		// true if the connection timed out or was
+		// reset by the other end
+		bool has_error() const { return m_error; }
+
+		const address& sender() const { return m_remote; }
+
+		int congestion_window() const { return m_cwnd; }
+
+		// in milliseconds
+		int rtt() const { return m_rtt; }
+
+	private:
+
+		enum packet_type
+		{
+			st_data = 0,
+			st_fin,
+			st_state,
+			st_reset,
+			st_syn
+		};
+
+		enum { sack_extension = 1 };
+
+		utp_stream(utp_socket_manager& man, const address& remote
+			, unsigned short recv_id, unsigned short send_id);
+
+		// the first packet of an outgoing connection
+		void send_syn();
+
+		// the connection was initiated by the other end
+		void on_syn(unsigned short seq_nr);
+
+		void incoming(int type, const char* payload, int size
+			, unsigned short seq_nr, unsigned short ack_nr
+			, boost::uint32_t timestamp, boost::uint32_t delay
+			, boost::uint32_t window, const char* sack, int sack_size);
+
+		// resends packets that have timed out
+		void tick();
+
+		// sends as much of the send buffer as the windows allow,
+		// and an ack if the packets we received haven't been
+		// acked yet
+		void flush();
+
+		struct packet
+		{
+			int type;
+			unsigned short seq_nr;
+			std::vector<char> buf;
+			timer_wheel::time_type sent;
+			bool resent;
+			// it has been selectively acked
+			bool acked;
+			// it has been resent because it was
+			// believed to be lost
+			bool fast_resent;
+		};
+
+		void send_packet(int type, const char* payload, int size);
+		void resend(packet& p);
+		void fast_resend(packet& p);
+		// restarts the retransmission timeout
+		void arm_timeout();
+		void send_ack();
+		void write_header(char* buf, int type, unsigned short seq_nr);
+		int receive_window() const;
+
+		void on_ack(unsigned short ack_nr, boost::uint32_t delay, bool pure_ack
+			, const char* sack, int sack_size);
+		// returns the number of payload bytes in the packet
+		int ack_packet(packet& p);
+		void on_delay_sample(boost::uint32_t delay, int bytes_acked);
+		void on_rtt_sample(int rtt);
+		void on_loss();
+
+		void deliver(const char* buf, int size);
+
+		utp_socket_manager& m_man;
+		address m_remote;
+		state_t m_state;
+
+		unsigned short m_recv_id;
+		unsigned short m_send_id;
+
+		// the sequence number of the next packet we send
+		unsigned short m_seq_nr;
+		// the last packet we have received in order
+		unsigned short m_ack_nr;
+		// the last ack we received
+		unsigned short m_last_ack;
+
+		// the packets that haven't been acked yet, in order
+		std::deque<packet> m_outstanding;
+		int m_bytes_in_flight;
+
+		std::deque<char> m_send_buffer;
+		std::deque<char> m_receive_buffer;
+
+		// the packets that were received out of order,
+		// by sequence number
+		std::map<unsigned short, std::vector<char> > m_reorder;
+		int m_reorder_bytes;
+
+		// the congestion window and the receive window
+		// of the other end, in bytes
+		int m_cwnd;
+		boost::uint32_t m_peer_window;
+
+		// the lowest delay seen during each of the last
+		// few minutes, in microseconds
+		boost::uint32_t m_delay_history[delay_history];
+		int m_history_pos;
+		timer_wheel::time_type m_history_start;
+
+		// the one-way delay of the last packet we received, it's
+		// sent back to the other end so that it can measure it
+		boost::uint32_t m_reply_delay;
+
+		// in milliseconds
+		int m_rtt;
+		int m_rtt_var;
+		int m_timeout;
+		timer_wheel::time_type m_timeout_at;
+		// when the last packet is resent, if
+		// nothing has been acked by then
+		timer_wheel::time_type m_probe_at;
+		int m_num_timeouts;
+
+		int m_duplicate_acks;
+
+		// the window isn't halved again until the packets that
+		// were in flight at the time of a loss have been acked
+		unsigned short m_loss_seq;
+		bool m_in_recovery;
+
+		bool m_ack_pending;
+		bool m_close_requested;
+
+		// the sequence number of the fin, and whether
+		// we have received it
+		unsigned short m_fin_seq;
+		bool m_got_fin;
+		// all data up to the fin has been received
+		bool m_eof;
+		bool m_error;
+	};
+
+	// owns the UDP socket that the uTP streams share. The socket is
+	// monitored by the session's selector, which hands it to
+	// incoming() when it's readable. The datagrams are received and
+	// sent in batches, with one system call per batch where the
+	// platform supports it.
+	class utp_socket_manager: public timer_callback, boost::noncopyable
+	{
+	friend class utp_stream;
+	public:
+
+		enum
+		{
+			// how often the retransmission timeouts are
+			// checked, in milliseconds
+			tick_interval = 100,
+			// the number of datagrams received or sent
+			// with one system call
+			batch_size = 32,
+			max_accept_queue = 50
+		};
+
+		utp_socket_manager(timer_wheel& timers, selector& sel);
+		~utp_socket_manager();
+
+		// opens the socket on the given port. Throws network_error
+		void listen(unsigned short port);
+
+		// the socket is opened on any port, if it isn't
+		// open already
+		boost::shared_ptr<utp_stream> connect(const address& a);
+
+		// returns the next incoming stream, or an empty pointer
+		boost::shared_ptr<utp_stream> accept();
+
+		// if the socket is ours, everything is received from
+		// it and true is returned
+		bool incoming(const boost::shared_ptr<socket>& s);
+
+		int num_sockets() const { return m_socket ? 1 : 0; }
+		int num_streams() const { return m_streams.size(); }
+
+		virtual void on_timer(timer_entry& t);
+
+	private:
+
+		void open_socket(unsigned short port);
+		void on_packet(const char* buf, int size, const address& from);
+
+		// the packets are queued, and sent by flush()
+		void send_packet(const address& to, const std::vector<char>& buf);
+		void send_reset(const address& to, unsigned short conn_id
+			, unsigned short ack_nr);
+		void flush();
+
+		void start_timer();
+
+		// the clock the packet timestamps are taken
+		// from, in microseconds
+		boost::uint32_t timestamp() const;
+
+		typedef std::map<std::pair<address, unsigned short>
+			, boost::shared_ptr<utp_stream> > stream_map;
+
+		timer_wheel& m_timers;
+		selector& m_selector;
+
+		boost::shared_ptr<socket> m_socket;
+
+		// by remote address and receive connection id
+		stream_map m_streams;
+		std::deque<boost::shared_ptr<utp_stream> > m_accept_queue;
+
+		std::vector<std::pair<address, std::vector<char> > > m_outgoing;
+		std::vector<char> m_receive_buffer;
+
+		timer_entry m_timer;
+	};
+
+}
+
+#endif // TORRENT_UTP_STREAM_HPP_INCLUDED
@@ -0,0 +1,208 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <algorithm>
+
+#include "libtorrent/bandwidth_manager.hpp"
+#include "libtorrent/peer_connection.hpp"
+
+namespace
+{
+	// returns the amount of quota that can be handed out
+	// to the given request. If share is true, the quota
+	// left in each channel is divided among the peers that
+	// are waiting for it
+	int quota_for(const libtorrent::bw_request& r, bool share)
+	{
+		int amount = r.max_amount;
+		for (int i = 0; i < r.num_channels; ++i)
+		{
+			const libtorrent::bandwidth_channel& c = *r.channel[i];
+			if (!c.is_limited()) continue;
+			int quota = c.quota_left();
+			if (share && c.tmp > 1)
+			{
+				// if there's too little to share, the first
+				// peer in the queue gets all of it
+				quota = std::max(quota / c.tmp, std::min(quota, 1));
+			}
+			amount = std::min(amount, quota);
+		}
+		return std::max(amount, 0);
+	}
+}
+
+namespace libtorrent
+{
+
+	bandwidth_channel::bandwidth_channel()
+		: tmp(0)
+		, m_limit(-1)
+		, m_quota_left(0)
+		, m_last_update(0)
+	{}
+
+	void bandwidth_channel::throttle(int limit)
+	{
+		assert(limit > 0 || limit == -1);
+		m_limit = limit;
+	}
+
+	void bandwidth_channel::update_quota(timer_wheel::time_type now)
+	{
+		timer_wheel::time_type elapsed = now - m_last_update;
+		m_last_update = now;
+		if (m_limit == -1 || elapsed <= 0) return;
+
+		const timer_wheel::time_type max_quota
+			= std::max(timer_wheel::time_type(m_limit) * max_burst_ms / 1000
+				, timer_wheel::time_type(1));
+		timer_wheel::time_type quota = m_quota_left
+			+ timer_wheel::time_type(m_limit) * elapsed / 1000;
+		m_quota_left = int(std::min(quota, max_quota));
+	}
+
+	void bandwidth_channel::use_quota(int amount)
+	{
+		assert(amount >= 0);
+		if (m_limit == -1) return;
+		assert(amount <= m_quota_left);
+		m_quota_left -= amount;
+	}
+
+	bandwidth_manager::bandwidth_manager(timer_wheel& timers, int channel)
+		: m_timers(timers)
+		, m_channel(channel)
+	{}
+
+	int bandwidth_manager::request_bandwidth(const bw_request& r)
+	{
+		assert(r.max_amount > 0);
+		assert(!is_queued(r.peer));
+
+		// if nobody else is waiting, hand out whatever
+		// quota there is right away
+		if (m_queue.empty())
+		{
+			const timer_wheel::time_type now = m_timers.now();
+			for (int i = 0; i < r.num_channels; ++i)
+				r.channel[i]->update_quota(now);
+
+			int amount = quota_for(r, false);
+			if (amount > 0)
+			{
+				for (int i = 0; i < r.num_channels; ++i)
+					r.channel[i]->use_quota(amount);
+				return amount;
+			}
+		}
+
+		m_queue.push_back(r);
+		if (!m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, refill_interval);
+		return 0;
+	}
+
+	void bandwidth_manager::cancel(peer_connection* p)
+	{
+		for (std::deque<bw_request>::iterator i = m_queue.begin();
+			i != m_queue.end(); ++i)
+		{
+			if (i->peer != p) continue;
+			m_queue.erase(i);
+			break;
+		}
+		assert(!is_queued(p));
+		if (m_queue.empty()) m_timer.cancel();
+	}
+
+	bool bandwidth_manager::is_queued(const peer_connection* p) const
+	{
+		for (std::deque<bw_request>::const_iterator i = m_queue.begin();
+			i != m_queue.end(); ++i)
+		{
+			if (i->peer == p) return true;
+		}
+		return false;
+	}
+
+	void bandwidth_manager::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_timer);
+		const timer_wheel::time_type now = m_timers.now();
+
+		// fill the buckets and count the number
+		// of waiting peers on each of them
+		std::deque<bw_request> queue;
+		queue.swap(m_queue);
+		for (std::deque<bw_request>::iterator i = queue.begin();
+			i != queue.end(); ++i)
+		{
+			for (int c = 0; c < i->num_channels; ++c)
+				i->channel[c]->tmp = 0;
+		}
+		for (std::deque<bw_request>::iterator i = queue.begin();
+			i != queue.end(); ++i)
+		{
+			for (int c = 0; c < i->num_channels; ++c)
+			{
+				i->channel[c]->update_quota(now);
+				++i->channel[c]->tmp;
+			}
+		}
+
+		// hand out a fair share to each peer, in the
+		// order they were queued. The ones that don't get
+		// anything stay in the queue.
+		for (std::deque<bw_request>::iterator i = queue.begin();
+			i != queue.end(); ++i)
+		{
+			int amount = quota_for(*i, true);
+			for (int c = 0; c < i->num_channels; ++c)
+			{
+				--i->channel[c]->tmp;
+				i->channel[c]->use_quota(amount);
+			}
+
+			if (amount == 0)
+			{
+				m_queue.push_back(*i);
+				continue;
+			}
+			i->peer->assign_bandwidth(m_channel, amount);
+		}
+
+		if (!m_queue.empty() && !m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, refill_interval);
+	}
+
+}
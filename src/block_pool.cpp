@@ -0,0 +1,331 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <algorithm>
+
+#if defined(TORRENT_USE_HUGE_PAGES)
+#include <sys/mman.h>
+#endif
+
+#include "libtorrent/block_pool.hpp"
+
+namespace
+{
+	// protects the pool pointers of the thread caches, and the
+	// pools' lists of caches. A thread may exit while the pool
+	// it has used is being destructed by another one
+	boost::mutex cache_mutex;
+}
+
+namespace libtorrent
+{
+
+	block_pool::thread_cache::~thread_cache()
+	{
+		boost::mutex::scoped_lock cl(cache_mutex);
+		// the pool is gone, and has freed our blocks
+		if (pool == 0) return;
+		pool->m_caches.erase(this);
+
+		// the thread is exiting, give its blocks back
+		// to the pool
+		boost::mutex::scoped_lock l(pool->m_mutex);
+		for (std::vector<char*>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+		{
+			pool->m_free[0].push_back(*i);
+			pool->m_free_bytes += pool->m_block_size;
+			--pool->m_cached_blocks;
+		}
+	}
+
+	block_pool::block_pool(int block_size)
+		: m_block_size(block_size)
+		, m_allocated(0)
+		, m_free_bytes(0)
+		, m_peak_allocated(0)
+		, m_peak_in_use(0)
+		, m_limit(0)
+		, m_cached_blocks(0)
+	{
+		assert(block_size > 0);
+	}
+
+	block_pool::~block_pool()
+	{
+		// flush the cache of this thread
+		m_thread_cache.reset();
+
+		boost::mutex::scoped_lock cl(cache_mutex);
+		boost::mutex::scoped_lock l(m_mutex);
+
+		// the other threads' caches are only deleted when
+		// those threads exit, which may be after we're gone.
+		// Nobody may use the pool anymore, so their blocks
+		// are taken from them
+		for (std::set<thread_cache*>::iterator i = m_caches.begin();
+			i != m_caches.end(); ++i)
+		{
+			thread_cache& tc = **i;
+			for (std::vector<char*>::iterator j = tc.blocks.begin();
+				j != tc.blocks.end(); ++j)
+			{
+				heap_free(*j, m_block_size);
+				--m_cached_blocks;
+			}
+			tc.blocks.clear();
+			tc.pool = 0;
+		}
+		m_caches.clear();
+
+		for (int c = 0; c < num_size_classes; ++c)
+		{
+			for (std::vector<char*>::iterator i = m_free[c].begin();
+				i != m_free[c].end(); ++i)
+			{
+				heap_free(*i, m_block_size << c);
+			}
+		}
+		assert(m_allocated == 0);
+	}
+
+	int block_pool::size_class(int size) const
+	{
+		int c = 0;
+		while ((m_block_size << c) < size)
+		{
+			++c;
+			if (c == num_size_classes) return -1;
+		}
+		return c;
+	}
+
+	block_pool::thread_cache* block_pool::get_thread_cache()
+	{
+		thread_cache* tc = m_thread_cache.get();
+		// the cache may have been left behind by a pool that
+		// was destructed at the same address. Its pool pointer
+		// was cleared before this pool was constructed
+		if (tc == 0 || tc->pool != this)
+		{
+			tc = new thread_cache(this);
+			{
+				boost::mutex::scoped_lock cl(cache_mutex);
+				m_caches.insert(tc);
+			}
+			// deletes the stale cache, if there is one
+			m_thread_cache.reset(tc);
+		}
+		return tc;
+	}
+
+	int block_pool::in_use() const
+	{
+		return m_allocated - m_free_bytes - m_cached_blocks * m_block_size;
+	}
+
+	void block_pool::flush_thread_cache()
+	{
+		thread_cache* tc = m_thread_cache.get();
+		if (tc == 0) return;
+		for (std::vector<char*>::iterator i = tc->blocks.begin();
+			i != tc->blocks.end(); ++i)
+		{
+			m_free[0].push_back(*i);
+			m_free_bytes += m_block_size;
+			--m_cached_blocks;
+		}
+		tc->blocks.clear();
+	}
+
+	char* block_pool::heap_allocate(int size)
+	{
+		char* ret = 0;
+#if defined(TORRENT_USE_HUGE_PAGES) && defined(MAP_HUGETLB)
+		// huge pages are 2 MB, only use them for
+		// buffers that fill at least one
+		if (size >= 2 * 1024 * 1024)
+		{
+			void* p = mmap(0, size, PROT_READ | PROT_WRITE
+				, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			// if there are no huge pages available, fall
+			// back to the heap
+			if (p != MAP_FAILED)
+			{
+				ret = static_cast<char*>(p);
+				m_huge_pages.insert(ret);
+			}
+		}
+#endif
+		if (ret == 0) ret = new char[size];
+		m_allocated += size;
+		m_peak_allocated = std::max(m_peak_allocated, m_allocated);
+		return ret;
+	}
+
+	void block_pool::heap_free(char* buf, int size)
+	{
+		assert(m_allocated >= size);
+		m_allocated -= size;
+#if defined(TORRENT_USE_HUGE_PAGES)
+		std::set<char*>::iterator i = m_huge_pages.find(buf);
+		if (i != m_huge_pages.end())
+		{
+			m_huge_pages.erase(i);
+			munmap(buf, size);
+			return;
+		}
+#endif
+		delete[] buf;
+	}
+
+	boost::shared_array<char> block_pool::allocate()
+	{
+		return allocate(m_block_size);
+	}
+
+	boost::shared_array<char> block_pool::allocate(int size)
+	{
+		assert(size > 0);
+		const int c = size_class(size);
+		// round the size up to the size of the class
+		if (c >= 0) size = m_block_size << c;
+
+		// blocks are taken from the thread's own cache first
+		if (c == 0)
+		{
+			thread_cache* tc = get_thread_cache();
+			if (!tc->blocks.empty())
+			{
+				char* buf = tc->blocks.back();
+				tc->blocks.pop_back();
+				--m_cached_blocks;
+				return boost::shared_array<char>(buf, deleter(this, size));
+			}
+		}
+
+		char* buf;
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			if (c >= 0 && !m_free[c].empty())
+			{
+				buf = m_free[c].back();
+				m_free[c].pop_back();
+				m_free_bytes -= size;
+			}
+			else
+			{
+				buf = heap_allocate(size);
+			}
+			m_peak_in_use = std::max(m_peak_in_use, in_use());
+		}
+		return boost::shared_array<char>(buf, deleter(this, size));
+	}
+
+	void block_pool::release(char* buf, int size)
+	{
+		assert(buf != 0);
+
+		// blocks are kept in the thread's own cache first,
+		// unless we're above the limit. The limit is checked
+		// without locking, a stale value only means that
+		// a single block is cached or freed by mistake
+		if (size == m_block_size
+			&& !(m_limit > 0 && m_allocated > m_limit))
+		{
+			thread_cache* tc = get_thread_cache();
+			if (int(tc->blocks.size()) < thread_cache_size)
+			{
+				tc->blocks.push_back(buf);
+				++m_cached_blocks;
+				return;
+			}
+		}
+
+		boost::mutex::scoped_lock l(m_mutex);
+		const int c = size_class(size);
+		// buffers that are too large to be pooled are
+		// freed right away, and so are all buffers as long
+		// as we're above the limit
+		if (c < 0 || (m_limit > 0 && m_allocated > m_limit))
+		{
+			heap_free(buf, size);
+			return;
+		}
+		m_free[c].push_back(buf);
+		m_free_bytes += size;
+	}
+
+	void block_pool::set_limit(int bytes)
+	{
+		assert(bytes >= 0);
+		boost::mutex::scoped_lock l(m_mutex);
+		m_limit = bytes;
+
+		// the blocks in the other threads' caches are
+		// counted as free by exceeded(), and are freed
+		// when they're released while we're above the limit
+		if (m_limit > 0 && m_allocated > m_limit)
+			flush_thread_cache();
+
+		// release cached buffers until we're within
+		// the new limit
+		for (int c = num_size_classes - 1; c >= 0; --c)
+		{
+			while (m_limit > 0 && m_allocated > m_limit && !m_free[c].empty())
+			{
+				heap_free(m_free[c].back(), m_block_size << c);
+				m_free[c].pop_back();
+				m_free_bytes -= m_block_size << c;
+			}
+		}
+	}
+
+	bool block_pool::exceeded() const
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		return m_limit > 0 && in_use() >= m_limit;
+	}
+
+	block_pool_status block_pool::status() const
+	{
+		boost::mutex::scoped_lock l(m_mutex);
+		block_pool_status ret;
+		ret.allocated = m_allocated;
+		ret.in_use = in_use();
+		ret.peak_allocated = m_peak_allocated;
+		ret.peak_in_use = m_peak_in_use;
+		ret.limit = m_limit;
+		return ret;
+	}
+
+}
@@ -0,0 +1,133 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include <algorithm>
+
+#include "libtorrent/chained_buffer.hpp"
+
+namespace libtorrent
+{
+
+	chained_buffer::chunk& chained_buffer::add_chunk(int size)
+	{
+		chunk c;
+		c.capacity = std::max(size, int(min_chunk_size));
+		c.buf.reset(new char[c.capacity]);
+		c.start = 0;
+		c.used = 0;
+		m_chunks.push_back(c);
+		return m_chunks.back();
+	}
+
+	void chained_buffer::append(const char* buf, int size)
+	{
+		assert(size >= 0);
+		char* dst = allocate_appendix(size);
+		std::copy(buf, buf + size, dst);
+	}
+
+	char* chained_buffer::allocate_appendix(int size)
+	{
+		assert(size >= 0);
+
+		// if there's room left in the last chunk, use it
+		if (m_chunks.empty()
+			|| m_chunks.back().capacity
+				- m_chunks.back().start
+				- m_chunks.back().used < size)
+		{
+			add_chunk(size);
+		}
+
+		chunk& c = m_chunks.back();
+		char* ret = c.buf.get() + c.start + c.used;
+		c.used += size;
+		m_bytes += size;
+		return ret;
+	}
+
+	void chained_buffer::pop_front(int size)
+	{
+		assert(size >= 0);
+		assert(size <= m_bytes);
+
+		m_bytes -= size;
+		while (size > 0)
+		{
+			assert(!m_chunks.empty());
+			chunk& c = m_chunks.front();
+			if (c.used > size)
+			{
+				c.start += size;
+				c.used -= size;
+				break;
+			}
+			size -= c.used;
+			if (m_chunks.size() == 1 && c.capacity == min_chunk_size)
+			{
+				// keep the last chunk if it's a small one,
+				// it will be reused by the next append. Every
+				// chunk is allocated by add_chunk(), so nobody
+				// else refers to it
+				assert(c.buf.unique());
+				assert(size == 0);
+				c.start = 0;
+				c.used = 0;
+				break;
+			}
+			m_chunks.pop_front();
+		}
+	}
+
+	void chained_buffer::build_iovec(std::vector<socket::buffer>& vec, int max_bytes) const
+	{
+		vec.clear();
+		for (std::deque<chunk>::const_iterator i = m_chunks.begin();
+			i != m_chunks.end() && max_bytes > 0;
+			++i)
+		{
+			if (i->used == 0) continue;
+			socket::buffer b;
+			b.buf = i->buf.get() + i->start;
+			b.size = std::min(i->used, max_bytes);
+			max_bytes -= b.size;
+			vec.push_back(b);
+		}
+	}
+
+	void chained_buffer::clear()
+	{
+		m_chunks.clear();
+		m_bytes = 0;
+	}
+
+}
@@ -0,0 +1,159 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+#include <algorithm>
+
+#include "libtorrent/connection_queue.hpp"
+#include "libtorrent/session.hpp"
+
+namespace
+{
+	struct in_torrent
+	{
+		in_torrent(const libtorrent::torrent* t_): t(t_) {}
+
+		template<class Entry>
+		bool operator()(const Entry& e) const
+		{ return e.t == t; }
+
+		const libtorrent::torrent* t;
+	};
+}
+
+namespace libtorrent
+{
+
+	connection_queue::connection_queue(detail::session_impl& ses)
+		: m_ses(ses)
+		, m_half_open(0)
+		, m_max_half_open(8)
+		, m_max_connections(200)
+		, m_connect_rate(10)
+		, m_connect_timeout(20)
+	{}
+
+	void connection_queue::enqueue(torrent* t, const address& a, const peer_id& id
+		, bool priority)
+	{
+		assert(t != 0);
+		if (priority) m_queue.push_front(entry(t, a, id));
+		else m_queue.push_back(entry(t, a, id));
+		wake_up();
+	}
+
+	void connection_queue::remove(torrent* t)
+	{
+		m_queue.erase(
+			std::remove_if(m_queue.begin(), m_queue.end(), in_torrent(t))
+			, m_queue.end());
+		if (m_queue.empty()) m_timer.cancel();
+	}
+
+	void connection_queue::done_connecting()
+	{
+		assert(m_half_open > 0);
+		--m_half_open;
+		wake_up();
+	}
+
+	void connection_queue::set_max_half_open(int limit)
+	{
+		assert(limit > 0 || limit == -1);
+		m_max_half_open = limit;
+		wake_up();
+	}
+
+	void connection_queue::set_max_connections(int limit)
+	{
+		assert(limit > 0 || limit == -1);
+		m_max_connections = limit;
+		wake_up();
+	}
+
+	void connection_queue::set_connect_rate(int attempts_per_second)
+	{
+		assert(attempts_per_second > 0 || attempts_per_second == -1);
+		m_connect_rate = attempts_per_second;
+	}
+
+	void connection_queue::set_connect_timeout(int seconds)
+	{
+		assert(seconds > 0);
+		m_connect_timeout = seconds;
+	}
+
+	bool connection_queue::can_connect() const
+	{
+		if (m_max_half_open != -1 && m_half_open >= m_max_half_open)
+			return false;
+		if (m_max_connections != -1
+			&& int(m_ses.m_connections.size()) >= m_max_connections)
+			return false;
+		return true;
+	}
+
+	void connection_queue::wake_up()
+	{
+		if (m_queue.empty() || m_timer.is_scheduled()) return;
+		m_ses.m_timers.schedule(m_timer, this, 0);
+	}
+
+	void connection_queue::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_timer);
+
+		// when we run out of slots, we'll be woken up by
+		// done_connecting(), or when a connection is closed
+		while (!m_queue.empty() && can_connect())
+		{
+			entry e = m_queue.front();
+			m_queue.pop_front();
+
+			// the torrent may have reached its own limit
+			// since the peer was queued. Then the peer is
+			// dropped, the tracker will give us more peers
+			if (e.t->is_full()) continue;
+
+			if (!e.t->get_policy().connect_peer(e.addr, e.id)) continue;
+
+			if (m_connect_rate != -1)
+			{
+				m_ses.m_timers.schedule(m_timer, this
+					, std::max(1000 / m_connect_rate, 1));
+				return;
+			}
+		}
+	}
+
+}
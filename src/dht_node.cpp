@@ -0,0 +1,721 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+#include <cstdlib>
+#include <ctime>
+#include <algorithm>
+#include <iterator>
+
+#include "libtorrent/dht_node.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/hasher.hpp"
+
+namespace
+{
+	using namespace libtorrent;
+
+	enum
+	{
+		// the size of a node in a compact node list
+		compact_node_size = 26,
+		compact_peer_size = 6,
+		error_protocol = 203,
+		error_method_unknown = 204
+	};
+
+	entry make_string(const std::string& str)
+	{
+		entry e(entry::string_t);
+		e.string() = str;
+		return e;
+	}
+
+	entry make_integer(entry::integer_type val)
+	{
+		entry e(entry::int_t);
+		e.integer() = val;
+		return e;
+	}
+
+	// returns the value of the key, if the entry is a dictionary
+	// that has it, and it's of the given type
+	const entry* find_key(const entry& e, const char* key, entry::data_type t)
+	{
+		if (e.type() != entry::dictionary_t) return 0;
+		entry::dictionary_type::const_iterator i = e.dict().find(key);
+		if (i == e.dict().end() || i->second.type() != t) return 0;
+		return &i->second;
+	}
+
+	bool read_id(const entry& e, const char* key, node_id& id)
+	{
+		const entry* i = find_key(e, key, entry::string_t);
+		if (i == 0 || i->string().size() != 20) return false;
+		std::copy(i->string().begin(), i->string().end(), id.begin());
+		return true;
+	}
+
+	std::string id_string(const node_id& id)
+	{
+		return std::string(id.begin(), id.end());
+	}
+
+	void write_address(const address& a, std::string& str)
+	{
+		unsigned int ip = ntohl(a.ip());
+		str += static_cast<char>(ip >> 24);
+		str += static_cast<char>(ip >> 16);
+		str += static_cast<char>(ip >> 8);
+		str += static_cast<char>(ip);
+		str += static_cast<char>(a.port() >> 8);
+		str += static_cast<char>(a.port());
+	}
+
+	address read_address(const char* buf)
+	{
+		const unsigned char* b = reinterpret_cast<const unsigned char*>(buf);
+		return address(b[0], b[1], b[2], b[3]
+			, static_cast<unsigned short>((b[4] << 8) | b[5]));
+	}
+
+	struct lookup_closer
+	{
+		lookup_closer(const node_id& t): target(t) {}
+		template<class T>
+		bool operator()(const T& a, const T& b) const
+		{ return closer_to(target, a.id, b.id); }
+		const node_id& target;
+	};
+
+	node_id generate_id(const void* p)
+	{
+		// the id has to be different for every node, even
+		// for nodes started at the same time in one process
+		hasher h;
+		std::time_t t = std::time(0);
+		std::clock_t c = std::clock();
+		int r = std::rand();
+		h.update(reinterpret_cast<const char*>(&t), sizeof(t));
+		h.update(reinterpret_cast<const char*>(&c), sizeof(c));
+		h.update(reinterpret_cast<const char*>(&r), sizeof(r));
+		h.update(reinterpret_cast<const char*>(&p), sizeof(p));
+		return h.final();
+	}
+}
+
+namespace libtorrent
+{
+
+	dht_node::dht_node(timer_wheel& timers, selector& sel, const peers_callback& cb)
+		: m_timers(timers)
+		, m_selector(sel)
+		, m_callback(cb)
+		, m_port(0)
+		, m_enabled(false)
+		, m_table(generate_id(this))
+		, m_bootstrapped(false)
+		, m_next_transaction(0)
+		, m_secret_changed(0)
+		, m_token_interval(token_interval)
+		, m_last_expire(0)
+	{
+		m_secret[0] = std::rand();
+		m_secret[1] = std::rand();
+	}
+
+	dht_node::~dht_node()
+	{
+		m_timer.cancel();
+		if (m_socket) m_selector.remove(m_socket);
+	}
+
+	void dht_node::start(unsigned short port)
+	{
+		m_enabled = true;
+		m_port = port;
+		if (!m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, 0);
+	}
+
+	void dht_node::stop()
+	{
+		m_enabled = false;
+		if (!m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, 0);
+	}
+
+	void dht_node::abort()
+	{
+		m_enabled = false;
+		m_timer.cancel();
+		close_socket();
+	}
+
+	void dht_node::add_node(const address& a)
+	{
+		m_pending_nodes.push_back(a);
+	}
+
+	void dht_node::get_peers(const sha1_hash& info_hash, int listen_port)
+	{
+		if (!m_socket) return;
+		start_lookup(info_hash, true, listen_port);
+	}
+
+	void dht_node::open_socket()
+	{
+		assert(!m_socket);
+		try
+		{
+			boost::shared_ptr<socket> s(new socket(socket::udp, false));
+			s->bind(m_port, false);
+			m_socket = s;
+		}
+		catch (std::exception&)
+		{
+			// the port may be in use, it's tried
+			// again with the next tick
+			return;
+		}
+		m_selector.monitor_readability(m_socket);
+	}
+
+	void dht_node::close_socket()
+	{
+		if (!m_socket) return;
+		m_selector.remove(m_socket);
+		m_socket.reset();
+		m_transactions.clear();
+		m_lookups.clear();
+	}
+
+	void dht_node::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_timer);
+
+		if (!m_enabled)
+		{
+			close_socket();
+			return;
+		}
+
+		if (!m_socket) open_socket();
+		m_timers.schedule(m_timer, this, tick_interval);
+		if (!m_socket) return;
+
+		timer_wheel::time_type now = m_timers.now();
+
+		// the queries that haven't been answered
+		for (std::map<unsigned short, transaction>::iterator i
+			= m_transactions.begin(); i != m_transactions.end();)
+		{
+			if (now - i->second.sent < query_timeout)
+			{
+				++i;
+				continue;
+			}
+			transaction tr = i->second;
+			m_transactions.erase(i++);
+			if (!tr.id.is_all_zeros()) m_table.node_failed(tr.id, tr.addr);
+			if (tr.l) lookup_failed(tr.l, tr.addr);
+		}
+
+		while (!m_pending_nodes.empty())
+		{
+			entry args(entry::dictionary_t);
+			send_query(m_pending_nodes.front(), node_id(), "ping", args
+				, boost::shared_ptr<lookup>());
+			m_pending_nodes.pop_front();
+		}
+
+		if (!m_bootstrapped && m_table.size() > 0)
+		{
+			// finding the nodes closest to us fills
+			// in the routing table
+			m_bootstrapped = true;
+			start_lookup(m_table.id(), false, 0);
+		}
+
+		node_id target;
+		if (m_bootstrapped && m_table.need_refresh(now, refresh_interval, target))
+			start_lookup(target, false, 0);
+
+		if (now - m_secret_changed > m_token_interval)
+		{
+			m_secret_changed = now;
+			m_secret[1] = m_secret[0];
+			m_secret[0] = std::rand();
+		}
+
+		if (now - m_last_expire > 60 * 1000)
+		{
+			m_last_expire = now;
+			expire_peers();
+		}
+	}
+
+	bool dht_node::incoming(const boost::shared_ptr<socket>& s)
+	{
+		if (!m_socket || s != m_socket) return false;
+
+		char buf[1500];
+		for (;;)
+		{
+			address from;
+			int size = m_socket->receive_from(buf, sizeof(buf), from);
+			if (size <= 0) break;
+			on_message(buf, size, from);
+			// the handler may have closed the socket
+			if (!m_socket) break;
+		}
+		return true;
+	}
+
+	void dht_node::on_message(const char* buf, int size, const address& from)
+	{
+		entry e;
+		try
+		{
+			e = bdecode(buf, buf + size);
+		}
+		catch (std::exception&)
+		{
+			return;
+		}
+
+		const entry* tid = find_key(e, "t", entry::string_t);
+		const entry* type = find_key(e, "y", entry::string_t);
+		if (tid == 0 || type == 0) return;
+
+		if (type->string() == "q")
+		{
+			const entry* query = find_key(e, "q", entry::string_t);
+			const entry* args = find_key(e, "a", entry::dictionary_t);
+			if (query == 0 || args == 0) return;
+			on_query(from, *tid, query->string(), *args);
+		}
+		else if (type->string() == "r")
+		{
+			on_response(from, tid->string(), find_key(e, "r", entry::dictionary_t));
+		}
+		else if (type->string() == "e")
+		{
+			// an error counts as a failed query
+			on_response(from, tid->string(), 0);
+		}
+	}
+
+	void dht_node::on_query(const address& from, const entry& tid
+		, const std::string& query, const entry& args)
+	{
+		entry msg(entry::dictionary_t);
+		msg.dict()["t"] = tid;
+
+		node_id id;
+		if (!read_id(args, "id", id))
+		{
+			entry err(entry::list_t);
+			err.list().push_back(make_integer(error_protocol));
+			err.list().push_back(make_string("missing id"));
+			msg.dict()["y"] = make_string("e");
+			msg.dict()["e"] = err;
+			send_message(from, msg);
+			return;
+		}
+		m_table.node_seen(id, from, m_timers.now());
+
+		entry r(entry::dictionary_t);
+		r.dict()["id"] = make_string(id_string(m_table.id()));
+
+		node_id target;
+		if (query == "ping")
+		{
+		}
+		else if ((query == "find_node" && read_id(args, "target", target))
+			|| (query == "get_peers" && read_id(args, "info_hash", target)))
+		{
+			std::vector<dht_node_entry> nodes;
+			m_table.find_closest(target, lookup_size, nodes);
+			std::string compact;
+			for (std::vector<dht_node_entry>::iterator i = nodes.begin();
+				i != nodes.end(); ++i)
+			{
+				compact += id_string(i->id);
+				write_address(i->addr, compact);
+			}
+			r.dict()["nodes"] = make_string(compact);
+
+			if (query == "get_peers")
+			{
+				r.dict()["token"] = make_string(make_token(from, m_secret[0]));
+				std::map<sha1_hash, std::vector<stored_peer> >::iterator i
+					= m_storage.find(target);
+				if (i != m_storage.end())
+				{
+					entry values(entry::list_t);
+					for (std::vector<stored_peer>::iterator j = i->second.begin();
+						j != i->second.end() && int(values.list().size()) < max_peers_reply; ++j)
+					{
+						std::string peer;
+						write_address(j->addr, peer);
+						values.list().push_back(make_string(peer));
+					}
+					r.dict()["values"] = values;
+				}
+			}
+		}
+		else if (query == "announce_peer")
+		{
+			const entry* port = find_key(args, "port", entry::int_t);
+			const entry* token = find_key(args, "token", entry::string_t);
+			if (!read_id(args, "info_hash", target) || port == 0 || token == 0
+				|| port->integer() <= 0 || port->integer() > 65535
+				|| !verify_token(from, token->string()))
+			{
+				entry err(entry::list_t);
+				err.list().push_back(make_integer(error_protocol));
+				err.list().push_back(make_string("invalid announce"));
+				msg.dict()["y"] = make_string("e");
+				msg.dict()["e"] = err;
+				send_message(from, msg);
+				return;
+			}
+			unsigned int ip = ntohl(from.ip());
+			announce_peer(target, address((ip >> 24) & 0xff, (ip >> 16) & 0xff
+				, (ip >> 8) & 0xff, ip & 0xff
+				, static_cast<unsigned short>(port->integer())));
+		}
+		else
+		{
+			entry err(entry::list_t);
+			err.list().push_back(make_integer(error_method_unknown));
+			err.list().push_back(make_string("method unknown"));
+			msg.dict()["y"] = make_string("e");
+			msg.dict()["e"] = err;
+			send_message(from, msg);
+			return;
+		}
+
+		msg.dict()["y"] = make_string("r");
+		msg.dict()["r"] = r;
+		send_message(from, msg);
+	}
+
+	void dht_node::on_response(const address& from, const std::string& tid
+		, const entry* args)
+	{
+		if (tid.size() != 2) return;
+		unsigned short t = static_cast<unsigned short>(
+			(static_cast<unsigned char>(tid[0]) << 8)
+			| static_cast<unsigned char>(tid[1]));
+
+		std::map<unsigned short, transaction>::iterator i = m_transactions.find(t);
+		// a late response, or someone else
+		// pretending to be the node
+		if (i == m_transactions.end() || i->second.addr != from) return;
+		transaction tr = i->second;
+		m_transactions.erase(i);
+
+		node_id id;
+		if (args == 0 || !read_id(*args, "id", id))
+		{
+			if (!tr.id.is_all_zeros()) m_table.node_failed(tr.id, tr.addr);
+			if (tr.l) lookup_failed(tr.l, from);
+			return;
+		}
+
+		m_table.node_seen(id, from, m_timers.now());
+		if (tr.l) lookup_response(tr.l, from, *args);
+	}
+
+	void dht_node::send_query(const address& to, const node_id& id
+		, const char* query, entry& args
+		, const boost::shared_ptr<lookup>& l)
+	{
+		// find a transaction id that isn't in use
+		while (m_transactions.find(m_next_transaction) != m_transactions.end())
+			++m_next_transaction;
+		unsigned short t = m_next_transaction++;
+
+		std::string tid;
+		tid += static_cast<char>(t >> 8);
+		tid += static_cast<char>(t);
+
+		args.dict()["id"] = make_string(id_string(m_table.id()));
+		entry msg(entry::dictionary_t);
+		msg.dict()["t"] = make_string(tid);
+		msg.dict()["y"] = make_string("q");
+		msg.dict()["q"] = make_string(query);
+		msg.dict()["a"] = args;
+		send_message(to, msg);
+
+		transaction& tr = m_transactions[t];
+		tr.addr = to;
+		tr.id = id;
+		tr.l = l;
+		tr.sent = m_timers.now();
+	}
+
+	void dht_node::send_message(const address& to, const entry& msg)
+	{
+		if (!m_socket) return;
+		std::string buf;
+		bencode(std::back_inserter(buf), msg);
+		// if it's lost, the query times out
+		m_socket->send_to(to, buf.c_str(), buf.size());
+	}
+
+	// ---- lookups ----
+
+	void dht_node::start_lookup(const node_id& target, bool get_peers, int listen_port)
+	{
+		boost::shared_ptr<lookup> l(new lookup);
+		l->target = target;
+		l->get_peers = get_peers;
+		l->listen_port = listen_port;
+		l->in_flight = 0;
+
+		std::vector<dht_node_entry> nodes;
+		m_table.find_closest(target, max_lookup_nodes, nodes);
+		for (std::vector<dht_node_entry>::iterator i = nodes.begin();
+			i != nodes.end(); ++i)
+		{
+			add_lookup_node(*l, i->id, i->addr);
+		}
+
+		m_lookups.push_back(l);
+		continue_lookup(l);
+	}
+
+	void dht_node::add_lookup_node(lookup& l, const node_id& id, const address& a)
+	{
+		if (id == m_table.id()) return;
+		for (std::vector<lookup_node>::iterator i = l.nodes.begin();
+			i != l.nodes.end(); ++i)
+		{
+			if (i->id == id || i->addr == a) return;
+		}
+
+		lookup_node n;
+		n.id = id;
+		n.addr = a;
+		n.state = lookup_node::fresh;
+		l.nodes.insert(std::upper_bound(l.nodes.begin(), l.nodes.end(), n
+			, lookup_closer(l.target)), n);
+
+		// the farthest nodes are never going to be queried
+		if (int(l.nodes.size()) > max_lookup_nodes)
+			l.nodes.resize(max_lookup_nodes);
+	}
+
+	void dht_node::lookup_response(const boost::shared_ptr<lookup>& l
+		, const address& from, const entry& r)
+	{
+		--l->in_flight;
+		std::vector<lookup_node>::iterator n = l->nodes.begin();
+		for (; n != l->nodes.end(); ++n)
+			if (n->addr == from) break;
+		if (n != l->nodes.end())
+		{
+			n->state = lookup_node::responded;
+			const entry* token = find_key(r, "token", entry::string_t);
+			if (token) n->token = token->string();
+		}
+
+		const entry* nodes = find_key(r, "nodes", entry::string_t);
+		if (nodes)
+		{
+			const std::string& str = nodes->string();
+			for (std::string::size_type i = 0; i + compact_node_size <= str.size();
+				i += compact_node_size)
+			{
+				node_id id;
+				std::copy(str.begin() + i, str.begin() + i + 20, id.begin());
+				add_lookup_node(*l, id, read_address(str.c_str() + i + 20));
+			}
+		}
+
+		const entry* values = find_key(r, "values", entry::list_t);
+		if (l->get_peers && values)
+		{
+			std::vector<address> peers;
+			for (entry::list_type::const_iterator i = values->list().begin();
+				i != values->list().end(); ++i)
+			{
+				if (i->type() != entry::string_t) continue;
+				if (i->string().size() != compact_peer_size) continue;
+				peers.push_back(read_address(i->string().c_str()));
+			}
+			if (!peers.empty() && m_callback) m_callback(l->target, peers);
+		}
+
+		continue_lookup(l);
+	}
+
+	void dht_node::lookup_failed(const boost::shared_ptr<lookup>& l, const address& from)
+	{
+		--l->in_flight;
+		for (std::vector<lookup_node>::iterator i = l->nodes.begin();
+			i != l->nodes.end(); ++i)
+		{
+			if (i->addr != from) continue;
+			i->state = lookup_node::failed;
+			break;
+		}
+		continue_lookup(l);
+	}
+
+	void dht_node::continue_lookup(const boost::shared_ptr<lookup>& l)
+	{
+		// query the closest nodes that haven't been queried, until
+		// the closest lookup_size nodes that are alive have responded
+		int alive = 0;
+		for (std::vector<lookup_node>::iterator i = l->nodes.begin();
+			i != l->nodes.end() && alive < lookup_size; ++i)
+		{
+			if (l->in_flight >= lookup_parallelism) return;
+			if (i->state == lookup_node::failed) continue;
+			++alive;
+			if (i->state != lookup_node::fresh) continue;
+
+			entry args(entry::dictionary_t);
+			if (l->get_peers)
+				args.dict()["info_hash"] = make_string(id_string(l->target));
+			else
+				args.dict()["target"] = make_string(id_string(l->target));
+			send_query(i->addr, i->id, l->get_peers ? "get_peers" : "find_node"
+				, args, l);
+			i->state = lookup_node::queried;
+			++l->in_flight;
+		}
+
+		if (l->in_flight == 0) finish_lookup(l);
+	}
+
+	void dht_node::finish_lookup(const boost::shared_ptr<lookup>& l)
+	{
+		if (l->get_peers && l->listen_port != 0)
+		{
+			// announce ourself to the closest nodes
+			// that gave us a token
+			int announced = 0;
+			for (std::vector<lookup_node>::iterator i = l->nodes.begin();
+				i != l->nodes.end() && announced < lookup_size; ++i)
+			{
+				if (i->state != lookup_node::responded || i->token.empty())
+					continue;
+				entry args(entry::dictionary_t);
+				args.dict()["info_hash"] = make_string(id_string(l->target));
+				args.dict()["port"] = make_integer(l->listen_port);
+				args.dict()["token"] = make_string(i->token);
+				send_query(i->addr, i->id, "announce_peer", args
+					, boost::shared_ptr<lookup>());
+				++announced;
+			}
+		}
+
+		std::list<boost::shared_ptr<lookup> >::iterator i
+			= std::find(m_lookups.begin(), m_lookups.end(), l);
+		if (i != m_lookups.end()) m_lookups.erase(i);
+	}
+
+	// ---- tokens and storage ----
+
+	std::string dht_node::make_token(const address& a, boost::uint32_t secret) const
+	{
+		unsigned int ip = a.ip();
+		hasher h;
+		h.update(reinterpret_cast<const char*>(&ip), sizeof(ip));
+		h.update(reinterpret_cast<const char*>(&secret), sizeof(secret));
+		sha1_hash digest = h.final();
+		return std::string(digest.begin(), digest.begin() + 4);
+	}
+
+	bool dht_node::verify_token(const address& a, const std::string& token) const
+	{
+		return token == make_token(a, m_secret[0])
+			|| token == make_token(a, m_secret[1]);
+	}
+
+	void dht_node::announce_peer(const sha1_hash& info_hash, const address& a)
+	{
+		std::map<sha1_hash, std::vector<stored_peer> >::iterator i
+			= m_storage.find(info_hash);
+		if (i == m_storage.end())
+		{
+			if (int(m_storage.size()) >= max_torrents) return;
+			i = m_storage.insert(std::make_pair(info_hash
+				, std::vector<stored_peer>())).first;
+		}
+
+		std::vector<stored_peer>& peers = i->second;
+		timer_wheel::time_type now = m_timers.now();
+		std::vector<stored_peer>::iterator oldest = peers.begin();
+		for (std::vector<stored_peer>::iterator j = peers.begin();
+			j != peers.end(); ++j)
+		{
+			if (j->addr == a)
+			{
+				j->added = now;
+				return;
+			}
+			if (j->added < oldest->added) oldest = j;
+		}
+
+		stored_peer p;
+		p.addr = a;
+		p.added = now;
+		if (int(peers.size()) < max_peers_per_torrent) peers.push_back(p);
+		else *oldest = p;
+	}
+
+	void dht_node::expire_peers()
+	{
+		timer_wheel::time_type now = m_timers.now();
+		for (std::map<sha1_hash, std::vector<stored_peer> >::iterator i
+			= m_storage.begin(); i != m_storage.end();)
+		{
+			std::vector<stored_peer>& peers = i->second;
+			for (std::vector<stored_peer>::iterator j = peers.begin();
+				j != peers.end();)
+			{
+				if (now - j->added > peer_timeout) j = peers.erase(j);
+				else ++j;
+			}
+			if (peers.empty()) m_storage.erase(i++);
+			else ++i;
+		}
+	}
+
+}
@@ -0,0 +1,247 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+#include <cstdlib>
+#include <algorithm>
+
+#include "libtorrent/dht_routing_table.hpp"
+
+namespace
+{
+	using namespace libtorrent;
+
+	struct closer
+	{
+		closer(const node_id& t): target(t) {}
+		bool operator()(const dht_node_entry& a, const dht_node_entry& b) const
+		{ return closer_to(target, a.id, b.id); }
+		const node_id& target;
+	};
+
+	struct has_id
+	{
+		has_id(const node_id& i): id(i) {}
+		bool operator()(const dht_node_entry& e) const { return e.id == id; }
+		const node_id& id;
+	};
+}
+
+namespace libtorrent
+{
+
+	int common_prefix(const node_id& a, const node_id& b)
+	{
+		node_id::const_iterator i = a.begin();
+		node_id::const_iterator j = b.begin();
+		for (int ret = 0; i != a.end(); ++i, ++j, ret += 8)
+		{
+			unsigned char diff = *i ^ *j;
+			if (diff == 0) continue;
+			while ((diff & 0x80) == 0)
+			{
+				diff <<= 1;
+				++ret;
+			}
+			return ret;
+		}
+		return 160;
+	}
+
+	bool closer_to(const node_id& target, const node_id& a, const node_id& b)
+	{
+		// the distance is the xor of the ids
+		node_id::const_iterator t = target.begin();
+		node_id::const_iterator i = a.begin();
+		node_id::const_iterator j = b.begin();
+		for (; t != target.end(); ++t, ++i, ++j)
+		{
+			unsigned char da = *i ^ *t;
+			unsigned char db = *j ^ *t;
+			if (da != db) return da < db;
+		}
+		return false;
+	}
+
+	node_id random_id_at(const node_id& id, int prefix)
+	{
+		assert(prefix >= 0 && prefix < 160);
+		node_id ret = id;
+		node_id::iterator i = ret.begin();
+		for (int bit = 0; i != ret.end(); ++i)
+		{
+			for (int k = 7; k >= 0; --k, ++bit)
+			{
+				unsigned char mask = static_cast<unsigned char>(1 << k);
+				if (bit < prefix) continue;
+				// the first bit after the prefix is different,
+				// the rest is random
+				if (bit == prefix || (std::rand() & 1))
+					*i ^= mask;
+			}
+		}
+		return ret;
+	}
+
+	dht_routing_table::dht_routing_table(const node_id& id)
+		: m_id(id)
+		, m_buckets(num_buckets)
+	{}
+
+	int dht_routing_table::bucket_index(const node_id& id) const
+	{
+		return common_prefix(m_id, id);
+	}
+
+	void dht_routing_table::node_seen(const node_id& id, const address& a
+		, timer_wheel::time_type now)
+	{
+		int index = bucket_index(id);
+		// it's us
+		if (index == num_buckets) return;
+		bucket& b = m_buckets[index];
+		b.last_active = now;
+
+		std::vector<dht_node_entry>::iterator i
+			= std::find_if(b.live.begin(), b.live.end(), has_id(id));
+		if (i != b.live.end())
+		{
+			// a node whose address has changed is
+			// probably someone else using its id
+			if (i->addr != a) return;
+			i->fail_count = 0;
+			i->last_seen = now;
+			return;
+		}
+
+		dht_node_entry e;
+		e.id = id;
+		e.addr = a;
+		e.fail_count = 0;
+		e.last_seen = now;
+
+		if (int(b.live.size()) < bucket_size)
+		{
+			b.live.push_back(e);
+			return;
+		}
+
+		// replace a node that has stopped responding
+		for (i = b.live.begin(); i != b.live.end(); ++i)
+		{
+			if (i->fail_count == 0) continue;
+			*i = e;
+			return;
+		}
+
+		i = std::find_if(b.replacements.begin(), b.replacements.end(), has_id(id));
+		if (i != b.replacements.end())
+		{
+			i->addr = a;
+			i->last_seen = now;
+			return;
+		}
+		if (int(b.replacements.size()) >= bucket_size)
+			b.replacements.erase(b.replacements.begin());
+		b.replacements.push_back(e);
+	}
+
+	void dht_routing_table::node_failed(const node_id& id, const address& a)
+	{
+		int index = bucket_index(id);
+		if (index == num_buckets) return;
+		bucket& b = m_buckets[index];
+
+		std::vector<dht_node_entry>::iterator i
+			= std::find_if(b.live.begin(), b.live.end(), has_id(id));
+		if (i == b.live.end() || i->addr != a) return;
+		if (++i->fail_count < max_fail_count) return;
+
+		b.live.erase(i);
+		if (b.replacements.empty()) return;
+		// the replacement seen last is most likely to be alive
+		b.live.push_back(b.replacements.back());
+		b.replacements.pop_back();
+	}
+
+	void dht_routing_table::find_closest(const node_id& target, int count
+		, std::vector<dht_node_entry>& nodes) const
+	{
+		nodes.clear();
+		for (std::vector<bucket>::const_iterator i = m_buckets.begin();
+			i != m_buckets.end(); ++i)
+		{
+			for (std::vector<dht_node_entry>::const_iterator j = i->live.begin();
+				j != i->live.end(); ++j)
+			{
+				if (j->fail_count == 0) nodes.push_back(*j);
+			}
+		}
+
+		count = std::min(count, int(nodes.size()));
+		std::partial_sort(nodes.begin(), nodes.begin() + count, nodes.end()
+			, closer(target));
+		nodes.resize(count);
+	}
+
+	bool dht_routing_table::need_refresh(timer_wheel::time_type now, int interval
+		, node_id& target)
+	{
+		// the buckets deeper than the deepest one with nodes in
+		// it are empty because there are no such nodes
+		int deepest = num_buckets - 1;
+		while (deepest > 0 && m_buckets[deepest].live.empty()) --deepest;
+
+		for (int i = 0; i <= deepest; ++i)
+		{
+			bucket& b = m_buckets[i];
+			if (now - b.last_active < interval) continue;
+			b.last_active = now;
+			target = random_id_at(m_id, i);
+			return true;
+		}
+		return false;
+	}
+
+	int dht_routing_table::size() const
+	{
+		int ret = 0;
+		for (std::vector<bucket>::const_iterator i = m_buckets.begin();
+			i != m_buckets.end(); ++i)
+		{
+			ret += i->live.size();
+		}
+		return ret;
+	}
+
+}
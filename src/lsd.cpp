@@ -0,0 +1,283 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+#include <cstdlib>
+#include <cctype>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+
+#include "libtorrent/lsd.hpp"
+
+namespace
+{
+	using namespace libtorrent;
+
+	// compares the header name case insensitively, and
+	// returns a pointer to the value if it matches
+	const char* header_value(const std::string& line, const char* name)
+	{
+		std::string::size_type i = 0;
+		for (; name[i] != 0; ++i)
+		{
+			if (i >= line.size()) return 0;
+			if (std::tolower(line[i]) != std::tolower(name[i])) return 0;
+		}
+		if (i >= line.size() || line[i] != ':') return 0;
+		++i;
+		while (i < line.size() && line[i] == ' ') ++i;
+		return line.c_str() + i;
+	}
+
+	int hex_value(char c)
+	{
+		if (c >= '0' && c <= '9') return c - '0';
+		if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+		return -1;
+	}
+
+	bool from_hex(const char* str, sha1_hash& h)
+	{
+		for (sha1_hash::iterator i = h.begin(); i != h.end(); ++i)
+		{
+			int hi = hex_value(str[0]);
+			if (hi < 0) return false;
+			int lo = hex_value(str[1]);
+			if (lo < 0) return false;
+			*i = (hi << 4) | lo;
+			str += 2;
+		}
+		return *str == 0;
+	}
+}
+
+namespace libtorrent
+{
+
+	lsd::lsd(timer_wheel& timers, selector& sel, const peer_callback& cb)
+		: m_timers(timers)
+		, m_selector(sel)
+		, m_callback(cb)
+		, m_listen_port(0)
+		, m_group(239, 192, 152, 143, lsd_port)
+		, m_next_announce(0)
+		, m_received(0)
+		, m_enabled(false)
+	{}
+
+	void lsd::start()
+	{
+		m_enabled = true;
+		if (!m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, 0);
+	}
+
+	void lsd::stop()
+	{
+		m_enabled = false;
+		m_queue.clear();
+		if (!m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, 0);
+	}
+
+	void lsd::abort()
+	{
+		m_enabled = false;
+		m_queue.clear();
+		m_timer.cancel();
+		close_socket();
+	}
+
+	void lsd::announce(const sha1_hash& info_hash)
+	{
+		m_torrents.insert(info_hash);
+		if (!m_enabled) return;
+		if (std::find(m_queue.begin(), m_queue.end(), info_hash) != m_queue.end())
+			return;
+		m_queue.push_back(info_hash);
+	}
+
+	void lsd::remove(const sha1_hash& info_hash)
+	{
+		m_torrents.erase(info_hash);
+		std::deque<sha1_hash>::iterator i
+			= std::find(m_queue.begin(), m_queue.end(), info_hash);
+		if (i != m_queue.end()) m_queue.erase(i);
+	}
+
+	void lsd::open_socket()
+	{
+		assert(!m_socket);
+
+		std::stringstream cookie;
+		cookie << std::hex << std::rand() << std::rand();
+		m_cookie = cookie.str();
+
+		try
+		{
+			boost::shared_ptr<socket> s(new socket(socket::udp, false));
+			s->bind(lsd_port, true);
+			s->join_multicast_group(m_group);
+			m_socket = s;
+		}
+		catch (std::exception&)
+		{
+			// there may not be a network that supports
+			// multicast. Try again with the next announce
+			return;
+		}
+		m_selector.monitor_readability(m_socket);
+	}
+
+	void lsd::close_socket()
+	{
+		if (!m_socket) return;
+		m_selector.remove(m_socket);
+		m_socket.reset();
+	}
+
+	void lsd::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_timer);
+
+		if (!m_enabled)
+		{
+			close_socket();
+			return;
+		}
+
+		timer_wheel::time_type now = m_timers.now();
+		m_received = 0;
+
+		if (now >= m_next_announce)
+		{
+			if (!m_socket) open_socket();
+			m_next_announce = now + announce_interval * 1000;
+			for (std::set<sha1_hash>::iterator i = m_torrents.begin();
+				i != m_torrents.end(); ++i)
+			{
+				announce(*i);
+			}
+		}
+
+		for (int i = 0; m_socket && i < max_announces_per_second
+			&& !m_queue.empty(); ++i)
+		{
+			send_announce(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		m_timers.schedule(m_timer, this, 1000);
+	}
+
+	void lsd::send_announce(const sha1_hash& info_hash)
+	{
+		std::stringstream msg;
+		msg << "BT-SEARCH * HTTP/1.1\r\n"
+			"Host: " << m_group.as_string() << ":" << lsd_port << "\r\n"
+			"Port: " << m_listen_port << "\r\n"
+			"Infohash: " << info_hash << "\r\n"
+			"cookie: " << m_cookie << "\r\n"
+			"\r\n\r\n";
+		std::string str = msg.str();
+		// if this fails, the torrent is announced again
+		// in the next round
+		m_socket->send_to(m_group, str.c_str(), str.size());
+	}
+
+	bool lsd::incoming(const boost::shared_ptr<socket>& s)
+	{
+		if (!m_socket || s != m_socket) return false;
+
+		char buf[1500];
+		for (;;)
+		{
+			address from;
+			int size = m_socket->receive_from(buf, sizeof(buf), from);
+			if (size <= 0) break;
+			if (m_received >= max_incoming_per_second) continue;
+			++m_received;
+			on_announce(buf, size, from);
+		}
+		return true;
+	}
+
+	void lsd::on_announce(const char* buf, int size, const address& from)
+	{
+		std::string msg(buf, size);
+		std::istringstream in(msg);
+		std::string line;
+
+		std::getline(in, line);
+		if (line.compare(0, 10, "BT-SEARCH ") != 0) return;
+
+		int port = 0;
+		std::vector<sha1_hash> hashes;
+		while (std::getline(in, line))
+		{
+			if (!line.empty() && line[line.size() - 1] == '\r')
+				line.resize(line.size() - 1);
+			if (line.empty()) break;
+
+			const char* value;
+			if ((value = header_value(line, "port")) != 0)
+			{
+				port = std::atoi(value);
+			}
+			else if ((value = header_value(line, "infohash")) != 0)
+			{
+				sha1_hash h;
+				if (from_hex(value, h)) hashes.push_back(h);
+			}
+			else if ((value = header_value(line, "cookie")) != 0)
+			{
+				// this is our own announce
+				if (m_cookie == value) return;
+			}
+		}
+
+		if (port <= 0 || port > 65535) return;
+		unsigned int ip = ntohl(from.ip());
+		address peer((ip >> 24) & 0xff, (ip >> 16) & 0xff
+			, (ip >> 8) & 0xff, ip & 0xff, port);
+
+		for (std::vector<sha1_hash>::iterator i = hashes.begin();
+			i != hashes.end(); ++i)
+		{
+			m_callback(*i, peer);
+		}
+	}
+
+}
@@ -0,0 +1,105 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+
+#include "libtorrent/peer_class.hpp"
+
+namespace libtorrent
+{
+
+	peer_class::peer_class(const std::string& n)
+		: name(n)
+		, connection_limit(-1)
+		, ignore_global_limit(false)
+		, connections(0)
+	{}
+
+	void peer_class::apply(const peer_class_settings& s)
+	{
+		bandwidth_limit[0].throttle(s.upload_limit);
+		bandwidth_limit[1].throttle(s.download_limit);
+		connection_limit = s.connection_limit;
+		ignore_global_limit = s.ignore_global_limit;
+	}
+
+	peer_class_map::peer_class_map()
+	{
+		m_ranges[0] = default_peer_class;
+	}
+
+	void peer_class_map::add_range(const address& first, const address& last, int peer_class)
+	{
+		unsigned int start = ntohl(first.ip());
+		unsigned int end = ntohl(last.ip());
+		assert(start <= end);
+
+		typedef std::map<unsigned int, int>::iterator iterator;
+
+		// the addresses after the range keep their class
+		if (end != 0xffffffff)
+			m_ranges[end + 1] = class_for(end + 1);
+
+		// the range replaces all the ranges that start within it
+		m_ranges.erase(m_ranges.lower_bound(start), m_ranges.upper_bound(end));
+		iterator i = m_ranges.insert(std::make_pair(start, peer_class)).first;
+
+		// merge with the neighbouring ranges if they're
+		// in the same class
+		iterator next = i;
+		++next;
+		if (next != m_ranges.end() && next->second == peer_class)
+			m_ranges.erase(next);
+		if (i != m_ranges.begin())
+		{
+			iterator prev = i;
+			--prev;
+			if (prev->second == peer_class) m_ranges.erase(i);
+		}
+		assert(m_ranges.begin()->first == 0);
+	}
+
+	int peer_class_map::class_for(const address& a) const
+	{
+		return class_for(ntohl(a.ip()));
+	}
+
+	int peer_class_map::class_for(unsigned int ip) const
+	{
+		std::map<unsigned int, int>::const_iterator i = m_ranges.upper_bound(ip);
+		assert(i != m_ranges.begin());
+		--i;
+		return i->second;
+	}
+
+}
@@ -36,6 +36,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/peer_connection.hpp"
 #include "libtorrent/session.hpp"
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/bencode.hpp"
 
 #if defined(_MSC_VER)
 #define for if (false) {} else for
@@ -80,45 +82,79 @@ libtorrent::peer_connection::peer_connection(
 	: m_state(read_protocol_length)
 	, m_timeout(120)
 	, m_packet_size(1)
-	, m_recv_pos(0)
-	, m_last_receive(boost::gregorian::date(std::time(0)))
-	, m_last_sent(boost::gregorian::date(std::time(0)))
+	, m_recv_start(0)
+	, m_recv_end(0)
+	, m_recv_counted(0)
+	, m_piece_received(0)
+	, m_bytes_sent(0)
+	, m_last_receive(ses.m_timers.now())
+	, m_last_sent(ses.m_timers.now())
 	, m_selector(sel)
 	, m_socket(s)
 	, m_torrent(t)
 	, m_attached_to_torrent(true)
 	, m_ses(ses)
 	, m_active(true)
+	, m_connecting(true)
 	, m_added_to_selector(false)
 	, m_peer_id(p)
 	, m_peer_interested(false)
 	, m_peer_choked(true)
 	, m_interesting(false)
 	, m_choked(true)
+	, m_supports_fast(false)
+	, m_supports_extensions(false)
+	, m_supports_dht(false)
+	, m_remote_listen_port(0)
+	, m_timed_block(-1, -1)
+	, m_timed_request_sent(0)
+	, m_timed_queue_ahead(0)
+	, m_rtt_age(0)
+	, m_desired_queue_size(initial_queue_size)
+	, m_request_progress(ses.m_timers.now())
+	, m_requests_expired(ses.m_timers.now())
+	, m_block_timeout(0)
+	, m_snubbed(false)
 	, m_free_upload(0)
-	, m_send_quota(100)
-	, m_send_quota_left(100)
-	, m_send_quota_limit(100)
+	, m_send_quota(-1)
+	, m_send_quota_left(-1)
+	, m_granted_quota(0)
+	, m_waiting_for_upload_quota(false)
+	, m_send_quota_limit(-1)
+	, m_upload_limit(-1)
+	, m_recv_quota_left(-1)
+	, m_waiting_for_download_quota(false)
+	, m_peer_class(ses.m_class_map.class_for(s->sender()))
 	, m_trust_points(0)
 {
 	assert(!m_socket->is_blocking());
+
+	m_rtt_history[0] = 0;
+	m_rtt_history[1] = 0;
 	assert(m_torrent != 0);
 
 #ifndef NDEBUG
 	m_logger = m_ses.create_log(s->sender().as_string().c_str());
 #endif
 
+	++m_ses.m_classes[m_peer_class].connections;
+	m_ses.m_connection_queue.connecting();
+	update_send_quota();
+	update_recv_quota();
 	send_handshake();
 
 	// start in the state where we are trying to read the
 	// handshake from the other side
-	m_recv_buffer.resize(1);
+	m_recv_buffer.resize(receive_buffer_size);
 
 	// assume the other end has no pieces
 	m_have_piece.resize(m_torrent->torrent_file().num_pieces());
 	std::fill(m_have_piece.begin(), m_have_piece.end(), false);
 
-	send_bitfield();
+	// the bitfield is sent once we have received the other
+	// end's handshake, and know which extensions it supports
+
+	schedule_timer();
 }
 
 libtorrent::peer_connection::peer_connection(
@@ -128,44 +164,86 @@ libtorrent::peer_connection::peer_connection(
 	: m_state(read_protocol_length)
 	, m_timeout(120)
 	, m_packet_size(1)
-	, m_recv_pos(0)
-	, m_last_receive(boost::gregorian::date(std::time(0)))
-	, m_last_sent(boost::gregorian::date(std::time(0)))
+	, m_recv_start(0)
+	, m_recv_end(0)
+	, m_recv_counted(0)
+	, m_piece_received(0)
+	, m_bytes_sent(0)
+	, m_last_receive(ses.m_timers.now())
+	, m_last_sent(ses.m_timers.now())
 	, m_selector(sel)
 	, m_socket(s)
 	, m_torrent(0)
 	, m_attached_to_torrent(0)
 	, m_ses(ses)
 	, m_active(false)
+	, m_connecting(false)
 	, m_added_to_selector(false)
 	, m_peer_id()
 	, m_peer_interested(false)
 	, m_peer_choked(true)
 	, m_interesting(false)
 	, m_choked(true)
+	, m_supports_fast(false)
+	, m_supports_extensions(false)
+	, m_supports_dht(false)
+	, m_remote_listen_port(0)
+	, m_timed_block(-1, -1)
+	, m_timed_request_sent(0)
+	, m_timed_queue_ahead(0)
+	, m_rtt_age(0)
+	, m_desired_queue_size(initial_queue_size)
+	, m_request_progress(ses.m_timers.now())
+	, m_requests_expired(ses.m_timers.now())
+	, m_block_timeout(0)
+	, m_snubbed(false)
 	, m_free_upload(0)
-	, m_send_quota(100)
-	, m_send_quota_left(100)
-	, m_send_quota_limit(100)
+	, m_send_quota(-1)
+	, m_send_quota_left(-1)
+	, m_granted_quota(0)
+	, m_waiting_for_upload_quota(false)
+	, m_send_quota_limit(-1)
+	, m_upload_limit(-1)
+	, m_recv_quota_left(-1)
+	, m_waiting_for_download_quota(false)
+	, m_peer_class(ses.m_class_map.class_for(s->sender()))
 	, m_trust_points(0)
 {
 	assert(!m_socket->is_blocking());
 
+	m_rtt_history[0] = 0;
+	m_rtt_history[1] = 0;
+
 #ifndef NDEBUG
 	m_logger = m_ses.create_log(s->sender().as_string().c_str());
 #endif
 
+	++m_ses.m_classes[m_peer_class].connections;
+	update_send_quota();
+	update_recv_quota();
+
 	// we are not attached to any torrent yet.
 	// we have to wait for the handshake to see
 	// which torrent the connector want's to connect to
 
 	// start in the state where we are trying to read the
 	// handshake from the other side
-	m_recv_buffer.resize(1);
+	m_recv_buffer.resize(receive_buffer_size);
+
+	schedule_timer();
 }
 
 libtorrent::peer_connection::~peer_connection()
 {
+	if (m_waiting_for_upload_quota)
+		m_ses.m_upload_manager.cancel(this);
+	if (m_waiting_for_download_quota)
+		m_ses.m_download_manager.cancel(this);
+	--m_ses.m_classes[m_peer_class].connections;
+	if (m_connecting)
+		m_ses.m_connection_queue.done_connecting();
+	else
+		m_ses.m_connection_queue.wake_up();
 	m_selector.remove(m_socket);
 	if (m_attached_to_torrent)
 	{
@@ -174,56 +252,49 @@ libtorrent::peer_connection::~peer_connection()
 	}
 }
 
-void libtorrent::peer_connection::set_send_quota(int num_bytes)
-{
-	assert(num_bytes <= m_send_quota_limit || m_send_quota_limit == -1);
-	if (num_bytes > m_send_quota_limit && m_send_quota_limit!=-1) num_bytes = m_send_quota_limit;
-
-	m_send_quota = num_bytes;
-	m_send_quota_left = num_bytes;
-	send_buffer_updated();
-}
-
 void libtorrent::peer_connection::send_handshake()
 {
-	assert(m_send_buffer.size() == 0);
+	assert(m_send_buffer.empty());
 
 	// add handshake to the send buffer
 	const char version_string[] = "BitTorrent protocol";
 	const int string_len = sizeof(version_string)-1;
 	int pos = 1;
 
-	m_send_buffer.resize(1 + string_len + 8 + 20 + 20);
+	char* buf = m_send_buffer.allocate_appendix(1 + string_len + 8 + 20 + 20);
 
 	// length of version string
-	m_send_buffer[0] = string_len;
+	buf[0] = string_len;
 
 	// version string itself
 	std::copy(
 		version_string
 		, version_string+string_len
-		, m_send_buffer.begin()+pos);
+		, buf + pos);
 	pos += string_len;
 
-	// 8 zeroes
+	// reserved bytes, the extensions we support
 	std::fill(
-		m_send_buffer.begin() + pos
-		, m_send_buffer.begin() + pos + 8
+		buf + pos
+		, buf + pos + 8
 		, 0);
+	buf[pos + 5] |= extension_protocol_bit;
+	buf[pos + 7] |= fast_extension_bit;
+	if (m_ses.m_dht.is_running()) buf[pos + 7] |= dht_bit;
 	pos += 8;
 
 	// info hash
 	std::copy(
 		m_torrent->torrent_file().info_hash().begin()
 		, m_torrent->torrent_file().info_hash().end()
-		, m_send_buffer.begin() + pos);
+		, buf + pos);
 	pos += 20;
 
 	// peer id
 	std::copy(
 		m_ses.get_peer_id().begin()
 		, m_ses.get_peer_id().end()
-		, m_send_buffer.begin() + pos);
+		, buf + pos);
 
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> HANDSHAKE\n";
@@ -234,14 +305,17 @@ void libtorrent::peer_connection::send_handshake()
 
 boost::optional<piece_block_progress> libtorrent::peer_connection::downloading_piece() const
 {
+	const std::size_t recv_pos = m_recv_end - m_recv_start + m_piece_received;
+
 	// are we currently receiving a 'piece' message?
 	if (m_state != read_packet
-		|| m_recv_pos < 9
-		|| m_recv_buffer[0] != msg_piece)
+		|| recv_pos < 9
+		|| m_recv_buffer[m_recv_start] != msg_piece)
 		return boost::optional<piece_block_progress>();
 
-	int piece_index = read_int(&m_recv_buffer[1]);
-	int offset = read_int(&m_recv_buffer[5]);
+	const char* packet = &m_recv_buffer[m_recv_start];
+	int piece_index = read_int(packet + 1);
+	int offset = read_int(packet + 5);
 	int len = m_packet_size - 9;
 
 	// is any of the piece message header data invalid?
@@ -258,21 +332,38 @@ boost::optional<piece_block_progress> libtorrent::peer_connection::downloading_p
 
 	p.piece_index = piece_index;
 	p.block_index = offset / m_torrent->block_size();
-	p.bytes_downloaded = m_recv_pos - 9;
+	p.bytes_downloaded = recv_pos - 9;
 	p.full_block_bytes = len;
 
 	return boost::optional<piece_block_progress>(p);
 }
 
-bool libtorrent::peer_connection::dispatch_message(int received)
+// is called once for every complete packet that has been
+// received. packet points to the first byte of the packet (the
+// message id) and the packet is m_packet_size bytes long.
+void libtorrent::peer_connection::dispatch_message(const char* packet)
 {
-	assert(m_recv_pos >= received);
-	assert(m_recv_pos > 0);
+	assert(m_packet_size > 0);
+
+	int packet_type = packet[0];
+	if (packet_type == msg_extended)
+	{
+		if (!m_supports_extensions)
+			throw protocol_error("extension message from peer that doesn't support it");
+		on_extended(packet);
+		return;
+	}
 
-	int packet_type = m_recv_buffer[0];
-	if (packet_type > msg_cancel || packet_type < msg_choke)
+	if (packet_type < msg_choke
+		|| (packet_type > msg_port && packet_type < msg_suggest_piece)
+		|| packet_type > msg_allowed_fast)
 		throw protocol_error("unknown message id");
 
+	// the fast extension messages may only be sent
+	// if both ends support it
+	if (packet_type >= msg_suggest_piece && !m_supports_fast)
+		throw protocol_error("fast extension message from peer that doesn't support it");
+
 	switch (packet_type)
 	{
 
@@ -280,8 +371,6 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 	case msg_choke:
 		if (m_packet_size != 1)
 			throw protocol_error("'choke' message size != 1");
-		m_statistics.received_bytes(0, received);
-		if (m_recv_pos < m_packet_size) return false;
 
 #ifndef NDEBUG
 		(*m_logger) << m_socket->sender().as_string() << " <== CHOKE\n";
@@ -289,6 +378,10 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 		m_peer_choked = true;
 		m_torrent->get_policy().choked(*this);
 
+		// with the fast extension, the peer will reject
+		// the requests it won't serve explicitly
+		if (m_supports_fast) break;
+
 		// remove all pieces from this peers download queue and
 		// remove the 'downloading' flag from piece_picker.
 		for (std::deque<piece_block>::iterator i = m_download_queue.begin();
@@ -298,6 +391,7 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 			m_torrent->picker().abort_download(*i);
 		}
 		m_download_queue.clear();
+		m_timed_block.piece_index = -1;
 #ifndef NDEBUG
 //		m_torrent->picker().integrity_check(m_torrent);
 #endif
@@ -309,8 +403,6 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 	case msg_unchoke:
 		if (m_packet_size != 1)
 			throw protocol_error("'unchoke' message size != 1");
-		m_statistics.received_bytes(0, received);
-		if (m_recv_pos < m_packet_size) return false;
 
 #ifndef NDEBUG
 		(*m_logger) << m_socket->sender().as_string() << " <== UNCHOKE\n";
@@ -324,8 +416,6 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 	case msg_interested:
 		if (m_packet_size != 1)
 			throw protocol_error("'interested' message size != 1");
-		m_statistics.received_bytes(0, received);
-		if (m_recv_pos < m_packet_size) return false;
 
 #ifndef NDEBUG
 		(*m_logger) << m_socket->sender().as_string() << " <== INTERESTED\n";
@@ -339,8 +429,6 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 	case msg_not_interested:
 		if (m_packet_size != 1)
 			throw protocol_error("'not interested' message size != 1");
-		m_statistics.received_bytes(0, received);
-		if (m_recv_pos < m_packet_size) return false;
 
 #ifndef NDEBUG
 		(*m_logger) << m_socket->sender().as_string() << " <== NOT_INTERESTED\n";
@@ -356,10 +444,8 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 		{
 			if (m_packet_size != 5)
 				throw protocol_error("'have' message size != 5");
-			m_statistics.received_bytes(0, received);
-			if (m_recv_pos < m_packet_size) return false;
 
-			std::size_t index = read_int(&m_recv_buffer[1]);
+			std::size_t index = read_int(packet + 1);
 			// if we got an invalid message, abort
 			if (index >= m_have_piece.size())
 				throw protocol_error("have message with higher index than the number of pieces");
@@ -391,8 +477,6 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 		{
 			if (m_packet_size - 1 != (m_have_piece.size() + 7) / 8)
 				throw protocol_error("bitfield with invalid size");
-			m_statistics.received_bytes(0, received);
-			if (m_recv_pos < m_packet_size) return false;
 
 #ifndef NDEBUG
 			(*m_logger) << m_socket->sender().as_string() << " <== BITFIELD\n";
@@ -401,7 +485,7 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 			bool is_seed = true;
 			for (std::size_t i = 0; i < m_have_piece.size(); ++i)
 			{
-				bool have = m_recv_buffer[1 + (i>>3)] & (1 << (7 - (i&7)));
+				bool have = packet[1 + (i>>3)] & (1 << (7 - (i&7)));
 				if (have && !m_have_piece[i])
 				{
 					m_have_piece[i] = true;
@@ -432,29 +516,41 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 		{
 			if (m_packet_size != 13)
 				throw protocol_error("'request' message size != 13");
-			m_statistics.received_bytes(0, received);
-			if (m_recv_pos < m_packet_size) return false;
 
 			peer_request r;
-			r.piece = read_int(&m_recv_buffer[1]);
-			r.start = read_int(&m_recv_buffer[5]);
-			r.length = read_int(&m_recv_buffer[9]);
+			r.piece = read_int(packet + 1);
+			r.start = read_int(packet + 5);
+			r.length = read_int(packet + 9);
+
+#ifndef NDEBUG
+			(*m_logger) << m_socket->sender().as_string() << " <== REQUEST [ piece: " << r.piece << " | s: " << r.start << " | l: " << r.length << " ]\n";
+#endif
 
-			if (!m_choked)
+			const bool have = r.piece >= 0
+				&& r.piece < int(m_have_piece.size())
+				&& m_torrent->have_piece(r.piece);
+
+			if (m_supports_fast && !have)
+			{
+				send_reject(r);
+			}
+			else if (!m_choked
+				|| std::find(m_accept_fast.begin(), m_accept_fast.end(), r.piece)
+					!= m_accept_fast.end())
 			{
 				m_requests.push_back(r);
 				send_buffer_updated();
 			}
+			else if (m_supports_fast)
+			{
+				send_reject(r);
+			}
 			else
 			{
 				// ignoring request since we have
 				// choked this peer
 			}
 
-#ifndef NDEBUG
-			(*m_logger) << m_socket->sender().as_string() << " <== REQUEST [ piece: " << r.piece << " | s: " << r.start << " | l: " << r.length << " ]\n";
-#endif
-
 			break;
 		}
 
@@ -463,26 +559,7 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 		// *************** PIECE ***************
 	case msg_piece:
 		{
-			if (m_recv_pos <= 9)
-				// only received protocol data
-				m_statistics.received_bytes(0, received);
-			else if (m_recv_pos - received >= 9)
-				// only received payload data
-				m_statistics.received_bytes(received, 0);
-			else
-			{
-				// received a bit of both
-				assert(m_recv_pos - received < 9);
-				assert(m_recv_pos > 9);
-				assert(9 - (m_recv_pos - received) <= 9);
-				m_statistics.received_bytes(
-					m_recv_pos - 9
-					, 9 - (m_recv_pos - received));
-			}
-
-			if (m_recv_pos < m_packet_size) return false;
-
-			std::size_t index = read_int(&m_recv_buffer[1]);
+			std::size_t index = read_int(packet + 1);
 			if (index < 0 || index >= m_torrent->torrent_file().num_pieces())
 			{
 #ifndef NDEBUG
@@ -490,7 +567,7 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 #endif
 				throw protocol_error("invalid piece index in piece message");
 			}
-			int offset = read_int(&m_recv_buffer[5]);
+			int offset = read_int(packet + 5);
 			int len = m_packet_size - 9;
 
 			if (offset < 0)
@@ -525,7 +602,7 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 #ifndef NDEBUG
 				(*m_logger) << m_socket->sender().as_string() << " piece packet contains unrequested index\n";
 #endif
-				return false;
+				return;
 			}
 
 			if (req.block_index != offset / m_torrent->block_size())
@@ -533,7 +610,7 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 #ifndef NDEBUG
 				(*m_logger) << m_socket->sender().as_string() << " piece packet contains unrequested offset\n";
 #endif
-				return false;
+				return;
 			}
 */
 #ifndef NDEBUG
@@ -548,26 +625,73 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 					m_download_queue.begin()
 					, m_download_queue.end()
 					, block_finished);
+			const bool requested = b != m_download_queue.end();
 
-			if (b != m_download_queue.end())
+			if (requested)
 			{
 				// pop the request that just finished
 				// from the download queue
 				m_download_queue.erase(b);
+
+				if (block_finished == m_timed_block)
+				{
+					// the blocks that were queued ahead of this one
+					// were sent first, that time isn't part of the
+					// round trip
+					int rtt = static_cast<int>(m_ses.m_timers.now() - m_timed_request_sent);
+					float rate = m_statistics.download_rate();
+					if (rate > 0.f)
+						rtt -= static_cast<int>(m_timed_queue_ahead
+							* m_torrent->block_size() * 1000.f / rate);
+					if (rtt > 0 && (m_rtt_history[0] == 0 || rtt < m_rtt_history[0]))
+						m_rtt_history[0] = rtt;
+					m_timed_block.piece_index = -1;
+				}
 			}
 			else
 			{
-				// TODO: cancel the block from the
-				// peer that has taken over it.
+				// the request was cancelled, and the block may have
+				// been requested from another peer since. That
+				// request is cancelled in policy::block_finished()
+			}
+
+			// only blocks requested from more than one peer (in
+			// end-game mode) may be in other peers' queues. A finished
+			// block has no requests left, they were cancelled when
+			// the first copy arrived
+			const bool other_requests
+				= picker.num_requests(block_finished) > (requested ? 1 : 0);
+
+			// in end-game mode, the block may have been sent by
+			// another peer first, and this copy sent before our
+			// cancel arrived
+			if (picker.is_finished(block_finished))
+			{
+				m_torrent->get_policy().block_finished(*this, block_finished
+					, other_requests);
+				break;
 			}
 
-			if (picker.is_finished(block_finished)) break;
+			// the piece may have been filtered out after the block
+			// was requested. The files it's in may not even be
+			// allocated, it isn't written
+			if (picker.piece_priority(index) == 0)
+			{
+				if (requested) picker.abort_download(block_finished);
+				m_torrent->get_policy().block_finished(*this, block_finished
+					, other_requests);
+				break;
+			}
 
-			m_torrent->filesystem().write(&m_recv_buffer[9], index, offset, len);
+			// the payload is either in a block buffer or, if it was
+			// received in one go, right after the header
+			const char* payload = m_piece_buffer ? m_piece_buffer.get() : packet + 9;
+			m_torrent->filesystem().write(payload, index, offset, len);
 
 			picker.mark_as_finished(block_finished, m_peer_id);
 
-			m_torrent->get_policy().block_finished(*this, block_finished);
+			m_torrent->get_policy().block_finished(*this, block_finished
+				, other_requests);
 
 			// did we just finish the piece?
 			if (picker.is_piece_finished(index))
@@ -592,19 +716,20 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 		{
 			if (m_packet_size != 13)
 				throw protocol_error("'cancel' message size != 13");
-			m_statistics.received_bytes(0, received);
-			if (m_recv_pos < m_packet_size) return false;
 
 			peer_request r;
-			r.piece = read_int(&m_recv_buffer[1]);
-			r.start = read_int(&m_recv_buffer[5]);
-			r.length = read_int(&m_recv_buffer[9]);
+			r.piece = read_int(packet + 1);
+			r.start = read_int(packet + 5);
+			r.length = read_int(packet + 9);
 
 			std::deque<peer_request>::iterator i
 				= std::find(m_requests.begin(), m_requests.end(), r);
 			if (i != m_requests.end())
 			{
 				m_requests.erase(i);
+				// the fast extension requires every request
+				// to be answered, even cancelled ones
+				if (m_supports_fast) send_reject(r);
 			}
 
 			if (!has_data() && m_added_to_selector)
@@ -618,9 +743,138 @@ bool libtorrent::peer_connection::dispatch_message(int received)
 #endif
 			break;
 		}
+
+
+		// *************** PORT ***************
+	case msg_port:
+		{
+			if (m_packet_size != 3)
+				throw protocol_error("'port' message size != 3");
+
+			unsigned short port = static_cast<unsigned short>(
+				(static_cast<unsigned char>(packet[1]) << 8)
+				| static_cast<unsigned char>(packet[2]));
+#ifndef NDEBUG
+			(*m_logger) << m_socket->sender().as_string() << " <== PORT [ " << port << " ]\n";
+#endif
+			// the peer's dht node is a good
+			// way into the dht
+			if (port == 0 || !m_ses.m_dht.is_running()) break;
+			unsigned int ip = ntohl(m_socket->sender().ip());
+			m_ses.m_dht.add_node(address((ip >> 24) & 0xff, (ip >> 16) & 0xff
+				, (ip >> 8) & 0xff, ip & 0xff, port));
+			break;
+		}
+
+
+		// *************** SUGGEST PIECE ***************
+	case msg_suggest_piece:
+		{
+			if (m_packet_size != 5)
+				throw protocol_error("'suggest piece' message size != 5");
+
+			std::size_t index = read_int(packet + 1);
+			if (index >= m_have_piece.size())
+				throw protocol_error("suggest piece message with higher index than the number of pieces");
+
+#ifndef NDEBUG
+			(*m_logger) << m_socket->sender().as_string() << " <== SUGGEST_PIECE [ piece: " << index << " ]\n";
+#endif
+			if (m_torrent->have_piece(index)) break;
+
+			std::vector<int>::iterator i = std::find(
+				m_suggested_pieces.begin(), m_suggested_pieces.end(), int(index));
+			if (i != m_suggested_pieces.end()) m_suggested_pieces.erase(i);
+			if (int(m_suggested_pieces.size()) >= max_suggested_pieces)
+				m_suggested_pieces.erase(m_suggested_pieces.begin());
+			m_suggested_pieces.push_back(index);
+			break;
+		}
+
+
+		// *************** HAVE ALL ***************
+	case msg_have_all:
+		{
+			if (m_packet_size != 1)
+				throw protocol_error("'have all' message size != 1");
+
+#ifndef NDEBUG
+			(*m_logger) << m_socket->sender().as_string() << " <== HAVE_ALL\n";
+			(*m_logger) << m_socket->sender().as_string() << " *** THIS IS A SEED ***\n";
+#endif
+			bool interesting = false;
+			for (std::size_t i = 0; i < m_have_piece.size(); ++i)
+			{
+				if (m_have_piece[i]) continue;
+				m_have_piece[i] = true;
+				if (m_torrent->peer_has(i)) interesting = true;
+			}
+			if (interesting) m_torrent->get_policy().peer_is_interesting(*this);
+			break;
+		}
+
+
+		// *************** HAVE NONE ***************
+	case msg_have_none:
+		if (m_packet_size != 1)
+			throw protocol_error("'have none' message size != 1");
+
+#ifndef NDEBUG
+		(*m_logger) << m_socket->sender().as_string() << " <== HAVE_NONE\n";
+#endif
+		// we already assume the peer doesn't have any pieces
+		break;
+
+
+		// *************** REJECT REQUEST ***************
+	case msg_reject_request:
+		{
+			if (m_packet_size != 13)
+				throw protocol_error("'reject request' message size != 13");
+
+			int index = read_int(packet + 1);
+			int offset = read_int(packet + 5);
+
+#ifndef NDEBUG
+			(*m_logger) << m_socket->sender().as_string() << " <== REJECT_REQUEST [ piece: " << index << " | s: " << offset << " ]\n";
+#endif
+			if (index < 0 || index >= int(m_have_piece.size())) break;
+
+			piece_block b(index, offset / m_torrent->block_size());
+			std::deque<piece_block>::iterator i
+				= std::find(m_download_queue.begin(), m_download_queue.end(), b);
+			// we may have cancelled it already
+			if (i == m_download_queue.end()) break;
+
+			m_download_queue.erase(i);
+			m_torrent->picker().abort_download(b);
+			m_torrent->get_policy().block_rejected(*this, b);
+			break;
+		}
+
+
+		// *************** ALLOWED FAST ***************
+	case msg_allowed_fast:
+		{
+			if (m_packet_size != 5)
+				throw protocol_error("'allowed fast' message size != 5");
+
+			std::size_t index = read_int(packet + 1);
+			if (index >= m_have_piece.size())
+				throw protocol_error("allowed fast message with higher index than the number of pieces");
+
+#ifndef NDEBUG
+			(*m_logger) << m_socket->sender().as_string() << " <== ALLOWED_FAST [ piece: " << index << " ]\n";
+#endif
+			if (std::find(m_allowed_fast.begin(), m_allowed_fast.end(), int(index))
+				!= m_allowed_fast.end())
+				break;
+
+			m_allowed_fast.push_back(index);
+			m_torrent->get_policy().allowed_fast(*this, index);
+			break;
+		}
 	}
-	assert(m_recv_pos == m_packet_size);
-	return true;
 }
 
 void libtorrent::peer_connection::cancel_block(piece_block block)
@@ -645,43 +899,62 @@ void libtorrent::peer_connection::cancel_block(piece_block block)
 	assert(block_size > 0);
 	assert(block_size <= m_torrent->block_size());
 
-	char buf[] = {0,0,0,13, msg_cancel};
-
-	std::size_t start_offset = m_send_buffer.size();
-	m_send_buffer.resize(start_offset + 17);
-
-	std::copy(buf, buf + 5, m_send_buffer.begin()+start_offset);
-	start_offset += 5;
+	char buf[17] = {0,0,0,13, msg_cancel};
+	char* ptr = buf + 5;
 
 	// index
-	write_int(block.piece_index, &m_send_buffer[start_offset]);
-	start_offset += 4;
+	write_int(block.piece_index, ptr);
+	ptr += 4;
 
 	// begin
-	write_int(block_offset, &m_send_buffer[start_offset]);
-	start_offset += 4;
+	write_int(block_offset, ptr);
+	ptr += 4;
 
 	// length
-	write_int(block_size, &m_send_buffer[start_offset]);
-	start_offset += 4;
+	write_int(block_size, ptr);
+	ptr += 4;
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> CANCEL [ piece: " << block.piece_index << " | s: " << block_offset << " | l: " << block_size << " | " << block.block_index << " ]\n";
 #endif
-	assert(start_offset == m_send_buffer.size());
+	assert(ptr == buf + sizeof(buf));
+	m_send_buffer.append(buf, sizeof(buf));
 
 	send_buffer_updated();
 }
 
+bool libtorrent::peer_connection::can_request_blocks() const
+{
+	if (m_torrent->buffer_pool().exceeded()) return false;
+	return !is_download_throttled() || m_download_queue.empty();
+}
+
 void libtorrent::peer_connection::request_block(piece_block block)
 {
 	assert(block.piece_index >= 0);
 	assert(block.piece_index < m_torrent->torrent_file().num_pieces());
-	assert(!m_torrent->picker().is_downloading(block));
+	assert(std::find(m_download_queue.begin(), m_download_queue.end(), block)
+		== m_download_queue.end());
 
 	m_torrent->picker().mark_as_downloading(block, m_peer_id);
 
+	// the peer has had nothing to do, it can't have
+	// been slow to send the blocks
+	if (m_download_queue.empty())
+		m_request_progress = m_ses.m_timers.now();
+
 	m_download_queue.push_back(block);
 
+	// time this request, unless another one is timed. The
+	// timed request may have been cancelled or rejected, then
+	// it's not in the queue anymore
+	if (std::find(m_download_queue.begin(), m_download_queue.end()
+		, m_timed_block) == m_download_queue.end())
+	{
+		m_timed_block = block;
+		m_timed_request_sent = m_ses.m_timers.now();
+		m_timed_queue_ahead = m_download_queue.size() - 1;
+	}
+
 	int block_offset = block.block_index * m_torrent->block_size();
 	int block_size
 		= std::min((int)m_torrent->torrent_file().piece_size(block.piece_index)-block_offset,
@@ -689,48 +962,59 @@ void libtorrent::peer_connection::request_block(piece_block block)
 	assert(block_size > 0);
 	assert(block_size <= m_torrent->block_size());
 
-	char buf[] = {0,0,0,13, msg_request};
-
-	std::size_t start_offset = m_send_buffer.size();
-	m_send_buffer.resize(start_offset + 17);
-
-	std::copy(buf, buf + 5, m_send_buffer.begin()+start_offset);
-	start_offset +=5;
+	char buf[17] = {0,0,0,13, msg_request};
+	char* ptr = buf + 5;
 
 	// index
-	write_int(block.piece_index, &m_send_buffer[start_offset]);
-	start_offset += 4;
+	write_int(block.piece_index, ptr);
+	ptr += 4;
 
 	// begin
-	write_int(block_offset, &m_send_buffer[start_offset]);
-	start_offset += 4;
+	write_int(block_offset, ptr);
+	ptr += 4;
 
 	// length
-	write_int(block_size, &m_send_buffer[start_offset]);
-	start_offset += 4;
+	write_int(block_size, ptr);
+	ptr += 4;
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> REQUEST [ piece: " << block.piece_index << " | s: " << block_offset << " | l: " << block_size << " | " << block.block_index << " ]\n";
 #endif
-	assert(start_offset == m_send_buffer.size());
+	assert(ptr == buf + sizeof(buf));
+	m_send_buffer.append(buf, sizeof(buf));
 
 	send_buffer_updated();
 }
 
 void libtorrent::peer_connection::send_bitfield()
 {
+	// peers that support the fast extension are told
+	// with a single byte if we have all or no pieces
+	if (m_supports_fast
+		&& (m_torrent->is_seed() || m_torrent->num_have() == 0))
+	{
+		char msg[] = {0,0,0,1,0};
+		msg[4] = m_torrent->is_seed() ? msg_have_all : msg_have_none;
+#ifndef NDEBUG
+		(*m_logger) << m_socket->sender().as_string()
+			<< (m_torrent->is_seed() ? " ==> HAVE_ALL\n" : " ==> HAVE_NONE\n");
+#endif
+		m_send_buffer.append(msg, sizeof(msg));
+		send_buffer_updated();
+		return;
+	}
+
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> BITFIELD\n";
 #endif
 	const int packet_size = (m_have_piece.size() + 7) / 8 + 5;
-	const int old_size = m_send_buffer.size();
-	m_send_buffer.resize(old_size + packet_size);
-	write_int(packet_size - 4, &m_send_buffer[old_size]);
-	m_send_buffer[old_size+4] = msg_bitfield;
-	std::fill(m_send_buffer.begin()+old_size+5, m_send_buffer.end(), 0);
+	char* buf = m_send_buffer.allocate_appendix(packet_size);
+	write_int(packet_size - 4, buf);
+	buf[4] = msg_bitfield;
+	std::fill(buf + 5, buf + packet_size, 0);
 	for (std::size_t i = 0; i < m_have_piece.size(); ++i)
 	{
 		if (m_torrent->have_piece(i))
-			m_send_buffer[old_size + 5 + (i>>3)] |= 1 << (7 - (i&7));
+			buf[5 + (i>>3)] |= 1 << (7 - (i&7));
 	}
 	send_buffer_updated();
 }
@@ -739,20 +1023,251 @@ void libtorrent::peer_connection::choke()
 {
 	if (m_choked) return;
 	char msg[] = {0,0,0,1,msg_choke};
-	m_send_buffer.insert(m_send_buffer.end(), msg, msg+sizeof(msg));
+	m_send_buffer.append(msg, sizeof(msg));
 	m_choked = true;
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> CHOKE\n";
 #endif
-	m_requests.clear();
+	if (m_supports_fast)
+	{
+		// the requests for pieces in the peer's allowed fast
+		// set are still served, the others are rejected
+		std::deque<peer_request> keep;
+		for (std::deque<peer_request>::iterator i = m_requests.begin();
+			i != m_requests.end(); ++i)
+		{
+			if (std::find(m_accept_fast.begin(), m_accept_fast.end(), i->piece)
+				!= m_accept_fast.end())
+				keep.push_back(*i);
+			else
+				send_reject(*i);
+		}
+		m_requests.swap(keep);
+	}
+	else
+	{
+		m_requests.clear();
+	}
+	send_buffer_updated();
+}
+
+void libtorrent::peer_connection::send_reject(const peer_request& r)
+{
+	assert(m_supports_fast);
+	char msg[17] = {0,0,0,13, msg_reject_request};
+	write_int(r.piece, msg + 5);
+	write_int(r.start, msg + 9);
+	write_int(r.length, msg + 13);
+	m_send_buffer.append(msg, sizeof(msg));
+#ifndef NDEBUG
+	(*m_logger) << m_socket->sender().as_string() << " ==> REJECT_REQUEST [ piece: " << r.piece << " | s: " << r.start << " | l: " << r.length << " ]\n";
+#endif
+	send_buffer_updated();
+}
+
+void libtorrent::peer_connection::send_allowed_fast(int index)
+{
+	assert(m_supports_fast);
+	char msg[9] = {0,0,0,5, msg_allowed_fast};
+	write_int(index, msg + 5);
+	m_send_buffer.append(msg, sizeof(msg));
+#ifndef NDEBUG
+	(*m_logger) << m_socket->sender().as_string() << " ==> ALLOWED_FAST [ piece: " << index << " ]\n";
+#endif
+	send_buffer_updated();
+}
+
+void libtorrent::peer_connection::send_dht_port()
+{
+	unsigned short port = m_ses.m_dht.port();
+	char msg[7] = {0,0,0,3, msg_port
+		, static_cast<char>(port >> 8), static_cast<char>(port)};
+	m_send_buffer.append(msg, sizeof(msg));
+#ifndef NDEBUG
+	(*m_logger) << m_socket->sender().as_string() << " ==> PORT [ " << port << " ]\n";
+#endif
+	send_buffer_updated();
+}
+
+void libtorrent::peer_connection::send_extended_handshake()
+{
+	assert(m_supports_extensions);
+
+	entry h(entry::dictionary_t);
+	entry m(entry::dictionary_t);
+	for (std::size_t i = 0; i < m_extensions.size(); ++i)
+	{
+		entry id(entry::int_t);
+		id.integer() = i + 1;
+		m.dict()[m_extensions[i]->message_name()] = id;
+		m_extensions[i]->add_handshake(h);
+	}
+	h.dict()["m"] = m;
+	entry port(entry::int_t);
+	port.integer() = m_ses.m_listen_port;
+	h.dict()["p"] = port;
+
+	std::string buf;
+	bencode(std::back_inserter(buf), h);
+
+	const int packet_size = 4 + 2 + buf.size();
+	char* ptr = m_send_buffer.allocate_appendix(packet_size);
+	write_int(packet_size - 4, ptr);
+	ptr[4] = msg_extended;
+	// 0 is the handshake
+	ptr[5] = 0;
+	std::copy(buf.begin(), buf.end(), ptr + 6);
+#ifndef NDEBUG
+	(*m_logger) << m_socket->sender().as_string() << " ==> EXTENDED_HANDSHAKE\n";
+#endif
+	send_buffer_updated();
+}
+
+void libtorrent::peer_connection::send_extended(const char* name, const std::string& payload)
+{
+	std::map<std::string, int>::const_iterator i = m_extension_ids.find(name);
+	assert(i != m_extension_ids.end());
+
+	const int packet_size = 4 + 2 + payload.size();
+	char* ptr = m_send_buffer.allocate_appendix(packet_size);
+	write_int(packet_size - 4, ptr);
+	ptr[4] = msg_extended;
+	ptr[5] = static_cast<char>(i->second);
+	std::copy(payload.begin(), payload.end(), ptr + 6);
+#ifndef NDEBUG
+	(*m_logger) << m_socket->sender().as_string() << " ==> EXTENDED [ " << name << " ]\n";
+#endif
 	send_buffer_updated();
 }
 
+void libtorrent::peer_connection::on_extended(const char* packet)
+{
+	if (m_packet_size < 2)
+		throw protocol_error("'extended' message size < 2");
+
+	const int id = static_cast<unsigned char>(packet[1]);
+	const char* body = packet + 2;
+	const int size = m_packet_size - 2;
+
+	if (id != 0)
+	{
+#ifndef NDEBUG
+		(*m_logger) << m_socket->sender().as_string() << " <== EXTENDED [ id: " << id << " ]\n";
+#endif
+		// messages for extensions we haven't told
+		// the peer about are ignored
+		if (id > int(m_extensions.size())) return;
+		m_extensions[id - 1]->on_message(body, size);
+		return;
+	}
+
+#ifndef NDEBUG
+	(*m_logger) << m_socket->sender().as_string() << " <== EXTENDED_HANDSHAKE\n";
+#endif
+
+	entry h;
+	try
+	{
+		h = bdecode(body, body + size);
+	}
+	catch(std::exception&)
+	{
+		throw protocol_error("invalid extension handshake");
+	}
+	if (h.type() != entry::dictionary_t)
+		throw protocol_error("invalid extension handshake");
+
+	// the handshake may be sent again to change the ids,
+	// an id of 0 means the extension is disabled
+	entry::dictionary_type::const_iterator i = h.dict().find("m");
+	if (i != h.dict().end() && i->second.type() == entry::dictionary_t)
+	{
+		const entry::dictionary_type& m = i->second.dict();
+		for (entry::dictionary_type::const_iterator j = m.begin(); j != m.end(); ++j)
+		{
+			if (j->second.type() != entry::int_t) continue;
+			const entry::integer_type msg_id = j->second.integer();
+			if (msg_id <= 0 || msg_id > 255) m_extension_ids.erase(j->first);
+			else m_extension_ids[j->first] = int(msg_id);
+		}
+	}
+
+	i = h.dict().find("p");
+	if (i != h.dict().end() && i->second.type() == entry::int_t
+		&& i->second.integer() > 0 && i->second.integer() < 65536)
+	{
+		m_remote_listen_port = int(i->second.integer());
+	}
+
+	for (std::vector<boost::shared_ptr<peer_extension> >::iterator j
+		= m_extensions.begin(); j != m_extensions.end(); ++j)
+	{
+		(*j)->on_handshake(h);
+	}
+}
+
+bool libtorrent::peer_connection::remote_listen_address(address& a) const
+{
+	if (m_active)
+	{
+		a = m_socket->sender();
+		return true;
+	}
+	if (m_remote_listen_port == 0) return false;
+	unsigned int ip = ntohl(m_socket->sender().ip());
+	a = address(ip >> 24, (ip >> 16) & 0xff, (ip >> 8) & 0xff, ip & 0xff
+		, static_cast<unsigned short>(m_remote_listen_port));
+	return true;
+}
+
+void libtorrent::peer_connection::send_allowed_fast_set()
+{
+	const int num_pieces = m_torrent->torrent_file().num_pieces();
+	const int set_size = std::min(int(allowed_fast_set_size), num_pieces);
+
+	// the set only depends on the peer's /24 network
+	// and the info hash, so it can't be changed by
+	// reconnecting
+	char x[4 + 20];
+	write_int(ntohl(m_socket->sender().ip()) & 0xffffff00, x);
+	std::copy(
+		m_torrent->torrent_file().info_hash().begin()
+		, m_torrent->torrent_file().info_hash().end()
+		, x + 4);
+
+	std::vector<int> set;
+	hasher h;
+	h.update(x, sizeof(x));
+	sha1_hash digest = h.final();
+	for (;;)
+	{
+		for (int i = 0; i < 5 && int(set.size()) < set_size; ++i)
+		{
+			int index = read_int(reinterpret_cast<const char*>(digest.begin()) + i * 4)
+				% num_pieces;
+			if (std::find(set.begin(), set.end(), index) == set.end())
+				set.push_back(index);
+		}
+		if (int(set.size()) >= set_size) break;
+		h.reset();
+		h.update(reinterpret_cast<const char*>(digest.begin()), 20);
+		digest = h.final();
+	}
+
+	// there's no point in offering the pieces we don't have
+	for (std::vector<int>::iterator i = set.begin(); i != set.end(); ++i)
+	{
+		if (!m_torrent->have_piece(*i)) continue;
+		m_accept_fast.push_back(*i);
+		send_allowed_fast(*i);
+	}
+}
+
 void libtorrent::peer_connection::unchoke()
 {
 	if (!m_choked) return;
 	char msg[] = {0,0,0,1,msg_unchoke};
-	m_send_buffer.insert(m_send_buffer.end(), msg, msg+sizeof(msg));
+	m_send_buffer.append(msg, sizeof(msg));
 	m_choked = false;
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> UNCHOKE\n";
@@ -764,7 +1279,7 @@ void libtorrent::peer_connection::interested()
 {
 	if (m_interesting) return;
 	char msg[] = {0,0,0,1,msg_interested};
-	m_send_buffer.insert(m_send_buffer.end(), msg, msg+sizeof(msg));
+	m_send_buffer.append(msg, sizeof(msg));
 	m_interesting = true;
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> INTERESTED\n";
@@ -776,7 +1291,7 @@ void libtorrent::peer_connection::not_interested()
 {
 	if (!m_interesting) return;
 	char msg[] = {0,0,0,1,msg_not_interested};
-	m_send_buffer.insert(m_send_buffer.end(), msg, msg+sizeof(msg));
+	m_send_buffer.append(msg, sizeof(msg));
 	m_interesting = false;
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> NOT_INTERESTED\n";
@@ -789,18 +1304,117 @@ void libtorrent::peer_connection::send_have(int index)
 	const int packet_size = 9;
 	char msg[packet_size] = {0,0,0,5,msg_have};
 	write_int(index, msg+5);
-	m_send_buffer.insert(m_send_buffer.end(), msg, msg + packet_size);
+	m_send_buffer.append(msg, packet_size);
 #ifndef NDEBUG
 	(*m_logger) << m_socket->sender().as_string() << " ==> HAVE [ piece: " << index << " ]\n";
 #endif
 	send_buffer_updated();
 }
 
+int libtorrent::peer_connection::request_rtt() const
+{
+	if (m_rtt_history[0] == 0) return m_rtt_history[1];
+	if (m_rtt_history[1] == 0) return m_rtt_history[0];
+	return std::min(m_rtt_history[0], m_rtt_history[1]);
+}
+
+void libtorrent::peer_connection::update_desired_queue_size()
+{
+	int rtt = request_rtt();
+	float rate = m_statistics.download_rate();
+	if (rtt > 0 && rate > 0.f)
+	{
+		// the number of blocks in flight that keeps the
+		// connection busy. Half as many again are requested,
+		// so that the queue grows while it's what limits
+		// the rate
+		int bdp = static_cast<int>(rate * rtt / 1000.f / m_torrent->block_size());
+		m_desired_queue_size = bdp + bdp / 2 + 2;
+
+		m_block_timeout = 3 * (rtt + static_cast<int>(
+			m_torrent->block_size() * 1000.f / rate));
+	}
+
+	if (m_desired_queue_size < m_ses.m_min_request_queue)
+		m_desired_queue_size = m_ses.m_min_request_queue;
+	if (m_desired_queue_size > m_ses.m_max_request_queue)
+		m_desired_queue_size = m_ses.m_max_request_queue;
+
+	// there's no point in queueing up blocks on a peer
+	// that doesn't send them
+	if (m_snubbed) m_desired_queue_size = 1;
+}
+
+void libtorrent::peer_connection::check_request_timeouts()
+{
+	if (m_download_queue.empty()) return;
+
+	const timer_wheel::time_type now = m_ses.m_timers.now();
+
+	// while we're not reading from the peer, for lack of download
+	// quota, it can't be blamed for not sending anything
+	if (is_download_throttled())
+	{
+		m_request_progress = now;
+		return;
+	}
+
+	const int idle = static_cast<int>(now - m_request_progress);
+
+	if (!m_snubbed && idle >= m_ses.m_snub_timeout * 1000)
+	{
+#ifndef NDEBUG
+		(*m_logger) << m_socket->sender().as_string() << " *** SNUBBED [ idle: " << idle << " ms ]\n";
+#endif
+		m_snubbed = true;
+	}
+
+	// the requests made since the last ones expired get
+	// a full timeout too
+	const int waited = static_cast<int>(now
+		- std::max(m_request_progress, m_requests_expired));
+	if (waited < std::max(m_block_timeout, m_ses.m_request_timeout * 1000)) return;
+	m_requests_expired = now;
+
+	// the first request is kept, the peer may be about to send
+	// it. The others are given back, so that other peers can
+	// download the blocks. A snubbed peer doesn't keep any
+	const std::size_t keep = m_snubbed ? 0 : 1;
+	if (m_download_queue.size() <= keep) return;
+
+#ifndef NDEBUG
+	(*m_logger) << m_socket->sender().as_string() << " *** REQUESTS TIMED OUT [ "
+		<< (int)(m_download_queue.size() - keep) << " blocks | idle: " << idle << " ms ]\n";
+#endif
+	while (m_download_queue.size() > keep)
+		cancel_block(m_download_queue.back());
+
+	m_torrent->get_policy().requests_timed_out(*this);
+}
+
 void libtorrent::peer_connection::second_tick()
 {
 	m_statistics.second_tick();
-	m_send_quota_left = m_send_quota;
-	if (m_send_quota > 0) send_buffer_updated();
+
+	// the round trip time is the lowest measured in the
+	// last 30 to 60 seconds, so that it follows changes
+	// in the route to the peer
+	if (++m_rtt_age >= 30)
+	{
+		m_rtt_history[1] = m_rtt_history[0];
+		m_rtt_history[0] = 0;
+		m_rtt_age = 0;
+	}
+	check_request_timeouts();
+	update_desired_queue_size();
+
+	for (std::vector<boost::shared_ptr<peer_extension> >::iterator i
+		= m_extensions.begin(); i != m_extensions.end(); ++i)
+	{
+		(*i)->tick();
+	}
+	m_send_quota = m_send_quota_left == -1 ? -1 : m_granted_quota;
+	m_granted_quota = 0;
 
 	// If the client sends more data
 	// we send it data faster, otherwise, slower.
@@ -837,267 +1451,615 @@ void libtorrent::peer_connection::second_tick()
 		// the maximum send_quota given our download rate from this peer
 		if (m_send_quota_limit < 256) m_send_quota_limit = 256;
 	}
+
+	update_upload_throttle();
 }
 
 // --------------------------
 // RECEIVE DATA
 // --------------------------
 
-// throws exception when the client should be disconnected
-void libtorrent::peer_connection::receive_data()
+// makes sure there's room in the receive buffer for at
+// least the remainder of the packet we're currently
+// receiving
+void libtorrent::peer_connection::prepare_receive_buffer()
 {
-	assert(!m_socket->is_blocking());
-	assert(m_packet_size > 0);
-	for(;;)
+	assert(m_recv_start <= m_recv_end);
+	assert(m_recv_end <= m_recv_buffer.size());
+
+	// everything in the buffer has been parsed,
+	// start over from the beginning
+	if (m_recv_start == m_recv_end)
 	{
-		assert(m_packet_size > 0);
-		int received = m_socket->receive(&m_recv_buffer[m_recv_pos], m_packet_size - m_recv_pos);
+		m_recv_start = 0;
+		m_recv_end = 0;
 
-		// connection closed
-		if (received == 0)
+		// if the buffer was grown to fit a large
+		// packet, shrink it back to its normal size
+		if (m_recv_buffer.size() > receive_buffer_size
+			&& m_packet_size <= receive_buffer_size)
 		{
-			throw network_error(0);
+			std::vector<char>(receive_buffer_size).swap(m_recv_buffer);
 		}
+	}
 
-		// an error
-		if (received < 0)
+	// move the partial packet to the front of the buffer
+	// if the rest of it won't fit, or if there's too
+	// little room left to make the receive worthwhile
+	if (m_recv_start > 0
+		&& (m_recv_start + m_packet_size > m_recv_buffer.size()
+			|| m_recv_buffer.size() - m_recv_end < m_recv_buffer.size() / 4))
+	{
+		std::copy(
+			m_recv_buffer.begin() + m_recv_start
+			, m_recv_buffer.begin() + m_recv_end
+			, m_recv_buffer.begin());
+		m_recv_end -= m_recv_start;
+		m_recv_start = 0;
+	}
+
+	// packets larger than the receive buffer (large
+	// bitfields for instance) will grow the buffer
+	if (m_recv_start + m_packet_size > m_recv_buffer.size())
+		m_recv_buffer.resize(m_recv_start + m_packet_size);
+
+	assert(m_recv_end < m_recv_buffer.size());
+}
+
+// updates the statistics with bytes [from, to) of the
+// packet currently being received.
+void libtorrent::peer_connection::account_received(std::size_t from, std::size_t to)
+{
+	assert(from <= to);
+	assert(to <= m_packet_size);
+	if (from == to) return;
+
+	int payload = 0;
+	if (m_state == read_packet
+		&& m_recv_buffer[m_recv_start] == msg_piece
+		&& to > 9)
+	{
+		// everything after the 9 bytes of the
+		// piece header is payload
+		payload = to - std::max(from, std::size_t(9));
+	}
+	m_statistics.received_bytes(payload, (to - from) - payload);
+
+	if (payload > 0)
+	{
+		m_request_progress = m_ses.m_timers.now();
+		m_snubbed = false;
+	}
+}
+
+// moves the part of the piece payload that has been received
+// from the receive buffer into a block buffer. The rest of the
+// payload is received directly into the block buffer, which
+// is then handed to the storage without being copied again.
+void libtorrent::peer_connection::start_piece_payload()
+{
+	assert(!m_piece_buffer);
+	assert(m_piece_received == 0);
+	assert(m_state == read_packet);
+	assert(m_recv_end - m_recv_start >= 9);
+
+	m_piece_buffer = m_ses.m_block_pool.allocate();
+	const char* payload = &m_recv_buffer[m_recv_start + 9];
+	m_piece_received = m_recv_end - m_recv_start - 9;
+	std::copy(payload, payload + m_piece_received, m_piece_buffer.get());
+	m_recv_end = m_recv_start + 9;
+}
+
+// parses as many complete packets as there are in the
+// receive buffer. The trailing partial packet (if any)
+// is left in the buffer until the rest of it arrives.
+// throws exception when the client should be disconnected
+void libtorrent::peer_connection::parse_received_data()
+{
+	for (;;)
+	{
+		assert(m_packet_size > 0);
+		const std::size_t available = m_recv_end - m_recv_start + m_piece_received;
+		if (available < m_packet_size)
 		{
-			// would_block means that no data was ready to be received
-			// returns to exit the loop
-			if (m_socket->last_error() == socket::would_block)
-				return;
+			// if this is the header of a piece message, receive
+			// the rest of its payload straight into a block buffer
+			if (!m_piece_buffer
+				&& m_state == read_packet
+				&& available >= 9
+				&& m_recv_buffer[m_recv_start] == msg_piece
+				&& m_packet_size - 9 <= std::size_t(m_ses.m_block_pool.block_size())
+				&& !m_ses.m_block_pool.exceeded())
+			{
+				start_piece_payload();
+			}
 
-			// the connection was closed
-			throw network_error(m_socket->last_error());
+			// count the bytes of the partial packet
+			// we haven't counted yet
+			if (available > m_recv_counted)
+			{
+				account_received(m_recv_counted, available);
+				m_recv_counted = available;
+			}
+			return;
 		}
 
-		if (received > 0)
+		account_received(m_recv_counted, m_packet_size);
+		m_recv_counted = 0;
+
+		const char* packet = &m_recv_buffer[m_recv_start];
+		const std::size_t packet_size = m_packet_size;
+
+		switch(m_state)
 		{
-			m_last_receive = boost::posix_time::second_clock::local_time();
+		case read_protocol_length:
 
-			m_recv_pos += received;
+			m_packet_size = static_cast<unsigned char>(packet[0]);
+#ifndef NDEBUG
+			(*m_logger) << m_socket->sender().as_string() << " protocol length: " << (int)m_packet_size << "\n";
+#endif
+			m_state = read_protocol_string;
 
-			switch(m_state)
+			if (m_packet_size == 0)
 			{
-			case read_protocol_length:
+#ifndef NDEBUG
+					(*m_logger) << "incorrect protocol length\n";
+#endif
+					throw network_error(0);
+			}
+			break;
 
-				m_statistics.received_bytes(0, received);
-				if (m_recv_pos < m_packet_size) break;
-				assert(m_recv_pos == m_packet_size);
 
-				m_packet_size = reinterpret_cast<unsigned char&>(m_recv_buffer[0]);
+		case read_protocol_string:
+			{
 #ifndef NDEBUG
-				(*m_logger) << m_socket->sender().as_string() << " protocol length: " << m_packet_size << "\n";
+				(*m_logger) << m_socket->sender().as_string() << " protocol: '" << std::string(packet, packet + packet_size) << "'\n";
 #endif
-				m_state = read_protocol_string;
-				m_recv_buffer.resize(m_packet_size);
-				m_recv_pos = 0;
-
-				if (m_packet_size == 0)
+				const char protocol_string[] = "BitTorrent protocol";
+				const int protocol_len = sizeof(protocol_string) - 1;
+				if (packet_size != protocol_len
+					|| !std::equal(packet, packet + packet_size, protocol_string))
 				{
 #ifndef NDEBUG
-						(*m_logger) << "incorrect protocol length\n";
+					(*m_logger) << "incorrect protocol name\n";
 #endif
-						throw network_error(0);
+					throw network_error(0);
 				}
-				break;
+
+				m_state = read_info_hash;
+				m_packet_size = 28;
+			}
+			break;
 
 
-			case read_protocol_string:
+		case read_info_hash:
+		{
+			// ok, now we have got enough of the handshake. Is this connection
+			// attached to a torrent?
+
+			// the first 8 bytes describe the extensions
+			// available on the other side
+			m_supports_fast = (packet[7] & fast_extension_bit) != 0;
+			m_supports_extensions = (packet[5] & extension_protocol_bit) != 0;
+			m_supports_dht = (packet[7] & dht_bit) != 0;
+
+			if (m_torrent == 0)
+			{
+				// now, we have to see if there's a torrent with the
+				// info_hash we got from the peer
+				sha1_hash info_hash;
+				std::copy(packet + 8, packet + 28, (char*)info_hash.begin());
+				
+				m_torrent = m_ses.find_torrent(info_hash);
+				if (m_torrent == 0)
 				{
-					m_statistics.received_bytes(0, received);
-					if (m_recv_pos < m_packet_size) break;
-					assert(m_recv_pos == m_packet_size);
+					// we couldn't find the torrent!
 #ifndef NDEBUG
-					(*m_logger) << m_socket->sender().as_string() << " protocol: '" << std::string(m_recv_buffer.begin(), m_recv_buffer.end()) << "'\n";
+					(*m_logger) << m_socket->sender().as_string() << " couldn't find a torrent with the given info_hash\n";
 #endif
-					const char protocol_string[] = "BitTorrent protocol";
-					const int protocol_len = sizeof(protocol_string) - 1;
-					if (!std::equal(m_recv_buffer.begin(), m_recv_buffer.end(), protocol_string))
-					{
+					throw network_error(0);
+				}
+
+				// assume the other end has no pieces
+				m_have_piece.resize(m_torrent->torrent_file().num_pieces());
+				std::fill(m_have_piece.begin(), m_have_piece.end(), false);
+
+				// yes, we found the torrent
+				// reply with our handshake
+				send_handshake();
+				send_bitfield();
+			}
+			else
+			{
+				// verify info hash
+				if (!std::equal(packet + 8, packet + 28, (const char*)m_torrent->torrent_file().info_hash().begin()))
+				{
 #ifndef NDEBUG
-						(*m_logger) << "incorrect protocol name\n";
+					(*m_logger) << m_socket->sender().as_string() << " received invalid info_hash\n";
 #endif
-						throw network_error(0);
-					}
-
-					m_state = read_info_hash;
-					m_packet_size = 28;
-					m_recv_pos = 0;
-					m_recv_buffer.resize(28);
+					throw network_error(0);
 				}
-				break;
+				send_bitfield();
+			}
 
+			if (m_supports_fast) send_allowed_fast_set();
+			if (m_supports_dht && m_ses.m_dht.is_running()) send_dht_port();
 
-			case read_info_hash:
+			if (m_supports_extensions)
 			{
-				m_statistics.received_bytes(0, received);
-				if (m_recv_pos < m_packet_size) break;
-				assert(m_recv_pos == m_packet_size);
-				// ok, now we have got enough of the handshake. Is this connection
-				// attached to a torrent?
-
-				if (m_torrent == 0)
+				for (std::vector<extension_factory>::iterator i
+					= m_ses.m_extensions.begin(); i != m_ses.m_extensions.end(); ++i)
 				{
-					// TODO: if the protocol is to be extended
-					// these 8 bytes would be used to describe the
-					// extensions available on the other side
-
-					// now, we have to see if there's a torrent with the
-					// info_hash we got from the peer
-					sha1_hash info_hash;
-					std::copy(m_recv_buffer.begin()+8, m_recv_buffer.begin() + 28, (char*)info_hash.begin());
-					
-					m_torrent = m_ses.find_torrent(info_hash);
-					if (m_torrent == 0)
-					{
-						// we couldn't find the torrent!
+					m_extensions.push_back((*i)(*m_torrent, *this));
+				}
+				send_extended_handshake();
+			}
+
+			m_state = read_peer_id;
+			m_packet_size = 20;
 #ifndef NDEBUG
-						(*m_logger) << m_socket->sender().as_string() << " couldn't find a torrent with the given info_hash\n";
+			(*m_logger) << m_socket->sender().as_string() << " info_hash received\n";
 #endif
-						throw network_error(0);
-					}
+			break;
+		}
 
-					// assume the other end has no pieces
-					m_have_piece.resize(m_torrent->torrent_file().num_pieces());
-					std::fill(m_have_piece.begin(), m_have_piece.end(), false);
 
-					// yes, we found the torrent
-					// reply with our handshake
-					std::copy(m_recv_buffer.begin()+28, m_recv_buffer.begin() + 48, (char*)m_peer_id.begin());
-					send_handshake();
-					send_bitfield();
-				}
-				else
+		case read_peer_id:
+		{
+			if (m_active && m_peer_id.is_all_zeros())
+			{
+				// the tracker didn't tell us the peer's id,
+				// accept the one it sends us
+				peer_id id;
+				std::copy(packet, packet + 20, (char*)id.begin());
+				if (m_torrent->has_peer(id))
 				{
-					// verify info hash
-					if (!std::equal(m_recv_buffer.begin()+8, m_recv_buffer.begin() + 28, (const char*)m_torrent->torrent_file().info_hash().begin()))
-					{
 #ifndef NDEBUG
-						(*m_logger) << m_socket->sender().as_string() << " received invalid info_hash\n";
+					(*m_logger) << m_socket->sender().as_string() << " duplicate connection, closing\n";
 #endif
-						throw network_error(0);
-					}
+					throw network_error(0);
 				}
-
-				m_state = read_peer_id;
-				m_packet_size = 20;
-				m_recv_pos = 0;
-				m_recv_buffer.resize(20);
+				m_peer_id = id;
+			}
+			else if (m_active)
+			{
+				// verify peer_id
+				// TODO: It seems like the original client ignores to check the peer id
+				// can that be correct?
+				if (!std::equal(packet, packet + 20, (const char*)m_peer_id.begin()))
+				{
 #ifndef NDEBUG
-				(*m_logger) << m_socket->sender().as_string() << " info_hash received\n";
+					(*m_logger) << m_socket->sender().as_string() << " invalid peer_id (it doesn't equal the one from the tracker)\n";
 #endif
-				break;
+					throw network_error(0);
+				}
 			}
-
-
-			case read_peer_id:
+			else
 			{
-				m_statistics.received_bytes(0, received);
-				if (m_recv_pos < m_packet_size) break;
-				assert(m_recv_pos == m_packet_size);
+				// check to make sure we don't have another connection with the same
+				// info_hash and peer_id. If we do. close this connection.
+				std::copy(packet, packet + 20, (char*)m_peer_id.begin());
 
-				if (m_active)
+				if (m_torrent->is_full())
 				{
-					// verify peer_id
-					// TODO: It seems like the original client ignores to check the peer id
-					// can that be correct?
-					if (!std::equal(m_recv_buffer.begin(), m_recv_buffer.begin() + 20, (const char*)m_peer_id.begin()))
-					{
 #ifndef NDEBUG
-						(*m_logger) << m_socket->sender().as_string() << " invalid peer_id (it doesn't equal the one from the tracker)\n";
+					(*m_logger) << m_socket->sender().as_string() << " torrent has too many connections, closing\n";
 #endif
-						throw network_error(0);
-					}
+					throw network_error(0);
 				}
-				else
+
+				if (m_torrent->has_peer(m_peer_id))
 				{
-					// check to make sure we don't have another connection with the same
-					// info_hash and peer_id. If we do. close this connection.
-					std::copy(m_recv_buffer.begin(), m_recv_buffer.begin() + 20, (char*)m_peer_id.begin());
+#ifndef NDEBUG
+					(*m_logger) << m_socket->sender().as_string() << " duplicate connection, closing\n";
+#endif
+					throw network_error(0);
+				}
+
+				m_attached_to_torrent = true;
+				m_torrent->attach_peer(this);
+				assert(m_torrent->get_policy().has_connection(this));
+
+				// the torrent's limits apply from now on
+				update_send_quota();
+				update_recv_quota();
+			}
 
-					if (m_torrent->has_peer(m_peer_id))
-					{
+			m_state = read_packet_size;
+			m_packet_size = 4;
 #ifndef NDEBUG
-						(*m_logger) << m_socket->sender().as_string() << " duplicate connection, closing\n";
+			(*m_logger) << m_socket->sender().as_string() << " received peer_id\n";
 #endif
-						throw network_error(0);
-					}
+			break;
+		}
 
-					m_attached_to_torrent = true;
-					m_torrent->attach_peer(this);
-					assert(m_torrent->get_policy().has_connection(this));
-				}
 
-				m_state = read_packet_size;
-				m_packet_size = 4;
-				m_recv_pos = 0;
-				m_recv_buffer.resize(4);
+		case read_packet_size:
+			// convert from big endian to native byte order
+			m_packet_size = read_int(packet);
+			// don't accept packets larger than 1 MB
+			if (m_packet_size > 1024*1024 || m_packet_size < 0)
+			{
 #ifndef NDEBUG
-				(*m_logger) << m_socket->sender().as_string() << " received peer_id\n";
+				(*m_logger) << m_socket->sender().as_string() << " packet too large (packet_size > 1 Megabyte), abort\n";
 #endif
-				break;
+				// packet too large
+				throw network_error(0);
 			}
+			
+			if (m_packet_size == 0)
+			{
+				// keepalive message
+				m_state = read_packet_size;
+				m_packet_size = 4;
+			}
+			else
+			{
+				m_state = read_packet;
+			}
+			assert(m_packet_size > 0);
+			break;
 
+		case read_packet:
 
-			case read_packet_size:
-				m_statistics.received_bytes(0, received);
-				if (m_recv_pos < m_packet_size) break;
-				assert(m_recv_pos == m_packet_size);
+			dispatch_message(packet);
+			m_state = read_packet_size;
+			m_packet_size = 4;
+			break;
+		}
 
-				// convert from big endian to native byte order
-				m_packet_size = read_int(&m_recv_buffer[0]);
-				// don't accept packets larger than 1 MB
-				if (m_packet_size > 1024*1024 || m_packet_size < 0)
-				{
-#ifndef NDEBUG
-					(*m_logger) << m_socket->sender().as_string() << " packet too large (packet_size > 1 Megabyte), abort\n";
-#endif
-					// packet too large
-					throw network_error(0);
-				}
-				
-				if (m_packet_size == 0)
-				{
-					// keepalive message
-					m_state = read_packet_size;
-					m_packet_size = 4;
-				}
-				else
-				{
-					m_state = read_packet;
-					m_recv_buffer.resize(m_packet_size);
-				}
-				m_recv_pos = 0;
-				assert(m_packet_size > 0);
-				break;
+		// the packet has been handled, move on to the next one.
+		// If the payload was received into a block buffer, only
+		// the header is in the receive buffer
+		m_recv_start += packet_size - m_piece_received;
+		m_piece_buffer.reset();
+		m_piece_received = 0;
+	}
+}
 
-			case read_packet:
+// throws exception when the client should be disconnected
+void libtorrent::peer_connection::receive_data()
+{
+	assert(!m_socket->is_blocking());
+	assert(m_packet_size > 0);
+	for(;;)
+	{
+		assert(m_packet_size > 0);
 
-				if (dispatch_message(received))
-				{
-					m_state = read_packet_size;
-					m_packet_size = 4;
-					m_recv_buffer.resize(4);
-					m_recv_pos = 0;
-					assert(m_packet_size > 0);
-				}
-				break;
-			}
+		// when we're out of download quota, we have
+		// to get more before reading anything
+		if (m_recv_quota_left == 0)
+		{
+			// we may still be in the list of readable
+			// sockets from before we stopped reading
+			if (m_waiting_for_download_quota) return;
+			if (!request_download_bandwidth()) return;
 		}
+
+		char* dst;
+		int max_receive;
+		if (m_piece_buffer)
+		{
+			// we're receiving the payload of a piece message,
+			// read exactly the rest of it into the block buffer
+			dst = m_piece_buffer.get() + m_piece_received;
+			max_receive = m_packet_size - 9 - m_piece_received;
+		}
+		else
+		{
+			// read as much as the kernel has for us, not only
+			// the rest of the current packet. All complete
+			// packets are then parsed in one go.
+			prepare_receive_buffer();
+			dst = &m_recv_buffer[m_recv_end];
+			max_receive = m_recv_buffer.size() - m_recv_end;
+		}
+		if (m_recv_quota_left != -1 && max_receive > m_recv_quota_left)
+			max_receive = m_recv_quota_left;
+		assert(max_receive > 0);
+		int received = m_socket->receive(dst, max_receive);
+
+		// connection closed
+		if (received == 0)
+		{
+			throw network_error(0);
+		}
+
+		// an error
+		if (received < 0)
+		{
+			// would_block means that no data was ready to be received
+			// returns to exit the loop
+			if (m_socket->last_error() == socket::would_block)
+				return;
+
+			// the connection was closed
+			throw network_error(m_socket->last_error());
+		}
+
+		m_last_receive = m_ses.m_timers.now();
+		if (m_recv_quota_left != -1) m_recv_quota_left -= received;
+		if (m_piece_buffer) m_piece_received += received;
+		else m_recv_end += received;
+
+		parse_received_data();
+
+		// if we didn't fill the buffer, we have
+		// drained the socket. Don't waste a system
+		// call just to hear that it would block
+		if (received < max_receive) break;
 	}
 	assert(m_packet_size > 0);
 }
 
 
-bool libtorrent::peer_connection::has_data() const throw()
+bool libtorrent::peer_connection::wants_to_send() const
 {
 	// if we have requests or pending data to be sent or announcements to be made
 	// we want to send data
-	return ((!m_requests.empty() && !m_choked)
+	return !m_requests.empty()
 		|| !m_send_buffer.empty()
-		|| !m_announce_queue.empty())
-		&& m_send_quota_left != 0;
+		|| !m_announce_queue.empty();
+}
+
+bool libtorrent::peer_connection::has_data() const throw()
+{
+	return wants_to_send() && m_send_quota_left != 0;
+}
+
+bool libtorrent::peer_connection::is_limited(int channel) const
+{
+	torrent* t = associated_torrent();
+	const libtorrent::peer_class& c = m_ses.m_classes[m_peer_class];
+	return m_bandwidth_limit[channel].is_limited()
+		|| (t != 0 && t->bandwidth_limit(channel).is_limited())
+		|| c.bandwidth_limit[channel].is_limited()
+		|| (!c.ignore_global_limit
+			&& m_ses.m_bandwidth_limit[channel].is_limited());
+}
+
+void libtorrent::peer_connection::add_channels(bw_request& r, int channel)
+{
+	r.add_channel(&m_bandwidth_limit[channel]);
+	torrent* t = associated_torrent();
+	if (t != 0) r.add_channel(&t->bandwidth_limit(channel));
+	libtorrent::peer_class& c = m_ses.m_classes[m_peer_class];
+	r.add_channel(&c.bandwidth_limit[channel]);
+	if (!c.ignore_global_limit)
+		r.add_channel(&m_ses.m_bandwidth_limit[channel]);
+}
+
+void libtorrent::peer_connection::set_upload_limit(int limit)
+{
+	assert(limit > 0 || limit == -1);
+	m_upload_limit = limit;
+	update_upload_throttle();
+}
+
+void libtorrent::peer_connection::set_download_limit(int limit)
+{
+	assert(limit > 0 || limit == -1);
+	m_bandwidth_limit[download_channel].throttle(limit);
+	update_recv_quota();
+}
+
+void libtorrent::peer_connection::update_upload_throttle()
+{
+	int limit = m_send_quota_limit;
+	if (limit == -1 || (m_upload_limit != -1 && m_upload_limit < limit))
+		limit = m_upload_limit;
+	m_bandwidth_limit[upload_channel].throttle(limit);
+	update_send_quota();
+}
+
+void libtorrent::peer_connection::update_send_quota()
+{
+	if (!is_limited(upload_channel))
+	{
+		// the limits have been lifted, we don't
+		// have to wait for any quota anymore
+		if (m_waiting_for_upload_quota)
+		{
+			m_ses.m_upload_manager.cancel(this);
+			m_waiting_for_upload_quota = false;
+		}
+		m_send_quota_left = -1;
+	}
+	else if (m_send_quota_left == -1)
+	{
+		m_send_quota_left = 0;
+	}
+	send_buffer_updated();
+}
+
+void libtorrent::peer_connection::request_upload_bandwidth()
+{
+	assert(m_send_quota_left == 0);
+	assert(!m_waiting_for_upload_quota);
+
+	// ask for enough to send what we have
+	// in the queue right now
+	int amount = m_send_buffer.size()
+		+ m_announce_queue.size() * 9;
+	if (!m_requests.empty() && !m_choked)
+		amount += m_requests.front().length + 13;
+	assert(amount > 0);
+
+	bw_request r(this, amount);
+	add_channels(r, upload_channel);
+	int granted = m_ses.m_upload_manager.request_bandwidth(r);
+	if (granted == 0)
+	{
+		m_waiting_for_upload_quota = true;
+		return;
+	}
+	m_send_quota_left = granted;
+	m_granted_quota += granted;
+}
+
+void libtorrent::peer_connection::update_recv_quota()
+{
+	if (!is_limited(download_channel))
+	{
+		// the limits have been lifted. If we had
+		// stopped reading, start again
+		if (m_waiting_for_download_quota)
+		{
+			m_ses.m_download_manager.cancel(this);
+			m_waiting_for_download_quota = false;
+			m_selector.monitor_readability(m_socket);
+		}
+		m_recv_quota_left = -1;
+	}
+	else if (m_recv_quota_left == -1)
+	{
+		m_recv_quota_left = 0;
+	}
+}
+
+bool libtorrent::peer_connection::request_download_bandwidth()
+{
+	assert(m_recv_quota_left == 0);
+	assert(!m_waiting_for_download_quota);
+
+	// ask for enough to fill the receive buffer
+	bw_request r(this, receive_buffer_size);
+	add_channels(r, download_channel);
+	int granted = m_ses.m_download_manager.request_bandwidth(r);
+	if (granted == 0)
+	{
+		// stop reading until we're given more quota
+		m_waiting_for_download_quota = true;
+		m_selector.remove_readable(m_socket);
+		return false;
+	}
+	m_recv_quota_left = granted;
+	return true;
+}
+
+void libtorrent::peer_connection::assign_bandwidth(int channel, int amount)
+{
+	assert(amount > 0);
+	if (channel == upload_channel)
+	{
+		assert(m_waiting_for_upload_quota);
+		assert(m_send_quota_left == 0);
+		m_waiting_for_upload_quota = false;
+
+		m_send_quota_left = amount;
+		m_granted_quota += amount;
+		send_buffer_updated();
+		return;
+	}
+
+	assert(channel == download_channel);
+	assert(m_waiting_for_download_quota);
+	assert(m_recv_quota_left == 0);
+	m_waiting_for_download_quota = false;
+
+	// start reading from the socket again
+	m_recv_quota_left = amount;
+	m_selector.monitor_readability(m_socket);
 }
 
 // --------------------------
@@ -1110,14 +2072,23 @@ void libtorrent::peer_connection::send_data()
 	assert(m_socket->is_writable());
 	assert(has_data());
 
+	// the first time the socket becomes writable,
+	// the connection has been established
+	if (m_connecting)
+	{
+		m_connecting = false;
+		m_ses.m_connection_queue.done_connecting();
+	}
+
 	// only add new piece-chunks if the send buffer is small enough
 	// otherwise there will be no end to how large it will be!
 	// TODO: make this a bit better. Don't always read the entire
 	// requested block. Have a limit of how much of the requested
 	// block is actually read at a time.
+	// while the peer is choked, the queue only holds
+	// requests for pieces in its allowed fast set
 	while (!m_requests.empty()
-		&& (m_send_buffer.size() < m_torrent->block_size())
-		&& !m_choked)
+		&& (m_send_buffer.size() < m_torrent->block_size()))
 	{
 		peer_request& r = m_requests.front();
 		
@@ -1133,16 +2104,16 @@ void libtorrent::peer_connection::send_data()
 #ifndef NDEBUG
 			assert(m_torrent->verify_piece(r.piece) && "internal error");
 #endif
-			const int send_buffer_offset = m_send_buffer.size();
+			const size_type send_buffer_offset = m_bytes_sent + m_send_buffer.size();
 			const int packet_size = 4 + 5 + 4 + r.length;
-			m_send_buffer.resize(send_buffer_offset + packet_size);
-			write_int(packet_size-4, &m_send_buffer[send_buffer_offset]);
-			m_send_buffer[send_buffer_offset+4] = msg_piece;
-			write_int(r.piece, &m_send_buffer[send_buffer_offset+5]);
-			write_int(r.start, &m_send_buffer[send_buffer_offset+9]);
+			char* buf = m_send_buffer.allocate_appendix(packet_size);
+			write_int(packet_size-4, buf);
+			buf[4] = msg_piece;
+			write_int(r.piece, buf + 5);
+			write_int(r.start, buf + 9);
 
 			m_torrent->filesystem().read(
-				&m_send_buffer[send_buffer_offset+13]
+				buf + 13
 				, r.piece
 				, r.start
 				, r.length);
@@ -1189,10 +2160,13 @@ void libtorrent::peer_connection::send_data()
 		assert(m_send_quota_left != 0);
 		if (m_send_quota_left > 0)
 			amount_to_send = std::min(m_send_quota_left, amount_to_send);
-		// we have data that's scheduled for sending
-		int sent = m_socket->send(
-			&m_send_buffer[0]
-			, amount_to_send);
+
+		// we have data that's scheduled for sending.
+		// send as much of it as possible with a single
+		// gather write
+		std::vector<socket::buffer> vec;
+		m_send_buffer.build_iovec(vec, amount_to_send);
+		int sent = m_socket->send(vec);
 
 	#ifndef NDEBUG
 		(*m_logger) << m_socket->sender().as_string() << " ==> SENT [ length: " << sent << " ]\n";
@@ -1206,50 +2180,35 @@ void libtorrent::peer_connection::send_data()
 				m_send_quota_left -= sent;
 			}
 
+			// count the payload bytes among the ones
+			// we just sent. Only the ranges at the front
+			// of the queue can be affected.
+			const size_type sent_end = m_bytes_sent + sent;
 			int amount_payload = 0;
-			if (!m_payloads.empty())
+			while (!m_payloads.empty() && m_payloads.front().start < sent_end)
 			{
-				for (std::deque<range>::iterator i = m_payloads.begin();
-					i != m_payloads.end();
-					++i)
+				range& r = m_payloads.front();
+				assert(r.start >= m_bytes_sent);
+				if (r.start + r.length <= sent_end)
+				{
+					amount_payload += r.length;
+					m_payloads.pop_front();
+				}
+				else
 				{
-					i->start -= sent;
-					if (i->start < 0)
-					{
-						if (i->start + i->length <= 0)
-						{
-							amount_payload += i->length;
-						}
-						else
-						{
-							amount_payload += -i->start;
-							i->length -= -i->start;
-							i->start = 0;
-						}
-					}
+					int consumed = int(sent_end - r.start);
+					amount_payload += consumed;
+					r.start += consumed;
+					r.length -= consumed;
+					break;
 				}
 			}
-			// remove all payload ranges that has been sent
-			m_payloads.erase(
-				std::remove_if(m_payloads.begin(), m_payloads.end(), range_below_zero)
-				, m_payloads.end());
 
 			assert(amount_payload <= sent);
 			m_statistics.sent_bytes(amount_payload, sent - amount_payload);
 
-			// empty the entire buffer at once or if
-			// only a part of the buffer could be sent
-			// remove the part that was sent from the buffer
-			if (sent == m_send_buffer.size())
-			{
-				m_send_buffer.clear();
-			}
-			else
-			{
-				m_send_buffer.erase(
-					m_send_buffer.begin()
-					, m_send_buffer.begin() + sent);
-			}
+			m_send_buffer.pop_front(sent);
+			m_bytes_sent = sent_end;
 		}
 		else
 		{
@@ -1257,7 +2216,7 @@ void libtorrent::peer_connection::send_data()
 			throw network_error(m_socket->last_error());
 		}
 
-		m_last_sent = boost::posix_time::second_clock::local_time();
+		m_last_sent = m_ses.m_timers.now();
 	}
 
 	assert(m_added_to_selector);
@@ -1274,15 +2233,48 @@ void libtorrent::peer_connection::send_data()
 }
 
 
+void libtorrent::peer_connection::schedule_timer()
+{
+	const timer_wheel::time_type now = m_ses.m_timers.now();
+	// the connection times out one millisecond after
+	// timeout() seconds without receiving anything
+	timer_wheel::time_type next = std::min(
+		m_last_receive + timeout() * 1000 + 1
+		, m_last_sent + m_timeout * 1000 / 2);
+	m_ses.m_timers.schedule(m_timer, this, int(std::max(next - now, timer_wheel::time_type(0))));
+}
+
+void libtorrent::peer_connection::on_timer(timer_entry& t)
+{
+	assert(&t == &m_timer);
+	if (has_timed_out())
+	{
+		// the connection can't be removed from within
+		// the timer callback, let the session do it
+		m_ses.m_timed_out.push_back(m_socket);
+		return;
+	}
+	keep_alive();
+	schedule_timer();
+}
+
+bool libtorrent::peer_connection::has_timed_out() const
+{
+	return m_ses.m_timers.now() - m_last_receive > timeout() * 1000;
+}
+
+int libtorrent::peer_connection::timeout() const
+{
+	return m_connecting ? m_ses.m_connection_queue.connect_timeout() : m_timeout;
+}
+
 void libtorrent::peer_connection::keep_alive()
 {
-	boost::posix_time::time_duration d;
-	d = boost::posix_time::second_clock::local_time() - m_last_sent;
-	if (d.seconds() > m_timeout / 2)
+	if (m_ses.m_timers.now() - m_last_sent >= m_timeout * 1000 / 2)
 	{
 		char noop[] = {0,0,0,0};
-		m_send_buffer.insert(m_send_buffer.end(), noop, noop+4);
-		m_last_sent = boost::posix_time::second_clock::local_time();
+		m_send_buffer.append(noop, 4);
+		m_last_sent = m_ses.m_timers.now();
 #ifndef NDEBUG
 		(*m_logger) << m_socket->sender().as_string() << " ==> NOP\n";
 #endif
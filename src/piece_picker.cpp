@@ -83,12 +83,16 @@ namespace libtorrent
 			assert(index < m_piece_map.size());
 			assert(m_piece_map[index].index  == 0xffffff);
 
-			int peer_count = m_piece_map[index].peer_count;
-			assert(peer_count == 0);
-			assert(m_piece_info.size() == 2);
+			assert(m_piece_map[index].peer_count == 0);
 
-			m_piece_map[index].index = m_piece_info[peer_count].size();
-			m_piece_info[peer_count].push_back(index);
+			// the piece may have been given a priority
+			// while the files were checked
+			int bucket = m_piece_map[index].bucket();
+			if (m_piece_info.size() <= bucket)
+				m_piece_info.resize(bucket + 1);
+
+			m_piece_map[index].index = m_piece_info[bucket].size();
+			m_piece_info[bucket].push_back(index);
 		}
 #ifndef NDEBUG
 //		integrity_check();
@@ -100,7 +104,7 @@ namespace libtorrent
 
 	void piece_picker::integrity_check(const torrent* t) const
 	{
-		assert(sizeof(piece_pos) == 4);
+		assert(sizeof(piece_pos) == 8);
 
 		if (t != 0)
 			assert(m_piece_map.size() == t->torrent_file().num_pieces());
@@ -185,8 +189,8 @@ namespace libtorrent
 					assert(!t->have_piece(index));
 
 				const std::vector<std::vector<int> >& c_vec = (i->downloading)?m_downloading_piece_info:m_piece_info;
-				assert(i->peer_count < c_vec.size());
-				const std::vector<int>& vec = c_vec[i->peer_count];
+				assert(i->bucket() < c_vec.size());
+				const std::vector<int>& vec = c_vec[i->bucket()];
 				assert(i->index < vec.size());
 				assert(vec[i->index] == index);
 			}
@@ -208,62 +212,63 @@ namespace libtorrent
 	}
 	#endif
 
-	void piece_picker::move(bool downloading, int peer_count, int elem_index)
+	void piece_picker::move(bool downloading, int bucket, int elem_index)
 	{
 		std::vector<std::vector<int> >& src_vec = (downloading)?m_downloading_piece_info:m_piece_info;
 
-		assert(src_vec.size() > peer_count);
-		assert(src_vec[peer_count].size() > elem_index);
+		assert(src_vec.size() > bucket);
+		assert(src_vec[bucket].size() > elem_index);
 
-		int index = src_vec[peer_count][elem_index];
+		int index = src_vec[bucket][elem_index];
 		// update the piece_map
 		piece_pos& p = m_piece_map[index];
+		const int dst_bucket = p.bucket();
 
-		assert(p.downloading != downloading || p.peer_count != peer_count);
+		assert(p.downloading != downloading || dst_bucket != bucket);
 
 		std::vector<std::vector<int> >& dst_vec = (p.downloading)?m_downloading_piece_info:m_piece_info;
 
-		if (dst_vec.size() <= p.peer_count)
+		if (dst_vec.size() <= dst_bucket)
 		{
-			dst_vec.resize(p.peer_count+1);
-			assert(dst_vec.size() > p.peer_count);
+			dst_vec.resize(dst_bucket+1);
+			assert(dst_vec.size() > dst_bucket);
 		}
 
-		p.index = dst_vec[p.peer_count].size();
-		dst_vec[p.peer_count].push_back(index);
-		assert(p.index < dst_vec[p.peer_count].size());
-		assert(dst_vec[p.peer_count][p.index] == index);
+		p.index = dst_vec[dst_bucket].size();
+		dst_vec[dst_bucket].push_back(index);
+		assert(p.index < dst_vec[dst_bucket].size());
+		assert(dst_vec[dst_bucket][p.index] == index);
 
 		// this will remove elem from the source vector without
 		// preserving order
-		int replace_index = src_vec[peer_count][elem_index] = src_vec[peer_count].back();
+		int replace_index = src_vec[bucket][elem_index] = src_vec[bucket].back();
 		if (index != replace_index)
 		{
 			// update the entry we moved from the back
 			m_piece_map[replace_index].index = elem_index;
 
-			assert(src_vec[peer_count].size() > elem_index);
-			assert(m_piece_map[replace_index].peer_count == peer_count);
+			assert(src_vec[bucket].size() > elem_index);
+			assert(m_piece_map[replace_index].bucket() == bucket);
 			assert(m_piece_map[replace_index].index == elem_index);
-			assert(src_vec[peer_count][elem_index] == replace_index);
+			assert(src_vec[bucket][elem_index] == replace_index);
 		}
 		else
 		{
-			assert(src_vec[peer_count].size() == elem_index+1);
+			assert(src_vec[bucket].size() == elem_index+1);
 		}
 
-		src_vec[peer_count].pop_back();
+		src_vec[bucket].pop_back();
 
 	}
 
-	void piece_picker::remove(bool downloading, int peer_count, int elem_index)
+	void piece_picker::remove(bool downloading, int bucket, int elem_index)
 	{
 		std::vector<std::vector<int> >& src_vec = (downloading)?m_downloading_piece_info:m_piece_info;
 
-		assert(src_vec.size() > peer_count);
-		assert(src_vec[peer_count].size() > elem_index);
+		assert(src_vec.size() > bucket);
+		assert(src_vec[bucket].size() > elem_index);
 
-		int index = src_vec[peer_count][elem_index];
+		int index = src_vec[bucket][elem_index];
 		m_piece_map[index].index = 0xffffff;
 
 		if (downloading)
@@ -279,11 +284,11 @@ namespace libtorrent
 
 		// this will remove elem from the vector without
 		// preserving order
-		index = src_vec[peer_count][elem_index] = src_vec[peer_count].back();
+		index = src_vec[bucket][elem_index] = src_vec[bucket].back();
 		// update the entry we moved from the back
-		if (src_vec[peer_count].size() > elem_index+1)
+		if (src_vec[bucket].size() > elem_index+1)
 			m_piece_map[index].index = elem_index;
-		src_vec[peer_count].pop_back();
+		src_vec[bucket].pop_back();
 
 	}
 
@@ -302,7 +307,7 @@ namespace libtorrent
 		m_downloads.erase(i);
 
 		m_piece_map[index].downloading = 0;
-		move(true, m_piece_map[index].peer_count, m_piece_map[index].index);
+		move(true, m_piece_map[index].bucket(), m_piece_map[index].index);
 
 #ifndef NDEBUG
 //		integrity_check();
@@ -326,19 +331,20 @@ namespace libtorrent
 		assert(i >= 0);
 		assert(i < m_piece_map.size());
 
-		int peer_count = m_piece_map[i].peer_count;
+		int bucket = m_piece_map[i].bucket();
 		int index = m_piece_map[i].index;
 
 		m_piece_map[i].peer_count++;
 
 		if (index == 0xffffff) return false;
 
-		move(m_piece_map[i].downloading, peer_count, index);
+		move(m_piece_map[i].downloading, bucket, index);
 
 #ifndef NDEBUG
 //		integrity_check();
 #endif
-		return true;
+		// pieces we have filtered out aren't interesting
+		return m_piece_map[i].piece_priority != 0;
 	}
 
 	void piece_picker::dec_refcount(int i)
@@ -346,26 +352,26 @@ namespace libtorrent
 		assert(i >= 0);
 		assert(i < m_piece_map.size());
 
-		int peer_count = m_piece_map[i].peer_count;
+		int bucket = m_piece_map[i].bucket();
 		int index = m_piece_map[i].index;
 		assert(m_piece_map[i].peer_count > 0);
 
 		m_piece_map[i].peer_count--;
 
 		if (index == 0xffffff) return;
-		move(m_piece_map[i].downloading, peer_count, index);
+		move(m_piece_map[i].downloading, bucket, index);
 	}
 
 	void piece_picker::we_have(int index)
 	{
 		assert(index < m_piece_map.size());
 		int info_index = m_piece_map[index].index;
-		int peer_count = m_piece_map[index].peer_count;
+		int bucket = m_piece_map[index].bucket();
 
 		assert(m_piece_map[index].downloading == 1);
 
 		assert(info_index != 0xffffff);
-		remove(m_piece_map[index].downloading, peer_count, info_index);
+		remove(m_piece_map[index].downloading, bucket, info_index);
 #ifndef NDEBUG
 //		integrity_check();
 #endif
@@ -381,36 +387,67 @@ namespace libtorrent
 //		integrity_check();
 #endif
 
-		// free refers to pieces that are free to download, noone else
-		// is downloading them.
-		// partial is pieces that are partially being downloaded, and
-		// parts of them may be free for download as well, the
-		// partially donloaded pieces will be prioritized
-		std::vector<std::vector<int> >::const_iterator free = m_piece_info.begin()+1;
-		std::vector<std::vector<int> >::const_iterator partial = m_downloading_piece_info.begin()+1;
-
-		while((free != m_piece_info.end()) || (partial != m_downloading_piece_info.end()))
+		// the pieces are picked one priority at a time, the highest
+		// first. The last range of buckets holds the pieces with
+		// priority 0, which are never picked
+		for (int first = 0; first < (priority_levels - 1) * bucket_stride;
+			first += bucket_stride)
 		{
-			if (partial != m_downloading_piece_info.end())
+			// the first bucket of every priority holds the
+			// pieces no peer has
+			const int last = first + bucket_stride;
+			const int free_end = std::min(last, int(m_piece_info.size()));
+			const int partial_end = std::min(last, int(m_downloading_piece_info.size()));
+
+			// free refers to pieces that are free to download, noone else
+			// is downloading them.
+			// partial is pieces that are partially being downloaded, and
+			// parts of them may be free for download as well, the
+			// partially donloaded pieces will be prioritized
+			int free = first + 1;
+			int partial = first + 1;
+
+			while (free < free_end || partial < partial_end)
 			{
-				for (int i = 0; i < 2; ++i)
+				for (int i = 0; i < 2 && partial < partial_end; ++i, ++partial)
 				{
-					num_blocks = add_interesting_blocks(*partial, pieces, interesting_pieces, num_blocks);
+					num_blocks = add_interesting_blocks(m_downloading_piece_info[partial]
+						, pieces, interesting_pieces, num_blocks);
 					if (num_blocks == 0) return;
-					++partial;
-					if (partial == m_downloading_piece_info.end()) break;
 				}
-			}
 
-			if (free != m_piece_info.end())
-			{
-				num_blocks = add_interesting_blocks(*free, pieces, interesting_pieces, num_blocks);
-				if (num_blocks == 0) return;
-				++free;
+				if (free < free_end)
+				{
+					num_blocks = add_interesting_blocks(m_piece_info[free]
+						, pieces, interesting_pieces, num_blocks);
+					if (num_blocks == 0) return;
+					++free;
+				}
 			}
 		}
 	}
 
+	void piece_picker::pick_in_order(const std::vector<bool>& pieces
+		, int first, int last
+		, std::vector<piece_block>& interesting_blocks
+		, int num_blocks) const
+	{
+		assert(pieces.size() == m_piece_map.size());
+		assert(first >= 0);
+
+		last = std::min(last, int(m_piece_map.size()));
+		std::vector<int> piece_list;
+		for (int i = first; i < last; ++i)
+		{
+			// the pieces we have, and the ones that
+			// are filtered, are skipped
+			if (m_piece_map[i].index == 0xffffff) continue;
+			if (m_piece_map[i].piece_priority == 0) continue;
+			piece_list.push_back(i);
+		}
+		add_interesting_blocks(piece_list, pieces, interesting_blocks, num_blocks);
+	}
+
 	int piece_picker::add_interesting_blocks(const std::vector<int>& piece_list,
 		const std::vector<bool>& pieces,
 		std::vector<piece_block>& interesting_blocks,
@@ -510,6 +547,80 @@ namespace libtorrent
 	}
 
 
+	void piece_picker::set_piece_priority(int index, int priority)
+	{
+		assert(index >= 0);
+		assert(index < m_piece_map.size());
+		assert(priority >= 0 && priority < priority_levels);
+
+		piece_pos& p = m_piece_map[index];
+		if (p.piece_priority == priority) return;
+
+		int bucket = p.bucket();
+		p.piece_priority = priority;
+
+		// the pieces we have (or the ones we don't know whether
+		// we have yet, before the files are checked) aren't in
+		// any bucket
+		if (p.index == 0xffffff) return;
+		if (p.bucket() == bucket) return;
+		move(p.downloading, bucket, p.index);
+#ifndef NDEBUG
+//		integrity_check();
+#endif
+	}
+
+	int piece_picker::piece_priority(int index) const
+	{
+		assert(index >= 0);
+		assert(index < m_piece_map.size());
+		return m_piece_map[index].piece_priority;
+	}
+
+	void piece_picker::filtered_pieces(std::vector<bool>& mask) const
+	{
+		mask.resize(m_piece_map.size());
+		for (int i = 0; i < int(m_piece_map.size()); ++i)
+			mask[i] = m_piece_map[i].piece_priority == 0;
+	}
+
+	int piece_picker::num_requests(piece_block block) const
+	{
+		assert(block.piece_index < m_piece_map.size());
+		assert(block.block_index < max_blocks_per_piece);
+
+		if (m_piece_map[block.piece_index].downloading == 0) return 0;
+		std::vector<downloading_piece>::const_iterator i
+			= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
+		assert(i != m_downloads.end());
+		if (i->finished_blocks[block.block_index]) return 0;
+		return i->info[block.block_index].num_requests;
+	}
+
+	bool piece_picker::is_end_game() const
+	{
+		// the pieces that no peer has are in the first bucket
+		// of every priority. They can't be requested, and
+		// neither can the pieces with priority 0, so they
+		// don't keep us out of end-game mode
+		const int end = std::min(int(m_piece_info.size())
+			, (priority_levels - 1) * bucket_stride);
+		for (int i = 0; i < end; ++i)
+		{
+			if (i % bucket_stride == 0) continue;
+			if (!m_piece_info[i].empty()) return false;
+		}
+
+		for (std::vector<downloading_piece>::const_iterator i = m_downloads.begin();
+			i != m_downloads.end(); ++i)
+		{
+			if (m_piece_map[i->index].piece_priority == 0) continue;
+			if ((int)i->requested_blocks.count() < blocks_in_piece(i->index))
+				return false;
+		}
+		return true;
+	}
+
 	void piece_picker::mark_as_downloading(piece_block block, const peer_id& peer)
 	{
 #ifndef NDEBUG
@@ -522,12 +633,13 @@ namespace libtorrent
 		if (p.downloading == 0)
 		{
 			p.downloading = 1;
-			move(false, p.peer_count, p.index);
+			move(false, p.bucket(), p.index);
 
 			downloading_piece dp;
 			dp.index = block.piece_index;
 			dp.requested_blocks[block.block_index] = 1;
 			dp.info[block.block_index].peer = peer;
+			dp.info[block.block_index].num_requests = 1;
 			m_downloads.push_back(dp);
 		}
 		else
@@ -535,8 +647,11 @@ namespace libtorrent
 			std::vector<downloading_piece>::iterator i
 				= std::find_if(m_downloads.begin(), m_downloads.end(), has_index(block.piece_index));
 			assert(i != m_downloads.end());
-			assert(i->requested_blocks[block.block_index] == 0);
+			assert(i->finished_blocks[block.block_index] == 0);
+			assert(i->requested_blocks[block.block_index] == 0
+				|| i->info[block.block_index].num_requests > 0);
 			i->info[block.block_index].peer = peer;
+			i->info[block.block_index].num_requests++;
 			i->requested_blocks[block.block_index] = 1;
 		}
 #ifndef NDEBUG
@@ -556,7 +671,7 @@ namespace libtorrent
 		if (p.downloading == 0)
 		{
 			p.downloading = 1;
-			move(false, p.peer_count, p.index);
+			move(false, p.bucket(), p.index);
 
 			downloading_piece dp;
 			dp.index = block.piece_index;
@@ -641,6 +756,11 @@ namespace libtorrent
 
 		assert(block.block_index < blocks_in_piece(block.piece_index));
 		assert(i->requested_blocks[block.block_index] == 1);
+		assert(i->info[block.block_index].num_requests > 0);
+
+		// the block is still downloading if it has
+		// been requested from other peers too
+		if (--i->info[block.block_index].num_requests > 0) return;
 
 		// clear this block as being downloaded
 		i->requested_blocks[block.block_index] = 0;
@@ -651,7 +771,7 @@ namespace libtorrent
 		{
 			m_downloads.erase(i);
 			m_piece_map[block.piece_index].downloading = 0;
-			move(true, m_piece_map[block.piece_index].peer_count, m_piece_map[block.piece_index].index);
+			move(true, m_piece_map[block.piece_index].bucket(), m_piece_map[block.piece_index].index);
 		}
 #ifndef NDEBUG
 //		integrity_check();
@@ -38,6 +38,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/torrent.hpp"
 #include "libtorrent/socket.hpp"
 #include "libtorrent/peer_connection.hpp"
+#include "libtorrent/block_pool.hpp"
 
 #if defined(_MSC_VER) && _MSC_VER < 1300
 #	define for if (false) {} else for
@@ -47,13 +48,13 @@ namespace
 {
 	enum
 	{
-		// we try to maintain 4 requested blocks in the download
-		// queue
-		request_queue = 16,
-
 		// the amount of free upload allowed before
 		// the peer is choked
-		free_upload_amount = 4 * 16 * 1024
+		free_upload_amount = 4 * 16 * 1024,
+
+		// in end-game mode, a block is requested from
+		// at most this many peers at a time
+		end_game_max_requests = 3
 	};
 
 
@@ -89,24 +90,90 @@ namespace
 		assert(false);
 	}
 
+	// returns a copy of the bitfield where only
+	// the given pieces may be set
+	std::vector<bool> only_pieces(const std::vector<bool>& bitfield
+		, const std::vector<int>& pieces)
+	{
+		std::vector<bool> ret(bitfield.size(), false);
+		for (std::vector<int>::const_iterator i = pieces.begin();
+			i != pieces.end(); ++i)
+		{
+			ret[*i] = bitfield[*i];
+		}
+		return ret;
+	}
+
+	// puts the blocks in front first, followed by the
+	// blocks that aren't among them, and swaps the result
+	// into blocks
+	void put_first(std::vector<piece_block>& front
+		, std::vector<piece_block>& blocks)
+	{
+		for (std::vector<piece_block>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+		{
+			if (std::find(front.begin(), front.end(), *i) == front.end())
+				front.push_back(*i);
+		}
+		blocks.swap(front);
+	}
+
 	void request_a_block(torrent& t, peer_connection& c)
 	{
-		int num_requests = request_queue - c.download_queue().size();
+		int num_requests = c.desired_queue_size() - c.download_queue().size();
 
 		// if our request queue is already full, we
 		// don't have to make any new requests yet
 		if (num_requests <= 0) return;
 
+		// if we're running out of buffers to receive blocks
+		// into, hold off requesting more until some of them
+		// have been written to disk. If this peer has run out
+		// of download quota, the blocks we already have
+		// requested will take a while to arrive
+		if (!c.can_request_blocks()) return;
+
 		piece_picker& p = t.picker();
 		std::vector<piece_block> interesting_pieces;
 		interesting_pieces.reserve(100);
 
-		// picks the interesting pieces from this peer
-		// the integer is the number of pieces that
-		// should be guaranteed to be available for download
-		// (if this number is too big, too many pieces are
-		// picked and cpu-time is wasted)
-		p.pick_pieces(c.get_bitfield(), interesting_pieces, num_requests);
+		if (c.has_peer_choked())
+		{
+			// while we're choked, only the pieces in the
+			// peer's allowed fast set may be requested
+			if (c.allowed_fast().empty()) return;
+			p.pick_pieces(only_pieces(c.get_bitfield(), c.allowed_fast())
+				, interesting_pieces, num_requests);
+		}
+		else
+		{
+			// picks the interesting pieces from this peer
+			// the integer is the number of pieces that
+			// should be guaranteed to be available for download
+			// (if this number is too big, too many pieces are
+			// picked and cpu-time is wasted)
+			p.pick_pieces(c.get_bitfield(), interesting_pieces, num_requests);
+
+			// the pieces the peer has suggested go first
+			if (!c.suggested_pieces().empty())
+			{
+				std::vector<piece_block> suggested;
+				p.pick_pieces(only_pieces(c.get_bitfield(), c.suggested_pieces())
+					, suggested, num_requests);
+				put_first(suggested, interesting_pieces);
+			}
+
+			// in sequential mode, the pieces in the read-ahead
+			// window go before everything else, in order
+			if (t.is_sequential_download())
+			{
+				std::vector<piece_block> in_order;
+				p.pick_in_order(c.get_bitfield(), t.sequential_cursor()
+					, t.sequential_cursor() + t.read_ahead(), in_order, num_requests);
+				put_first(in_order, interesting_pieces);
+			}
+		}
 
 		// this vector is filled with the interestin pieces
 		// that some other peer is currently downloading
@@ -135,6 +202,30 @@ namespace
 
 		if (busy_pieces.empty()) return;
 
+		// once every block that's left has been requested, the
+		// last ones would be stuck on the peers they happened to
+		// be requested from. In end-game mode they are requested
+		// from this peer too, the ones requested from the fewest
+		// peers first. When the first copy of a block arrives,
+		// the other requests are cancelled (see block_finished())
+		if (p.is_end_game())
+		{
+			const std::deque<piece_block>& queue = c.download_queue();
+			for (int n = 1; n < end_game_max_requests; ++n)
+			{
+				for (std::vector<piece_block>::iterator i = busy_pieces.begin();
+					i != busy_pieces.end(); ++i)
+				{
+					if (p.num_requests(*i) != n) continue;
+					if (std::find(queue.begin(), queue.end(), *i) != queue.end()) continue;
+					c.request_block(*i);
+					num_requests--;
+					if (num_requests <= 0) return;
+				}
+			}
+			return;
+		}
+
 		// first look for blocks that are just queued
 		// and not actually sent to us yet
 		// (then we can cancel those and request them
@@ -179,6 +270,20 @@ namespace
 	}
 
 
+	// gives every other peer a chance to request the blocks c
+	// has given back to the picker. The ones with full request
+	// queues will pick them up when they have room
+	void request_from_other_peers(torrent& t, peer_connection& c)
+	{
+		for (torrent::peer_iterator i = t.begin(); i != t.end(); ++i)
+		{
+			if (*i == &c || (*i)->is_snubbed()) continue;
+			if (!(*i)->has_peer_choked() || !(*i)->allowed_fast().empty())
+				request_a_block(t, **i);
+		}
+	}
+
+
 	int collect_free_download(
 		torrent::peer_iterator start
 		, torrent::peer_iterator end)
@@ -430,9 +535,28 @@ namespace libtorrent
 #endif
 	}
 
+	std::vector<policy::peer>::iterator policy::find_peer(const address& remote
+		, const peer_id& id)
+	{
+		if (!id.is_all_zeros()) return std::find(m_peers.begin(), m_peers.end(), id);
+
+		std::vector<peer>::iterator i = m_peers.begin();
+		for (; i != m_peers.end(); ++i)
+			if (i->ip == remote) break;
+		return i;
+	}
+
+	std::vector<policy::peer>::iterator policy::find_connection(const peer_connection& c)
+	{
+		std::vector<peer>::iterator i = m_peers.begin();
+		for (; i != m_peers.end(); ++i)
+			if (i->connection == &c) break;
+		return i;
+	}
+
 	void policy::ban_peer(const peer_connection& c)
 	{
-		std::vector<peer>::iterator i = std::find(m_peers.begin(), m_peers.end(), c.get_peer_id());
+		std::vector<peer>::iterator i = find_connection(c);
 		assert(i != m_peers.end());
 
 		i->banned = true;
@@ -465,10 +589,31 @@ namespace libtorrent
 	}
 
 	void policy::peer_from_tracker(const address& remote, const peer_id& id)
+	{
+		std::vector<peer>::iterator i = find_peer(remote, id);
+		if (i != m_peers.end() && (i->connection != 0 || i->banned)) return;
+
+		// there's no point in queueing up peers we won't
+		// be allowed to connect to
+		if (m_torrent->is_full()) return;
+
+		m_torrent->queue_connection(remote, id);
+	}
+
+	void policy::peer_from_lsd(const address& remote)
+	{
+		std::vector<peer>::iterator i = find_peer(remote, peer_id());
+		if (i != m_peers.end() && (i->connection != 0 || i->banned)) return;
+		if (m_torrent->is_full()) return;
+
+		m_torrent->queue_connection(remote, peer_id(), true);
+	}
+
+	bool policy::connect_peer(const address& remote, const peer_id& id)
 	{
 		try
 		{
-			std::vector<peer>::iterator i = std::find(m_peers.begin(), m_peers.end(), id);
+			std::vector<peer>::iterator i = find_peer(remote, id);
 			if (i == m_peers.end())
 			{
 				using namespace boost::posix_time;
@@ -477,6 +622,7 @@ namespace libtorrent
 				// we don't have ny info about this peer.
 				// add a new entry
 				peer p(id);
+				p.ip = remote;
 				m_peers.push_back(p);
 				i = m_peers.end()-1;
 			}
@@ -485,17 +631,18 @@ namespace libtorrent
 				// this means we're already connected
 				// to this peer. don't connect to
 				// it again.
-				return;
+				return false;
 			}
 
-			if (i->banned) return;
+			if (i->banned) return false;
 
 			i->connected = boost::posix_time::second_clock::local_time();
 			i->connection = &m_torrent->connect_to_peer(remote, id);
-
+			return true;
 		}
 		catch(network_error&) {}
 		catch(protocol_error&) {}
+		return false;
 	}
 
 	// this is called when we are choked by a peer
@@ -511,10 +658,52 @@ namespace libtorrent
 		// in some way
 	}
 
-	void policy::block_finished(peer_connection& c, piece_block b)
+	void policy::block_finished(peer_connection& c, piece_block b
+		, bool other_requests)
 	{
-		// if the peer hasn't choked us, ask for another piece
-		if (!c.has_peer_choked()) request_a_block(*m_torrent, c);
+		// in end-game mode the block may have been requested
+		// from other peers too. Their requests are cancelled,
+		// and they may request other blocks instead
+		for (torrent::peer_iterator i = m_torrent->begin();
+			other_requests && i != m_torrent->end(); ++i)
+		{
+			if (*i == &c) continue;
+			const std::deque<piece_block>& queue = (*i)->download_queue();
+			if (std::find(queue.begin(), queue.end(), b) == queue.end()) continue;
+			(*i)->cancel_block(b);
+			if (!(*i)->has_peer_choked() || !(*i)->allowed_fast().empty())
+				request_a_block(*m_torrent, **i);
+		}
+
+		// if the peer hasn't choked us, ask for another piece.
+		// If it has, we may still request the pieces it
+		// allows us to
+		if (!c.has_peer_choked() || !c.allowed_fast().empty())
+			request_a_block(*m_torrent, c);
+	}
+
+	// the block has been given back to the piece picker. It's
+	// not requested from this peer again right away, it would
+	// most likely be rejected again, but the other peers may
+	// request it
+	void policy::block_rejected(peer_connection& c, piece_block b)
+	{
+		request_from_other_peers(*m_torrent, c);
+	}
+
+	// the blocks may be picked by the other peers now
+	void policy::requests_timed_out(peer_connection& c)
+	{
+		request_from_other_peers(*m_torrent, c);
+	}
+
+	void policy::allowed_fast(peer_connection& c, int index)
+	{
+		if (!c.has_piece(index) || m_torrent->have_piece(index)) return;
+
+		// the piece is interesting whether we're choked or not
+		c.interested();
+		if (c.has_peer_choked()) request_a_block(*m_torrent, c);
 	}
 
 	// this is called when we are unchoked by a peer
@@ -553,11 +742,14 @@ namespace libtorrent
 	// this is called whenever a peer connection is closed
 	void policy::connection_closed(const peer_connection& c)
 	{
-		std::vector<peer>::iterator i
-			= std::find(m_peers.begin(), m_peers.end(), c.get_peer_id());
+		std::vector<peer>::iterator i = find_connection(c);
 
 		assert(i != m_peers.end());
 
+		// if the tracker didn't tell us the peer's id,
+		// we may have learned it in the handshake
+		if (i->id.is_all_zeros()) i->id = c.get_peer_id();
+
 		i->connected = boost::posix_time::second_clock::local_time();
 		i->prev_amount_download += c.statistics().total_download();
 		i->prev_amount_upload += c.statistics().total_upload();
@@ -583,10 +775,15 @@ namespace libtorrent
 		request_a_block(*m_torrent, c);
 	}
 
+	void policy::peer_is_uninteresting(peer_connection& c)
+	{
+		c.not_interested();
+	}
+
 #ifndef NDEBUG
 	bool policy::has_connection(const peer_connection* p)
 	{
-		return std::find(m_peers.begin(), m_peers.end(), p->get_peer_id()) != m_peers.end();
+		return find_connection(*p) != m_peers.end();
 	}
 
 	void policy::check_invariant()
@@ -0,0 +1,270 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#if defined(_WIN32)
+#include <ws2tcpip.h>
+#endif
+
+#include <boost/bind.hpp>
+
+#include "libtorrent/resolver.hpp"
+
+namespace
+{
+	int host_lookup(const std::string& hostname, unsigned int& ip)
+	{
+		addrinfo hints;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		addrinfo* res = 0;
+		int error = getaddrinfo(hostname.c_str(), 0, &hints, &res);
+
+		ip = 0;
+		if (error == 0 && res != 0)
+			ip = ntohl(reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr.s_addr);
+		if (res != 0) freeaddrinfo(res);
+		if (error == 0 && ip == 0) error = -1;
+		return error;
+	}
+}
+
+namespace libtorrent
+{
+
+	resolver::resolver(timer_wheel& timers)
+		: m_timers(timers)
+		, m_cache_ttl(cache_ttl)
+		, m_negative_cache_ttl(negative_cache_ttl)
+		, m_abort(false)
+		, m_lookup(&host_lookup)
+	{
+		start_threads();
+	}
+
+	resolver::resolver(timer_wheel& timers, const lookup_function& f)
+		: m_timers(timers)
+		, m_cache_ttl(cache_ttl)
+		, m_negative_cache_ttl(negative_cache_ttl)
+		, m_abort(false)
+		, m_lookup(f)
+	{
+		start_threads();
+	}
+
+	void resolver::start_threads()
+	{
+		for (int i = 0; i < num_threads; ++i)
+			m_threads.create_thread(boost::bind(&resolver::worker, this));
+	}
+
+	void resolver::set_cache_ttl(int ttl, int negative_ttl)
+	{
+		assert(ttl >= 0);
+		assert(negative_ttl >= 0);
+		m_cache_ttl = ttl;
+		m_negative_cache_ttl = negative_ttl;
+	}
+
+	resolver::~resolver()
+	{
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			m_abort = true;
+			m_cond.notify_all();
+		}
+		m_threads.join_all();
+	}
+
+	void resolver::async_resolve(const std::string& hostname
+		, unsigned short port
+		, const void* owner
+		, const handler& h)
+	{
+		request r;
+		r.hostname = hostname;
+		r.port = port;
+		r.owner = owner;
+		r.h = h;
+
+		// IPs don't have to be looked up. They aren't cached
+		// either, the peer lists would fill the cache with them
+		unsigned long ip = inet_addr(hostname.c_str());
+		r.literal = ip != INADDR_NONE;
+		r.ip = r.literal ? ntohl(ip) : 0;
+		m_requests.push_back(r);
+
+		std::map<std::string, cache_entry>::iterator i = m_cache.find(hostname);
+		if (i != m_cache.end() && i->second.expires < m_timers.now())
+		{
+			m_cache.erase(i);
+			i = m_cache.end();
+		}
+
+		if (r.literal || i != m_cache.end())
+		{
+			// deliver the result as soon as possible
+			if (m_timer.is_scheduled()) m_timer.cancel();
+			m_timers.schedule(m_timer, this, 0);
+			return;
+		}
+
+		lookup(hostname);
+		if (!m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, poll_interval);
+	}
+
+	void resolver::lookup(const std::string& hostname)
+	{
+		if (!m_in_progress.insert(hostname).second) return;
+		boost::mutex::scoped_lock l(m_mutex);
+		m_jobs.push_back(hostname);
+		m_cond.notify_one();
+	}
+
+	void resolver::cancel(const void* owner)
+	{
+		for (std::list<request>::iterator i = m_requests.begin();
+			i != m_requests.end();)
+		{
+			if (i->owner == owner) m_requests.erase(i++);
+			else ++i;
+		}
+	}
+
+	void resolver::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_timer);
+
+		std::deque<result> results;
+		{
+			boost::mutex::scoped_lock l(m_mutex);
+			results.swap(m_results);
+		}
+
+		if (!results.empty() && int(m_cache.size()) + int(results.size()) > max_cache_size)
+			prune_cache();
+
+		for (std::deque<result>::iterator i = results.begin();
+			i != results.end(); ++i)
+		{
+			cache_entry e;
+			e.ip = i->ip;
+			e.error = i->error;
+			e.expires = m_timers.now()
+				+ (i->error == 0 ? m_cache_ttl : m_negative_cache_ttl);
+			m_cache[i->hostname] = e;
+			m_in_progress.erase(i->hostname);
+		}
+
+		// the handlers may make new requests or cancel
+		// old ones, so they're taken off the list, together
+		// with their results, before any of them is called
+		std::vector<std::pair<request, cache_entry> > done;
+		for (std::list<request>::iterator i = m_requests.begin();
+			i != m_requests.end();)
+		{
+			if (i->literal)
+			{
+				cache_entry e;
+				e.ip = i->ip;
+				e.error = 0;
+				e.expires = 0;
+				done.push_back(std::make_pair(*i, e));
+				m_requests.erase(i++);
+				continue;
+			}
+			std::map<std::string, cache_entry>::iterator e
+				= m_cache.find(i->hostname);
+			if (e == m_cache.end())
+			{
+				// the entry may have been pruned from the
+				// cache before the request was delivered
+				lookup(i->hostname);
+				++i;
+				continue;
+			}
+			done.push_back(std::make_pair(*i, e->second));
+			m_requests.erase(i++);
+		}
+
+		if (!m_requests.empty() && !m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, poll_interval);
+
+		for (std::vector<std::pair<request, cache_entry> >::iterator i
+			= done.begin(); i != done.end(); ++i)
+		{
+			i->first.h(i->second.error, address(i->second.ip, i->first.port));
+		}
+	}
+
+	void resolver::prune_cache()
+	{
+		const timer_wheel::time_type now = m_timers.now();
+		for (std::map<std::string, cache_entry>::iterator i = m_cache.begin();
+			i != m_cache.end();)
+		{
+			if (i->second.expires < now) m_cache.erase(i++);
+			else ++i;
+		}
+
+		// if that wasn't enough, start over
+		if (int(m_cache.size()) >= max_cache_size) m_cache.clear();
+	}
+
+	void resolver::worker()
+	{
+		for (;;)
+		{
+			std::string hostname;
+			{
+				boost::mutex::scoped_lock l(m_mutex);
+				while (m_jobs.empty() && !m_abort) m_cond.wait(l);
+				if (m_abort) return;
+				hostname = m_jobs.front();
+				m_jobs.pop_front();
+			}
+
+			unsigned int ip = 0;
+			int error = m_lookup(hostname, ip);
+
+			boost::mutex::scoped_lock l(m_mutex);
+			m_results.push_back(result(hostname, ip, error));
+		}
+	}
+
+}
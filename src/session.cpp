@@ -44,6 +44,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <boost/filesystem/convenience.hpp>
 #include <boost/filesystem/exception.hpp>
 #include <boost/limits.hpp>
+#include <boost/bind.hpp>
 
 #include "libtorrent/peer_id.hpp"
 #include "libtorrent/torrent_info.hpp"
@@ -53,6 +54,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/entry.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/fingerprint.hpp"
+#include "libtorrent/ut_pex.hpp"
 
 #if defined(_MSC_VER) && _MSC_VER < 1300
 namespace std
@@ -62,195 +64,6 @@ namespace std
 };
 #endif
 
-namespace
-{
-
-
-	// This struct is used by control_upload_rates() below. It keeps
-	// track how much bandwidth has been allocated to each connection
-	// and other relevant information to assist in the allocation process.
-	struct connection_info
-	{
-		libtorrent::peer_connection* p; // which peer_connection this info refers to
-		int allocated_quota;	// bandwidth allocated to this peer connection
-		int quota_limit;	// bandwidth limit
-		int estimated_upload_capacity; // estimated channel bandwidth
-
-		bool operator < (connection_info &other) const
-		{
-			return estimated_upload_capacity < other.estimated_upload_capacity;
-		}
-		
-		int give(int amount)
-		{
-
-			// if amount > 0, try to add amount to the allocated quota.
-			// if amount < 0, try to subtract abs(amount) from the allocated quota
-			// 
-			// Quota will not go above quota_limit or below 0. This means that
-			// not all the amount given or taken may be accepted.
-			//
-			// return value: how much quota was actually added (or subtracted if negative).
-
-			int old_quota=allocated_quota;
-			allocated_quota+=amount;
-			if(quota_limit!=-1)
-				allocated_quota=std::min(allocated_quota,quota_limit);
-			allocated_quota=std::max(0,allocated_quota);
-			return allocated_quota-old_quota;
-		}
-	};
-
-	// adjusts the upload rates of every peer connection
-	// to make sure the sum of all send quotas equals
-	// the given upload_limit. An upload limit of -1 means
-	// unlimited upload rate, but the rates of each peer
-	// has to be set anyway, since it depends on the download
-	// rate from the peer.
-	void control_upload_rates(
-		int upload_limit
-		, libtorrent::detail::session_impl::connection_map connections)
-	{
-		using namespace libtorrent;
-
-		if (connections.empty()) return;
-
-		assert(upload_limit != 0);
-
-		if (upload_limit == -1)
-		{
-			for (detail::session_impl::connection_map::iterator i = connections.begin();
-				i != connections.end();
-				++i)
-			{
-				// there's no limit, set the quota to max
-				// allowed
-				peer_connection& p = *i->second;
-				p.set_send_quota(p.send_quota_limit());
-			}
-			return;
-		}
-		else
-		{
-			// There's an upload limit, so we need to distribute the available
-			// upload bandwidth among the peer_connections fairly, but not
-			// wastefully.
-
-			// For each peer_connection, keep some local data about their
-			// quota limit and estimated upload capacity, and how much quota
-			// has been allocated to them.
-
-			std::vector<connection_info> peer_info;
-
-			for (detail::session_impl::connection_map::iterator i = connections.begin();
-				i != connections.end();
-				++i)
-			{
-				peer_connection& p = *i->second;
-				connection_info pi;
-
-				pi.p=&p;
-				pi.allocated_quota=0; // we haven't given it any bandwith yet
-				pi.quota_limit=p.send_quota_limit();
-
-				pi.estimated_upload_capacity=
-					p.has_data() ? std::max(10,(int)ceil(p.statistics().upload_rate()*1.1f))
-					// If there's no data to send, upload capacity is practically 0.
-					// Here we set it to 1 though, because otherwise it will not be able
-					// to accept any quota at all, which may upset quota_limit balances.
-					              : 1;
-
-				peer_info.push_back(pi);
-			}
-
-			// Sum all peer_connections' quota limit to get the total quota limit.
-
-			int sum_total_of_quota_limits=0;
-			for(int i=0;i<peer_info.size();i++)
-			{
-				int quota_limit=peer_info[i].quota_limit;
-				if(quota_limit==-1)
-				{
-					// quota_limit=-1 means infinite, so
-					// sum_total_of_quota_limits will be infinite too...
-					sum_total_of_quota_limits=std::numeric_limits<int>::max();
-					break;
-				}
-				sum_total_of_quota_limits+=quota_limit;
-			}
-
-			// This is how much total bandwidth that can be distributed.
-			int quota_left_to_distribute=std::min(upload_limit,sum_total_of_quota_limits);
-
-
-			// Sort w.r.t. channel capacitiy, lowest channel capacity first.
-			// Makes it easy to traverse the list in sorted order.
-			std::sort(peer_info.begin(),peer_info.end());
-
-
-			// Distribute quota until there's nothing more to distribute
-
-			while(quota_left_to_distribute!=0)
-			{
-				assert(quota_left_to_distribute>0);
-
-				for(int i=0;i<peer_info.size();i++)
-				{
-					// Traverse the peer list from slowest connection to fastest.
-
-					// In each step, share bandwidth equally between this peer_connection
-					// and the following faster peer_connections.
-					//
-					// Rounds upwards to avoid trying to give 0 bandwidth to someone (may get caught in an endless loop otherwise)
-					
-					int num_peers_left_to_share_quota=peer_info.size()-i;
-					int try_to_give_to_this_peer=(quota_left_to_distribute+num_peers_left_to_share_quota-1)/num_peers_left_to_share_quota;
-
-					// But do not allocate more than the estimated upload capacity.
-					try_to_give_to_this_peer=std::min(
-						peer_info[i].estimated_upload_capacity,
-						try_to_give_to_this_peer);
-
-					// Also, when the peer is given quota, it will not accept more than it's quota_limit.
-					int quota_actually_given_to_peer=peer_info[i].give(try_to_give_to_this_peer);
-
-					quota_left_to_distribute-=quota_actually_given_to_peer;
-				}
-			}
-			
-			// Finally, inform the peers of how much quota they get.
-
-			for(int i=0;i<peer_info.size();i++)
-				peer_info[i].p->set_send_quota(peer_info[i].allocated_quota);
-		}
-
-#ifndef NDEBUG
-		{
-		int sum_quota = 0;
-		int sum_quota_limit = 0;
-		for (detail::session_impl::connection_map::iterator i = connections.begin();
-			i != connections.end();
-			++i)
-		{
-			peer_connection& p = *i->second;
-			sum_quota += p.send_quota();
-
-			if(p.send_quota_limit() == -1)
-			{
-				sum_quota_limit=std::numeric_limits<int>::max();
-			}
-
-			if(sum_quota_limit!=std::numeric_limits<int>::max())
-			{
-				sum_quota_limit += p.send_quota_limit();
-			}
-		}
-		assert(sum_quota == std::min(upload_limit,sum_quota_limit));
-		}
-#endif
-	}
-}
-
 namespace libtorrent
 {
 	namespace detail
@@ -295,6 +108,7 @@ namespace libtorrent
 
 						m_ses->m_torrents.insert(
 							std::make_pair(t->info_hash, t->torrent_ptr)).first;
+						t->torrent_ptr->start();
 					}
 				}
 				catch(const std::exception& e)
@@ -329,12 +143,27 @@ namespace libtorrent
 			return 0;
 		}
 
-		session_impl::session_impl(int listen_port,
-			const fingerprint& cl_fprint)
-			: m_abort(false)
+		session_impl::session_impl(int listen_port
+			, const fingerprint& cl_fprint
+			, int listen_backlog)
+			: m_resolver(m_timers)
+			, m_upload_manager(m_timers, peer_connection::upload_channel)
+			, m_download_manager(m_timers, peer_connection::download_channel)
+			, m_connection_queue(*this)
 			, m_tracker_manager(m_settings)
+			, m_udp_tracker_manager(m_timers, m_selector, m_resolver)
+			, m_tracker_scheduler(*this)
+			, m_lsd(m_timers, m_selector
+				, boost::bind(&session_impl::on_lsd_peer, this, _1, _2))
+			, m_dht(m_timers, m_selector
+				, boost::bind(&session_impl::on_dht_peers, this, _1, _2))
 			, m_listen_port(listen_port)
-			, m_upload_rate(-1)
+			, m_listen_backlog(listen_backlog)
+			, m_min_request_queue(2)
+			, m_max_request_queue(250)
+			, m_request_timeout(10)
+			, m_snub_timeout(30)
+			, m_abort(false)
 		{
 
 			// ---- generate a peer id ----
@@ -357,6 +186,86 @@ namespace libtorrent
 			{
 				*i = rand();
 			}
+
+			// ---- the built in peer classes ----
+
+			m_classes.push_back(peer_class("default"));
+			m_classes.push_back(peer_class("local"));
+			assert(m_classes.size() == local_peer_class + 1);
+
+			// the local network isn't limited by the
+			// session wide rate limits
+			m_classes[local_peer_class].ignore_global_limit = true;
+
+			// loopback, the private networks and link-local
+			m_class_map.add_range(address(127, 0, 0, 0, 0)
+				, address(127, 255, 255, 255, 0), local_peer_class);
+			m_class_map.add_range(address(10, 0, 0, 0, 0)
+				, address(10, 255, 255, 255, 0), local_peer_class);
+			m_class_map.add_range(address(172, 16, 0, 0, 0)
+				, address(172, 31, 255, 255, 0), local_peer_class);
+			m_class_map.add_range(address(192, 168, 0, 0, 0)
+				, address(192, 168, 255, 255, 0), local_peer_class);
+			m_class_map.add_range(address(169, 254, 0, 0, 0)
+				, address(169, 254, 255, 255, 0), local_peer_class);
+
+			// ---- the built in extensions ----
+
+			m_extensions.push_back(&create_ut_pex);
+		}
+
+		void session_impl::accept_connections(boost::shared_ptr<socket> listener)
+		{
+			// accept all the connections that are waiting, not
+			// just one. Otherwise the backlog overflows when a
+			// lot of peers connect at the same time
+			for (;;)
+			{
+				boost::shared_ptr<libtorrent::socket> s = listener->accept();
+				if (!s) return;
+				s->set_blocking(false);
+
+				// we got a connection request!
+#ifndef NDEBUG
+				(*m_logger) << s->sender().as_string() << " <== INCOMING CONNECTION\n";
+#endif
+				// TODO: filter ip:s
+
+				if (m_connection_queue.max_connections() != -1
+					&& int(m_connections.size()) >= m_connection_queue.max_connections())
+				{
+#ifndef NDEBUG
+					(*m_logger) << s->sender().as_string() << " too many connections, closing\n";
+#endif
+					continue;
+				}
+
+				if (m_classes[m_class_map.class_for(s->sender())].is_full())
+				{
+#ifndef NDEBUG
+					(*m_logger) << s->sender().as_string() << " peer class is full, closing\n";
+#endif
+					continue;
+				}
+
+				boost::shared_ptr<peer_connection> c(
+					new peer_connection(*this, m_selector, s));
+
+				m_connections.insert(std::make_pair(s, c));
+				m_selector.monitor_readability(s);
+				m_selector.monitor_errors(s);
+			}
+		}
+
+		void session_impl::update_quotas()
+		{
+			for (connection_map::iterator i = m_connections.begin();
+				i != m_connections.end();
+				++i)
+			{
+				i->second->update_send_quota();
+				i->second->update_recv_quota();
+			}
 		}
 
 
@@ -379,7 +288,7 @@ namespace libtorrent
 			{
 				try
 				{
-					listener->listen(m_listen_port, 5);
+					listener->listen(m_listen_port, m_listen_backlog);
 				}
 				catch(std::exception&)
 				{
@@ -394,46 +303,67 @@ namespace libtorrent
 #ifndef NDEBUG
 			(*m_logger) << "listening on port: " << m_listen_port << "\n";
 #endif
+			m_lsd.set_listen_port(m_listen_port);
 			m_selector.monitor_readability(listener);
 			m_selector.monitor_errors(listener);
 
 			std::vector<boost::shared_ptr<socket> > readable_clients;
 			std::vector<boost::shared_ptr<socket> > writable_clients;
 			std::vector<boost::shared_ptr<socket> > error_clients;
-			boost::posix_time::ptime timer = boost::posix_time::second_clock::local_time();
 
-#ifndef NDEBUG
-			int loops_per_second = 0;
-#endif
+			{
+				boost::mutex::scoped_lock l(m_mutex);
+				m_timers.update_time();
+				m_timers.schedule(m_second_timer, this, 1000);
+				m_tracker_scheduler.start();
+			}
+
 			for(;;)
 			{
 
 #ifndef NDEBUG
 				assert_invariant();
-				loops_per_second++;
 #endif
 
-
-				// if nothing happens within 500000 microseconds (0.5 seconds)
-				// do the loop anyway to check if anything else has changed
-		//		 << "sleeping\n";
-				m_selector.wait(500000, readable_clients, writable_clients, error_clients);
+				// sleep until the next timer expires, unless
+				// something happens on the sockets before that
+				int timeout;
+				{
+					boost::mutex::scoped_lock l(m_mutex);
+					m_timers.update_time();
+					timeout = m_timers.time_to_next();
+				}
+				// the second timer is always scheduled, so
+				// there's always a timer to wait for
+				assert(timeout >= 0);
+				m_selector.wait(timeout * 1000, readable_clients, writable_clients, error_clients);
 
 				boost::mutex::scoped_lock l(m_mutex);
 
-				// +1 for the listen socket
-				assert(m_selector.count_read_monitors() == m_connections.size() + 1);
+				// read the clock once per loop. All timestamps
+				// within this iteration use this time
+				m_timers.update_time();
+
+				// +1 for the listen socket. Connections that are
+				// waiting for download quota aren't monitored
+				assert(m_selector.count_read_monitors() <= m_connections.size() + 1
+					+ m_udp_tracker_manager.num_sockets()
+					+ m_lsd.num_sockets()
+					+ m_dht.num_sockets());
 
 				if (m_abort)
 				{
 					m_tracker_manager.abort_all_requests();
+					m_udp_tracker_manager.abort_all_requests();
+					m_lsd.abort();
+					m_dht.abort();
 					for (std::map<sha1_hash, boost::shared_ptr<torrent> >::iterator i =
 							m_torrents.begin();
 						i != m_torrents.end();
 						++i)
 					{
 						i->second->abort();
-						m_tracker_manager.queue_request(i->second->generate_tracker_request(m_listen_port));
+						i->second->announce(0);
 					}
 					m_connections.clear();
 					m_torrents.clear();
@@ -455,26 +385,12 @@ namespace libtorrent
 					// special case for listener socket
 					if (*i == listener)
 					{
-						boost::shared_ptr<libtorrent::socket> s = (*i)->accept();
-						s->set_blocking(false);
-						if (s)
-						{
-							// we got a connection request!
-#ifndef NDEBUG
-							(*m_logger) << s->sender().as_string() << " <== INCOMING CONNECTION\n";
-#endif
-							// TODO: filter ip:s
-
-							boost::shared_ptr<peer_connection> c(
-								new peer_connection(*this, m_selector, s));
-
-							if (m_upload_rate != -1) c->set_send_quota(0);
-							m_connections.insert(std::make_pair(s, c));
-							m_selector.monitor_readability(s);
-							m_selector.monitor_errors(s);
-						}
+						accept_connections(listener);
 						continue;
 					}
+					if (m_udp_tracker_manager.incoming(*i)) continue;
+					if (m_lsd.incoming(*i)) continue;
+					if (m_dht.incoming(*i)) continue;
 					connection_map::iterator p = m_connections.find(*i);
 					if(p == m_connections.end())
 					{
@@ -556,84 +472,46 @@ namespace libtorrent
 				assert_invariant();
 #endif
 
-				boost::posix_time::time_duration d = boost::posix_time::second_clock::local_time() - timer;
-				if (d.seconds() < 1) continue;
-				timer = boost::posix_time::second_clock::local_time();
-
 				// ************************
-				// THE SECTION BELOW IS EXECUTED ONCE EVERY SECOND
+				// TIMERS
 				// ************************
 
-#ifndef NDEBUG
-				// std::cout << "\n\nloops: " << loops_per_second << "\n";
-				loops_per_second = 0;
-#endif
-
-				// do the second_tick() on each connection
-				// this will update their statistics (download and upload speeds)
-				// also purge sockets that have timed out
-				// and keep sockets open by keeping them alive.
-				for (connection_map::iterator i = m_connections.begin();
-					i != m_connections.end();)
-				{
-					connection_map::iterator j = i;
-					++i;
-					// if this socket has timed out
-					// close it.
-					if (j->second->has_timed_out())
-					{
-						m_selector.remove(j->first);
-						m_connections.erase(j);
-						continue;
-					}
-
-					j->second->keep_alive();
-				}
+				m_timers.advance();
 
-				// check each torrent for abortion or
-				// tracker updates
-				for (std::map<sha1_hash, boost::shared_ptr<torrent> >::iterator i
-					= m_torrents.begin();
-					i != m_torrents.end();)
+				// close the connections that timed out
+				for (std::vector<boost::shared_ptr<socket> >::iterator i
+					= m_timed_out.begin();
+					i != m_timed_out.end();
+					++i)
 				{
-					if (i->second->is_aborted())
-					{
-						m_tracker_manager.queue_request(
-							i->second->generate_tracker_request(m_listen_port));
-						i->second->close_all_connections();
-#ifndef NDEBUG
-						sha1_hash i_hash = i->second->torrent_file().info_hash();
-#endif
-						std::map<sha1_hash, boost::shared_ptr<torrent> >::iterator j = i;
-						++i;
-						m_torrents.erase(j);
-						assert(m_torrents.find(i_hash) == m_torrents.end());
-						continue;
-					}
-					else if (i->second->should_request())
-					{
-						m_tracker_manager.queue_request(
-							i->second->generate_tracker_request(m_listen_port),
-							boost::get_pointer(i->second));
-					}
-
-					i->second->second_tick();
-					++i;
+					connection_map::iterator p = m_connections.find(*i);
+					m_selector.remove(*i);
+					// the connection may have been disconnected already
+					if (p != m_connections.end()) m_connections.erase(p);
 				}
-				// distribute the maximum upload rate among the peers
-				control_upload_rates(m_upload_rate, m_connections);
-
-
-				m_tracker_manager.tick();
+				m_timed_out.clear();
 			}
 
-			while (!m_tracker_manager.send_finished())
+			while (!m_tracker_manager.send_finished()
+				|| !m_udp_tracker_manager.send_finished())
 			{
 				m_tracker_manager.tick();
-				boost::xtime t;
-				boost::xtime_get(&t, boost::TIME_UTC);
-				t.nsec += 100000000;
-				boost::thread::sleep(t);
+
+				// the udp requests are driven by the selector
+				// and the timers, like in the main loop
+				std::vector<boost::shared_ptr<socket> > readable;
+				std::vector<boost::shared_ptr<socket> > writable;
+				std::vector<boost::shared_ptr<socket> > error;
+				m_selector.wait(100000, readable, writable, error);
+				m_timers.update_time();
+				for (std::vector<boost::shared_ptr<socket> >::iterator i = readable.begin();
+					i != readable.end(); ++i)
+				{
+					// the listen socket isn't served anymore
+					if (!m_udp_tracker_manager.incoming(*i))
+						m_selector.remove(*i);
+				}
+				m_timers.advance();
 			}
 
 #ifndef NDEBUG
@@ -654,6 +532,41 @@ namespace libtorrent
 		}
 
 
+		// this is called by the timer wheel once every second,
+		// from within the main loop
+		void session_impl::on_timer(timer_entry& t)
+		{
+			assert(&t == &m_second_timer);
+			m_timers.schedule(m_second_timer, this, 1000);
+
+			// check each torrent for abortion
+			// and update its statistics
+			for (std::map<sha1_hash, boost::shared_ptr<torrent> >::iterator i
+				= m_torrents.begin();
+				i != m_torrents.end();)
+			{
+				if (i->second->is_aborted())
+				{
+					i->second->announce(0);
+					i->second->close_all_connections();
+#ifndef NDEBUG
+					sha1_hash i_hash = i->second->torrent_file().info_hash();
+#endif
+					std::map<sha1_hash, boost::shared_ptr<torrent> >::iterator j = i;
+					++i;
+					m_lsd.remove(j->first);
+					m_torrents.erase(j);
+					assert(m_torrents.find(i_hash) == m_torrents.end());
+					continue;
+				}
+
+				i->second->second_tick();
+				++i;
+			}
+
+			m_tracker_manager.tick();
+		}
+
 		// the return value from this function is valid only as long as the
 		// session is locked!
 		torrent* session_impl::find_torrent(const sha1_hash& info_hash)
@@ -664,6 +577,28 @@ namespace libtorrent
 			return 0;
 		}
 
+		void session_impl::on_lsd_peer(const sha1_hash& info_hash
+			, const address& peer)
+		{
+			torrent* t = find_torrent(info_hash);
+			if (t == 0) return;
+			t->local_peer_found(peer);
+		}
+
+		void session_impl::on_dht_peers(const sha1_hash& info_hash
+			, const std::vector<address>& peers)
+		{
+			// the torrent may have been removed while
+			// it was looked up
+			torrent* t = find_torrent(info_hash);
+			if (t == 0) return;
+			for (std::vector<address>::const_iterator i = peers.begin();
+				i != peers.end(); ++i)
+			{
+				t->dht_peer_found(*i);
+			}
+		}
+
 #ifndef NDEBUG
 		boost::shared_ptr<logger> session_impl::create_log(std::string name)
 		{
@@ -685,6 +620,10 @@ namespace libtorrent
 				++i)
 			{
 				assert(i->second->has_data() == m_selector.is_writability_monitored(i->first));
+				// connections that are waiting for download
+				// quota are not read from
+				assert(i->second->is_download_throttled()
+					!= m_selector.is_readability_monitored(i->first));
 				if (i->second->associated_torrent())
 				{
 					assert(i->second->associated_torrent()
@@ -696,8 +635,10 @@ namespace libtorrent
 
 	}
 
-	session::session(int listen_port, const fingerprint& id)
-		: m_impl(listen_port, id)
+	session::session(int listen_port
+		, const fingerprint& id
+		, int listen_backlog)
+		: m_impl(listen_port, id, listen_backlog)
 		, m_checker_impl(&m_impl)
 		, m_thread(boost::ref(m_impl))
 		, m_checker_thread(boost::ref(m_checker_impl))
@@ -711,8 +652,8 @@ namespace libtorrent
 #endif
 	}
 
-	session::session(int listen_port)
-		: m_impl(listen_port, fingerprint("LT",0,0,1,0))
+	session::session(int listen_port, int listen_backlog)
+		: m_impl(listen_port, fingerprint("LT",0,0,1,0), listen_backlog)
 		, m_checker_impl(&m_impl)
 		, m_thread(boost::ref(m_impl))
 		, m_checker_thread(boost::ref(m_checker_impl))
@@ -832,16 +773,132 @@ namespace libtorrent
 	{
 		assert(bytes_per_second > 0 || bytes_per_second == -1);
 		boost::mutex::scoped_lock l(m_impl.m_mutex);
-		m_impl.m_upload_rate = bytes_per_second;
-		if (m_impl.m_upload_rate != -1 || !m_impl.m_connections.empty())
-			return;
+		m_impl.m_bandwidth_limit[peer_connection::upload_channel]
+			.throttle(bytes_per_second);
+		m_impl.update_quotas();
+	}
 
-		for (detail::session_impl::connection_map::iterator i
-			= m_impl.m_connections.begin();
-			i != m_impl.m_connections.end();)
-		{
-			i->second->set_send_quota(-1);
-		}
+	void session::set_download_rate_limit(int bytes_per_second)
+	{
+		assert(bytes_per_second > 0 || bytes_per_second == -1);
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_bandwidth_limit[peer_connection::download_channel]
+			.throttle(bytes_per_second);
+		m_impl.update_quotas();
+	}
+
+	int session::create_peer_class(const std::string& name)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_classes.push_back(peer_class(name));
+		return m_impl.m_classes.size() - 1;
+	}
+
+	void session::set_peer_class_settings(int peer_class, const peer_class_settings& s)
+	{
+		assert(s.upload_limit > 0 || s.upload_limit == -1);
+		assert(s.download_limit > 0 || s.download_limit == -1);
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		assert(peer_class >= 0 && peer_class < (int)m_impl.m_classes.size());
+		m_impl.m_classes[peer_class].apply(s);
+		m_impl.update_quotas();
+	}
+
+	void session::set_max_connections(int limit)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_connection_queue.set_max_connections(limit);
+	}
+
+	void session::set_max_half_open_connections(int limit)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_connection_queue.set_max_half_open(limit);
+	}
+
+	void session::set_connect_rate(int attempts_per_second)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_connection_queue.set_connect_rate(attempts_per_second);
+	}
+
+	void session::set_connect_timeout(int seconds)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_connection_queue.set_connect_timeout(seconds);
+	}
+
+	void session::set_request_queue_limits(int min_blocks, int max_blocks)
+	{
+		assert(min_blocks > 0);
+		assert(max_blocks >= min_blocks);
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_min_request_queue = min_blocks;
+		m_impl.m_max_request_queue = max_blocks;
+	}
+
+	void session::set_request_timeout(int seconds)
+	{
+		assert(seconds > 0);
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_request_timeout = seconds;
+	}
+
+	void session::set_snub_timeout(int seconds)
+	{
+		assert(seconds > 0);
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_snub_timeout = seconds;
+	}
+
+	void session::add_peer_class_range(const address& first
+		, const address& last, int peer_class)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		assert(peer_class >= 0 && peer_class < (int)m_impl.m_classes.size());
+		m_impl.m_class_map.add_range(first, last, peer_class);
+	}
+
+	void session::start_lsd()
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_lsd.start();
+	}
+
+	void session::stop_lsd()
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_lsd.stop();
+	}
+
+	void session::start_dht(int port)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_dht.start(port);
+	}
+
+	void session::stop_dht()
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_dht.stop();
+	}
+
+	void session::add_dht_node(const address& node)
+	{
+		boost::mutex::scoped_lock l(m_impl.m_mutex);
+		m_impl.m_dht.add_node(node);
+	}
+
+	void session::set_buffer_pool_limit(int bytes)
+	{
+		assert(bytes >= 0);
+		// the pool has its own mutex
+		m_impl.m_block_pool.set_limit(bytes);
+	}
+
+	block_pool_status session::buffer_pool_status() const
+	{
+		return m_impl.m_block_pool.status();
 	}
 
 	std::auto_ptr<alert> session::pop_alert()
@@ -51,6 +51,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/peer_id.hpp"
+#include "libtorrent/block_pool.hpp"
 
 #if defined(_MSC_VER)
 #define for if (false) {} else for
@@ -353,7 +354,8 @@ namespace libtorrent {
 
 		impl(
 			const torrent_info& info
-		  , const boost::filesystem::path& path);
+		  , const boost::filesystem::path& path
+		  , block_pool& pool);
 
 		void check_pieces(
 			boost::mutex& mutex
@@ -362,6 +364,9 @@ namespace libtorrent {
 
 		void allocate_slots(int num_slots);
 
+		void set_piece_filter(const std::vector<bool>& filter)
+		{ m_piece_filter = filter; }
+
 		size_type read(char* buf, int piece_index, size_type offset, size_type size);
 		void write(const char* buf, int piece_index, size_type offset, size_type size);
 
@@ -373,6 +378,10 @@ namespace libtorrent {
 		// piece or assigns the given piece_index to a free slot
 		int slot_for_piece(int piece_index);
 
+		// false if the slot belongs to a piece we don't download
+		bool is_wanted_slot(int slot) const
+		{ return m_piece_filter.empty() || !m_piece_filter[slot]; }
+
 		void check_invariant() const;
 		void debug_log() const;
 
@@ -394,6 +403,10 @@ namespace libtorrent {
 		// slots that has file storage, but isn't assigned to a piece
 		std::vector<int> m_free_slots;
 
+		// the pieces we don't download. Their slots are never
+		// allocated. Empty if every piece is downloaded
+		std::vector<bool> m_piece_filter;
+
 		// index here is a slot number in the file
 		// -1 : the slot is unallocated
 		// -2 : the slot is allocated but not assigned to a piece
@@ -402,6 +415,10 @@ namespace libtorrent {
 
 		boost::filesystem::path m_save_path;
 
+		// the buffers used to read and move pieces
+		// are allocated from this pool
+		block_pool& m_pool;
+
 		mutable boost::recursive_mutex m_mutex;
 
 		bool m_allocating;
@@ -411,17 +428,20 @@ namespace libtorrent {
 
 	piece_manager::impl::impl(
 		const torrent_info& info
-	  , const fs::path& save_path)
+	  , const fs::path& save_path
+	  , block_pool& pool)
 		: m_storage(info, save_path)
 		, m_info(info)
 		, m_save_path(save_path)
+		, m_pool(pool)
 	{
 	}
 
 	piece_manager::piece_manager(
 		const torrent_info& info
-	  , const fs::path& save_path)
-		: m_pimpl(new impl(info, save_path))
+	  , const fs::path& save_path
+	  , block_pool& pool)
+		: m_pimpl(new impl(info, save_path, pool))
 	{
 	}
 
@@ -486,7 +506,7 @@ namespace libtorrent {
 		bool changed_file = true;
 		fs::ifstream in;
 
-		std::vector<char> piece_data(m_info.piece_length());
+		boost::shared_array<char> piece_data = m_pool.allocate(m_info.piece_length());
 		std::size_t piece_offset = 0;
 
 		int current_slot = 0;
@@ -721,9 +741,10 @@ namespace libtorrent {
 				if (m_free_slots.size() == 1)
 					allocate_slots(5);
 				assert(m_free_slots.size() > 1);
-				// TODO: assumes that all allocated slots
-				// are put at the end of the free_slots vector
-				iter = m_free_slots.end() - 1;
+				// the last slot is only in the list once, one
+				// of the first two is an ordinary slot
+				iter = m_free_slots.begin();
+				if (*iter == m_info.num_pieces() - 1) ++iter;
 			}
 		}
 
@@ -758,9 +779,9 @@ namespace libtorrent {
 
 			debug_log();
 
-			std::vector<char> buf(m_info.piece_length());
-			m_storage.read(&buf[0], piece_index, 0, m_info.piece_length());
-			m_storage.write(&buf[0], slot_index, 0, m_info.piece_length());
+			boost::shared_array<char> buf = m_pool.allocate(m_info.piece_length());
+			m_storage.read(buf.get(), piece_index, 0, m_info.piece_length());
+			m_storage.write(buf.get(), slot_index, 0, m_info.piece_length());
 
 			std::swap(
 				m_slot_to_piece[piece_index]
@@ -808,7 +829,21 @@ namespace libtorrent {
 
 		const size_type piece_size = m_info.piece_length();
 
-		std::vector<char> zeros(piece_size, 0);
+		boost::shared_array<char> zeros = m_pool.allocate(piece_size);
+		std::fill(zeros.get(), zeros.get() + piece_size, 0);
+
+		// the slots of filtered pieces are left unallocated. They're
+		// moved to the end of the list, the ones that are allocated
+		// are erased from the front. Filtered pieces downloaded
+		// before they were filtered may take up wanted slots
+		// though. Once the wanted slots have run out, the
+		// filtered ones are allocated after all
+		if (!m_piece_filter.empty())
+		{
+			std::vector<int>::iterator wanted_end = std::stable_partition(
+				iter, end_iter, boost::bind(&impl::is_wanted_slot, this, _1));
+			if (wanted_end != iter) end_iter = wanted_end;
+		}
 
 		for (int i = 0; i < num_slots; ++i, ++iter)
 		{
@@ -823,7 +858,7 @@ namespace libtorrent {
 			if (m_piece_to_slot[pos] != -1)
 			{
 				assert(m_piece_to_slot[pos] >= 0);
-				m_storage.read(&zeros[0], m_piece_to_slot[pos], 0, m_info.piece_size(pos));
+				m_storage.read(zeros.get(), m_piece_to_slot[pos], 0, m_info.piece_size(pos));
 				new_free_slot = m_piece_to_slot[pos];
 				m_slot_to_piece[pos] = pos;
 				m_piece_to_slot[pos] = pos;
@@ -832,7 +867,7 @@ namespace libtorrent {
 			m_slot_to_piece[new_free_slot] = -2;
 			m_free_slots.push_back(new_free_slot);
 
-			m_storage.write(&zeros[0], pos, 0, m_info.piece_size(pos));
+			m_storage.write(zeros.get(), pos, 0, m_info.piece_size(pos));
 		}
 
 		m_unallocated_slots.erase(m_unallocated_slots.begin(), iter);
@@ -847,6 +882,11 @@ namespace libtorrent {
 		m_pimpl->allocate_slots(num_slots);
 	}
 
+	void piece_manager::set_piece_filter(const std::vector<bool>& filter)
+	{
+		m_pimpl->set_piece_filter(filter);
+	}
+
 	const boost::filesystem::path& piece_manager::save_path() const
 	{
 		return m_pimpl->save_path();
@@ -0,0 +1,288 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <algorithm>
+
+#include "libtorrent/timer_wheel.hpp"
+
+namespace
+{
+	libtorrent::timer_wheel::time_type read_clock()
+	{
+#if defined(_WIN32)
+		// GetTickCount() wraps after 49.7 days, the
+		// performance counter doesn't
+		static LARGE_INTEGER frequency = {0};
+		if (frequency.QuadPart == 0)
+			QueryPerformanceFrequency(&frequency);
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		// split up to avoid overflowing the multiplication
+		return libtorrent::timer_wheel::time_type(
+			counter.QuadPart / frequency.QuadPart) * 1000
+			+ (counter.QuadPart % frequency.QuadPart) * 1000
+			/ frequency.QuadPart;
+#else
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return libtorrent::timer_wheel::time_type(ts.tv_sec) * 1000
+			+ ts.tv_nsec / 1000000;
+#endif
+	}
+}
+
+namespace libtorrent
+{
+
+	void timer_entry::unlink()
+	{
+		assert(is_scheduled());
+		m_prev->m_next = m_next;
+		m_next->m_prev = m_prev;
+		m_next = 0;
+		m_prev = 0;
+	}
+
+	void timer_entry::cancel()
+	{
+		if (!is_scheduled()) return;
+		assert(m_wheel != 0);
+		unlink();
+		--m_wheel->m_size;
+	}
+
+	timer_wheel::timer_wheel()
+		: m_now(read_clock())
+		, m_size(0)
+	{
+		m_tick = m_now / tick_ms;
+		for (int l = 0; l < num_levels; ++l)
+		{
+			for (int s = 0; s < num_slots; ++s)
+			{
+				timer_entry& head = m_slots[l][s];
+				head.m_next = &head;
+				head.m_prev = &head;
+			}
+		}
+	}
+
+	timer_wheel::~timer_wheel()
+	{
+		// unlink all timers that are still scheduled
+		// and make the heads look unscheduled, so that
+		// they won't try to unlink themselves
+		for (int l = 0; l < num_levels; ++l)
+		{
+			for (int s = 0; s < num_slots; ++s)
+			{
+				timer_entry& head = m_slots[l][s];
+				while (head.m_next != &head)
+					head.m_next->unlink();
+				head.m_next = 0;
+				head.m_prev = 0;
+			}
+		}
+	}
+
+	void timer_wheel::update_time()
+	{
+		m_now = read_clock();
+	}
+
+	void timer_wheel::link(timer_entry& t)
+	{
+		boost::int64_t delta = t.m_expires - m_tick;
+		boost::int64_t expires = t.m_expires;
+
+		// timers that already have expired are put
+		// in the slot that's processed next
+		if (delta < 0) expires = m_tick;
+
+		// timers too far into the future are put in
+		// the last slot of the top level. They are
+		// rescheduled when that slot is cascaded
+		const boost::int64_t max_delta
+			= (boost::int64_t(1) << (num_levels * level_bits)) - 1;
+		if (delta > max_delta) expires = m_tick + max_delta;
+
+		int level = 0;
+		while (level < num_levels - 1
+			&& expires - m_tick >= (boost::int64_t(1) << ((level + 1) * level_bits)))
+		{
+			++level;
+		}
+
+		timer_entry& head = m_slots[level][slot_index(expires, level)];
+		t.m_next = &head;
+		t.m_prev = head.m_prev;
+		head.m_prev->m_next = &t;
+		head.m_prev = &t;
+	}
+
+	void timer_wheel::schedule(timer_entry& t, timer_callback* c, int milliseconds)
+	{
+		assert(c != 0);
+		assert(milliseconds >= 0);
+		assert(t.m_wheel == 0 || t.m_wheel == this);
+
+		t.cancel();
+		t.m_wheel = this;
+		t.m_callback = c;
+		// round up, a timer never expires early
+		t.m_expires = (m_now + milliseconds + tick_ms - 1) / tick_ms;
+		link(t);
+		++m_size;
+	}
+
+	int timer_wheel::cascade(int level)
+	{
+		const int index = slot_index(m_tick, level);
+		timer_entry& head = m_slots[level][index];
+		while (head.m_next != &head)
+		{
+			timer_entry& t = *head.m_next;
+			t.unlink();
+			link(t);
+		}
+		return index;
+	}
+
+	void timer_wheel::advance()
+	{
+		const boost::int64_t target = m_now / tick_ms;
+
+		// if there are no timers, there's
+		// nothing to step through
+		if (m_size == 0 && m_tick <= target)
+			m_tick = target + 1;
+
+		while (m_tick <= target)
+		{
+			// when the lowest level wraps, move the timers
+			// of the next slot on the level above down
+			if (slot_index(m_tick, 0) == 0)
+			{
+				for (int l = 1; l < num_levels && cascade(l) == 0; ++l);
+			}
+
+			// move the timers in this slot to a list of their
+			// own before the tick is advanced. That way, timers
+			// that are rescheduled by their callbacks end up in
+			// a later slot, and are not fired again right away
+			timer_entry& head = m_slots[0][slot_index(m_tick, 0)];
+			timer_entry expired;
+			expired.m_next = &expired;
+			expired.m_prev = &expired;
+			if (head.m_next != &head)
+			{
+				expired.m_next = head.m_next;
+				expired.m_prev = head.m_prev;
+				expired.m_next->m_prev = &expired;
+				expired.m_prev->m_next = &expired;
+				head.m_next = &head;
+				head.m_prev = &head;
+			}
+			const boost::int64_t tick = m_tick;
+			++m_tick;
+
+			while (expired.m_next != &expired)
+			{
+				timer_entry& t = *expired.m_next;
+				t.unlink();
+				--m_size;
+
+				// timers that were too far into the future
+				// to fit in the wheel may end up here early
+				if (t.m_expires > tick)
+				{
+					link(t);
+					++m_size;
+					continue;
+				}
+				t.m_callback->on_timer(t);
+			}
+			// make the list head look unscheduled
+			expired.m_next = 0;
+			expired.m_prev = 0;
+
+			// skip ahead if all timers have fired
+			if (m_size == 0 && m_tick <= target)
+				m_tick = target + 1;
+		}
+	}
+
+	int timer_wheel::time_to_next() const
+	{
+		if (m_size == 0) return -1;
+
+		boost::int64_t next = -1;
+
+		// the first non-empty slot on the lowest level
+		// is the exact time of the next timer there
+		for (int i = 0; i < num_slots; ++i)
+		{
+			const timer_entry& head = m_slots[0][slot_index(m_tick + i, 0)];
+			if (head.m_next == &head) continue;
+			next = m_tick + i;
+			break;
+		}
+
+		// timers on higher levels need to be woken up for
+		// when their slots are cascaded down
+		for (int l = 1; l < num_levels; ++l)
+		{
+			const int shift = l * level_bits;
+			for (int i = 0; i <= num_slots; ++i)
+			{
+				const boost::int64_t slot_start
+					= ((m_tick >> shift) + i) << shift;
+				// the current slot has already been cascaded,
+				// unless we're right at the start of it
+				if (slot_start < m_tick) continue;
+				const timer_entry& head = m_slots[l][slot_index(slot_start, l)];
+				if (head.m_next == &head) continue;
+				if (next == -1 || slot_start < next) next = slot_start;
+				break;
+			}
+		}
+		if (next == -1) next = m_tick;
+		return int(std::max(boost::int64_t(0), next * tick_ms - m_now));
+	}
+
+}
@@ -41,6 +41,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem/convenience.hpp>
+#include <boost/bind.hpp>
 
 #include "libtorrent/torrent_handle.hpp"
 #include "libtorrent/session.hpp"
@@ -51,6 +52,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/entry.hpp"
 #include "libtorrent/peer.hpp"
 #include "libtorrent/peer_id.hpp"
+#include "libtorrent/alert_types.hpp"
 
 #if defined(_MSC_VER) && _MSC_VER < 1300
 namespace std
@@ -68,9 +70,28 @@ namespace
 	enum
 	{
 		// wait 60 seconds before retrying a failed tracker
-		tracker_retry_delay = 60
+		tracker_retry_delay = 60,
+
+		// the number of pieces picked in order in
+		// sequential mode, unless set_read_ahead() is called
+		default_read_ahead = 8,
+
+		// a block of a piece with a deadline is requested
+		// from at most this many peers at a time
+		time_critical_max_requests = 3
 	};
 
+	// the estimated number of milliseconds until the peer has
+	// sent us the given number of blocks. -1 if the peer hasn't
+	// sent us anything lately to estimate it from
+	int download_eta(const peer_connection& p, int blocks, int block_size)
+	{
+		float rate = p.statistics().download_rate();
+		if (rate <= 0.f) return -1;
+		return p.request_rtt()
+			+ static_cast<int>(blocks * block_size * 1000.f / rate);
+	}
+
 	int calculate_block_size(const torrent_info& i)
 	{
 		// TODO: if blocks_per_piece > 128 increase block-size
@@ -84,11 +105,18 @@ namespace
 
 		const entry::dictionary_type& info = e.dict();
 
-		// extract peer id
+		// extract peer id. UDP trackers don't send
+		// the ids, those peers get an id of all zeros
 		entry::dictionary_type::const_iterator i = info.find("peer id");
-		if (i == info.end()) throw std::runtime_error("invalid response from tracker");
-		if (i->second.string().length() != 20) throw std::runtime_error("invalid response from tracker");
-		std::copy(i->second.string().begin(), i->second.string().end(), ret.id.begin());
+		if (i == info.end())
+		{
+			ret.id = peer_id();
+		}
+		else
+		{
+			if (i->second.string().length() != 20) throw std::runtime_error("invalid response from tracker");
+			std::copy(i->second.string().begin(), i->second.string().end(), ret.id.begin());
+		}
 
 		// extract ip
 		i = info.find("ip");
@@ -103,20 +131,6 @@ namespace
 		return ret;
 	}
 
-	std::string escape_string(const char* str, int len)
-	{
-		std::stringstream ret;
-		ret << std::hex  << std::setfill('0');
-		for (int i = 0; i < len; ++i)
-		{
-			// TODO: should alnum() be replaced with printable()?
-			if (std::isalnum(static_cast<unsigned char>(*str))) ret << *str;
-			else ret << "%" << std::setw(2) << (int)static_cast<unsigned char>(*str);
-			++str;
-		}
-		return ret.str();
-	}
-
 	struct find_peer
 	{
 		find_peer(const peer_id& i, const torrent* t): id(i), tor(t) {}
@@ -143,6 +157,68 @@ namespace
 namespace libtorrent
 {
 
+	std::string escape_string(const char* str, int len)
+	{
+		std::stringstream ret;
+		ret << std::hex  << std::setfill('0');
+		for (int i = 0; i < len; ++i)
+		{
+			// TODO: should alnum() be replaced with printable()?
+			if (std::isalnum(static_cast<unsigned char>(*str))) ret << *str;
+			else ret << "%" << std::setw(2) << (int)static_cast<unsigned char>(*str);
+			++str;
+		}
+		return ret.str();
+	}
+
+	int file_piece_priorities(const torrent_info& info
+		, const std::vector<int>& file_priority, int index
+		, std::vector<int>& piece_priority)
+	{
+		assert(index >= 0 && index < int(info.num_files()));
+		assert(file_priority.size() == info.num_files());
+
+		piece_priority.clear();
+
+		// the offsets of the files in the torrent
+		const int num_files = int(info.num_files());
+		std::vector<entry::integer_type> offsets(num_files);
+		entry::integer_type offset = 0;
+		for (int i = 0; i < num_files; ++i)
+		{
+			offsets[i] = offset;
+			offset += info.file_at(i).size;
+		}
+
+		const entry::integer_type size = info.file_at(index).size;
+		if (size == 0) return -1;
+
+		const int piece_length = info.piece_length();
+		const int first = int(offsets[index] / piece_length);
+		const int last = int((offsets[index] + size - 1) / piece_length);
+
+		int file = 0;
+		for (int piece = first; piece <= last; ++piece)
+		{
+			const entry::integer_type start = entry::integer_type(piece) * piece_length;
+			const entry::integer_type end = start + info.piece_size(piece);
+
+			// the files the piece overlaps follow each other,
+			// starting with the one the piece starts in
+			while (offsets[file] + info.file_at(file).size <= start)
+				++file;
+
+			int priority = 0;
+			for (int i = file; i < num_files && offsets[i] < end; ++i)
+			{
+				if (info.file_at(i).size == 0) continue;
+				priority = std::max(priority, file_priority[i]);
+			}
+			piece_priority.push_back(priority);
+		}
+		return first;
+	}
+
 	torrent::torrent(
 		detail::session_impl& ses
 		, const torrent_info& torrent_file
@@ -151,79 +227,103 @@ namespace libtorrent
 		, m_abort(false)
 		, m_event(event_started)
 		, m_torrent_file(torrent_file)
-		, m_storage(m_torrent_file, save_path)
+		, m_storage(m_torrent_file, save_path, ses.m_block_pool)
 		, m_next_request(boost::posix_time::second_clock::local_time())
 		, m_duration(1800)
+		, m_max_connections(-1)
 		, m_policy(new policy(this))
 		, m_ses(ses)
 		, m_picker(torrent_file.piece_length() / m_block_size,
 			(torrent_file.total_size()+m_block_size-1)/m_block_size)
 		, m_last_working_tracker(0)
 		, m_currently_trying_tracker(0)
-		, m_time_scaler(0)
+		, m_num_complete(-1)
+		, m_num_incomplete(-1)
+		, m_announce_slot(-1)
+		, m_started(false)
 		, m_priority(.5)
 		, m_num_pieces(0)
+		, m_sequential_download(false)
+		, m_read_ahead(default_read_ahead)
+		, m_sequential_cursor(0)
 	{
 		assert(torrent_file.begin_files() != torrent_file.end_files());
 		m_have_pieces.resize(torrent_file.num_pieces(), false);
+		m_file_priority.resize(torrent_file.num_files()
+			, piece_picker::default_priority);
 	}
 
 	torrent::~torrent()
 	{
 		if (m_ses.m_abort) m_abort = true;
+		// torrents that haven't been started have never
+		// queued any peers, and may not touch the session
+		if (m_started)
+		{
+			m_ses.m_connection_queue.remove(this);
+			m_ses.m_tracker_scheduler.cancel_announce(m_announce_slot);
+			m_ses.m_resolver.cancel(this);
+			m_ses.m_udp_tracker_manager.abort_request(this);
+		}
 	}
 
 	void torrent::tracker_response(const entry& e)
 	{
 		std::vector<peer> peer_list;
+		std::vector<address> compact_peers;
 		try
 		{
 			// parse the response
-			parse_response(e, peer_list);
+			parse_response(e, peer_list, compact_peers);
 
 			m_last_working_tracker
 				= m_torrent_file.prioritize_tracker(m_currently_trying_tracker);
-			m_next_request = boost::posix_time::second_clock::local_time()
-				+ boost::posix_time::seconds(m_duration);
+			set_next_request(m_duration);
 			m_currently_trying_tracker = 0;
 
 			// connect to random peers from the list
 			std::random_shuffle(peer_list.begin(), peer_list.end());
+			std::random_shuffle(compact_peers.begin(), compact_peers.end());
 
-
-			std::cout << "interval: " << m_duration << "\n";
-			std::cout << "peers:\n";
-			for (std::vector<peer>::const_iterator i = peer_list.begin();
-				i != peer_list.end();
-				++i)
-			{
-				std::cout << "  " << std::setfill(' ') << std::setw(16) << i->ip
-					<< " " << std::setw(5) << std::dec << i->port << "  "
-					<< i->id << " " << extract_fingerprint(i->id) << "\n";
-			}
-			std::cout << std::setfill(' ');
-
+#ifndef NDEBUG
+			(*m_ses.m_logger) << "tracker response, interval: " << m_duration
+				<< " peers: " << int(peer_list.size())
+				<< " compact peers: " << int(compact_peers.size()) << "\n";
+#endif
 
 			// for each of the peers we got from the tracker
 			for (std::vector<peer>::iterator i = peer_list.begin();
 				i != peer_list.end();
 				++i)
 			{
-				// don't make connections to ourself
-				if (i->id == m_ses.get_peer_id())
-					continue;
-
-				address a(i->ip, i->port);
-
-				// if we aleady have a connection to the person, don't make another one
-				if (std::find_if(m_ses.m_connections.begin(),
-					m_ses.m_connections.end(),
-					find_peer(i->id, this)) != m_ses.m_connections.end())
+				if (!i->id.is_all_zeros())
 				{
-					continue;
+					// don't make connections to ourself
+					if (i->id == m_ses.get_peer_id())
+						continue;
+
+					// if we aleady have a connection to the person, don't make another one
+					if (std::find_if(m_ses.m_connections.begin(),
+						m_ses.m_connections.end(),
+						find_peer(i->id, this)) != m_ses.m_connections.end())
+					{
+						continue;
+					}
 				}
 
-				m_policy->peer_from_tracker(a, i->id);
+				// the ip may be a hostname, it's looked up
+				// without blocking
+				m_ses.m_resolver.async_resolve(i->ip, i->port, this
+					, boost::bind(&torrent::on_peer_resolved, this, _1, _2, i->id));
+			}
+
+			// the compact peers don't have any ids and their
+			// addresses don't need to be looked up
+			for (std::vector<address>::iterator i = compact_peers.begin();
+				i != compact_peers.end();
+				++i)
+			{
+				on_peer_resolved(0, *i, peer_id());
 			}
 
 		}
@@ -251,6 +351,310 @@ namespace libtorrent
 			!= m_connections.end();
 	}
 
+	void torrent::set_max_connections(int limit)
+	{
+		assert(limit > 0 || limit == -1);
+		m_max_connections = limit;
+	}
+
+	void torrent::set_piece_priority(int index, int priority)
+	{
+		assert(index >= 0 && index < m_torrent_file.num_pieces());
+		assert(priority >= 0 && priority < piece_picker::priority_levels);
+
+		bool unfiltered = m_picker.piece_priority(index) == 0 && priority > 0;
+		m_picker.set_piece_priority(index, priority);
+		priorities_changed(unfiltered);
+	}
+
+	int torrent::piece_priority(int index) const
+	{
+		assert(index >= 0 && index < m_torrent_file.num_pieces());
+		return m_picker.piece_priority(index);
+	}
+
+	void torrent::set_file_priority(int index, int priority)
+	{
+		assert(index >= 0 && index < int(m_file_priority.size()));
+		assert(priority >= 0 && priority < piece_picker::priority_levels);
+
+		m_file_priority[index] = priority;
+
+		std::vector<int> piece_priority;
+		const int first = file_piece_priorities(m_torrent_file
+			, m_file_priority, index, piece_priority);
+		if (first < 0) return;
+
+		bool unfiltered = false;
+		for (int i = 0; i < int(piece_priority.size()); ++i)
+		{
+			const int piece = first + i;
+			if (m_picker.piece_priority(piece) == 0 && piece_priority[i] > 0)
+				unfiltered = true;
+			m_picker.set_piece_priority(piece, piece_priority[i]);
+		}
+		priorities_changed(unfiltered);
+	}
+
+	int torrent::file_priority(int index) const
+	{
+		assert(index >= 0 && index < int(m_file_priority.size()));
+		return m_file_priority[index];
+	}
+
+	void torrent::priorities_changed(bool unfiltered)
+	{
+		std::vector<bool> filter;
+		m_picker.filtered_pieces(filter);
+
+		// the blocks wouldn't be written anyway
+		for (std::vector<peer_connection*>::iterator i = m_connections.begin();
+			i != m_connections.end(); ++i)
+		{
+			std::vector<piece_block> queue((*i)->download_queue().begin()
+				, (*i)->download_queue().end());
+			for (std::vector<piece_block>::iterator j = queue.begin();
+				j != queue.end(); ++j)
+			{
+				if (filter[j->piece_index]) (*i)->cancel_block(*j);
+			}
+		}
+
+		// without any filtered pieces, the storage
+		// doesn't have to look at the filter
+		if (std::find(filter.begin(), filter.end(), true) == filter.end())
+			filter.clear();
+		m_storage.set_piece_filter(filter);
+
+		if (unfiltered)
+		{
+			// the sequential cursor may have passed
+			// pieces that are wanted now
+			m_sequential_cursor = 0;
+			if (m_started) advance_sequential_cursor();
+		}
+
+		// peers may have become interesting, or may
+		// only have pieces we don't want anymore
+		for (std::vector<peer_connection*>::iterator i = m_connections.begin();
+			i != m_connections.end(); ++i)
+		{
+			bool wanted = false;
+			for (int j = 0; j < m_torrent_file.num_pieces(); ++j)
+			{
+				if (!(*i)->has_piece(j) || m_have_pieces[j]
+					|| m_picker.piece_priority(j) == 0) continue;
+				wanted = true;
+				break;
+			}
+			if (wanted && !(*i)->is_interesting())
+				m_policy->peer_is_interesting(**i);
+			else if (!wanted && (*i)->is_interesting())
+				m_policy->peer_is_uninteresting(**i);
+		}
+	}
+
+	void torrent::set_piece_deadline(int index, int deadline)
+	{
+		assert(index >= 0 && index < m_torrent_file.num_pieces());
+		assert(deadline >= 0);
+
+		reset_piece_deadline(index);
+
+		// until the files have been checked, we don't know
+		// which pieces we have. Those are posted by start()
+		if (m_started && m_have_pieces[index])
+		{
+			post_piece_finished(index);
+			return;
+		}
+
+		time_critical_piece p;
+		p.piece = index;
+		p.deadline = m_ses.m_timers.now() + deadline;
+		m_time_critical_pieces.insert(std::upper_bound(
+			m_time_critical_pieces.begin(), m_time_critical_pieces.end(), p), p);
+
+		if (m_started) request_time_critical_pieces();
+	}
+
+	void torrent::reset_piece_deadline(int index)
+	{
+		assert(index >= 0 && index < m_torrent_file.num_pieces());
+
+		for (std::vector<time_critical_piece>::iterator i
+			= m_time_critical_pieces.begin();
+			i != m_time_critical_pieces.end(); ++i)
+		{
+			if (i->piece != index) continue;
+			m_time_critical_pieces.erase(i);
+			return;
+		}
+	}
+
+	void torrent::request_time_critical_pieces()
+	{
+		if (m_time_critical_pieces.empty()) return;
+
+		// choked and snubbed peers wouldn't send
+		// the blocks in time. The ones we shouldn't request
+		// more from right now are left out too
+		std::vector<peer_connection*> peers;
+		for (peer_iterator i = m_connections.begin();
+			i != m_connections.end(); ++i)
+		{
+			if ((*i)->has_peer_choked() || (*i)->is_snubbed()) continue;
+			if (!(*i)->can_request_blocks()) continue;
+			peers.push_back(*i);
+		}
+		if (peers.empty()) return;
+
+		const timer_wheel::time_type now = m_ses.m_timers.now();
+
+		// the pieces with the earliest deadlines get
+		// the fastest peers
+		for (std::vector<time_critical_piece>::iterator i
+			= m_time_critical_pieces.begin();
+			i != m_time_critical_pieces.end(); ++i)
+		{
+			const int piece = i->piece;
+			if (m_picker.piece_priority(piece) == 0) continue;
+
+			const int time_left = static_cast<int>(i->deadline - now);
+			const int num_blocks = m_picker.blocks_in_piece(piece);
+
+			for (int j = 0; j < num_blocks; ++j)
+			{
+				piece_block block(piece, j);
+				if (m_picker.is_finished(block)) continue;
+
+				const int num_requests = m_picker.num_requests(block);
+				if (num_requests >= time_critical_max_requests) continue;
+
+				if (num_requests > 0)
+				{
+					// the block is requested again only if none of
+					// the peers it's requested from is expected to
+					// send it with a margin to the deadline. If we
+					// can't tell, it's requested again once the
+					// deadline has passed
+					int eta = -1;
+					for (peer_iterator k = m_connections.begin();
+						k != m_connections.end(); ++k)
+					{
+						const std::deque<piece_block>& queue = (*k)->download_queue();
+						std::deque<piece_block>::const_iterator pos
+							= std::find(queue.begin(), queue.end(), block);
+						if (pos == queue.end()) continue;
+						int e = download_eta(**k, pos - queue.begin() + 1, m_block_size);
+						if (e >= 0 && (eta < 0 || e < eta)) eta = e;
+					}
+					if (eta >= 0 ? eta * 2 < time_left : time_left > 0) continue;
+				}
+
+				// the peer that is expected to send the block the
+				// soonest, counting the blocks already queued on it.
+				// Peers we don't know the rate of are only used
+				// if there's no other
+				peer_connection* peer = 0;
+				int best_eta = -1;
+				for (std::vector<peer_connection*>::iterator k = peers.begin();
+					k != peers.end(); ++k)
+				{
+					if (!(*k)->has_piece(piece)) continue;
+					const std::deque<piece_block>& queue = (*k)->download_queue();
+					if (std::find(queue.begin(), queue.end(), block) != queue.end())
+						continue;
+					int e = download_eta(**k, queue.size() + 1, m_block_size);
+					if (peer == 0 || (e >= 0 && (best_eta < 0 || e < best_eta)))
+					{
+						peer = *k;
+						best_eta = e;
+					}
+				}
+
+				if (peer == 0) continue;
+				peer->request_block(block);
+			}
+		}
+	}
+
+	void torrent::post_piece_finished(int index)
+	{
+		// the buffer is handed to the user, so it isn't
+		// allocated from the block pool
+		const int size = static_cast<int>(m_torrent_file.piece_size(index));
+		boost::shared_array<char> buffer(new char[size]);
+		m_storage.read(buffer.get(), index, 0, size);
+
+		m_ses.m_alerts.post_alert(piece_finished_alert(
+			m_torrent_file.info_hash(), index, buffer, size
+			, "piece " + boost::lexical_cast<std::string>(index) + " finished"));
+	}
+
+	void torrent::set_sequential_download(bool sequential)
+	{
+		m_sequential_download = sequential;
+		m_sequential_cursor = 0;
+		if (m_started) advance_sequential_cursor();
+	}
+
+	void torrent::set_read_ahead(int pieces)
+	{
+		assert(pieces > 0);
+		m_read_ahead = pieces;
+	}
+
+	void torrent::advance_sequential_cursor()
+	{
+		const int num_pieces = m_torrent_file.num_pieces();
+		while (m_sequential_cursor < num_pieces
+			&& (m_have_pieces[m_sequential_cursor]
+				|| m_picker.piece_priority(m_sequential_cursor) == 0))
+		{
+			++m_sequential_cursor;
+		}
+	}
+
+	void torrent::queue_connection(const address& a, const peer_id& id
+		, bool priority)
+	{
+		assert(m_started);
+		m_ses.m_connection_queue.enqueue(this, a, id, priority);
+	}
+
+	peer_connection* torrent::connection_for(const address& a) const
+	{
+		for (peer_const_iterator i = m_connections.begin();
+			i != m_connections.end(); ++i)
+		{
+			if ((*i)->get_socket()->sender() == a) return *i;
+		}
+		return 0;
+	}
+
+	void torrent::set_upload_limit(int limit)
+	{
+		assert(limit > 0 || limit == -1);
+		m_bandwidth_limit[peer_connection::upload_channel].throttle(limit);
+		for (peer_iterator i = m_connections.begin();
+			i != m_connections.end(); ++i)
+		{
+			(*i)->update_send_quota();
+		}
+	}
+
+	void torrent::set_download_limit(int limit)
+	{
+		assert(limit > 0 || limit == -1);
+		m_bandwidth_limit[peer_connection::download_channel].throttle(limit);
+		for (peer_iterator i = m_connections.begin();
+			i != m_connections.end(); ++i)
+		{
+			(*i)->update_recv_quota();
+		}
+	}
+
 	torrent::size_type torrent::bytes_left() const
 	{
 		size_type have_bytes = m_num_pieces * m_torrent_file.piece_length();
@@ -331,12 +735,24 @@ namespace libtorrent
 		m_picker.we_have(index);
 		for (std::vector<peer_connection*>::iterator i = m_connections.begin(); i != m_connections.end(); ++i)
 			(*i)->announce_piece(index);
+
+		for (std::vector<time_critical_piece>::iterator i
+			= m_time_critical_pieces.begin();
+			i != m_time_critical_pieces.end(); ++i)
+		{
+			if (i->piece != index) continue;
+			m_time_critical_pieces.erase(i);
+			post_piece_finished(index);
+			break;
+		}
+
+		if (m_sequential_download) advance_sequential_cursor();
 	}
 
 	std::string torrent::generate_tracker_request(int port)
 	{
 		m_duration = 1800;
-		m_next_request = boost::posix_time::second_clock::local_time() + boost::posix_time::seconds(m_duration);
+		set_next_request(m_duration);
 
 		std::vector<char> buffer;
 		std::string request = m_torrent_file.trackers()[m_currently_trying_tracker].url;
@@ -359,6 +775,10 @@ namespace libtorrent
 		request += "&left=";
 		request += boost::lexical_cast<std::string>(bytes_left());
 
+		// trackers that support it will send the peers as a
+		// string of 6 bytes per peer, others ignore this
+		request += "&compact=1";
+
 		if (m_event != event_none)
 		{
 			const char* event_string[] = {"started", "stopped", "completed"};
@@ -370,7 +790,82 @@ namespace libtorrent
 		return request;
 	}
 
-	void torrent::parse_response(const entry& e, std::vector<peer>& peer_list)
+	udp_tracker_request torrent::generate_udp_tracker_request(int port)
+	{
+		m_duration = 1800;
+		set_next_request(m_duration);
+
+		udp_tracker_request req;
+		req.url = m_torrent_file.trackers()[m_currently_trying_tracker].url;
+		req.info_hash = m_torrent_file.info_hash();
+		req.id = m_ses.get_peer_id();
+		req.downloaded = m_stat.total_download();
+		req.uploaded = m_stat.total_upload();
+		req.left = bytes_left();
+		req.listen_port = port;
+
+		switch (m_event)
+		{
+		case event_started: req.event = udp_tracker_request::started; break;
+		case event_stopped: req.event = udp_tracker_request::stopped; break;
+		case event_completed: req.event = udp_tracker_request::completed; break;
+		default: req.event = udp_tracker_request::none; break;
+		}
+		m_event = event_none;
+
+		return req;
+	}
+
+	void torrent::announce(request_callback* c)
+	{
+		const std::string& url = m_torrent_file.trackers()[m_currently_trying_tracker].url;
+		if (url.compare(0, 6, "udp://") == 0)
+		{
+			m_ses.m_udp_tracker_manager.queue_request(
+				generate_udp_tracker_request(m_ses.m_listen_port), c);
+		}
+		else
+		{
+			m_ses.m_tracker_manager.queue_request(
+				generate_tracker_request(m_ses.m_listen_port), c);
+		}
+	}
+
+	void torrent::on_peer_resolved(int error, const address& a, const peer_id& id)
+	{
+		if (error != 0 || m_abort) return;
+
+		// we may have connected to the peer while
+		// its address was looked up
+		if (id.is_all_zeros())
+		{
+			if (connection_for(a) != 0) return;
+		}
+		else if (std::find_if(m_ses.m_connections.begin(),
+			m_ses.m_connections.end(),
+			find_peer(id, this)) != m_ses.m_connections.end())
+		{
+			return;
+		}
+
+		m_policy->peer_from_tracker(a, id);
+	}
+
+	void torrent::local_peer_found(const address& a)
+	{
+		if (m_abort || connection_for(a) != 0) return;
+		m_policy->peer_from_lsd(a);
+	}
+
+	void torrent::dht_peer_found(const address& a)
+	{
+		if (m_abort || connection_for(a) != 0) return;
+		m_policy->peer_from_tracker(a, peer_id());
+	}
+
+	void torrent::parse_response(const entry& e
+		, std::vector<peer>& peer_list
+		, std::vector<address>& compact_peers)
 	{
 		entry::dictionary_type::const_iterator i = e.dict().find("failure reason");
 		if (i != e.dict().end())
@@ -384,10 +879,34 @@ namespace libtorrent
 
 		m_duration = i->second.integer();
 
+		// the swarm size, not all trackers send it
+		entry::dictionary_type::const_iterator complete = msg.find("complete");
+		entry::dictionary_type::const_iterator incomplete = msg.find("incomplete");
+		if (complete != msg.end() && incomplete != msg.end())
+			set_swarm_size(complete->second.integer(), incomplete->second.integer());
+
 		i = msg.find("peers");
 		if (i == msg.end()) throw std::runtime_error("invalid response from tracker (no peers)");
 
 		peer_list.clear();
+		compact_peers.clear();
+
+		// the compact form is a string of 4 bytes ip and
+		// 2 bytes port per peer, both in network byte order
+		if (i->second.type() == entry::string_t)
+		{
+			const std::string& s = i->second.string();
+			if (s.size() % 6 != 0) throw std::runtime_error("invalid response from tracker (invalid compact peer list)");
+			compact_peers.reserve(s.size() / 6);
+			const unsigned char* p = reinterpret_cast<const unsigned char*>(s.data());
+			const unsigned char* end = p + s.size();
+			for (; p != end; p += 6)
+			{
+				compact_peers.push_back(address(p[0], p[1], p[2], p[3]
+					, static_cast<unsigned short>((p[4] << 8) | p[5])));
+			}
+			return;
+		}
 
 		const entry::list_type& l = i->second.list();
 		for(entry::list_type::const_iterator i = l.begin(); i != l.end(); ++i)
@@ -428,6 +947,10 @@ namespace libtorrent
 
 	peer_connection& torrent::connect_to_peer(const address& a, const peer_id& id)
 	{
+		// don't exceed the connection limit of the peer's class
+		if (m_ses.m_classes[m_ses.m_class_map.class_for(a)].is_full())
+			throw network_error(0);
+
 		boost::shared_ptr<socket> s(new socket(socket::tcp, false));
 		s->connect(a);
 		boost::shared_ptr<peer_connection> c(new peer_connection(
@@ -436,7 +959,6 @@ namespace libtorrent
 			, this
 			, s
 			, id));
-		if (m_ses.m_upload_rate != -1) c->set_send_quota(0);
 		detail::session_impl::connection_map::iterator p =
 			m_ses.m_connections.insert(std::make_pair(s, c)).first;
 
@@ -501,12 +1023,12 @@ namespace libtorrent
 		{
 			// if we've looped the tracker list, wait a bit before retrying
 			m_currently_trying_tracker = 0;
-			m_next_request = boost::posix_time::second_clock::local_time() + boost::posix_time::seconds(tracker_retry_delay);
+			set_next_request(tracker_retry_delay);
 		}
 		else
 		{
 			// don't delay before trying the next tracker
-			m_next_request = boost::posix_time::second_clock::local_time();
+			set_next_request(0);
 		}
 	}
 
@@ -519,6 +1041,9 @@ namespace libtorrent
 		  , m_have_pieces.end()
 		  , 0);
 
+		// the priorities may be set while the files are checked,
+		// by a torrent_handle that holds the checker's mutex
+		boost::mutex::scoped_lock l(mutex);
 		m_picker.files_checked(m_have_pieces);
 #ifndef NDEBUG
 		m_picker.integrity_check(this);
@@ -533,15 +1058,78 @@ namespace libtorrent
 	}
 #endif
 
-	void torrent::second_tick()
+	void torrent::start()
+	{
+		assert(!m_started);
+		m_started = true;
+		set_next_request(0);
+		m_ses.m_lsd.announce(m_torrent_file.info_hash());
+		m_ses.m_timers.schedule(m_pulse_timer, this, 10 * 1000);
+		m_ses.m_timers.schedule(m_dht_timer, this, 0);
+
+		// the deadlines may have been set on pieces
+		// that were found when the files were checked
+		for (std::vector<time_critical_piece>::iterator i
+			= m_time_critical_pieces.begin();
+			i != m_time_critical_pieces.end();)
+		{
+			if (!m_have_pieces[i->piece]) { ++i; continue; }
+			post_piece_finished(i->piece);
+			i = m_time_critical_pieces.erase(i);
+		}
+
+		advance_sequential_cursor();
+	}
+
+	void torrent::set_next_request(int seconds)
+	{
+		// the session spreads out the announces of
+		// all torrents
+		if (m_started)
+			seconds = m_ses.m_tracker_scheduler.announce_delay(seconds, m_announce_slot);
+		m_next_request = boost::posix_time::second_clock::local_time()
+			+ boost::posix_time::seconds(seconds);
+		if (m_started)
+			m_ses.m_timers.schedule(m_announce_timer, this, seconds * 1000);
+	}
+
+	void torrent::on_timer(timer_entry& t)
 	{
-		m_time_scaler++;
-		if (m_time_scaler >= 10)
+		// the session sends the last tracker request
+		// for aborted torrents
+		if (m_abort) return;
+
+		if (&t == &m_pulse_timer)
 		{
-			m_time_scaler = 0;
 			m_policy->pulse();
+			m_ses.m_timers.schedule(m_pulse_timer, this, 10 * 1000);
+			return;
 		}
 
+		if (&t == &m_dht_timer)
+		{
+			// while the dht isn't running, it's checked
+			// once a minute whether it has been started
+			if (m_ses.m_dht.is_running())
+			{
+				m_ses.m_dht.get_peers(m_torrent_file.info_hash(), m_ses.m_listen_port);
+				m_ses.m_timers.schedule(m_dht_timer, this, 15 * 60 * 1000);
+			}
+			else
+			{
+				m_ses.m_timers.schedule(m_dht_timer, this, 60 * 1000);
+			}
+			return;
+		}
+
+		assert(&t == &m_announce_timer);
+		// the slot is used up
+		m_announce_slot = -1;
+		announce(this);
+	}
+
+	void torrent::second_tick()
+	{
 		for (std::vector<peer_connection*>::iterator i = m_connections.begin();
 			i != m_connections.end();
 			++i)
@@ -552,17 +1140,24 @@ namespace libtorrent
 			p->second_tick();
 		}
 
+		request_time_critical_pieces();
+
 		m_stat.second_tick();
 	}
 
+	block_pool& torrent::buffer_pool()
+	{
+		return m_ses.m_block_pool;
+	}
+
 	bool torrent::verify_piece(int piece_index)
 	{
 		size_type size = m_torrent_file.piece_size(piece_index);
-		std::vector<char> buffer(size);
-		m_storage.read(&buffer[0], piece_index, 0, size);
+		boost::shared_array<char> buffer = m_ses.m_block_pool.allocate(size);
+		m_storage.read(buffer.get(), piece_index, 0, size);
 
 		hasher h;
-		h.update(&buffer[0], size);
+		h.update(buffer.get(), size);
 		sha1_hash digest = h.final();
 
 		if (m_torrent_file.hash_for_piece(piece_index) != digest)
@@ -609,6 +1204,9 @@ namespace libtorrent
 		st.next_announce = next_announce()
 			- boost::posix_time::second_clock::local_time();
 
+		st.num_complete = m_num_complete;
+		st.num_incomplete = m_num_incomplete;
+
 		// TODO: this is not accurate because it assumes the last
 		// block is m_block_size bytes
 		// TODO: st.pieces could be a const pointer maybe?
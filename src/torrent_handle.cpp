@@ -92,6 +92,340 @@ namespace libtorrent
 		}
 		throw invalid_handle();
 	}
+
+	void torrent_handle::set_max_connections(int max_connections)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_max_connections(max_connections);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_max_connections(max_connections);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_piece_priority(int index, int priority)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_piece_priority(index, priority);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_piece_priority(index, priority);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	int torrent_handle::piece_priority(int index) const
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0) return t->piece_priority(index);
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0) return d->torrent_ptr->piece_priority(index);
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_file_priority(int index, int priority)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_file_priority(index, priority);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_file_priority(index, priority);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	int torrent_handle::file_priority(int index) const
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0) return t->file_priority(index);
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0) return d->torrent_ptr->file_priority(index);
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_piece_deadline(int index, int deadline)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_piece_deadline(index, deadline);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_piece_deadline(index, deadline);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::reset_piece_deadline(int index)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->reset_piece_deadline(index);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->reset_piece_deadline(index);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_sequential_download(bool sequential)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_sequential_download(sequential);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_sequential_download(sequential);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_read_ahead(int pieces)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_read_ahead(pieces);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_read_ahead(pieces);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_upload_limit(int limit)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_upload_limit(limit);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_upload_limit(limit);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_download_limit(int limit)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				t->set_download_limit(limit);
+				return;
+			}
+		}
+
+		{
+			boost::mutex::scoped_lock l(m_chk->m_mutex);
+
+			detail::piece_checker_data* d = m_chk->find_torrent(m_info_hash);
+			if (d != 0)
+			{
+				d->torrent_ptr->set_download_limit(limit);
+				return;
+			}
+		}
+		throw invalid_handle();
+	}
+
+	void torrent_handle::set_peer_upload_limit(const address& ip, int limit)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				peer_connection* p = t->connection_for(ip);
+				if (p != 0) p->set_upload_limit(limit);
+				return;
+			}
+		}
+
+		// torrents that are being checked don't have any peers
+		boost::mutex::scoped_lock l(m_chk->m_mutex);
+		if (m_chk->find_torrent(m_info_hash) == 0) throw invalid_handle();
+	}
+
+	void torrent_handle::set_peer_download_limit(const address& ip, int limit)
+	{
+		if (m_ses == 0) throw invalid_handle();
+
+		assert(m_chk != 0);
+		{
+			boost::mutex::scoped_lock l(m_ses->m_mutex);
+			torrent* t = m_ses->find_torrent(m_info_hash);
+			if (t != 0)
+			{
+				peer_connection* p = t->connection_for(ip);
+				if (p != 0) p->set_download_limit(limit);
+				return;
+			}
+		}
+
+		// torrents that are being checked don't have any peers
+		boost::mutex::scoped_lock l(m_chk->m_mutex);
+		if (m_chk->find_torrent(m_info_hash) == 0) throw invalid_handle();
+	}
 	
 	torrent_status torrent_handle::status() const
 	{
@@ -240,9 +574,14 @@ namespace libtorrent
 
 			p.upload_limit = peer->send_quota();
 			p.upload_ceiling = peer->send_quota_limit();
+			p.peer_class = peer->peer_class();
 
 			p.load_balancing = peer->total_free_upload();
 
+			p.download_queue_length = peer->download_queue().size();
+			p.desired_queue_length = peer->desired_queue_size();
+			p.rtt = peer->request_rtt();
+
 			boost::optional<piece_block_progress> ret = peer->downloading_piece();
 			if (ret)
 			{
@@ -264,6 +603,7 @@ namespace libtorrent
 			if (peer->is_choked()) p.flags |= peer_info::choked;
 			if (peer->is_peer_interested()) p.flags |= peer_info::remote_interested;
 			if (peer->has_peer_choked()) p.flags |= peer_info::remote_choked;
+			if (peer->is_snubbed()) p.flags |= peer_info::snubbed;
 
 			p.pieces = peer->get_bitfield();
 		}
@@ -0,0 +1,278 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+#include <cstdlib>
+
+#include "libtorrent/tracker_scheduler.hpp"
+#include "libtorrent/session.hpp"
+#include "libtorrent/torrent.hpp"
+
+namespace
+{
+	// returns the scrape url that corresponds to the given
+	// announce url, or an empty string if the tracker doesn't
+	// support scraping. By convention the last element of the
+	// path must start with "announce", and it's replaced by
+	// "scrape". UDP trackers are scraped on the announce url
+	std::string scrape_url(const std::string& announce)
+	{
+		if (announce.compare(0, 6, "udp://") == 0) return announce;
+
+		std::string::size_type pos = announce.rfind('/');
+		if (pos == std::string::npos
+			|| announce.compare(pos + 1, 8, "announce") != 0)
+			return std::string();
+
+		return announce.substr(0, pos + 1) + "scrape" + announce.substr(pos + 9);
+	}
+}
+
+namespace libtorrent
+{
+
+	scrape_batch::scrape_batch(detail::session_impl& ses
+		, const std::string& url
+		, const std::vector<sha1_hash>& hashes)
+		: m_ses(ses)
+		, m_url(url)
+		, m_hashes(hashes)
+		, m_done(false)
+	{
+		assert(!m_hashes.empty());
+	}
+
+	void scrape_batch::send()
+	{
+		if (m_url.compare(0, 6, "udp://") == 0)
+		{
+			udp_tracker_request req;
+			req.kind = udp_tracker_request::scrape_request;
+			req.url = m_url;
+			req.scrape_hashes = m_hashes;
+			m_ses.m_udp_tracker_manager.queue_request(req, this);
+			return;
+		}
+
+		std::string request = m_url;
+		char separator = request.find('?') == std::string::npos ? '?' : '&';
+		for (std::vector<sha1_hash>::const_iterator i = m_hashes.begin();
+			i != m_hashes.end(); ++i)
+		{
+			request += separator;
+			request += "info_hash=";
+			request += escape_string(reinterpret_cast<const char*>(i->begin()), 20);
+			separator = '&';
+		}
+		m_ses.m_tracker_manager.queue_request(request, this);
+	}
+
+	void scrape_batch::tracker_response(const entry& e)
+	{
+		m_done = true;
+		try
+		{
+			entry::dictionary_type::const_iterator f = e.dict().find("files");
+			if (f == e.dict().end()) return;
+			const entry::dictionary_type& files = f->second.dict();
+			for (entry::dictionary_type::const_iterator i = files.begin();
+				i != files.end(); ++i)
+			{
+				if (i->first.size() != 20) continue;
+				sha1_hash h;
+				std::copy(i->first.begin(), i->first.end(), h.begin());
+
+				// the torrent may have been removed
+				torrent* t = m_ses.find_torrent(h);
+				if (t == 0) continue;
+
+				const entry::dictionary_type& info = i->second.dict();
+				entry::dictionary_type::const_iterator complete = info.find("complete");
+				entry::dictionary_type::const_iterator incomplete = info.find("incomplete");
+				if (complete == info.end() || incomplete == info.end()) continue;
+				t->set_swarm_size(complete->second.integer(), incomplete->second.integer());
+			}
+		}
+		catch(std::exception&)
+		{
+			// the response is ignored, the torrents
+			// will get their numbers when they announce
+		}
+	}
+
+	void scrape_batch::tracker_request_timed_out()
+	{
+		m_done = true;
+	}
+
+	void scrape_batch::tracker_request_error(const char* str)
+	{
+		m_done = true;
+	}
+
+#ifndef NDEBUG
+	void scrape_batch::debug_log(const std::string& line)
+	{
+		(*m_ses.m_logger) << line << "\n";
+	}
+#endif
+
+	tracker_scheduler::tracker_scheduler(detail::session_impl& ses)
+		: m_ses(ses)
+	{}
+
+	tracker_scheduler::~tracker_scheduler()
+	{
+		// the tracker managers may still hold on
+		// to the requests' callbacks
+		for (std::list<boost::shared_ptr<scrape_batch> >::iterator i
+			= m_requests.begin(); i != m_requests.end(); ++i)
+		{
+			if ((*i)->done()) continue;
+			m_ses.m_tracker_manager.abort_request(i->get());
+			m_ses.m_udp_tracker_manager.abort_request(i->get());
+		}
+	}
+
+	int tracker_scheduler::announce_delay(int seconds, boost::int64_t& slot)
+	{
+		assert(seconds >= 0);
+
+		// a torrent that reschedules its announce
+		// doesn't keep the old slot
+		cancel_announce(slot);
+
+		// announces that are far enough away are made a bit
+		// earlier than asked for, by a random amount
+		if (seconds >= 60)
+			seconds -= std::rand() % (seconds * announce_jitter / 100 + 1);
+
+		const boost::int64_t now = m_ses.m_timers.now() / 1000;
+		m_announces.erase(m_announces.begin(), m_announces.lower_bound(now));
+
+		// find the first second that isn't full
+		boost::int64_t when = now + seconds;
+		std::map<boost::int64_t, int>::iterator i = m_announces.lower_bound(when);
+		while (i != m_announces.end() && i->first == when
+			&& i->second >= max_announces_per_second)
+		{
+			++i;
+			++when;
+		}
+		++m_announces[when];
+		slot = when;
+		return int(when - now);
+	}
+
+	void tracker_scheduler::cancel_announce(boost::int64_t slot)
+	{
+		if (slot < 0) return;
+		std::map<boost::int64_t, int>::iterator i = m_announces.find(slot);
+		if (i == m_announces.end()) return;
+		assert(i->second > 0);
+		if (--i->second == 0) m_announces.erase(i);
+	}
+
+	void tracker_scheduler::start()
+	{
+		m_ses.m_timers.schedule(m_scrape_timer, this, scrape_interval * 1000);
+	}
+
+	void tracker_scheduler::queue_scrapes()
+	{
+		// the torrents, grouped by the scrape url
+		// of their tracker
+		std::map<std::string, std::vector<sha1_hash> > batches;
+		for (std::map<sha1_hash, boost::shared_ptr<torrent> >::iterator i
+			= m_ses.m_torrents.begin(); i != m_ses.m_torrents.end(); ++i)
+		{
+			torrent& t = *i->second;
+			if (t.is_aborted() || t.torrent_file().trackers().empty()) continue;
+
+			std::string url = scrape_url(t.tracker_url());
+			if (url.empty()) continue;
+			batches[url].push_back(i->first);
+		}
+
+		for (std::map<std::string, std::vector<sha1_hash> >::iterator i
+			= batches.begin(); i != batches.end(); ++i)
+		{
+			std::vector<sha1_hash>& hashes = i->second;
+			for (std::vector<sha1_hash>::iterator j = hashes.begin();
+				j != hashes.end();)
+			{
+				std::vector<sha1_hash>::iterator end = j
+					+ std::min(int(hashes.end() - j), int(max_scrape_batch));
+				m_scrape_queue.push_back(boost::shared_ptr<scrape_batch>(
+					new scrape_batch(m_ses, i->first, std::vector<sha1_hash>(j, end))));
+				j = end;
+			}
+		}
+	}
+
+	void tracker_scheduler::on_timer(timer_entry& t)
+	{
+		// forget the requests that are done
+		for (std::list<boost::shared_ptr<scrape_batch> >::iterator i
+			= m_requests.begin(); i != m_requests.end();)
+		{
+			if ((*i)->done()) m_requests.erase(i++);
+			else ++i;
+		}
+
+		if (&t == &m_scrape_timer)
+		{
+			m_ses.m_timers.schedule(m_scrape_timer, this, scrape_interval * 1000);
+			// if the last round hasn't been sent yet,
+			// don't queue another one
+			if (!m_scrape_queue.empty()) return;
+			queue_scrapes();
+		}
+		else
+		{
+			assert(&t == &m_send_timer);
+		}
+
+		for (int i = 0; i < max_scrapes_per_second && !m_scrape_queue.empty(); ++i)
+		{
+			boost::shared_ptr<scrape_batch> r = m_scrape_queue.front();
+			m_scrape_queue.pop_front();
+			m_requests.push_back(r);
+			r->send();
+		}
+
+		if (!m_scrape_queue.empty() && !m_send_timer.is_scheduled())
+			m_ses.m_timers.schedule(m_send_timer, this, 1000);
+	}
+
+}
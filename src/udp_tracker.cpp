@@ -0,0 +1,474 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <cassert>
+#include <cstdlib>
+
+#include <boost/bind.hpp>
+
+#include "libtorrent/udp_tracker.hpp"
+#include "libtorrent/resolver.hpp"
+#include "libtorrent/entry.hpp"
+
+namespace
+{
+	// the magic number that starts every connect request
+	const boost::int64_t protocol_id = 0x41727101980LL;
+
+	void write_uint32(boost::uint32_t val, char*& buf)
+	{
+		*buf++ = static_cast<char>(val >> 24);
+		*buf++ = static_cast<char>(val >> 16);
+		*buf++ = static_cast<char>(val >> 8);
+		*buf++ = static_cast<char>(val);
+	}
+
+	void write_int64(boost::int64_t val, char*& buf)
+	{
+		write_uint32(static_cast<boost::uint32_t>(val >> 32), buf);
+		write_uint32(static_cast<boost::uint32_t>(val), buf);
+	}
+
+	void write_uint16(unsigned short val, char*& buf)
+	{
+		*buf++ = static_cast<char>(val >> 8);
+		*buf++ = static_cast<char>(val);
+	}
+
+	boost::uint32_t read_uint32(const char*& buf)
+	{
+		const unsigned char* b = reinterpret_cast<const unsigned char*>(buf);
+		buf += 4;
+		return (boost::uint32_t(b[0]) << 24)
+			| (boost::uint32_t(b[1]) << 16)
+			| (boost::uint32_t(b[2]) << 8)
+			| boost::uint32_t(b[3]);
+	}
+
+	boost::int64_t read_int64(const char*& buf)
+	{
+		boost::int64_t val = read_uint32(buf);
+		return (val << 32) | read_uint32(buf);
+	}
+
+	libtorrent::entry make_integer(libtorrent::entry::integer_type val)
+	{
+		libtorrent::entry e(libtorrent::entry::int_t);
+		e.integer() = val;
+		return e;
+	}
+
+	libtorrent::entry make_string(const std::string& val)
+	{
+		libtorrent::entry e(libtorrent::entry::string_t);
+		e.string() = val;
+		return e;
+	}
+
+	// splits udp://hostname:port/whatever into hostname
+	// and port. Returns false if the url is invalid
+	bool parse_udp_url(const std::string& url, std::string& hostname, int& port)
+	{
+		const std::string scheme = "udp://";
+		if (url.compare(0, scheme.size(), scheme) != 0) return false;
+
+		std::string::size_type host_end = url.find_first_of(":/", scheme.size());
+		if (host_end == std::string::npos || url[host_end] != ':') return false;
+		hostname = url.substr(scheme.size(), host_end - scheme.size());
+		port = std::atoi(url.c_str() + host_end + 1);
+		return !hostname.empty() && port > 0 && port < 65536;
+	}
+}
+
+namespace libtorrent
+{
+
+	udp_tracker_connection::udp_tracker_connection(udp_tracker_manager& man
+		, const udp_tracker_request& req
+		, request_callback* c)
+		: m_man(man)
+		, m_request(req)
+		, m_callback(c)
+		, m_socket(new socket(socket::udp, false))
+		, m_state(state_resolving)
+		, m_transaction_id(0)
+		, m_connection_id(0)
+		, m_cached_id(false)
+		, m_attempts(0)
+	{}
+
+	udp_tracker_connection::~udp_tracker_connection()
+	{
+		m_man.m_resolver.cancel(this);
+		m_man.m_selector.remove(m_socket);
+	}
+
+	void udp_tracker_connection::start()
+	{
+		std::string hostname;
+		int port;
+		if (!parse_udp_url(m_request.url, hostname, port))
+		{
+			fail("invalid udp tracker url");
+			return;
+		}
+		m_man.m_selector.monitor_readability(m_socket);
+		m_man.m_resolver.async_resolve(hostname, port, this
+			, boost::bind(&udp_tracker_connection::on_resolved, this, _1, _2));
+	}
+
+	void udp_tracker_connection::on_resolved(int error, const address& a)
+	{
+		if (error != 0)
+		{
+			fail("couldn't resolve the tracker's hostname");
+			return;
+		}
+		m_tracker = a;
+		m_cached_id = m_man.cached_connection_id(m_tracker, m_connection_id);
+		m_state = m_cached_id ? state_requesting : state_connecting;
+		send_request();
+	}
+
+	void udp_tracker_connection::send_request()
+	{
+		assert(m_state == state_connecting || m_state == state_requesting);
+
+		// every packet, including the resent ones,
+		// gets a new transaction id
+		m_transaction_id = (boost::uint32_t(std::rand()) << 16)
+			^ boost::uint32_t(std::rand());
+
+		// large enough for the announce too
+		char buf[16 + 20 * udp_tracker_manager::max_scrape_hashes];
+		char* ptr = buf;
+
+		if (m_state == state_connecting)
+		{
+			write_int64(protocol_id, ptr);
+			write_uint32(action_connect, ptr);
+			write_uint32(m_transaction_id, ptr);
+		}
+		else if (m_request.kind == udp_tracker_request::announce_request)
+		{
+			write_int64(m_connection_id, ptr);
+			write_uint32(action_announce, ptr);
+			write_uint32(m_transaction_id, ptr);
+			std::copy(m_request.info_hash.begin(), m_request.info_hash.end(), ptr);
+			ptr += 20;
+			std::copy(m_request.id.begin(), m_request.id.end(), ptr);
+			ptr += 20;
+			write_int64(m_request.downloaded, ptr);
+			write_int64(m_request.left, ptr);
+			write_int64(m_request.uploaded, ptr);
+			write_uint32(m_request.event, ptr);
+			// our ip, 0 means the one the packet comes from
+			write_uint32(0, ptr);
+			// the key
+			write_uint32(0, ptr);
+			// num want, -1 means the tracker's default
+			write_uint32(boost::uint32_t(-1), ptr);
+			write_uint16(m_request.listen_port, ptr);
+		}
+		else
+		{
+			write_int64(m_connection_id, ptr);
+			write_uint32(action_scrape, ptr);
+			write_uint32(m_transaction_id, ptr);
+			assert(int(m_request.scrape_hashes.size()) <= udp_tracker_manager::max_scrape_hashes);
+			for (std::vector<sha1_hash>::const_iterator i = m_request.scrape_hashes.begin();
+				i != m_request.scrape_hashes.end(); ++i)
+			{
+				std::copy(i->begin(), i->end(), ptr);
+				ptr += 20;
+			}
+		}
+		assert(ptr <= buf + sizeof(buf));
+
+		m_socket->send_to(m_tracker, buf, int(ptr - buf));
+		m_man.m_timers.schedule(m_timer, this
+			, udp_tracker_manager::initial_timeout << m_attempts);
+		++m_attempts;
+	}
+
+	void udp_tracker_connection::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_timer);
+		assert(m_state == state_connecting || m_state == state_requesting);
+
+		// requests nobody waits for are only tried once
+		if (m_attempts >= udp_tracker_manager::max_attempts || m_callback == 0)
+		{
+			if (m_callback) m_callback->tracker_request_timed_out();
+			finish();
+			return;
+		}
+		send_request();
+	}
+
+	void udp_tracker_connection::receive()
+	{
+		char buf[8192];
+		for (;;)
+		{
+			int size = m_socket->receive(buf, sizeof(buf));
+			if (size < 0)
+			{
+				// there's nothing more to receive. Other errors
+				// (like ICMP port unreachable) are ignored, the
+				// request will time out
+				return;
+			}
+
+			if (m_state != state_connecting && m_state != state_requesting)
+				continue;
+
+			// action and transaction id
+			if (size < 8) continue;
+			const char* ptr = buf;
+			boost::uint32_t action = read_uint32(ptr);
+			boost::uint32_t transaction_id = read_uint32(ptr);
+
+			// a late response to a packet we have resent,
+			// or something that isn't from the tracker
+			if (transaction_id != m_transaction_id) continue;
+
+			if (action == action_error)
+			{
+				// the tracker may have forgotten the connection
+				// id we cached. Get a new one and try once more
+				if (m_state == state_requesting && m_cached_id)
+				{
+					m_man.forget_connection_id(m_tracker);
+					m_cached_id = false;
+					m_state = state_connecting;
+					m_attempts = 0;
+					send_request();
+					continue;
+				}
+
+				std::string msg(ptr, size - 8);
+				fail(msg.c_str());
+				return;
+			}
+
+			if (m_state == state_connecting)
+			{
+				if (action != action_connect || size < 16) continue;
+				m_connection_id = read_int64(ptr);
+				m_man.cache_connection_id(m_tracker, m_connection_id);
+				m_state = state_requesting;
+				m_attempts = 0;
+				send_request();
+				continue;
+			}
+
+			if (m_request.kind == udp_tracker_request::announce_request)
+			{
+				if (action != action_announce) continue;
+				parse_announce_response(ptr, int(buf + size - ptr));
+			}
+			else
+			{
+				if (action != action_scrape) continue;
+				parse_scrape_response(ptr, int(buf + size - ptr));
+			}
+			return;
+		}
+	}
+
+	// the response is turned into the same kind of dictionary
+	// an http tracker would have sent. The peers are already
+	// in the compact form.
+	void udp_tracker_connection::parse_announce_response(const char* buf, int size)
+	{
+		// interval, leechers and seeders
+		if (size < 12)
+		{
+			fail("invalid response from tracker");
+			return;
+		}
+
+		entry e(entry::dictionary_t);
+		e.dict()["interval"] = make_integer(read_uint32(buf));
+		e.dict()["incomplete"] = make_integer(read_uint32(buf));
+		e.dict()["complete"] = make_integer(read_uint32(buf));
+		size -= 12;
+
+		e.dict()["peers"] = make_string(std::string(buf, size - size % 6));
+
+		request_callback* c = m_callback;
+		finish();
+		if (c) c->tracker_response(e);
+	}
+
+	void udp_tracker_connection::parse_scrape_response(const char* buf, int size)
+	{
+		// seeders, completed and leechers for each
+		// torrent, in the order they were asked for
+		if (size < 12 * int(m_request.scrape_hashes.size()))
+		{
+			fail("invalid response from tracker");
+			return;
+		}
+
+		entry files(entry::dictionary_t);
+		for (std::vector<sha1_hash>::const_iterator i = m_request.scrape_hashes.begin();
+			i != m_request.scrape_hashes.end(); ++i)
+		{
+			entry info(entry::dictionary_t);
+			info.dict()["complete"] = make_integer(read_uint32(buf));
+			info.dict()["downloaded"] = make_integer(read_uint32(buf));
+			info.dict()["incomplete"] = make_integer(read_uint32(buf));
+			files.dict()[std::string(i->begin(), i->end())] = info;
+		}
+		entry e(entry::dictionary_t);
+		e.dict()["files"] = files;
+
+		request_callback* c = m_callback;
+		finish();
+		if (c) c->tracker_response(e);
+	}
+
+	void udp_tracker_connection::fail(const char* msg)
+	{
+		request_callback* c = m_callback;
+		finish();
+		if (c) c->tracker_request_error(msg);
+	}
+
+	void udp_tracker_connection::finish()
+	{
+		m_timer.cancel();
+		m_state = state_done;
+		m_callback = 0;
+		m_man.connection_done();
+	}
+
+	udp_tracker_manager::udp_tracker_manager(timer_wheel& timers
+		, selector& sel
+		, resolver& r)
+		: m_timers(timers)
+		, m_selector(sel)
+		, m_resolver(r)
+	{}
+
+	void udp_tracker_manager::queue_request(const udp_tracker_request& req
+		, request_callback* c)
+	{
+		boost::shared_ptr<udp_tracker_connection> con(
+			new udp_tracker_connection(*this, req, c));
+		m_connections.push_back(con);
+		con->start();
+	}
+
+	void udp_tracker_manager::abort_request(request_callback* c)
+	{
+		for (std::list<boost::shared_ptr<udp_tracker_connection> >::iterator i
+			= m_connections.begin(); i != m_connections.end(); ++i)
+		{
+			if ((*i)->callback() == c) (*i)->clear_callback();
+		}
+	}
+
+	void udp_tracker_manager::abort_all_requests()
+	{
+		for (std::list<boost::shared_ptr<udp_tracker_connection> >::iterator i
+			= m_connections.begin(); i != m_connections.end(); ++i)
+		{
+			(*i)->clear_callback();
+		}
+	}
+
+	bool udp_tracker_manager::incoming(const boost::shared_ptr<socket>& s)
+	{
+		for (std::list<boost::shared_ptr<udp_tracker_connection> >::iterator i
+			= m_connections.begin(); i != m_connections.end(); ++i)
+		{
+			if ((*i)->get_socket() != s) continue;
+			(*i)->receive();
+			return true;
+		}
+		return false;
+	}
+
+	void udp_tracker_manager::connection_done()
+	{
+		if (!m_cleanup_timer.is_scheduled())
+			m_timers.schedule(m_cleanup_timer, this, 0);
+	}
+
+	void udp_tracker_manager::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_cleanup_timer);
+		for (std::list<boost::shared_ptr<udp_tracker_connection> >::iterator i
+			= m_connections.begin(); i != m_connections.end();)
+		{
+			if ((*i)->done()) m_connections.erase(i++);
+			else ++i;
+		}
+	}
+
+	bool udp_tracker_manager::cached_connection_id(const address& a
+		, boost::int64_t& id) const
+	{
+		std::map<address, cached_id>::const_iterator i = m_connection_ids.find(a);
+		if (i == m_connection_ids.end()) return false;
+		if (i->second.expires < m_timers.now()) return false;
+		id = i->second.id;
+		return true;
+	}
+
+	void udp_tracker_manager::forget_connection_id(const address& a)
+	{
+		m_connection_ids.erase(a);
+	}
+
+	void udp_tracker_manager::cache_connection_id(const address& a, boost::int64_t id)
+	{
+		// forget the ones that have expired
+		const timer_wheel::time_type now = m_timers.now();
+		for (std::map<address, cached_id>::iterator i = m_connection_ids.begin();
+			i != m_connection_ids.end();)
+		{
+			if (i->second.expires < now) m_connection_ids.erase(i++);
+			else ++i;
+		}
+
+		cached_id c;
+		c.id = id;
+		c.expires = now + connection_id_ttl;
+		m_connection_ids[a] = c;
+	}
+
+}
@@ -0,0 +1,168 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <vector>
+#include <iterator>
+#include <algorithm>
+
+#include "libtorrent/ut_pex.hpp"
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/peer_connection.hpp"
+#include "libtorrent/bencode.hpp"
+
+namespace
+{
+	using namespace libtorrent;
+
+	// appends the address in the compact form, 4 bytes
+	// ip and 2 bytes port in network byte order
+	void write_compact(const address& a, std::string& out)
+	{
+		unsigned int ip = ntohl(a.ip());
+		out += static_cast<char>(ip >> 24);
+		out += static_cast<char>(ip >> 16);
+		out += static_cast<char>(ip >> 8);
+		out += static_cast<char>(ip);
+		out += static_cast<char>(a.port() >> 8);
+		out += static_cast<char>(a.port());
+	}
+
+	address read_compact(const char* p)
+	{
+		const unsigned char* b = reinterpret_cast<const unsigned char*>(p);
+		return address(b[0], b[1], b[2], b[3]
+			, static_cast<unsigned short>((b[4] << 8) | b[5]));
+	}
+}
+
+namespace libtorrent
+{
+
+	ut_pex_peer::ut_pex_peer(torrent& t, peer_connection& c)
+		: m_torrent(t)
+		, m_connection(c)
+		// the first message is sent soon after the handshake
+		, m_countdown(5)
+		, m_last_received(send_interval)
+	{}
+
+	void ut_pex_peer::on_message(const char* body, int size)
+	{
+		// peers that send more often than we do are ignored
+		if (m_last_received < send_interval / 2) return;
+		m_last_received = 0;
+
+		entry e;
+		try
+		{
+			e = bdecode(body, body + size);
+		}
+		catch(std::exception&)
+		{
+			throw protocol_error("invalid ut_pex message");
+		}
+		if (e.type() != entry::dictionary_t) throw protocol_error("invalid ut_pex message");
+
+		entry::dictionary_type::const_iterator i = e.dict().find("added");
+		if (i == e.dict().end() || i->second.type() != entry::string_t) return;
+
+		const std::string& added = i->second.string();
+		const int num_peers = std::min(int(added.size() / 6), int(max_peers));
+		for (int j = 0; j < num_peers; ++j)
+		{
+			// the peers don't have any ids, and are checked
+			// against our connections by address
+			m_torrent.on_peer_resolved(0, read_compact(added.c_str() + j * 6), peer_id());
+		}
+	}
+
+	void ut_pex_peer::tick()
+	{
+		++m_last_received;
+		if (--m_countdown > 0) return;
+		m_countdown = send_interval;
+
+		if (!m_connection.supports_extension(message_name())) return;
+
+		// the peers we're connected to now, that
+		// others could connect to
+		std::set<address> current;
+		for (torrent::peer_iterator i = m_torrent.begin(); i != m_torrent.end(); ++i)
+		{
+			if (*i == &m_connection) continue;
+			address a;
+			if ((*i)->remote_listen_address(a)) current.insert(a);
+		}
+
+		std::vector<address> dropped;
+		std::set_difference(m_sent.begin(), m_sent.end()
+			, current.begin(), current.end(), std::back_inserter(dropped));
+		std::vector<address> added;
+		std::set_difference(current.begin(), current.end()
+			, m_sent.begin(), m_sent.end(), std::back_inserter(added));
+		if (int(added.size()) > max_peers) added.resize(max_peers);
+		if (int(dropped.size()) > max_peers) dropped.resize(max_peers);
+
+		if (added.empty() && dropped.empty()) return;
+
+		entry msg(entry::dictionary_t);
+		entry added_e(entry::string_t);
+		entry flags_e(entry::string_t);
+		entry dropped_e(entry::string_t);
+		for (std::vector<address>::iterator i = added.begin(); i != added.end(); ++i)
+		{
+			write_compact(*i, added_e.string());
+			// we don't know anything about the peers
+			flags_e.string() += '\0';
+			m_sent.insert(*i);
+		}
+		for (std::vector<address>::iterator i = dropped.begin(); i != dropped.end(); ++i)
+		{
+			write_compact(*i, dropped_e.string());
+			m_sent.erase(*i);
+		}
+		msg.dict()["added"] = added_e;
+		msg.dict()["added.f"] = flags_e;
+		msg.dict()["dropped"] = dropped_e;
+
+		std::string buf;
+		bencode(std::back_inserter(buf), msg);
+		m_connection.send_extended(message_name(), buf);
+	}
+
+	boost::shared_ptr<peer_extension> create_ut_pex(torrent& t, peer_connection& c)
+	{
+		return boost::shared_ptr<peer_extension>(new ut_pex_peer(t, c));
+	}
+
+}
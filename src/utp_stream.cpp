@@ -0,0 +1,901 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include <cassert>
+#include <cstdlib>
+#include <algorithm>
+
+#include "libtorrent/utp_stream.hpp"
+
+namespace
+{
+	// the packet timestamps, in microseconds. The timer wheel's
+	// clock is read once per loop, the queuing delays LEDBAT
+	// measures are often smaller than that. The timestamps
+	// wrap, only their differences are used
+	boost::uint32_t read_microseconds()
+	{
+#if defined(_WIN32)
+		static LARGE_INTEGER frequency = {0};
+		if (frequency.QuadPart == 0)
+			QueryPerformanceFrequency(&frequency);
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		// split up to avoid overflowing the multiplication
+		return static_cast<boost::uint32_t>(
+			counter.QuadPart / frequency.QuadPart * 1000000
+			+ counter.QuadPart % frequency.QuadPart * 1000000
+			/ frequency.QuadPart);
+#else
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return static_cast<boost::uint32_t>(boost::int64_t(ts.tv_sec) * 1000000
+			+ ts.tv_nsec / 1000);
+#endif
+	}
+
+	void write_uint32(boost::uint32_t val, char*& buf)
+	{
+		*buf++ = static_cast<char>(val >> 24);
+		*buf++ = static_cast<char>(val >> 16);
+		*buf++ = static_cast<char>(val >> 8);
+		*buf++ = static_cast<char>(val);
+	}
+
+	void write_uint16(unsigned short val, char*& buf)
+	{
+		*buf++ = static_cast<char>(val >> 8);
+		*buf++ = static_cast<char>(val);
+	}
+
+	boost::uint32_t read_uint32(const char*& buf)
+	{
+		const unsigned char* b = reinterpret_cast<const unsigned char*>(buf);
+		buf += 4;
+		return (boost::uint32_t(b[0]) << 24)
+			| (boost::uint32_t(b[1]) << 16)
+			| (boost::uint32_t(b[2]) << 8)
+			| boost::uint32_t(b[3]);
+	}
+
+	unsigned short read_uint16(const char*& buf)
+	{
+		const unsigned char* b = reinterpret_cast<const unsigned char*>(buf);
+		buf += 2;
+		return static_cast<unsigned short>((b[0] << 8) | b[1]);
+	}
+
+	// the sequence numbers wrap, a is before b if
+	// it's less than half the number space behind
+	bool seq_less(unsigned short a, unsigned short b)
+	{
+		return a != b && static_cast<unsigned short>(b - a) < 0x8000;
+	}
+
+	enum { protocol_version = 1 };
+}
+
+namespace libtorrent
+{
+
+	utp_stream::utp_stream(utp_socket_manager& man, const address& remote
+		, unsigned short recv_id, unsigned short send_id)
+		: m_man(man)
+		, m_remote(remote)
+		, m_state(state_syn_sent)
+		, m_recv_id(recv_id)
+		, m_send_id(send_id)
+		, m_seq_nr(1)
+		, m_ack_nr(0)
+		, m_last_ack(0)
+		, m_bytes_in_flight(0)
+		, m_reorder_bytes(0)
+		, m_cwnd(2 * min_window)
+		, m_peer_window(max_receive_buffer)
+		, m_history_pos(0)
+		, m_history_start(man.m_timers.now())
+		, m_reply_delay(0)
+		, m_rtt(0)
+		, m_rtt_var(0)
+		, m_timeout(initial_timeout)
+		, m_timeout_at(0)
+		, m_probe_at(0)
+		, m_num_timeouts(0)
+		, m_duplicate_acks(0)
+		, m_loss_seq(0)
+		, m_in_recovery(false)
+		, m_ack_pending(false)
+		, m_close_requested(false)
+		, m_fin_seq(0)
+		, m_got_fin(false)
+		, m_eof(false)
+		, m_error(false)
+	{
+		std::fill(m_delay_history, m_delay_history + delay_history
+			, boost::uint32_t(0xffffffff));
+	}
+
+	void utp_stream::send_syn()
+	{
+		assert(m_state == state_syn_sent);
+		m_last_ack = m_seq_nr - 1;
+		send_packet(st_syn, 0, 0);
+	}
+
+	void utp_stream::on_syn(unsigned short seq_nr)
+	{
+		m_state = state_connected;
+		m_seq_nr = static_cast<unsigned short>(std::rand());
+		m_last_ack = m_seq_nr - 1;
+		m_ack_nr = seq_nr;
+		m_ack_pending = true;
+	}
+
+	bool utp_stream::is_writable() const
+	{
+		return m_state == state_connected
+			&& !m_close_requested
+			&& int(m_send_buffer.size()) < max_send_buffer;
+	}
+
+	int utp_stream::send(const char* buf, int size)
+	{
+		if (m_error || m_close_requested || m_state == state_closed)
+			return -1;
+
+		size = std::min(size, int(max_send_buffer - m_send_buffer.size()));
+		if (size <= 0) return 0;
+		m_send_buffer.insert(m_send_buffer.end(), buf, buf + size);
+		flush();
+		m_man.flush();
+		return size;
+	}
+
+	int utp_stream::receive(char* buf, int size)
+	{
+		if (m_receive_buffer.empty())
+		{
+			if (m_eof) return 0;
+			return -1;
+		}
+
+		// if the other end has stopped sending because our
+		// window was closed, tell it that it has opened
+		bool window_closed = receive_window() < payload_size;
+
+		size = std::min(size, int(m_receive_buffer.size()));
+		std::copy(m_receive_buffer.begin(), m_receive_buffer.begin() + size, buf);
+		m_receive_buffer.erase(m_receive_buffer.begin(), m_receive_buffer.begin() + size);
+
+		if (window_closed && receive_window() >= payload_size
+			&& m_state != state_closed)
+		{
+			send_ack();
+			m_man.flush();
+		}
+		return size;
+	}
+
+	void utp_stream::close()
+	{
+		if (m_close_requested) return;
+		m_close_requested = true;
+		flush();
+		m_man.flush();
+	}
+
+	int utp_stream::receive_window() const
+	{
+		return std::max(0, int(max_receive_buffer
+			- m_receive_buffer.size() - m_reorder_bytes));
+	}
+
+	void utp_stream::write_header(char* buf, int type, unsigned short seq_nr)
+	{
+		*buf++ = static_cast<char>((type << 4) | protocol_version);
+		// no extensions
+		*buf++ = 0;
+		// the syn carries the id the other end will
+		// send its packets with
+		write_uint16(type == st_syn ? m_recv_id : m_send_id, buf);
+		write_uint32(m_man.timestamp(), buf);
+		write_uint32(m_reply_delay, buf);
+		write_uint32(receive_window(), buf);
+		write_uint16(seq_nr, buf);
+		write_uint16(m_ack_nr, buf);
+		// every packet acks what we have received
+		m_ack_pending = false;
+	}
+
+	void utp_stream::send_packet(int type, const char* payload, int size)
+	{
+		assert(size <= payload_size);
+
+		if (m_outstanding.empty()) arm_timeout();
+
+		m_outstanding.push_back(packet());
+		packet& p = m_outstanding.back();
+		p.type = type;
+		p.seq_nr = m_seq_nr++;
+		p.buf.resize(header_size + size);
+		if (size > 0) std::copy(payload, payload + size, p.buf.begin() + header_size);
+		p.resent = false;
+		p.acked = false;
+		p.fast_resent = false;
+		m_bytes_in_flight += size;
+
+		write_header(&p.buf[0], type, p.seq_nr);
+		p.sent = m_man.m_timers.now();
+		m_man.send_packet(m_remote, p.buf);
+	}
+
+	void utp_stream::resend(packet& p)
+	{
+		write_header(&p.buf[0], p.type, p.seq_nr);
+		p.sent = m_man.m_timers.now();
+		p.resent = true;
+		m_man.send_packet(m_remote, p.buf);
+	}
+
+	void utp_stream::arm_timeout()
+	{
+		timer_wheel::time_type now = m_man.m_timers.now();
+		m_timeout_at = now + m_timeout;
+		m_probe_at = now + std::max(m_rtt * 2, int(min_probe_timeout));
+	}
+
+	void utp_stream::fast_resend(packet& p)
+	{
+		if (p.fast_resent) return;
+		p.fast_resent = true;
+		resend(p);
+	}
+
+	void utp_stream::send_ack()
+	{
+		// acks don't use up a sequence number
+		std::vector<char> buf(header_size);
+		write_header(&buf[0], st_state, m_seq_nr);
+
+		// tell the other end which packets we have received
+		// out of order, so that only the lost ones are resent
+		if (!m_reorder.empty())
+		{
+			int max_bit = 0;
+			for (std::map<unsigned short, std::vector<char> >::iterator i
+				= m_reorder.begin(); i != m_reorder.end(); ++i)
+			{
+				max_bit = std::max(max_bit
+					, static_cast<unsigned short>(i->first - m_ack_nr) - 2);
+			}
+			// the size has to be a multiple of 4
+			int size = std::min(int(max_sack_size), (max_bit / 32 + 1) * 4);
+			buf[1] = sack_extension;
+			buf.push_back(0);
+			buf.push_back(static_cast<char>(size));
+			std::vector<char>::size_type mask = buf.size();
+			buf.resize(mask + size, 0);
+			for (std::map<unsigned short, std::vector<char> >::iterator i
+				= m_reorder.begin(); i != m_reorder.end(); ++i)
+			{
+				int bit = static_cast<unsigned short>(i->first - m_ack_nr) - 2;
+				if (bit >= size * 8) continue;
+				buf[mask + bit / 8] |= static_cast<char>(1 << (bit % 8));
+			}
+		}
+		m_man.send_packet(m_remote, buf);
+	}
+
+	void utp_stream::flush()
+	{
+		if (m_state == state_connected)
+		{
+			char payload[payload_size];
+			while (!m_send_buffer.empty())
+			{
+				int window = std::min(m_cwnd, int(m_peer_window));
+				int size = std::min(int(payload_size), int(m_send_buffer.size()));
+				// the window may be overshot by the last packet, so
+				// that a small window isn't wasted and a closed
+				// one is probed
+				if (m_bytes_in_flight >= window && m_bytes_in_flight > 0)
+					break;
+				// don't let the sequence numbers wrap
+				// into the ones that are in flight
+				if (m_outstanding.size() >= 0x4000) break;
+
+				std::copy(m_send_buffer.begin(), m_send_buffer.begin() + size, payload);
+				m_send_buffer.erase(m_send_buffer.begin(), m_send_buffer.begin() + size);
+				send_packet(st_data, payload, size);
+			}
+
+			if (m_close_requested && m_send_buffer.empty())
+			{
+				send_packet(st_fin, 0, 0);
+				m_state = state_fin_sent;
+			}
+		}
+
+		if (m_ack_pending && m_state != state_closed) send_ack();
+	}
+
+	void utp_stream::incoming(int type, const char* payload, int size
+		, unsigned short seq_nr, unsigned short ack_nr
+		, boost::uint32_t timestamp, boost::uint32_t delay
+		, boost::uint32_t window, const char* sack, int sack_size)
+	{
+		if (m_state == state_closed) return;
+
+		if (type == st_reset)
+		{
+			m_error = true;
+			m_state = state_closed;
+			return;
+		}
+
+		m_reply_delay = m_man.timestamp() - timestamp;
+		m_peer_window = window;
+
+		if (type == st_syn)
+		{
+			// our ack to the syn was lost
+			m_ack_pending = true;
+			return;
+		}
+
+		if (m_state == state_syn_sent)
+		{
+			// the first packet from the other end is
+			// the ack of the syn
+			if (type != st_state) return;
+			m_state = state_connected;
+			m_ack_nr = seq_nr - 1;
+		}
+
+		on_ack(ack_nr, delay, type == st_state, sack, sack_size);
+
+		if (type != st_data && type != st_fin) return;
+
+		unsigned short dist = seq_nr - m_ack_nr;
+		if (dist == 0 || dist >= 0x8000)
+		{
+			// we have received it already, our ack
+			// was probably lost
+			m_ack_pending = true;
+			return;
+		}
+
+		if (m_got_fin && seq_less(m_fin_seq, seq_nr)) return;
+
+		// don't ack what we have no room for, it will be
+		// resent once the window has opened
+		if (size > receive_window()) return;
+
+		if (type == st_fin)
+		{
+			m_got_fin = true;
+			m_fin_seq = seq_nr;
+		}
+
+		m_ack_pending = true;
+
+		if (dist > 1)
+		{
+			if (m_reorder.find(seq_nr) != m_reorder.end()) return;
+			m_reorder[seq_nr].assign(payload, payload + size);
+			m_reorder_bytes += size;
+			return;
+		}
+
+		deliver(payload, size);
+		m_ack_nr = seq_nr;
+
+		for (std::map<unsigned short, std::vector<char> >::iterator i
+			= m_reorder.find(static_cast<unsigned short>(m_ack_nr + 1)); i != m_reorder.end();
+			i = m_reorder.find(static_cast<unsigned short>(m_ack_nr + 1)))
+		{
+			deliver(i->second.empty() ? 0 : &i->second[0], i->second.size());
+			m_reorder_bytes -= i->second.size();
+			m_ack_nr = i->first;
+			m_reorder.erase(i);
+		}
+
+		if (m_got_fin && m_ack_nr == m_fin_seq)
+		{
+			m_eof = true;
+			m_reorder.clear();
+			m_reorder_bytes = 0;
+			if (m_state == state_fin_sent && m_outstanding.empty())
+				m_state = state_closed;
+		}
+	}
+
+	void utp_stream::deliver(const char* buf, int size)
+	{
+		m_receive_buffer.insert(m_receive_buffer.end(), buf, buf + size);
+	}
+
+	int utp_stream::ack_packet(packet& p)
+	{
+		assert(!p.acked);
+		p.acked = true;
+		// the round trip time of a resent packet is
+		// ambiguous, it's not used
+		if (!p.resent) on_rtt_sample(int(m_man.m_timers.now() - p.sent));
+		int size = p.buf.size() - header_size;
+		m_bytes_in_flight -= size;
+		return size;
+	}
+
+	void utp_stream::on_ack(unsigned short ack_nr, boost::uint32_t delay
+		, bool pure_ack, const char* sack, int sack_size)
+	{
+		// an ack of something we haven't sent
+		if (seq_less(m_seq_nr - 1, ack_nr)) return;
+
+		int bytes_acked = 0;
+		bool fin_acked = false;
+		while (!m_outstanding.empty()
+			&& !seq_less(ack_nr, m_outstanding.front().seq_nr))
+		{
+			packet& p = m_outstanding.front();
+			if (!p.acked) bytes_acked += ack_packet(p);
+			if (p.type == st_fin) fin_acked = true;
+			m_outstanding.pop_front();
+		}
+		bool progress = bytes_acked > 0 || fin_acked;
+
+		// the selective ack has one bit for every packet after
+		// ack_nr + 1. A packet that three packets sent after
+		// it have overtaken is considered lost, or fewer when
+		// the window is too small for three more. The packets
+		// are walked backwards to count the ones after each
+		std::vector<int> lost;
+		int threshold = std::max(1, std::min(3, int(m_outstanding.size()) - 1));
+		int sacked_after = 0;
+		for (int i = int(m_outstanding.size()) - 1; sack_size > 0 && i >= 0; --i)
+		{
+			packet& p = m_outstanding[i];
+			int bit = static_cast<unsigned short>(p.seq_nr - ack_nr) - 2;
+			if (bit >= 0 && bit < sack_size * 8
+				&& (static_cast<unsigned char>(sack[bit / 8]) >> (bit % 8)) & 1)
+			{
+				if (!p.acked) bytes_acked += ack_packet(p);
+				++sacked_after;
+			}
+			else if (sacked_after >= threshold && !p.acked && !p.fast_resent)
+			{
+				lost.push_back(i);
+			}
+		}
+
+		if (progress)
+		{
+			m_num_timeouts = 0;
+			m_duplicate_acks = 0;
+			arm_timeout();
+			if (m_in_recovery && !seq_less(ack_nr, m_loss_seq))
+				m_in_recovery = false;
+		}
+		else if (pure_ack && sack_size == 0 && ack_nr == m_last_ack
+			&& !m_outstanding.empty())
+		{
+			// the other end doesn't send selective acks. The packet
+			// after the one that's acked over and over again was lost
+			if (++m_duplicate_acks == 3) lost.push_back(0);
+		}
+		m_last_ack = ack_nr;
+
+		// the other end sends 0 until it has
+		// received a packet from us
+		if (delay != 0 && bytes_acked > 0) on_delay_sample(delay, bytes_acked);
+
+		if (!lost.empty())
+		{
+			on_loss();
+			for (std::vector<int>::reverse_iterator i = lost.rbegin();
+				i != lost.rend(); ++i)
+				fast_resend(m_outstanding[*i]);
+		}
+
+		if (fin_acked && m_eof) m_state = state_closed;
+	}
+
+	void utp_stream::on_delay_sample(boost::uint32_t delay, int bytes_acked)
+	{
+		// the clocks at the two ends aren't synchronized, so the
+		// delay is only meaningful relative to the lowest one seen.
+		// That is the delay of an empty queue. The history is
+		// kept for a few minutes, so that a route change or clock
+		// drift is eventually forgotten
+		timer_wheel::time_type now = m_man.m_timers.now();
+		if (now - m_history_start > 60 * 1000)
+		{
+			m_history_start = now;
+			m_history_pos = (m_history_pos + 1) % delay_history;
+			m_delay_history[m_history_pos] = delay;
+		}
+		m_delay_history[m_history_pos]
+			= std::min(m_delay_history[m_history_pos], delay);
+		boost::uint32_t base_delay = *std::min_element(m_delay_history
+			, m_delay_history + delay_history);
+
+		boost::int64_t queuing_delay = delay - base_delay;
+		boost::int64_t off_target = target_delay - queuing_delay;
+		// when the queues fill up faster than we can measure,
+		// don't shrink the window more than one packet per
+		// round trip
+		if (off_target < -target_delay) off_target = -target_delay;
+
+		// the window grows by up to one packet per round trip
+		// while there's no queuing delay, like TCP. At the
+		// target delay it stays put, and above it it shrinks
+		boost::int64_t gain = boost::int64_t(payload_size) * off_target
+			* bytes_acked / (boost::int64_t(target_delay) * m_cwnd);
+
+		// if the window isn't used, there's no
+		// reason to make it bigger
+		if (gain > 0 && m_bytes_in_flight + bytes_acked < m_cwnd - payload_size)
+			gain = 0;
+
+		m_cwnd = int(std::max(boost::int64_t(min_window)
+			, std::min(boost::int64_t(max_window), m_cwnd + gain)));
+	}
+
+	void utp_stream::on_rtt_sample(int rtt)
+	{
+		if (m_rtt == 0)
+		{
+			m_rtt = rtt;
+			m_rtt_var = rtt / 2;
+		}
+		else
+		{
+			int delta = m_rtt - rtt;
+			if (delta < 0) delta = -delta;
+			m_rtt_var += (delta - m_rtt_var) / 4;
+			m_rtt += (rtt - m_rtt) / 8;
+		}
+		m_timeout = std::max(int(min_timeout), m_rtt + m_rtt_var * 4);
+	}
+
+	void utp_stream::on_loss()
+	{
+		if (m_in_recovery) return;
+		m_in_recovery = true;
+		m_loss_seq = m_seq_nr - 1;
+		m_cwnd = std::max(int(min_window), m_cwnd / 2);
+	}
+
+	void utp_stream::tick()
+	{
+		if (m_state == state_closed || m_outstanding.empty()) return;
+
+		timer_wheel::time_type now = m_man.m_timers.now();
+		if (now < m_timeout_at)
+		{
+			// if the ack of the last packets was lost, nothing
+			// more will be acked until we send something. Resending
+			// the last packet makes the other end ack everything it
+			// has, long before the timeout
+			if (now >= m_probe_at)
+			{
+				m_probe_at = m_timeout_at;
+				resend(m_outstanding.back());
+			}
+			return;
+		}
+
+		if (++m_num_timeouts > max_timeouts)
+		{
+			m_error = true;
+			m_state = state_closed;
+			return;
+		}
+
+		// nothing has been acked for a whole timeout, start
+		// over with one packet in flight, like TCP does
+		m_cwnd = min_window;
+		m_in_recovery = true;
+		m_loss_seq = m_seq_nr - 1;
+		m_timeout = std::min(m_timeout * 2, int(max_timeout));
+		arm_timeout();
+		resend(m_outstanding.front());
+	}
+
+	// ---------------------------------------------------------
+
+	utp_socket_manager::utp_socket_manager(timer_wheel& timers, selector& sel)
+		: m_timers(timers)
+		, m_selector(sel)
+		, m_receive_buffer(batch_size * utp_stream::packet_size)
+	{}
+
+	utp_socket_manager::~utp_socket_manager()
+	{
+		m_timer.cancel();
+		if (m_socket) m_selector.remove(m_socket);
+	}
+
+	boost::uint32_t utp_socket_manager::timestamp() const
+	{
+		return read_microseconds();
+	}
+
+	void utp_socket_manager::open_socket(unsigned short port)
+	{
+		assert(!m_socket);
+		boost::shared_ptr<socket> s(new socket(socket::udp, false));
+		s->bind(port, false);
+		m_socket = s;
+		m_selector.monitor_readability(m_socket);
+	}
+
+	void utp_socket_manager::listen(unsigned short port)
+	{
+		if (m_socket)
+		{
+			m_selector.remove(m_socket);
+			m_socket.reset();
+		}
+		open_socket(port);
+	}
+
+	boost::shared_ptr<utp_stream> utp_socket_manager::connect(const address& a)
+	{
+		if (!m_socket) open_socket(0);
+
+		unsigned short recv_id;
+		do
+		{
+			recv_id = static_cast<unsigned short>(std::rand());
+		} while (m_streams.find(std::make_pair(a, recv_id)) != m_streams.end());
+
+		boost::shared_ptr<utp_stream> s(new utp_stream(*this, a, recv_id, recv_id + 1));
+		m_streams[std::make_pair(a, recv_id)] = s;
+		s->send_syn();
+		flush();
+		start_timer();
+		return s;
+	}
+
+	boost::shared_ptr<utp_stream> utp_socket_manager::accept()
+	{
+		if (m_accept_queue.empty()) return boost::shared_ptr<utp_stream>();
+		boost::shared_ptr<utp_stream> s = m_accept_queue.front();
+		m_accept_queue.pop_front();
+		return s;
+	}
+
+	bool utp_socket_manager::incoming(const boost::shared_ptr<socket>& s)
+	{
+		if (!m_socket || s != m_socket) return false;
+
+		socket::datagram d[batch_size];
+		for (;;)
+		{
+			for (int i = 0; i < batch_size; ++i)
+			{
+				d[i].buf = &m_receive_buffer[i * utp_stream::packet_size];
+				d[i].size = utp_stream::packet_size;
+			}
+			int num = m_socket->receive_batch(d, batch_size);
+			if (num <= 0) break;
+			for (int i = 0; i < num; ++i)
+				on_packet(d[i].buf, d[i].size, d[i].addr);
+			if (num < batch_size) break;
+		}
+
+		// the acks for the whole batch, and the data
+		// the acks made room for, are sent together
+		for (stream_map::iterator i = m_streams.begin(); i != m_streams.end(); ++i)
+			i->second->flush();
+		flush();
+		return true;
+	}
+
+	void utp_socket_manager::on_packet(const char* buf, int size, const address& from)
+	{
+		if (size < utp_stream::header_size) return;
+
+		const char* ptr = buf;
+		int type = (ptr[0] >> 4) & 0xf;
+		int version = ptr[0] & 0xf;
+		int extension = static_cast<unsigned char>(ptr[1]);
+		ptr += 2;
+		if (version != protocol_version || type > utp_stream::st_syn) return;
+
+		unsigned short conn_id = read_uint16(ptr);
+		boost::uint32_t timestamp = read_uint32(ptr);
+		boost::uint32_t delay = read_uint32(ptr);
+		boost::uint32_t window = read_uint32(ptr);
+		unsigned short seq_nr = read_uint16(ptr);
+		unsigned short ack_nr = read_uint16(ptr);
+
+		// the selective ack is the only extension we
+		// understand, the others are skipped
+		const char* end = buf + size;
+		const char* sack = 0;
+		int sack_size = 0;
+		while (extension != 0)
+		{
+			if (end - ptr < 2) return;
+			int next = static_cast<unsigned char>(ptr[0]);
+			int len = static_cast<unsigned char>(ptr[1]);
+			ptr += 2;
+			if (end - ptr < len) return;
+			if (extension == utp_stream::sack_extension)
+			{
+				sack = ptr;
+				sack_size = len;
+			}
+			extension = next;
+			ptr += len;
+		}
+
+		if (type == utp_stream::st_syn)
+		{
+			// the syn carries the id we'll receive with minus one
+			std::pair<address, unsigned short> key(from, conn_id + 1);
+			stream_map::iterator i = m_streams.find(key);
+			if (i != m_streams.end())
+			{
+				i->second->incoming(type, ptr, end - ptr, seq_nr, ack_nr
+					, timestamp, delay, window, sack, sack_size);
+				return;
+			}
+
+			if (int(m_accept_queue.size()) >= max_accept_queue)
+			{
+				send_reset(from, conn_id, seq_nr);
+				return;
+			}
+
+			boost::shared_ptr<utp_stream> s(new utp_stream(*this, from
+				, conn_id + 1, conn_id));
+			s->on_syn(seq_nr);
+			s->incoming(type, ptr, end - ptr, seq_nr, ack_nr, timestamp
+				, delay, window, sack, sack_size);
+			m_streams[key] = s;
+			m_accept_queue.push_back(s);
+			start_timer();
+			return;
+		}
+
+		stream_map::iterator i = m_streams.find(std::make_pair(from, conn_id));
+		if (i == m_streams.end() && type == utp_stream::st_reset)
+		{
+			// a reset may be sent with the id we send with, which
+			// is one above or below the one we receive with
+			i = m_streams.find(std::make_pair(from, static_cast<unsigned short>(conn_id + 1)));
+			if (i == m_streams.end() || i->second->m_send_id != conn_id)
+				i = m_streams.find(std::make_pair(from, static_cast<unsigned short>(conn_id - 1)));
+			if (i != m_streams.end() && i->second->m_send_id != conn_id)
+				i = m_streams.end();
+		}
+		if (i == m_streams.end())
+		{
+			if (type != utp_stream::st_reset) send_reset(from, conn_id, seq_nr);
+			return;
+		}
+		i->second->incoming(type, ptr, end - ptr, seq_nr, ack_nr
+			, timestamp, delay, window, sack, sack_size);
+	}
+
+	void utp_socket_manager::send_packet(const address& to, const std::vector<char>& buf)
+	{
+		m_outgoing.push_back(std::make_pair(to, buf));
+	}
+
+	void utp_socket_manager::send_reset(const address& to, unsigned short conn_id
+		, unsigned short ack_nr)
+	{
+		std::vector<char> buf(utp_stream::header_size);
+		char* ptr = &buf[0];
+		*ptr++ = static_cast<char>((utp_stream::st_reset << 4) | protocol_version);
+		*ptr++ = 0;
+		write_uint16(conn_id, ptr);
+		write_uint32(timestamp(), ptr);
+		write_uint32(0, ptr);
+		write_uint32(0, ptr);
+		write_uint16(static_cast<unsigned short>(std::rand()), ptr);
+		write_uint16(ack_nr, ptr);
+		send_packet(to, buf);
+	}
+
+	void utp_socket_manager::flush()
+	{
+		if (!m_socket)
+		{
+			m_outgoing.clear();
+			return;
+		}
+
+		socket::datagram d[batch_size];
+		std::vector<std::pair<address, std::vector<char> > >::iterator i
+			= m_outgoing.begin();
+		while (i != m_outgoing.end())
+		{
+			int num = 0;
+			for (; num < batch_size && i != m_outgoing.end(); ++num, ++i)
+			{
+				d[num].buf = &i->second[0];
+				d[num].size = i->second.size();
+				d[num].addr = i->first;
+			}
+			// the packets that can't be sent are lost, like
+			// on the network. They're resent when they time out
+			if (m_socket->send_batch(d, num) < num) break;
+		}
+		m_outgoing.clear();
+	}
+
+	void utp_socket_manager::start_timer()
+	{
+		if (!m_timer.is_scheduled())
+			m_timers.schedule(m_timer, this, tick_interval);
+	}
+
+	void utp_socket_manager::on_timer(timer_entry& t)
+	{
+		assert(&t == &m_timer);
+
+		for (stream_map::iterator i = m_streams.begin(); i != m_streams.end();)
+		{
+			utp_stream& s = *i->second;
+			s.tick();
+
+			// nobody is using the stream anymore, the data
+			// that's left is sent before it's closed
+			if (i->second.unique() && s.state() == utp_stream::state_connected)
+				s.close();
+			if (i->second.unique() && s.state() == utp_stream::state_fin_sent
+				&& s.m_outstanding.empty())
+				s.m_state = utp_stream::state_closed;
+
+			if (s.state() == utp_stream::state_closed) m_streams.erase(i++);
+			else ++i;
+		}
+		flush();
+
+		if (!m_streams.empty())
+			m_timers.schedule(m_timer, this, tick_interval);
+	}
+
+}
@@ -0,0 +1,119 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#ifndef TORRENT_TEST_HPP_INCLUDED
+#define TORRENT_TEST_HPP_INCLUDED
+
+#include <iostream>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include "libtorrent/socket.hpp"
+#include "libtorrent/timer_wheel.hpp"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// a minimal harness for the test drivers. Every failed
+// check is printed, and main() returns the number of
+// failures, so that the driver exits with non-zero if
+// any check failed.
+
+namespace test
+{
+	inline int& failures()
+	{
+		static int n = 0;
+		return n;
+	}
+
+	inline void report(const char* expr, const char* file, int line)
+	{
+		std::cerr << file << ":" << line << ": check failed: " << expr << "\n";
+		++failures();
+	}
+
+	inline void sleep(int milliseconds)
+	{
+#if defined(_WIN32)
+		Sleep(milliseconds);
+#else
+		usleep(milliseconds * 1000);
+#endif
+	}
+
+	// the network thread of the tests that use sockets. The
+	// sockets that are monitored by sel are handed to
+	// on_readable() when they become readable, and the timers
+	// are fired when they're due
+	struct event_loop
+	{
+		virtual ~event_loop() {}
+
+		// waits up to 10 ms for a socket to become readable
+		void step()
+		{
+			std::vector<boost::shared_ptr<libtorrent::socket> > readable;
+			std::vector<boost::shared_ptr<libtorrent::socket> > writable;
+			std::vector<boost::shared_ptr<libtorrent::socket> > error;
+			sel.wait(10 * 1000, readable, writable, error);
+			timers.update_time();
+			for (std::vector<boost::shared_ptr<libtorrent::socket> >::iterator i
+				= readable.begin(); i != readable.end(); ++i)
+			{
+				on_readable(*i);
+			}
+			timers.advance();
+		}
+
+		void run(int milliseconds)
+		{
+			libtorrent::timer_wheel::time_type end = timers.now() + milliseconds;
+			while (timers.now() < end) step();
+		}
+
+		virtual void on_readable(const boost::shared_ptr<libtorrent::socket>& s) = 0;
+
+		libtorrent::timer_wheel timers;
+		libtorrent::selector sel;
+	};
+}
+
+#define TEST_CHECK(x) \
+	if (!(x)) test::report(#x, __FILE__, __LINE__)
+
+#endif // TORRENT_TEST_HPP_INCLUDED
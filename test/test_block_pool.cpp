@@ -0,0 +1,132 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/shared_array.hpp>
+
+#include "libtorrent/block_pool.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	// lets the main thread and the worker take turns
+	struct turns
+	{
+		turns(): step(0) {}
+
+		void wait_for(int s)
+		{
+			boost::mutex::scoped_lock l(mutex);
+			while (step < s) cond.wait(l);
+		}
+
+		void next()
+		{
+			boost::mutex::scoped_lock l(mutex);
+			++step;
+			cond.notify_all();
+		}
+
+		boost::mutex mutex;
+		boost::condition cond;
+		int step;
+	};
+
+	// allocates and releases a few blocks, which end up in
+	// its thread cache, and then waits for the pool to be
+	// destructed before it exits
+	void worker(block_pool** pool, turns* t)
+	{
+		{
+			std::vector<boost::shared_array<char> > blocks;
+			for (int i = 0; i < 10; ++i)
+				blocks.push_back((*pool)->allocate());
+		}
+		t->next();
+		t->wait_for(2);
+	}
+}
+
+int main()
+{
+	{
+		block_pool pool;
+		std::vector<boost::shared_array<char> > blocks;
+		for (int i = 0; i < 10; ++i) blocks.push_back(pool.allocate());
+		TEST_CHECK(pool.status().in_use == 10 * pool.block_size());
+		blocks.clear();
+		// the blocks in the thread cache aren't in use
+		TEST_CHECK(pool.status().in_use == 0);
+		TEST_CHECK(pool.status().allocated == 10 * pool.block_size());
+
+		// over the limit, released blocks are freed
+		// instead of cached
+		for (int i = 0; i < 10; ++i) blocks.push_back(pool.allocate());
+		pool.set_limit(4 * pool.block_size());
+		TEST_CHECK(pool.exceeded());
+		blocks.resize(2);
+		TEST_CHECK(!pool.exceeded());
+		TEST_CHECK(pool.status().allocated <= 4 * pool.block_size());
+	}
+
+	// a thread that has used the pool exits after
+	// the pool has been destructed
+	turns t;
+	block_pool* pool = new block_pool;
+	boost::thread th(boost::bind(&worker, &pool, &t));
+	t.wait_for(1);
+	TEST_CHECK(pool->status().in_use == 0);
+	delete pool;
+	pool = 0;
+	t.next();
+	th.join();
+
+	// and a new pool works alongside the caches
+	// of the old one
+	block_pool pool2;
+	{
+		boost::shared_array<char> b = pool2.allocate();
+		TEST_CHECK(pool2.status().in_use == pool2.block_size());
+	}
+	TEST_CHECK(pool2.status().in_use == 0);
+
+	return test::failures();
+}
@@ -0,0 +1,374 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <vector>
+#include <string>
+#include <iterator>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+
+#include "libtorrent/dht_node.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/entry.hpp"
+#include "libtorrent/bencode.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	enum
+	{
+		num_nodes = 200,
+		first_port = 49000,
+		client_port = 48999,
+		// in milliseconds
+		token_interval = 1000
+	};
+
+	// records the peers the lookups found
+	struct peer_collector
+	{
+		void peers_found(const sha1_hash& info_hash
+			, const std::vector<address>& peers)
+		{
+			for (std::vector<address>::const_iterator i = peers.begin();
+				i != peers.end(); ++i)
+			{
+				found.push_back(std::make_pair(info_hash, *i));
+			}
+		}
+
+		bool has(const sha1_hash& info_hash, const address& a) const
+		{
+			return std::find(found.begin(), found.end()
+				, std::make_pair(info_hash, a)) != found.end();
+		}
+
+		std::vector<std::pair<sha1_hash, address> > found;
+	};
+
+	entry make_string(const std::string& str)
+	{
+		entry e(entry::string_t);
+		e.string() = str;
+		return e;
+	}
+
+	entry make_integer(entry::integer_type val)
+	{
+		entry e(entry::int_t);
+		e.integer() = val;
+		return e;
+	}
+
+	// a swarm of nodes on the loopback interface, and a socket
+	// that sends hand made queries to them
+	struct network: test::event_loop
+	{
+		network()
+			: client(new libtorrent::socket(libtorrent::socket::udp, false, client_port))
+			, next_transaction(0)
+		{
+			sel.monitor_readability(client);
+			for (int i = 0; i < num_nodes; ++i)
+			{
+				boost::shared_ptr<dht_node> n(new dht_node(timers, sel
+					, boost::bind(&peer_collector::peers_found, &peers, _1, _2)));
+				n->set_token_interval(token_interval);
+				n->start(first_port + i);
+				nodes.push_back(n);
+			}
+		}
+
+		~network()
+		{
+			for (int i = 0; i < num_nodes; ++i) nodes[i]->abort();
+		}
+
+		virtual void on_readable(const boost::shared_ptr<libtorrent::socket>& s)
+		{
+			if (s == client)
+			{
+				client_incoming();
+				return;
+			}
+			for (int i = 0; i < num_nodes; ++i)
+				if (nodes[i]->incoming(s)) break;
+		}
+
+		void client_incoming()
+		{
+			char buf[1500];
+			address from;
+			int size;
+			while ((size = client->receive_from(buf, sizeof(buf), from)) > 0)
+			{
+				try { reply = bdecode(buf, buf + size); }
+				catch (std::exception&) {}
+			}
+		}
+
+		// sends the query to the node and returns its reply, or
+		// an empty dictionary if it didn't reply in time
+		entry query(int node, const char* q, entry args)
+		{
+			std::string tid;
+			tid += static_cast<char>(next_transaction >> 8);
+			tid += static_cast<char>(next_transaction);
+			++next_transaction;
+
+			args.dict()["id"] = make_string(std::string(20, 'c'));
+			entry msg(entry::dictionary_t);
+			msg.dict()["t"] = make_string(tid);
+			msg.dict()["y"] = make_string("q");
+			msg.dict()["q"] = make_string(q);
+			msg.dict()["a"] = args;
+			std::string buf;
+			bencode(std::back_inserter(buf), msg);
+
+			reply = entry(entry::dictionary_t);
+			client->send_to(address(127, 0, 0, 1, first_port + node)
+				, buf.c_str(), buf.size());
+			timer_wheel::time_type end = timers.now() + 2000;
+			while (timers.now() < end)
+			{
+				step();
+				entry::dictionary_type::iterator i = reply.dict().find("t");
+				if (i != reply.dict().end() && i->second.type() == entry::string_t
+					&& i->second.string() == tid)
+					break;
+			}
+			return reply;
+		}
+
+		// returns true if the reply is a response and not an error
+		static bool is_response(entry& e)
+		{
+			entry::dictionary_type::iterator i = e.dict().find("y");
+			return i != e.dict().end() && i->second.type() == entry::string_t
+				&& i->second.string() == "r";
+		}
+
+		static bool is_error(entry& e)
+		{
+			entry::dictionary_type::iterator i = e.dict().find("y");
+			return i != e.dict().end() && i->second.type() == entry::string_t
+				&& i->second.string() == "e";
+		}
+
+		// asks the node for the peers of the torrent, and
+		// returns the token it hands out
+		std::string get_token(int node, const sha1_hash& info_hash)
+		{
+			entry args(entry::dictionary_t);
+			args.dict()["info_hash"] = make_string(
+				std::string(info_hash.begin(), info_hash.end()));
+			entry r = query(node, "get_peers", args);
+			if (!is_response(r)) return std::string();
+			entry& t = r.dict()["r"].dict()["token"];
+			if (t.type() != entry::string_t) return std::string();
+			return t.string();
+		}
+
+		entry announce(int node, const sha1_hash& info_hash
+			, entry::integer_type port, const std::string& token)
+		{
+			entry args(entry::dictionary_t);
+			args.dict()["info_hash"] = make_string(
+				std::string(info_hash.begin(), info_hash.end()));
+			args.dict()["port"] = make_integer(port);
+			args.dict()["token"] = make_string(token);
+			return query(node, "announce_peer", args);
+		}
+
+		// the number of peers the node returns for the torrent
+		int num_stored(int node, const sha1_hash& info_hash)
+		{
+			entry args(entry::dictionary_t);
+			args.dict()["info_hash"] = make_string(
+				std::string(info_hash.begin(), info_hash.end()));
+			entry r = query(node, "get_peers", args);
+			if (!is_response(r)) return -1;
+			entry::dictionary_type& d = r.dict()["r"].dict();
+			if (d.find("values") == d.end()) return 0;
+			return d["values"].list().size();
+		}
+
+		peer_collector peers;
+		std::vector<boost::shared_ptr<dht_node> > nodes;
+		boost::shared_ptr<libtorrent::socket> client;
+		unsigned short next_transaction;
+		entry reply;
+	};
+
+	sha1_hash make_hash(unsigned char c)
+	{
+		sha1_hash h;
+		std::fill(h.begin(), h.end(), c);
+		return h;
+	}
+}
+
+int main()
+{
+	network n;
+
+	// every node only knows about the first one to begin
+	// with, and has to find the others through it. They join
+	// a few at a time, the first node's socket buffer won't
+	// hold the queries of all of them at once
+	n.run(100);
+	n.nodes[0]->add_node(address(127, 0, 0, 1, first_port + 1));
+	for (int i = 1; i < num_nodes; ++i)
+	{
+		n.nodes[i]->add_node(address(127, 0, 0, 1, first_port));
+		if (i % 10 == 0) n.run(dht_node::tick_interval);
+	}
+	n.run(5000);
+
+	int min_nodes = num_nodes;
+	int total_nodes = 0;
+	int lookups = 0;
+	for (int i = 0; i < num_nodes; ++i)
+	{
+		TEST_CHECK(n.nodes[i]->is_running());
+		min_nodes = std::min(min_nodes, n.nodes[i]->num_nodes());
+		total_nodes += n.nodes[i]->num_nodes();
+		lookups += n.nodes[i]->num_lookups();
+	}
+	// the buckets far from our id hold up to eight nodes each,
+	// so the tables have more than the bootstrap node in them
+	TEST_CHECK(min_nodes > int(dht_routing_table::bucket_size));
+	TEST_CHECK(total_nodes / num_nodes >= 2 * int(dht_routing_table::bucket_size));
+	TEST_CHECK(lookups == 0);
+	if (min_nodes <= int(dht_routing_table::bucket_size))
+		std::cerr << "smallest routing table: " << min_nodes << " nodes\n";
+
+	// one node announces a torrent, and another one that
+	// doesn't know about it finds it
+	sha1_hash torrent = make_hash(0x42);
+	n.nodes[17]->get_peers(torrent, 6881);
+	n.run(3000);
+	n.nodes[150]->get_peers(torrent, 0);
+	n.run(3000);
+	TEST_CHECK(n.peers.has(torrent, address(127, 0, 0, 1, 6881)));
+	// the lookup without a listen port doesn't announce
+	for (std::vector<std::pair<sha1_hash, address> >::iterator i
+		= n.peers.found.begin(); i != n.peers.found.end(); ++i)
+	{
+		TEST_CHECK(i->second == address(127, 0, 0, 1, 6881));
+	}
+
+	// ---- announce_peer validation ----
+
+	sha1_hash hash = make_hash(0x17);
+	std::string token = n.get_token(3, hash);
+	TEST_CHECK(token.size() == 4);
+
+	// a query without an id is an error
+	{
+		entry msg(entry::dictionary_t);
+		msg.dict()["t"] = make_string("xx");
+		msg.dict()["y"] = make_string("q");
+		msg.dict()["q"] = make_string("ping");
+		msg.dict()["a"] = entry(entry::dictionary_t);
+		std::string buf;
+		bencode(std::back_inserter(buf), msg);
+		n.reply = entry(entry::dictionary_t);
+		n.client->send_to(address(127, 0, 0, 1, first_port + 3), buf.c_str(), buf.size());
+		n.run(300);
+		TEST_CHECK(network::is_error(n.reply));
+	}
+
+	entry r = n.announce(3, hash, 7000, "xxxx");
+	TEST_CHECK(network::is_error(r));
+	r = n.announce(3, hash, 7000, "");
+	TEST_CHECK(network::is_error(r));
+	r = n.announce(3, hash, 0, token);
+	TEST_CHECK(network::is_error(r));
+	r = n.announce(3, hash, 65536, token);
+	TEST_CHECK(network::is_error(r));
+	// the token is only good for the node that handed it out
+	r = n.announce(4, hash, 7000, token);
+	TEST_CHECK(network::is_error(r));
+	{
+		// the info-hash is missing
+		entry args(entry::dictionary_t);
+		args.dict()["port"] = make_integer(7000);
+		args.dict()["token"] = make_string(token);
+		r = n.query(3, "announce_peer", args);
+		TEST_CHECK(network::is_error(r));
+	}
+	TEST_CHECK(n.num_stored(3, hash) == 0);
+
+	r = n.announce(3, hash, 7000, token);
+	TEST_CHECK(network::is_response(r));
+	TEST_CHECK(n.num_stored(3, hash) == 1);
+	// announcing again refreshes the same peer
+	r = n.announce(3, hash, 7000, token);
+	TEST_CHECK(network::is_response(r));
+	TEST_CHECK(n.num_stored(3, hash) == 1);
+	r = n.announce(3, hash, 7001, token);
+	TEST_CHECK(network::is_response(r));
+	TEST_CHECK(n.num_stored(3, hash) == 2);
+
+	// ---- token rotation ----
+
+	// the secret is replaced on the first tick more than
+	// token_interval after the last time. A token is accepted
+	// until the secret it was made from is replaced the second
+	// time, which is at least one interval away, and at most
+	// two plus a tick
+	token = n.get_token(5, hash);
+	n.run(token_interval);
+	r = n.announce(5, hash, 7000, token);
+	TEST_CHECK(network::is_response(r));
+
+	n.run(2 * token_interval + 3 * dht_node::tick_interval);
+	r = n.announce(5, hash, 7002, token);
+	TEST_CHECK(network::is_error(r));
+	TEST_CHECK(n.num_stored(5, hash) == 1);
+
+	// a fresh token works again
+	token = n.get_token(5, hash);
+	r = n.announce(5, hash, 7002, token);
+	TEST_CHECK(network::is_response(r));
+	TEST_CHECK(n.num_stored(5, hash) == 2);
+
+	return test::failures();
+}
@@ -0,0 +1,183 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
+
+#include "libtorrent/lsd.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/peer_id.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	// records the peers one lsd instance has been told about
+	struct collector
+	{
+		void peer_found(const sha1_hash& info_hash, const address& peer)
+		{
+			peers.push_back(std::make_pair(info_hash, peer.port()));
+		}
+
+		bool has(const sha1_hash& info_hash, unsigned short port) const
+		{
+			return std::find(peers.begin(), peers.end()
+				, std::make_pair(info_hash, port)) != peers.end();
+		}
+
+		bool has_port(unsigned short port) const
+		{
+			for (std::vector<std::pair<sha1_hash, unsigned short> >::const_iterator i
+				= peers.begin(); i != peers.end(); ++i)
+			{
+				if (i->second == port) return true;
+			}
+			return false;
+		}
+
+		std::vector<std::pair<sha1_hash, unsigned short> > peers;
+	};
+
+	// a number of sessions' local service discovery in one
+	// process. They share the multicast port and see each
+	// other's announces, and their own, over the loopback
+	struct network: test::event_loop
+	{
+		enum { num_nodes = 3, first_port = 7001 };
+
+		network()
+		{
+			for (int i = 0; i < num_nodes; ++i)
+			{
+				nodes[i].reset(new lsd(timers, sel
+					, boost::bind(&collector::peer_found, &peers[i], _1, _2)));
+				nodes[i]->set_listen_port(first_port + i);
+			}
+		}
+
+		virtual void on_readable(const boost::shared_ptr<libtorrent::socket>& s)
+		{
+			for (int i = 0; i < num_nodes; ++i)
+				if (nodes[i]->incoming(s)) break;
+		}
+
+		collector peers[num_nodes];
+		boost::shared_ptr<lsd> nodes[num_nodes];
+	};
+
+	sha1_hash make_hash(unsigned char c)
+	{
+		sha1_hash h;
+		std::fill(h.begin(), h.end(), c);
+		return h;
+	}
+}
+
+int main()
+{
+	network n;
+
+	sha1_hash shared = make_hash(1);
+	sha1_hash only_last = make_hash(2);
+	sha1_hash removed = make_hash(3);
+
+	// the sockets are opened by the first timer callback. The
+	// announces sent before the others have joined the group
+	// are lost, so wait for all of them
+	for (int i = 0; i < network::num_nodes; ++i)
+		n.nodes[i]->start();
+	n.run(500);
+	for (int i = 0; i < network::num_nodes; ++i)
+		TEST_CHECK(n.nodes[i]->num_sockets() == 1);
+
+	n.nodes[0]->announce(shared);
+	n.nodes[1]->announce(shared);
+	n.nodes[2]->announce(only_last);
+	// a torrent that's removed before its turn isn't announced
+	n.nodes[2]->announce(removed);
+	n.nodes[2]->remove(removed);
+
+	n.run(1500);
+
+	// every node hears the others' announces
+	TEST_CHECK(n.peers[0].has(shared, network::first_port + 1));
+	TEST_CHECK(n.peers[0].has(only_last, network::first_port + 2));
+	TEST_CHECK(n.peers[1].has(shared, network::first_port));
+	TEST_CHECK(n.peers[1].has(only_last, network::first_port + 2));
+	TEST_CHECK(n.peers[2].has(shared, network::first_port));
+	TEST_CHECK(n.peers[2].has(shared, network::first_port + 1));
+
+	// but never its own, they're recognized by the cookie
+	for (int i = 0; i < network::num_nodes; ++i)
+		TEST_CHECK(!n.peers[i].has_port(network::first_port + i));
+
+	for (int i = 0; i < network::num_nodes; ++i)
+		TEST_CHECK(!n.peers[i].has(removed, network::first_port + 2));
+
+	// a new torrent is announced within a second, and
+	// the ones that are already announced aren't repeated
+	for (int i = 0; i < network::num_nodes; ++i)
+		n.peers[i].peers.clear();
+	sha1_hash added = make_hash(4);
+	n.nodes[0]->announce(added);
+	n.run(1500);
+	TEST_CHECK(n.peers[1].has(added, network::first_port));
+	TEST_CHECK(n.peers[2].has(added, network::first_port));
+	TEST_CHECK(n.peers[1].peers.size() == 1);
+	TEST_CHECK(n.peers[2].peers.size() == 1);
+	TEST_CHECK(n.peers[0].peers.empty());
+
+	// a stopped node closes its socket and stops announcing
+	n.nodes[1]->stop();
+	n.run(1500);
+	TEST_CHECK(n.nodes[1]->num_sockets() == 0);
+	for (int i = 0; i < network::num_nodes; ++i)
+		n.peers[i].peers.clear();
+	n.nodes[1]->announce(make_hash(5));
+	n.run(1500);
+	TEST_CHECK(!n.peers[0].has_port(network::first_port + 1));
+	TEST_CHECK(!n.peers[2].has_port(network::first_port + 1));
+
+	for (int i = 0; i < network::num_nodes; ++i)
+		n.nodes[i]->abort();
+
+	return test::failures();
+}
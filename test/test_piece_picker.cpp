@@ -0,0 +1,241 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+#include "libtorrent/piece_picker.hpp"
+#include "libtorrent/torrent_info.hpp"
+#include "libtorrent/torrent.hpp"
+#include "libtorrent/bencode.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	const int blocks_per_piece = 4;
+	const int num_pieces = 8;
+
+	// the number of peers that have each piece
+	const int availability[num_pieces] = { 3, 1, 2, 1, 3, 2, 3, 2 };
+
+	// the pieces of the picked blocks, in the order they're
+	// picked, every piece once
+	std::vector<int> picked_pieces(const std::vector<piece_block>& blocks)
+	{
+		std::vector<int> ret;
+		for (std::vector<piece_block>::const_iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+		{
+			if (std::find(ret.begin(), ret.end(), i->piece_index) == ret.end())
+				ret.push_back(i->piece_index);
+		}
+		return ret;
+	}
+
+	std::vector<int> pick(const piece_picker& p, const std::vector<bool>& have)
+	{
+		std::vector<piece_block> blocks;
+		p.pick_pieces(have, blocks, num_pieces * blocks_per_piece);
+		return picked_pieces(blocks);
+	}
+
+	bool picked(const std::vector<int>& pieces, int index)
+	{
+		return std::find(pieces.begin(), pieces.end(), index) != pieces.end();
+	}
+
+	int position(const std::vector<int>& pieces, int index)
+	{
+		return std::find(pieces.begin(), pieces.end(), index) - pieces.begin();
+	}
+
+	// a torrent with the files (size, name): (20, a), (0, b),
+	// (12, c) and (40, d) and 16 byte pieces. The hashes
+	// aren't checked
+	entry torrent_file()
+	{
+		std::stringstream s;
+		s << "d8:announce9:localhost4:infod5:filesl"
+			<< "d6:lengthi20e4:pathl1:aee"
+			<< "d6:lengthi0e4:pathl1:bee"
+			<< "d6:lengthi12e4:pathl1:cee"
+			<< "d6:lengthi40e4:pathl1:dee"
+			<< "e4:name4:test12:piece lengthi16e"
+			<< "6:pieces100:" << std::string(100, 'x')
+			<< "ee";
+		const std::string str = s.str();
+		return bdecode(str.begin(), str.end());
+	}
+}
+
+int main()
+{
+	// the last piece has two blocks
+	piece_picker p(blocks_per_piece, num_pieces * blocks_per_piece - 2);
+	p.files_checked(std::vector<bool>(num_pieces, false));
+	for (int i = 0; i < num_pieces; ++i)
+	{
+		for (int j = 0; j < availability[i]; ++j)
+			TEST_CHECK(p.inc_refcount(i));
+	}
+
+	// a peer that has every piece
+	std::vector<bool> have(num_pieces, true);
+	std::vector<int> pieces;
+
+	// rarest first
+	pieces = pick(p, have);
+	TEST_CHECK(int(pieces.size()) == num_pieces);
+	for (int i = 1; i < int(pieces.size()); ++i)
+		TEST_CHECK(availability[pieces[i - 1]] <= availability[pieces[i]]);
+
+	std::vector<piece_block> blocks;
+	p.pick_pieces(have, blocks, 3);
+	TEST_CHECK(blocks.size() == 3);
+	TEST_CHECK(availability[blocks.front().piece_index] == 1);
+
+	// the pieces of a higher priority are picked first, even
+	// though they're more common. Within a priority, rarest
+	// first still applies
+	p.set_piece_priority(0, 7);
+	p.set_piece_priority(4, 5);
+	pieces = pick(p, have);
+	TEST_CHECK(int(pieces.size()) == num_pieces);
+	TEST_CHECK(pieces[0] == 0);
+	TEST_CHECK(pieces[1] == 4);
+	TEST_CHECK(availability[pieces[2]] == 1);
+
+	// the peer only has pieces of lower priorities. The
+	// higher bands are walked past
+	have.assign(num_pieces, false);
+	have[6] = true;
+	have[7] = true;
+	pieces = pick(p, have);
+	TEST_CHECK(pieces.size() == 2);
+	TEST_CHECK(pieces[0] == 7);
+	TEST_CHECK(pieces[1] == 6);
+	have.assign(num_pieces, true);
+
+	// filtered pieces are never picked, and
+	// aren't interesting
+	p.set_piece_priority(1, 0);
+	p.set_piece_priority(3, 0);
+	TEST_CHECK(p.piece_priority(1) == 0);
+	TEST_CHECK(!p.inc_refcount(1));
+	p.dec_refcount(1);
+	pieces = pick(p, have);
+	TEST_CHECK(int(pieces.size()) == num_pieces - 2);
+	TEST_CHECK(!picked(pieces, 1));
+	TEST_CHECK(!picked(pieces, 3));
+
+	blocks.clear();
+	p.pick_in_order(have, 0, num_pieces, blocks, num_pieces * blocks_per_piece);
+	pieces = picked_pieces(blocks);
+	TEST_CHECK(int(pieces.size()) == num_pieces - 2);
+	TEST_CHECK(pieces[0] == 0);
+	TEST_CHECK(pieces[1] == 2);
+	TEST_CHECK(pieces[2] == 4);
+
+	std::vector<bool> filter;
+	p.filtered_pieces(filter);
+	TEST_CHECK(int(filter.size()) == num_pieces);
+	TEST_CHECK(std::count(filter.begin(), filter.end(), true) == 2);
+	TEST_CHECK(filter[1] && filter[3]);
+
+	// a partially downloaded piece is picked before the other
+	// pieces of its priority, but not before higher priorities
+	p.mark_as_downloading(piece_block(5, 0), peer_id());
+	pieces = pick(p, have);
+	TEST_CHECK(pieces[0] == 0);
+	TEST_CHECK(pieces[1] == 4);
+	TEST_CHECK(pieces[2] == 5);
+
+	// and it's filtered like any other piece
+	p.set_piece_priority(5, 0);
+	pieces = pick(p, have);
+	TEST_CHECK(!picked(pieces, 5));
+	p.set_piece_priority(5, piece_picker::default_priority);
+	p.abort_download(piece_block(5, 0));
+
+	// unfiltered, the piece is picked again, rarest first
+	p.set_piece_priority(1, piece_picker::default_priority);
+	pieces = pick(p, have);
+	TEST_CHECK(picked(pieces, 1));
+	TEST_CHECK(position(pieces, 1) == 2);
+
+	// a piece gets the highest priority of the files it
+	// overlaps. Empty files don't count
+	torrent_info info(torrent_file());
+	TEST_CHECK(info.num_pieces() == 5);
+	std::vector<int> file_priority(4);
+	file_priority[0] = 1;
+	file_priority[1] = 7;
+	file_priority[2] = 3;
+	file_priority[3] = 0;
+	std::vector<int> piece_priority;
+
+	TEST_CHECK(file_piece_priorities(info, file_priority, 0, piece_priority) == 0);
+	TEST_CHECK(piece_priority.size() == 2);
+	TEST_CHECK(piece_priority[0] == 1);
+	TEST_CHECK(piece_priority[1] == 3);
+
+	TEST_CHECK(file_piece_priorities(info, file_priority, 1, piece_priority) == -1);
+	TEST_CHECK(piece_priority.empty());
+
+	TEST_CHECK(file_piece_priorities(info, file_priority, 2, piece_priority) == 1);
+	TEST_CHECK(piece_priority.size() == 1);
+	TEST_CHECK(piece_priority[0] == 3);
+
+	// the pieces only a skipped file overlaps are filtered
+	TEST_CHECK(file_piece_priorities(info, file_priority, 3, piece_priority) == 2);
+	TEST_CHECK(piece_priority.size() == 3);
+	TEST_CHECK(std::count(piece_priority.begin(), piece_priority.end(), 0) == 3);
+
+	// the empty file doesn't keep the piece it's
+	// in from being filtered
+	file_priority[0] = 0;
+	file_priority[2] = 0;
+	file_priority[3] = 2;
+	TEST_CHECK(file_piece_priorities(info, file_priority, 0, piece_priority) == 0);
+	TEST_CHECK(piece_priority.size() == 2);
+	TEST_CHECK(piece_priority[0] == 0);
+	TEST_CHECK(piece_priority[1] == 0);
+
+	return test::failures();
+}
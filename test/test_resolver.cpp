@@ -0,0 +1,199 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <map>
+#include <string>
+#include <sstream>
+
+#include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "libtorrent/resolver.hpp"
+#include "libtorrent/timer_wheel.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	// stands in for the name server. good.example resolves
+	// to 127.0.0.1, everything else fails. Every lookup is
+	// counted, and takes a while, so that concurrent requests
+	// for the same name have a chance to be merged
+	struct stub_resolver
+	{
+		int lookup(const std::string& hostname, unsigned int& ip)
+		{
+			test::sleep(100);
+			boost::mutex::scoped_lock l(mutex);
+			++lookups[hostname];
+			if (hostname != "good.example") return -2;
+			ip = 0x7f000001;
+			return 0;
+		}
+
+		int num_lookups(const std::string& hostname)
+		{
+			boost::mutex::scoped_lock l(mutex);
+			return lookups[hostname];
+		}
+
+		boost::mutex mutex;
+		std::map<std::string, int> lookups;
+	};
+
+	struct result
+	{
+		result(): calls(0), error(0) {}
+		int calls;
+		int error;
+		address addr;
+	};
+
+	void on_resolved(result* r, int error, const address& a)
+	{
+		++r->calls;
+		r->error = error;
+		r->addr = a;
+	}
+
+	// runs the timers until the result has been delivered,
+	// or a few seconds have passed
+	void wait_for(timer_wheel& timers, const result& r)
+	{
+		for (int i = 0; i < 300 && r.calls == 0; ++i)
+		{
+			test::sleep(10);
+			timers.update_time();
+			timers.advance();
+		}
+	}
+
+	// runs the timers for the given number of milliseconds
+	void run_for(timer_wheel& timers, int milliseconds)
+	{
+		for (int i = 0; i < milliseconds / 10; ++i)
+		{
+			test::sleep(10);
+			timers.update_time();
+			timers.advance();
+		}
+	}
+}
+
+int main()
+{
+	timer_wheel timers;
+	stub_resolver stub;
+	resolver res(timers, boost::bind(&stub_resolver::lookup, &stub, _1, _2));
+	res.set_cache_ttl(60 * 1000, 300);
+
+	// two concurrent requests for the same name
+	// are merged into one lookup
+	result r1, r2;
+	res.async_resolve("good.example", 80, &r1, boost::bind(&on_resolved, &r1, _1, _2));
+	res.async_resolve("good.example", 81, &r2, boost::bind(&on_resolved, &r2, _1, _2));
+	wait_for(timers, r1);
+	wait_for(timers, r2);
+	TEST_CHECK(r1.calls == 1 && r1.error == 0);
+	TEST_CHECK(r2.calls == 1 && r2.error == 0);
+	TEST_CHECK(r1.addr == address(127, 0, 0, 1, 80));
+	TEST_CHECK(r2.addr == address(127, 0, 0, 1, 81));
+	TEST_CHECK(stub.num_lookups("good.example") == 1);
+
+	// the next request is answered from the cache
+	result r3;
+	res.async_resolve("good.example", 80, &r3, boost::bind(&on_resolved, &r3, _1, _2));
+	wait_for(timers, r3);
+	TEST_CHECK(r3.calls == 1 && r3.error == 0);
+	TEST_CHECK(stub.num_lookups("good.example") == 1);
+
+	// IPs aren't looked up at all
+	result r4;
+	res.async_resolve("10.0.0.1", 80, &r4, boost::bind(&on_resolved, &r4, _1, _2));
+	wait_for(timers, r4);
+	TEST_CHECK(r4.calls == 1 && r4.error == 0);
+	TEST_CHECK(r4.addr == address(10, 0, 0, 1, 80));
+	TEST_CHECK(stub.num_lookups("10.0.0.1") == 0);
+
+	// and they don't take up room in the cache
+	int cached = res.cache_size();
+	result r4b;
+	for (int i = 0; i < 2000; ++i)
+	{
+		std::stringstream ip;
+		ip << "10.0." << (i >> 8) << "." << (i & 0xff);
+		res.async_resolve(ip.str(), 80, &r4b, boost::bind(&on_resolved, &r4b, _1, _2));
+	}
+	wait_for(timers, r4b);
+	TEST_CHECK(r4b.calls == 2000 && r4b.error == 0);
+	TEST_CHECK(res.cache_size() == cached);
+
+	// failures are cached too
+	result r5;
+	res.async_resolve("bad.example", 80, &r5, boost::bind(&on_resolved, &r5, _1, _2));
+	wait_for(timers, r5);
+	TEST_CHECK(r5.calls == 1 && r5.error != 0);
+	TEST_CHECK(stub.num_lookups("bad.example") == 1);
+
+	result r6;
+	res.async_resolve("bad.example", 80, &r6, boost::bind(&on_resolved, &r6, _1, _2));
+	wait_for(timers, r6);
+	TEST_CHECK(r6.calls == 1 && r6.error != 0);
+	TEST_CHECK(stub.num_lookups("bad.example") == 1);
+
+	// but not for longer than the negative ttl
+	run_for(timers, 400);
+	result r7;
+	res.async_resolve("bad.example", 80, &r7, boost::bind(&on_resolved, &r7, _1, _2));
+	wait_for(timers, r7);
+	TEST_CHECK(r7.calls == 1 && r7.error != 0);
+	TEST_CHECK(stub.num_lookups("bad.example") == 2);
+
+	// the successful lookup is still cached
+	result r8;
+	res.async_resolve("good.example", 80, &r8, boost::bind(&on_resolved, &r8, _1, _2));
+	wait_for(timers, r8);
+	TEST_CHECK(r8.calls == 1);
+	TEST_CHECK(stub.num_lookups("good.example") == 1);
+
+	// cancelled requests are never delivered
+	result r9;
+	res.async_resolve("other.example", 80, &r9, boost::bind(&on_resolved, &r9, _1, _2));
+	res.cancel(&r9);
+	run_for(timers, 500);
+	TEST_CHECK(r9.calls == 0);
+
+	return test::failures();
+}
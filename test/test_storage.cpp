@@ -0,0 +1,129 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/filesystem/operations.hpp>
+
+#include "libtorrent/storage.hpp"
+#include "libtorrent/torrent_info.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/block_pool.hpp"
+#include "libtorrent/session.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+namespace fs = boost::filesystem;
+
+namespace
+{
+	const int piece_length = 16 * 1024;
+	const int num_pieces = 8;
+
+	// a single file torrent. The last piece is shorter than
+	// the others. The hashes aren't checked
+	entry torrent_file()
+	{
+		const int size = (num_pieces - 1) * piece_length + 1000;
+		std::stringstream s;
+		s << "d8:announce9:localhost4:infod"
+			<< "6:lengthi" << size << "e"
+			<< "4:name12:test_storage"
+			<< "12:piece lengthi" << piece_length << "e"
+			<< "6:pieces" << num_pieces * 20 << ":"
+			<< std::string(num_pieces * 20, 'x')
+			<< "ee";
+		const std::string str = s.str();
+		return bdecode(str.begin(), str.end());
+	}
+
+	void write_piece(piece_manager& pm, const torrent_info& info, int index)
+	{
+		std::vector<char> buf(info.piece_size(index), char('a' + index));
+		pm.write(&buf[0], index, 0, buf.size());
+	}
+
+	bool check_piece(piece_manager& pm, const torrent_info& info, int index)
+	{
+		std::vector<char> buf(info.piece_size(index));
+		pm.read(&buf[0], index, 0, buf.size());
+		return buf == std::vector<char>(buf.size(), char('a' + index));
+	}
+}
+
+int main()
+{
+	fs::path save_path("test_storage_dir");
+	fs::remove_all(save_path);
+	fs::create_directory(save_path);
+
+	torrent_info info(torrent_file());
+	TEST_CHECK(info.num_pieces() == num_pieces);
+
+	{
+		block_pool pool;
+		piece_manager pm(info, save_path, pool);
+
+		boost::mutex mutex;
+		detail::piece_checker_data data;
+		std::vector<bool> pieces(num_pieces, false);
+		pm.check_pieces(mutex, data, pieces);
+
+		// the piece takes up a slot of another piece, since
+		// the slots are allocated in order
+		write_piece(pm, info, 6);
+
+		// and is filtered after it has been downloaded. Its
+		// own slot isn't allocated, so the wanted pieces run
+		// out of slots before they're all written. The slot
+		// of the filtered piece is allocated then
+		std::vector<bool> filter(num_pieces, false);
+		filter[6] = true;
+		pm.set_piece_filter(filter);
+
+		for (int i = 0; i < num_pieces; ++i)
+			if (i != 6) write_piece(pm, info, i);
+
+		for (int i = 0; i < num_pieces; ++i)
+			TEST_CHECK(check_piece(pm, info, i));
+	}
+
+	fs::remove_all(save_path);
+	return test::failures();
+}
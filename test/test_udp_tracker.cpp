@@ -0,0 +1,312 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/cstdint.hpp>
+
+#include "libtorrent/udp_tracker.hpp"
+#include "libtorrent/resolver.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/socket.hpp"
+#include "libtorrent/entry.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	enum { tracker_port = 48123 };
+
+	void write_uint32(unsigned int val, char*& buf)
+	{
+		*buf++ = static_cast<char>(val >> 24);
+		*buf++ = static_cast<char>(val >> 16);
+		*buf++ = static_cast<char>(val >> 8);
+		*buf++ = static_cast<char>(val);
+	}
+
+	unsigned int read_uint32(const char*& buf)
+	{
+		const unsigned char* b = reinterpret_cast<const unsigned char*>(buf);
+		buf += 4;
+		return (boost::uint32_t(b[0]) << 24) | (boost::uint32_t(b[1]) << 16)
+			| (boost::uint32_t(b[2]) << 8) | boost::uint32_t(b[3]);
+	}
+
+	// a stand-in for a UDP tracker on the loopback interface.
+	// It hands out connection ids, and rejects the ones it has
+	// forgotten with an error, the way real trackers do when
+	// an id has expired
+	struct stub_tracker
+	{
+		stub_tracker()
+			: sock(new libtorrent::socket(libtorrent::socket::udp, false, tracker_port))
+			, connection_id(1)
+			, connects(0)
+			, announces(0)
+			, scrapes(0)
+			, reject_all(false)
+		{}
+
+		// the ids handed out so far aren't accepted anymore
+		void forget_ids() { ++connection_id; }
+
+		void incoming()
+		{
+			char buf[2048];
+			address from;
+			int size;
+			while ((size = sock->receive_from(buf, sizeof(buf), from)) >= 16)
+			{
+				const char* ptr = buf;
+				unsigned int id_high = read_uint32(ptr);
+				unsigned int id_low = read_uint32(ptr);
+				unsigned int action = read_uint32(ptr);
+				unsigned int transaction = read_uint32(ptr);
+
+				char reply[256];
+				char* out = reply;
+				if (action == 0)
+				{
+					++connects;
+					write_uint32(0, out);
+					write_uint32(transaction, out);
+					write_uint32(0, out);
+					write_uint32(connection_id, out);
+				}
+				else if (id_high != 0 || id_low != connection_id || reject_all)
+				{
+					write_uint32(3, out);
+					write_uint32(transaction, out);
+					const char msg[] = "connection id expired";
+					std::memcpy(out, msg, sizeof(msg) - 1);
+					out += sizeof(msg) - 1;
+				}
+				else if (action == 1)
+				{
+					++announces;
+					write_uint32(1, out);
+					write_uint32(transaction, out);
+					// interval, leechers, seeders
+					write_uint32(1800, out);
+					write_uint32(2, out);
+					write_uint32(3, out);
+					// one peer, 10.0.0.1:6881
+					const char peer[] = {10, 0, 0, 1, 0x1a, char(0xe1)};
+					std::memcpy(out, peer, 6);
+					out += 6;
+				}
+				else if (action == 2)
+				{
+					++scrapes;
+					write_uint32(2, out);
+					write_uint32(transaction, out);
+					// the counters of the n:th torrent are
+					// 5, 6 and 7 plus 10 * n
+					for (int i = 16, n = 0; i + 20 <= size; i += 20, ++n)
+					{
+						write_uint32(5 + 10 * n, out);
+						write_uint32(6 + 10 * n, out);
+						write_uint32(7 + 10 * n, out);
+					}
+				}
+				sock->send_to(from, reply, int(out - reply));
+			}
+		}
+
+		boost::shared_ptr<libtorrent::socket> sock;
+		unsigned int connection_id;
+		int connects;
+		int announces;
+		int scrapes;
+		bool reject_all;
+	};
+
+	struct callback: request_callback
+	{
+		callback(): responses(0), timeouts(0), errors(0) {}
+
+		virtual void tracker_response(const entry& e)
+		{
+			++responses;
+			response = e;
+		}
+		virtual void tracker_request_timed_out() { ++timeouts; }
+		virtual void tracker_request_error(const char* str)
+		{
+			++errors;
+			error = str;
+		}
+#ifndef NDEBUG
+		virtual void debug_log(const std::string& line) {}
+#endif
+
+		bool done() const { return responses + timeouts + errors > 0; }
+
+		int responses;
+		int timeouts;
+		int errors;
+		entry response;
+		std::string error;
+	};
+
+	struct network: test::event_loop
+	{
+		network()
+			: resolv(timers)
+			, manager(timers, sel, resolv)
+		{
+			sel.monitor_readability(tracker.sock);
+		}
+
+		virtual void on_readable(const boost::shared_ptr<libtorrent::socket>& s)
+		{
+			if (s == tracker.sock) tracker.incoming();
+			else manager.incoming(s);
+		}
+
+		// runs the network loop until the request is done,
+		// or a few seconds have passed
+		void wait_for(const callback& c)
+		{
+			for (int i = 0; i < 300 && !c.done(); ++i) step();
+			// let the manager clean up the finished request
+			test::sleep(2 * timer_wheel::tick_ms);
+			timers.update_time();
+			timers.advance();
+		}
+
+		udp_tracker_request announce()
+		{
+			udp_tracker_request req;
+			req.url = "udp://127.0.0.1:48123/announce";
+			req.listen_port = 6881;
+			req.event = udp_tracker_request::started;
+			return req;
+		}
+
+		resolver resolv;
+		udp_tracker_manager manager;
+		stub_tracker tracker;
+	};
+}
+
+int main()
+{
+	network n;
+
+	// the first announce connects first
+	callback c1;
+	n.manager.queue_request(n.announce(), &c1);
+	n.wait_for(c1);
+	TEST_CHECK(c1.responses == 1);
+	TEST_CHECK(n.tracker.connects == 1);
+	TEST_CHECK(n.tracker.announces == 1);
+	if (c1.responses == 1)
+	{
+		entry::dictionary_type& d = c1.response.dict();
+		TEST_CHECK(d["interval"].integer() == 1800);
+		TEST_CHECK(d["incomplete"].integer() == 2);
+		TEST_CHECK(d["complete"].integer() == 3);
+		TEST_CHECK(d["peers"].string() == std::string("\x0a\x00\x00\x01\x1a\xe1", 6));
+	}
+
+	// the next one uses the cached connection id
+	callback c2;
+	n.manager.queue_request(n.announce(), &c2);
+	n.wait_for(c2);
+	TEST_CHECK(c2.responses == 1);
+	TEST_CHECK(n.tracker.connects == 1);
+	TEST_CHECK(n.tracker.announces == 2);
+
+	// when the tracker has forgotten the cached id,
+	// it's dropped and we connect again
+	n.tracker.forget_ids();
+	callback c3;
+	n.manager.queue_request(n.announce(), &c3);
+	n.wait_for(c3);
+	TEST_CHECK(c3.responses == 1);
+	TEST_CHECK(c3.errors == 0);
+	TEST_CHECK(n.tracker.connects == 2);
+	TEST_CHECK(n.tracker.announces == 3);
+
+	// but only once. An error with a fresh id is final
+	n.tracker.reject_all = true;
+	n.tracker.forget_ids();
+	callback c4;
+	n.manager.queue_request(n.announce(), &c4);
+	n.wait_for(c4);
+	TEST_CHECK(c4.errors == 1);
+	TEST_CHECK(c4.error == "connection id expired");
+	TEST_CHECK(n.tracker.connects == 3);
+	n.tracker.reject_all = false;
+
+	// scrapes get one set of counters per torrent
+	udp_tracker_request scrape;
+	scrape.kind = udp_tracker_request::scrape_request;
+	scrape.url = "udp://127.0.0.1:48123/announce";
+	scrape.scrape_hashes.resize(2);
+	std::fill(scrape.scrape_hashes[0].begin(), scrape.scrape_hashes[0].end(), 1);
+	std::fill(scrape.scrape_hashes[1].begin(), scrape.scrape_hashes[1].end(), 2);
+	callback c5;
+	n.manager.queue_request(scrape, &c5);
+	n.wait_for(c5);
+	TEST_CHECK(c5.responses == 1);
+	TEST_CHECK(n.tracker.scrapes == 1);
+	if (c5.responses == 1)
+	{
+		entry::dictionary_type& files = c5.response.dict()["files"].dict();
+		TEST_CHECK(files.size() == 2);
+		for (int i = 0; i < 2; ++i)
+		{
+			const sha1_hash& h = scrape.scrape_hashes[i];
+			std::string key(h.begin(), h.end());
+			TEST_CHECK(files.find(key) != files.end());
+			if (files.find(key) == files.end()) continue;
+			entry::dictionary_type& info = files[key].dict();
+			TEST_CHECK(info["complete"].integer() == 5 + 10 * i);
+			TEST_CHECK(info["downloaded"].integer() == 6 + 10 * i);
+			TEST_CHECK(info["incomplete"].integer() == 7 + 10 * i);
+		}
+	}
+
+	TEST_CHECK(n.manager.send_finished());
+
+	return test::failures();
+}
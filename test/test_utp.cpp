@@ -0,0 +1,364 @@
+/*
+
+Copyright (c) 2003, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <iostream>
+
+#include <boost/shared_ptr.hpp>
+
+#include "libtorrent/utp_stream.hpp"
+#include "libtorrent/timer_wheel.hpp"
+#include "libtorrent/socket.hpp"
+
+#include "test.hpp"
+
+using namespace libtorrent;
+
+namespace
+{
+	enum
+	{
+		server_port = 48200,
+		relay_port = 48201
+	};
+
+	// sits between the client and the server on the loopback
+	// interface and stands in for a real link. It drops every
+	// drop_interval:th datagram in each direction, so that the
+	// streams have to recover from lost packets, acks and fins.
+	// The datagrams can be delayed too, and the ones from the
+	// client are sent through a bottleneck of the given rate,
+	// with an unlimited queue in front of it. The datagrams are
+	// released by the timer, which has a resolution of 10 ms
+	struct simulated_link: timer_callback
+	{
+		simulated_link(timer_wheel& t)
+			: sock(new libtorrent::socket(libtorrent::socket::udp, false, relay_port))
+			, server(127, 0, 0, 1, server_port)
+			, drop_interval(0)
+			, delay(0)
+			, rate(0)
+			, forwarded(0)
+			, dropped(0)
+			, max_queuing_delay(0)
+			, m_timers(t)
+			, m_link_free(0)
+		{}
+
+		void incoming()
+		{
+			char buf[2048];
+			address from;
+			int size;
+			while ((size = sock->receive_from(buf, sizeof(buf), from)) > 0)
+			{
+				address to = server;
+				if (from == server) to = client;
+				else client = from;
+
+				if (drop_interval > 0 && ++forwarded % drop_interval == 0)
+				{
+					++dropped;
+					continue;
+				}
+
+				if (delay == 0 && rate == 0)
+				{
+					sock->send_to(to, buf, size);
+					continue;
+				}
+
+				// the time the datagram has gone through
+				// the bottleneck
+				const timer_wheel::time_type now = m_timers.now();
+				timer_wheel::time_type sent = now;
+				if (rate > 0 && to == server)
+				{
+					m_link_free = std::max(m_link_free, now) + size * 1000 / rate;
+					sent = m_link_free;
+					max_queuing_delay = std::max(max_queuing_delay, int(sent - now));
+				}
+
+				datagram d;
+				d.to = to;
+				d.buf.assign(buf, buf + size);
+				d.release = sent + delay;
+				// the datagrams are kept in the order they're
+				// released. The ones to the client don't queue
+				std::deque<datagram>::iterator i = m_queue.end();
+				while (i != m_queue.begin() && (i - 1)->release > d.release) --i;
+				m_queue.insert(i, d);
+			}
+			schedule();
+		}
+
+		virtual void on_timer(timer_entry&)
+		{
+			const timer_wheel::time_type now = m_timers.now();
+			while (!m_queue.empty() && m_queue.front().release <= now)
+			{
+				const datagram& d = m_queue.front();
+				sock->send_to(d.to, &d.buf[0], d.buf.size());
+				m_queue.pop_front();
+			}
+			schedule();
+		}
+
+		void schedule()
+		{
+			if (m_queue.empty() || m_timer.is_scheduled()) return;
+			m_timers.schedule(m_timer, this, int(std::max(
+				m_queue.front().release - m_timers.now(), timer_wheel::time_type(0))));
+		}
+
+		struct datagram
+		{
+			address to;
+			std::vector<char> buf;
+			timer_wheel::time_type release;
+		};
+
+		boost::shared_ptr<libtorrent::socket> sock;
+		address server;
+		address client;
+		int drop_interval;
+		// one-way, in milliseconds
+		int delay;
+		// of the bottleneck, in bytes per second.
+		// 0 is unlimited
+		int rate;
+		int forwarded;
+		int dropped;
+		// the longest a datagram has waited for the
+		// bottleneck, in milliseconds
+		int max_queuing_delay;
+
+	private:
+
+		timer_wheel& m_timers;
+		std::deque<datagram> m_queue;
+		timer_wheel::time_type m_link_free;
+		timer_entry m_timer;
+	};
+
+	struct network: test::event_loop
+	{
+		network()
+			: client(timers, sel)
+			, server(timers, sel)
+			, relay(timers)
+		{
+			server.listen(server_port);
+			sel.monitor_readability(relay.sock);
+		}
+
+		virtual void on_readable(const boost::shared_ptr<libtorrent::socket>& s)
+		{
+			if (s == relay.sock) relay.incoming();
+			else if (!client.incoming(s)) server.incoming(s);
+		}
+
+		// sends size bytes from one stream to the other, reading
+		// them as they arrive. Returns the number of bytes that
+		// were received intact
+		int transfer(utp_stream& from, utp_stream& to, int size, int milliseconds)
+		{
+			int sent = 0;
+			int received = 0;
+			bool intact = true;
+			char buf[4096];
+			timer_wheel::time_type end = timers.now() + milliseconds;
+			while (received < size && timers.now() < end)
+			{
+				while (sent < size)
+				{
+					int len = std::min(int(sizeof(buf)), size - sent);
+					for (int i = 0; i < len; ++i)
+						buf[i] = static_cast<char>((sent + i) * 7);
+					int ret = from.send(buf, len);
+					if (ret <= 0) break;
+					sent += ret;
+				}
+				step();
+				int ret;
+				while ((ret = to.receive(buf, sizeof(buf))) > 0)
+				{
+					for (int i = 0; i < ret; ++i)
+						if (buf[i] != static_cast<char>((received + i) * 7)) intact = false;
+					received += ret;
+				}
+			}
+			return intact ? received : -1;
+		}
+
+		// runs the network until both ends of the stream have
+		// seen the other one close, and the managers have let
+		// go of it
+		void close(boost::shared_ptr<utp_stream>& a, boost::shared_ptr<utp_stream>& b)
+		{
+			a->close();
+			char buf[100];
+			timer_wheel::time_type end = timers.now() + 10 * 1000;
+			while (timers.now() < end && b->receive(buf, sizeof(buf)) != 0)
+				step();
+			TEST_CHECK(b->receive(buf, sizeof(buf)) == 0);
+			b->close();
+			while (timers.now() < end && a->receive(buf, sizeof(buf)) != 0)
+				step();
+			TEST_CHECK(a->receive(buf, sizeof(buf)) == 0);
+			TEST_CHECK(!a->has_error());
+			TEST_CHECK(!b->has_error());
+
+			a.reset();
+			b.reset();
+			while (timers.now() < end
+				&& (client.num_streams() > 0 || server.num_streams() > 0))
+			{
+				test::sleep(utp_socket_manager::tick_interval / 2);
+				step();
+			}
+			TEST_CHECK(client.num_streams() == 0);
+			TEST_CHECK(server.num_streams() == 0);
+		}
+
+		boost::shared_ptr<utp_stream> accept(int milliseconds)
+		{
+			boost::shared_ptr<utp_stream> s;
+			timer_wheel::time_type end = timers.now() + milliseconds;
+			while (!s && timers.now() < end)
+			{
+				step();
+				s = server.accept();
+			}
+			return s;
+		}
+
+		utp_socket_manager client;
+		utp_socket_manager server;
+		simulated_link relay;
+	};
+
+	void run_transfer(network& n, const address& server, const char* name
+		, int upload, int download, int min_rtt = 0)
+	{
+		boost::shared_ptr<utp_stream> c = n.client.connect(server);
+		boost::shared_ptr<utp_stream> s = n.accept(5000);
+		TEST_CHECK(s);
+		if (!s) return;
+
+		// the syn's ack is the first thing the client gets back
+		for (int i = 0; i < 500 && c->state() == utp_stream::state_syn_sent; ++i)
+			n.step();
+		TEST_CHECK(c->state() == utp_stream::state_connected);
+		TEST_CHECK(s->state() == utp_stream::state_connected);
+
+		int size = upload;
+		int received = n.transfer(*c, *s, size, 30 * 1000);
+		TEST_CHECK(received == size);
+		if (received != size)
+			std::cerr << name << ": " << received << " of " << size
+				<< " bytes received by the server\n";
+
+		size = download;
+		received = n.transfer(*s, *c, size, 30 * 1000);
+		TEST_CHECK(received == size);
+		if (received != size)
+			std::cerr << name << ": " << received << " of " << size
+				<< " bytes received by the client\n";
+
+		TEST_CHECK(c->rtt() >= min_rtt);
+		TEST_CHECK(c->congestion_window() >= utp_stream::min_window);
+
+		n.close(c, s);
+	}
+}
+
+int main()
+{
+	network n;
+
+	// straight over the loopback. More than the buffers
+	// hold, so that the windows are filled and opened again
+	run_transfer(n, address(127, 0, 0, 1, server_port), "direct"
+		, 1024 * 1024, 300 * 1024);
+
+	// through the relay, which loses every 13th datagram.
+	// Most of the time is spent waiting for timeouts
+	n.relay.drop_interval = 13;
+	run_transfer(n, address(127, 0, 0, 1, relay_port), "lossy"
+		, 200 * 1024, 50 * 1024);
+	TEST_CHECK(n.relay.dropped > 0);
+
+	// through a link with a delay of 20 ms each way, and a
+	// bottleneck of 100 kB/s on the way to the server. LEDBAT
+	// keeps the queue in front of the bottleneck near the
+	// target delay. Growing the window by a packet per round
+	// trip regardless, the queue reaches about 400 ms here
+	n.relay.drop_interval = 0;
+	n.relay.delay = 20;
+	n.relay.rate = 100 * 1024;
+	run_transfer(n, address(127, 0, 0, 1, relay_port), "delayed"
+		, 800 * 1024, 50 * 1024, 2 * n.relay.delay);
+	TEST_CHECK(n.relay.max_queuing_delay > 0);
+	TEST_CHECK(n.relay.max_queuing_delay < 2 * utp_stream::target_delay / 1000);
+	if (n.relay.max_queuing_delay >= 2 * utp_stream::target_delay / 1000)
+		std::cerr << "delayed: " << n.relay.max_queuing_delay
+			<< " ms queuing delay\n";
+
+	// a stream that's dropped by its owner is closed by the
+	// manager, once the data that's left has been sent
+	boost::shared_ptr<utp_stream> c = n.client.connect(address(127, 0, 0, 1, server_port));
+	boost::shared_ptr<utp_stream> s = n.accept(5000);
+	TEST_CHECK(s);
+	if (s)
+	{
+		char buf[1000];
+		std::fill(buf, buf + sizeof(buf), 'x');
+		TEST_CHECK(c->send(buf, sizeof(buf)) == int(sizeof(buf)));
+		c.reset();
+		int received = 0;
+		int ret = -1;
+		for (int i = 0; i < 500 && ret != 0; ++i)
+		{
+			test::sleep(utp_socket_manager::tick_interval / 10);
+			n.step();
+			while ((ret = s->receive(buf, sizeof(buf))) > 0) received += ret;
+		}
+		TEST_CHECK(received == int(sizeof(buf)));
+		TEST_CHECK(ret == 0);
+	}
+
+	return test::failures();
+}